@@ -1,3 +1,6 @@
 int msi_alloc_vector(struct MSIMessage *msg, void (*handler)(void *), void *private) {
 	return 0;
 }
+int msi_alloc_vector_cpu(struct MSIMessage *msg, int cpu, void (*handler)(void *), void *private) {
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * x86 FPU and SSE state
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <arch/x86/mmu.h>
+#include <common/x86.h>
+#include <core/proc.h>
+#include <cpuid.h>
+#include <defs.h>
+
+// User processes may use x87 and SSE instructions. The kernel is built
+// without them, so the registers of a process stay live while it runs in
+// the kernel and only need to be saved and restored by the scheduler.
+
+#define CPUID_FXSR (1 << 24)
+#define CPUID_SSE (1 << 25)
+
+static int fpu_enabled;
+
+// Enable FXSAVE and SSE on this CPU if it has them
+void fpu_init(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & CPUID_FXSR) || !(edx & CPUID_SSE)) {
+		return;
+	}
+	lcr0((rcr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	__asm__ volatile("fninit");
+	fpu_enabled = 1;
+}
+
+// The state of a freshly initialized FPU with all exceptions masked
+void fpu_state_init(struct FpuState *fpu) {
+	memset(fpu, 0, sizeof(struct FpuState));
+	*(unsigned short *)&fpu->data[0] = 0x37f; // FCW
+	*(unsigned int *)&fpu->data[24] = 0x1f80; // MXCSR
+}
+
+void fpu_save(struct FpuState *fpu) {
+	if (fpu_enabled) {
+		fxsave(fpu->data);
+	}
+}
+
+void fpu_restore(struct FpuState *fpu) {
+	if (fpu_enabled) {
+		fxrstor(fpu->data);
+	}
+}
@@ -120,6 +120,14 @@ void lapiceoi(void) {
 	}
 }
 
+// Send a fixed interrupt to the processor with the given APIC ID.
+void lapic_send_ipi(unsigned char apicid, unsigned int vector) {
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 #define CMOS_PORT 0x70
 #define CMOS_RETURN 0x71
 
@@ -5,6 +5,7 @@ int lapicid(void);
 void lapiceoi(void);
 void lapicinit(void);
 void lapicstartap(unsigned char, unsigned int);
+void lapic_send_ipi(unsigned char apicid, unsigned int vector);
 void microdelay(int);
 
 #endif
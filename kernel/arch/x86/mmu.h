@@ -25,11 +25,16 @@
 
 // Control Register flags
 #define CR0_PE 0x00000001 // Protection Enable
+#define CR0_MP 0x00000002 // Monitor coProcessor
+#define CR0_EM 0x00000004 // Emulation
+#define CR0_TS 0x00000008 // Task Switched
 #define CR0_WP 0x00010000 // Write Protect
 #define CR0_PG 0x80000000 // Paging
 
 #define CR4_PSE 0x00000010 // Page size extension
 #define CR4_PAE 0x00000020 // Physical address extension
+#define CR4_OSFXSR 0x00000200 // FXSAVE and SSE enabled
+#define CR4_OSXMMEXCPT 0x00000400 // SIMD floating point exceptions enabled
 
 // various segment selectors.
 #define SEG_KCODE 1 // kernel code
@@ -143,6 +148,12 @@ struct segdesc {
 #define PTE_W 0x002 // Writeable
 #define PTE_U 0x004 // User
 #define PTE_PS 0x080 // Page Size
+#define PTE_COW 0x200 // Copy-on-write, available to software
+
+// Page fault error code
+#define PGFLT_P 0x1 // Protection violation on a present page
+#define PGFLT_W 0x2 // Caused by a write
+#define PGFLT_U 0x4 // Caused in user mode
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte) ((unsigned long long)(pte) & ~(0xfff0000000000fff))
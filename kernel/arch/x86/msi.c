@@ -17,28 +17,90 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/proc.h>
 #include <defs.h>
+#include <param.h>
+#include <proc/kcall.h>
 
 #include "msi.h"
 
 #define MSI_VECTOR_MAX 190
 #define MSI_VECTOR_BASE 65
 
+// Vectors are spread over the CPUs instead of all landing on CPU 0, which
+// also takes the timer tick. A vector targets the CPU its owner asked for,
+// a multi-queue device asks for the CPU submitting to each queue, or else
+// the CPU with the fewest vectors, ties broken round robin.
+
 static struct MSIVector {
 	struct {
 		unsigned char used : 1;
 	};
+	unsigned char cpu; // target CPU
 	void (*handler)(void *);
 	void *private;
+	unsigned int count[NCPU]; // interrupts taken on each CPU
 } msi_vector[MSI_VECTOR_MAX];
 
+static struct spinlock msi_lock;
+static unsigned int msi_cpu_vectors[NCPU]; // vectors targeting each CPU
+static unsigned int msi_next_cpu; // first CPU looked at by msi_pick_cpu()
+
+struct IrqKcall {
+#define IRQ_KCALL_OP_VECTOR_STATS 0
+	unsigned int op;
+	unsigned int vector; // first vector to look at, then the vector found
+	unsigned int ncpu;
+	unsigned int cpu; // target CPU
+	unsigned int count[NCPU]; // interrupts taken on each CPU
+};
+
+// Statistics of the first allocated vector from p->vector on, return
+// ERROR_NOT_EXIST if there is none. They are gathered in s and copied to
+// p after msi_lock is dropped, storing to p may fault.
+static int msi_kcall_vector_stats(struct IrqKcall *p) {
+	int ret = ERROR_NOT_EXIST;
+	struct IrqKcall s = {.op = p->op, .vector = p->vector};
+	unsigned int vec = s.vector < MSI_VECTOR_BASE ? 0 : s.vector - MSI_VECTOR_BASE;
+	acquire(&msi_lock);
+	for (; vec < MSI_VECTOR_MAX; vec++) {
+		if (msi_vector[vec].used) {
+			s.vector = vec + MSI_VECTOR_BASE;
+			s.ncpu = ncpu;
+			s.cpu = msi_vector[vec].cpu;
+			memmove(s.count, msi_vector[vec].count, sizeof(s.count));
+			ret = 0;
+			break;
+		}
+	}
+	release(&msi_lock);
+	if (ret == 0) {
+		*p = s;
+	}
+	return ret;
+}
+
+static int msi_kcall_handler(unsigned int arg) {
+	struct IrqKcall *p = (struct IrqKcall *)arg;
+	switch (p->op) {
+		case IRQ_KCALL_OP_VECTOR_STATS:
+			return msi_kcall_vector_stats(p);
+	}
+	return ERROR_INVAILD;
+}
+
 void msi_init(void) {
 	memset(msi_vector, 0, sizeof(msi_vector));
+	initlock(&msi_lock, "msi");
+	kcall_set("irq", msi_kcall_handler);
 }
 
 void msi_intr(int vector) {
 	int vec = vector - MSI_VECTOR_BASE;
 	if (msi_vector[vec].used) {
+		msi_vector[vec].count[cpuid()]++;
 		msi_vector[vec].handler(msi_vector[vec].private);
 	} else {
 		cprintf("[pci] spurious MSI interrupt vector %d\n", vector);
@@ -50,20 +112,50 @@ static void msi_compose_msg(struct MSIMessage *msg, unsigned int vector, unsigne
 	msg->data = vector;
 }
 
-int msi_alloc_vector(struct MSIMessage *msg, void (*handler)(void *), void *private) {
+// the CPU with the fewest vectors, msi_lock must be held
+static unsigned int msi_pick_cpu(void) {
+	unsigned int best = msi_next_cpu % ncpu;
+	for (unsigned int i = 1; i < ncpu; i++) {
+		unsigned int cpu = (msi_next_cpu + i) % ncpu;
+		if (msi_cpu_vectors[cpu] < msi_cpu_vectors[best]) {
+			best = cpu;
+		}
+	}
+	msi_next_cpu = best + 1;
+	return best;
+}
+
+// Allocate a vector delivered to cpu, or to the least loaded CPU if cpu is
+// MSI_CPU_ANY, and compose the message the device sends for it. Return the
+// vector, or 0 if all are in use.
+int msi_alloc_vector_cpu(struct MSIMessage *msg, int cpu, void (*handler)(void *), void *private) {
+	acquire(&msi_lock);
+	unsigned int target = cpu == MSI_CPU_ANY ? msi_pick_cpu() : (unsigned int)cpu % ncpu;
 	for (int i = 0; i < MSI_VECTOR_MAX; i++) {
 		if (!msi_vector[i].used) {
 			msi_vector[i].used = 1;
+			msi_vector[i].cpu = target;
 			msi_vector[i].handler = handler;
 			msi_vector[i].private = private;
-			msi_compose_msg(msg, i + MSI_VECTOR_BASE, 0);
+			memset(msi_vector[i].count, 0, sizeof(msi_vector[i].count));
+			msi_cpu_vectors[target]++;
+			release(&msi_lock);
+			msi_compose_msg(msg, i + MSI_VECTOR_BASE, cpus[target].apicid);
 			return i + MSI_VECTOR_BASE;
 		}
 	}
+	release(&msi_lock);
 	return 0;
 }
 
+int msi_alloc_vector(struct MSIMessage *msg, void (*handler)(void *), void *private) {
+	return msi_alloc_vector_cpu(msg, MSI_CPU_ANY, handler, private);
+}
+
 void msi_free_vector(const struct MSIMessage *msg) {
 	unsigned int vector = msg->data & 0xff;
+	acquire(&msi_lock);
+	msi_cpu_vectors[msi_vector[vector - MSI_VECTOR_BASE].cpu]--;
 	msi_vector[vector - MSI_VECTOR_BASE].used = 0;
+	release(&msi_lock);
 }
@@ -8,8 +8,11 @@ struct MSIMessage {
 	uint32_t data;
 };
 
+#define MSI_CPU_ANY -1 // the least loaded CPU
+
 void msi_init(void);
 void msi_intr(int vector);
+int msi_alloc_vector_cpu(struct MSIMessage *msg, int cpu, void (*handler)(void *), void *private);
 int msi_alloc_vector(struct MSIMessage *msg, void (*handler)(void *), void *private);
 void msi_free_vector(const struct MSIMessage *msg);
 
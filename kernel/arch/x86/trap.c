@@ -77,9 +77,14 @@ void trap(struct trapframe *tf) {
 				ticks++;
 				wakeup(&ticks);
 				release(&tickslock);
+				event_tick();
 			}
 			lapiceoi();
 			break;
+		case T_IRQ0 + IRQ_RESCHED:
+			// nothing to do, the idle CPU looks at its run queue again
+			lapiceoi();
+			break;
 		case T_IRQ0 + IRQ_MOUSE:
 			ps2_mouse_intr();
 			lapiceoi();
@@ -123,6 +128,21 @@ void trap(struct trapframe *tf) {
 			msi_intr(tf->trapno);
 			lapiceoi();
 			break;
+		case T_PGFLT:
+			// copy-on-write and demand loading, also taken by the kernel
+			// touching user memory. Loading a page may sleep, do it with
+			// interrupts on unless the faulting code had them off.
+			if (myproc()) {
+				unsigned int va = rcr2();
+				if (mycpu()->ncli == 0 && (tf->eflags & FL_IF)) {
+					sti();
+				}
+				if (vm_page_fault(myproc(), va, tf->err) == 0) {
+					break;
+				}
+				cli();
+			}
+			// fall through
 		// PAGEBREAK: 13
 		default:
 			if (myproc() == 0 || (tf->cs & 3) == 0) {
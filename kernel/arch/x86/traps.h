@@ -56,6 +56,7 @@
 #define IRQ_MOUSE 12
 #define IRQ_IDE 14
 #define IRQ_ERROR 19
+#define IRQ_RESCHED 30 // inter-processor interrupt waking an idle CPU
 #define IRQ_SPURIOUS 31
 
 // Message signaled interrupt
@@ -18,6 +18,7 @@
  */
 
 #include <arch/x86/mmu.h>
+#include <common/errorcode.h>
 #include <common/spinlock.h>
 #include <common/x86.h>
 #include <core/proc.h>
@@ -25,10 +26,14 @@
 #include <filesystem/vfs/vfs.h>
 #include <memlayout.h>
 #include <param.h>
+#include <proc/kcall.h>
 
 extern char data[]; // defined by kernel.ld
 pdpte_t *kpgdir; // for use in scheduler()
 
+// page fault counters, per CPU so the fault path never shares a cache line
+static struct VmStats vmstats[NCPU];
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void seginit(void) {
@@ -320,8 +325,10 @@ int deallocuvm(pdpte_t *pgdir, unsigned int oldsz, unsigned int newsz) {
 			if (pa == 0) {
 				panic("kfree");
 			}
-			char *v = P2V(pa);
-			kfree(v);
+			// device memory such as a framebuffer is not ours to free
+			if (pa < PHYSTOP) {
+				page_put(P2V(pa));
+			}
 			*pte = 0;
 		}
 	}
@@ -359,31 +366,434 @@ void clearpteu(pdpte_t *pgdir, char *uva) {
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child. Pages are shared instead of copied, writable
+// pages become read-only copy-on-write in both page tables and
+// are copied by vm_page_fault() on the first write. Pages of lazily
+// loaded areas not faulted in yet are skipped. The caller must flush
+// the TLB if oldpgdir is in use.
 pdpte_t *copyuvm(pdpte_t *newpgdir, pdpte_t *oldpgdir, unsigned int begin, unsigned int end) {
 	pte_t *pte;
 	unsigned int pa, i, flags;
-	char *mem;
 
 	for (i = begin; i < end; i += PGSIZE) {
-		if ((pte = walkpgdir(oldpgdir, (void *)i, 0, PTE_W | PTE_U)) == 0) {
-			panic("copyuvm: pte should exist");
+		if ((pte = walkpgdir(oldpgdir, (void *)i, 0, PTE_W | PTE_U)) == 0 || !(*pte & PTE_P)) {
+			continue;
 		}
-		if (!(*pte & PTE_P)) {
-			panic("copyuvm: page not present");
+		if (*pte & PTE_W) {
+			*pte = (*pte & ~PTE_W) | PTE_COW;
 		}
 		pa = PTE_ADDR(*pte);
 		flags = PTE_FLAGS(*pte);
-		if ((mem = kalloc()) == 0) {
+		if (mappages(newpgdir, (void *)i, PGSIZE, pa, flags) < 0) {
 			return 0;
 		}
-		memmove(mem, (char *)P2V(pa), PGSIZE);
-		if (mappages(newpgdir, (void *)i, PGSIZE, V2P(mem), flags) < 0) {
+		page_get(P2V(pa));
+		pushcli();
+		vmstats[cpuid()].cow_shared++;
+		popcli();
+	}
+	return newpgdir;
+}
+
+// Give the page at va in pgdir a private writable copy
+// if it is shared copy-on-write. Return 0 on success.
+static int cow_page(pdpte_t *pgdir, unsigned int va) {
+	pte_t *pte = walkpgdir(pgdir, (void *)va, 0, PTE_W | PTE_U);
+	if (pte == 0 || (*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW)) {
+		return -1;
+	}
+	char *old = P2V(PTE_ADDR(*pte));
+	unsigned int flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+	pushcli();
+	vmstats[cpuid()].cow_faults++;
+	popcli();
+	if (page_refcount(old) == 1) {
+		// every other sharer already took its own copy
+		*pte = V2P(old) | flags;
+	} else {
+		char *mem = kalloc();
+		if (mem == 0) {
+			return -1;
+		}
+		memmove(mem, old, PGSIZE);
+		*pte = V2P(mem) | flags;
+		page_put(old);
+		pushcli();
+		vmstats[cpuid()].cow_copies++;
+		popcli();
+	}
+	invlpg((void *)va);
+	return 0;
+}
+
+// Return an empty map, 0 if memory is exhausted
+struct VmMap *vm_map_alloc(void) {
+	struct VmMap *map = kmalloc_try(sizeof(struct VmMap));
+	if (map) {
+		map->num = 0;
+	}
+	return map;
+}
+
+// mapping a file, pinned with vfs_pagecache_map()
+static inline int vm_area_is_file(const struct VmArea *area) {
+	return !area->anon && !area->shm;
+}
+
+// Shared memory and file mappings are copied along with their reference.
+// Return 0 if memory is exhausted.
+struct VmMap *vm_map_dup(struct VmMap *map) {
+	struct VmMap *new = vm_map_alloc();
+	if (new && map) {
+		memmove(new, map, sizeof(struct VmMap));
+		for (unsigned int i = 0; i < map->num; i++) {
+			struct VmArea *area = &map->area[i];
+			if (area->shm) {
+				shm_get(area->shm);
+			} else if (vm_area_is_file(area)) {
+				// can't fail, a mapped file is not open for writing
+				vfs_pagecache_map(area->fs_id, area->block, area->size);
+			}
+		}
+	}
+	return new;
+}
+
+void vm_map_free(struct VmMap *map) {
+	for (unsigned int i = 0; map && i < map->num; i++) {
+		struct VmArea *area = &map->area[i];
+		if (area->shm) {
+			shm_put(area->shm);
+		} else if (vm_area_is_file(area)) {
+			vfs_pagecache_unmap(area->fs_id, area->block);
+		}
+	}
+	kmfree(map);
+}
+
+// Add a lazily loaded area to map, the pages are filled in by vm_page_fault().
+// An area mapping a file takes over the caller's vfs_pagecache_map() pin.
+int vm_map_add(struct VmMap *map, struct VmArea *area) {
+	if (map->num == PROC_VMA_MAX) {
+		return -1;
+	}
+	map->area[map->num++] = *area;
+	return 0;
+}
+
+static struct VmArea *vm_map_find(struct VmMap *map, unsigned int va) {
+	if (!map) {
+		return 0;
+	}
+	for (unsigned int i = 0; i < map->num; i++) {
+		if (va >= map->area[i].begin && va < map->area[i].end) {
+			return &map->area[i];
+		}
+	}
+	return 0;
+}
+
+// Fill in the page at va of a lazily loaded area. Pages holding nothing
+// but file data map the page cache page, shared read-only or copy-on-write,
+// the rest get a private page. Reading the file sleeps, it is only done
+// with interrupts on. Return 0 on success.
+static int vm_area_fault(struct proc *p, struct VmArea *area, unsigned int va, unsigned int err) {
+	pte_t *pte = walkpgdir(p->pgdir, (void *)va, 1, PTE_W | PTE_U);
+	if (pte == 0) {
+		return -1;
+	}
+	if (*pte & PTE_P) {
+		return 0;
+	}
+	if (area->shm) {
+		char *page = shm_page(area->shm, (va - area->begin) / PGSIZE);
+		if (page == 0) {
+			return -1;
+		}
+		*pte = V2P(page) | PTE_P | PTE_U | PTE_W;
+		return 0;
+	}
+	struct FileDesc fd = {
+		.used = 1,
+		.read = 1,
+		.fs_id = area->fs_id,
+		.block = area->block,
+		.size = area->size,
+	};
+	int can_sleep = readeflags() & FL_IF;
+	unsigned int offset = area->offset + (va - area->begin);
+	char *mem;
+
+	if (va + PGSIZE <= area->data_end && offset % PGSIZE == 0) {
+		mem = can_sleep ? vfs_pagecache_get(&fd, offset) : vfs_pagecache_find(&fd, offset);
+		if (mem == 0) {
+			return -1;
+		}
+		*pte = V2P(mem) | PTE_P | PTE_U | (area->writable ? PTE_COW : 0);
+		pushcli();
+		vmstats[cpuid()].file_faults++;
+		popcli();
+		if (err & PGFLT_W) {
+			return cow_page(p->pgdir, va);
+		}
+		return 0;
+	}
+
+	if (va < area->data_end && !can_sleep) {
+		return -1;
+	}
+	if ((mem = kalloc()) == 0) {
+		return -1;
+	}
+	memset(mem, 0, PGSIZE);
+	if (va < area->data_end) {
+		unsigned int n = area->data_end - va < PGSIZE ? area->data_end - va : PGSIZE;
+		if (vfs_fd_seek(&fd, offset, SEEK_SET) < 0 || vfs_fd_read(&fd, mem, n) != (int)n) {
 			kfree(mem);
+			return -1;
+		}
+	}
+	*pte = V2P(mem) | PTE_P | PTE_U | (area->writable ? PTE_W : 0);
+	pushcli();
+	vmstats[cpuid()].anon_faults++;
+	popcli();
+	return 0;
+}
+
+// Handle a page fault at va of process p, err is the error code
+// pushed by the processor. Return 0 if the faulting access
+// can be restarted.
+int vm_page_fault(struct proc *p, unsigned int va, unsigned int err) {
+	pushcli();
+	vmstats[cpuid()].page_faults++;
+	popcli();
+	if (va >= KERNBASE) {
+		return -1;
+	}
+	va = PGROUNDDOWN(va);
+	if (err & PGFLT_P) {
+		return (err & PGFLT_W) ? cow_page(p->pgdir, va) : -1;
+	}
+	struct VmArea *area = vm_map_find(p->vmmap, va);
+	if (area == 0 || ((err & PGFLT_W) && !area->writable)) {
+		return -1;
+	}
+	return vm_area_fault(p, area, va, err);
+}
+
+// Fault in the not yet loaded pages of [addr, addr+size) of process p, so
+// the kernel can use a user buffer while holding locks the fault path takes.
+int vm_fault_in(struct proc *p, unsigned int addr, unsigned int size) {
+	if (!p->vmmap) {
+		return 0;
+	}
+	unsigned int end = addr + size < addr ? KERNBASE : addr + size;
+	for (unsigned int i = 0; i < p->vmmap->num; i++) {
+		struct VmArea *area = &p->vmmap->area[i];
+		unsigned int begin = addr > area->begin ? PGROUNDDOWN(addr) : area->begin;
+		for (unsigned int va = begin; va < end && va < area->end; va += PGSIZE) {
+			if (vm_area_fault(p, area, va, 0) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static struct VmArea *vm_map_overlap(struct VmMap *map, unsigned int begin, unsigned int end) {
+	for (unsigned int i = 0; i < map->num; i++) {
+		if (map->area[i].begin < end && begin < map->area[i].end) {
+			return &map->area[i];
+		}
+	}
+	return 0;
+}
+
+// lowest address of the anonymous mapping space with size bytes free, or 0
+static unsigned int vm_map_find_free(struct VmMap *map, unsigned int size) {
+	struct VmArea *area;
+	unsigned int addr = PROC_ANON_BOTTOM;
+	while (addr <= PROC_MMAP_BOTTOM - size && (area = vm_map_overlap(map, addr, addr + size))) {
+		addr = area->end;
+	}
+	return addr > PROC_MMAP_BOTTOM - size ? 0 : addr;
+}
+
+// Map size bytes of demand-zero memory into p at addr, or at the lowest
+// free address of the anonymous mapping space if addr is 0. A mapping
+// right after an anonymous area extends it, so a user allocator can grow
+// a mapping in place. Return the address or 0.
+unsigned int vm_map_anon(struct proc *p, unsigned int addr, unsigned int size) {
+	if (size == 0 || size > PROC_MMAP_BOTTOM - PROC_ANON_BOTTOM) {
+		return 0;
+	}
+	size = PGROUNDUP(size);
+	if (!p->vmmap && !(p->vmmap = vm_map_alloc())) {
+		return 0;
+	}
+	struct VmMap *map = p->vmmap;
+	if (addr) {
+		if (addr % PGSIZE || addr < PROC_ANON_BOTTOM || addr > PROC_MMAP_BOTTOM - size ||
+			vm_map_overlap(map, addr, addr + size)) {
 			return 0;
 		}
+	} else if ((addr = vm_map_find_free(map, size)) == 0) {
+		return 0;
 	}
-	return newpgdir;
+
+	for (unsigned int i = 0; i < map->num; i++) {
+		if (map->area[i].anon && map->area[i].end == addr) {
+			map->area[i].end += size;
+			return addr;
+		}
+	}
+	struct VmArea area = {
+		.begin = addr,
+		.end = addr + size,
+		.writable = 1,
+		.anon = 1,
+	};
+	if (vm_map_add(map, &area) < 0) {
+		return 0;
+	}
+	return addr;
+}
+
+// Unmap [addr, addr+size) from the anonymous mappings of p and free its
+// pages. The range may cover any part of one or more mappings. Return 0
+// on success.
+int vm_unmap_anon(struct proc *p, unsigned int addr, unsigned int size) {
+	size = PGROUNDUP(size);
+	unsigned int end = addr + size;
+	if (!p->vmmap || addr % PGSIZE || addr < PROC_ANON_BOTTOM || end > PROC_MMAP_BOTTOM ||
+		end < addr) {
+		return -1;
+	}
+	struct VmMap *map = p->vmmap;
+	struct VmArea *area = vm_map_overlap(map, addr, end);
+	if (area && area->begin < addr && area->end > end && map->num == PROC_VMA_MAX) {
+		return -1; // no room to split the area
+	}
+
+	for (unsigned int i = 0; i < map->num;) {
+		area = &map->area[i];
+		if (!area->anon || area->end <= addr || area->begin >= end) {
+			i++;
+			continue;
+		}
+		if (area->begin < addr && area->end > end) {
+			struct VmArea tail = *area;
+			tail.begin = end;
+			area->end = addr;
+			vm_map_add(map, &tail);
+		} else if (area->begin < addr) {
+			area->end = addr;
+		} else if (area->end > end) {
+			area->begin = end;
+		} else {
+			*area = map->area[--map->num];
+			continue;
+		}
+		i++;
+	}
+	deallocuvm(p->pgdir, end, addr);
+	switchuvm(p);
+	return 0;
+}
+
+// Map the shared memory object id of size bytes into the anonymous mapping
+// space of p, the caller holds a reference for the mapping. Return the
+// address or 0.
+unsigned int vm_map_shm(struct proc *p, unsigned int id, unsigned int size) {
+	if (!p->vmmap && !(p->vmmap = vm_map_alloc())) {
+		return 0;
+	}
+	struct VmArea area = {
+		.writable = 1,
+		.shm = id,
+	};
+	if ((area.begin = vm_map_find_free(p->vmmap, size)) == 0) {
+		return 0;
+	}
+	area.end = area.begin + size;
+	if (vm_map_add(p->vmmap, &area) < 0) {
+		return 0;
+	}
+	return area.begin;
+}
+
+// Unmap the shared memory mapped at addr from p. Return 0 on success.
+int vm_unmap_shm(struct proc *p, unsigned int addr) {
+	struct VmMap *map = p->vmmap;
+	for (unsigned int i = 0; map && i < map->num; i++) {
+		struct VmArea area = map->area[i];
+		if (area.shm && area.begin == addr) {
+			map->area[i] = map->area[--map->num];
+			deallocuvm(p->pgdir, area.end, area.begin);
+			switchuvm(p);
+			shm_put(area.shm);
+			return 0;
+		}
+	}
+	return ERROR_INVAILD;
+}
+
+// present private user page of p in RAM at the page aligned va, or 0
+static pte_t *vm_private_pte(struct proc *p, unsigned int va) {
+	if (va >= KERNBASE) {
+		return 0;
+	}
+	struct VmArea *area = vm_map_find(p->vmmap, va);
+	if (area && area->shm) {
+		return 0;
+	}
+	pte_t *pte = walkpgdir(p->pgdir, (void *)va, 0, PTE_W | PTE_U);
+	if (pte == 0 || (*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U)) {
+		return 0;
+	}
+	// device memory such as the framebuffer has no page counts
+	if (PTE_ADDR(*pte) >= PHYSTOP) {
+		return 0;
+	}
+	return pte;
+}
+
+// Lend the page of the current process p at the page aligned va to a
+// message instead of copying it. A writable page becomes copy-on-write.
+// Return the page with a reference taken, 0 if it cannot be lent.
+void *vm_page_lend(struct proc *p, unsigned int va) {
+	pte_t *pte = vm_private_pte(p, va);
+	if (pte == 0) {
+		return 0;
+	}
+	if (*pte & PTE_W) {
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+		invlpg((void *)va);
+	}
+	char *page = P2V(PTE_ADDR(*pte));
+	page_get(page);
+	pushcli();
+	vmstats[cpuid()].msg_pages_lent++;
+	popcli();
+	return page;
+}
+
+// Map page copy-on-write at the page aligned va of the current process p
+// in place of the writable page there, taking over the caller's reference.
+// Return -1 if there is no such page at va.
+int vm_page_install(struct proc *p, unsigned int va, void *page) {
+	pte_t *pte = vm_private_pte(p, va);
+	if (pte == 0 || !(*pte & (PTE_W | PTE_COW))) {
+		return -1;
+	}
+	char *old = P2V(PTE_ADDR(*pte));
+	*pte = V2P(page) | ((PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW);
+	invlpg((void *)va);
+	page_put(old);
+	pushcli();
+	vmstats[cpuid()].msg_pages_mapped++;
+	popcli();
+	return 0;
 }
 
 // PAGEBREAK!
@@ -411,6 +821,11 @@ int copyout(pdpte_t *pgdir, unsigned int va, void *p, unsigned int len) {
 	buf = (char *)p;
 	while (len > 0) {
 		va0 = (unsigned int)PGROUNDDOWN(va);
+		// writes through the kernel mapping bypass copy-on-write
+		pte_t *pte = walkpgdir(pgdir, (void *)va0, 0, PTE_W | PTE_U);
+		if (pte && (*pte & PTE_COW) && cow_page(pgdir, va0) < 0) {
+			return -1;
+		}
 		pa0 = uva2ka(pgdir, (char *)va0);
 		if (pa0 == 0) {
 			return -1;
@@ -447,6 +862,48 @@ pdpte_t *copypgdir(pdpte_t *newpgdir, pdpte_t *oldpgdir, unsigned int begin, uns
 	return newpgdir;
 }
 
+void vm_get_stats(struct VmStats *stats) {
+	memset(stats, 0, sizeof(struct VmStats));
+	for (int i = 0; i < NCPU; i++) {
+		stats->page_faults += vmstats[i].page_faults;
+		stats->cow_faults += vmstats[i].cow_faults;
+		stats->cow_copies += vmstats[i].cow_copies;
+		stats->cow_shared += vmstats[i].cow_shared;
+		stats->file_faults += vmstats[i].file_faults;
+		stats->anon_faults += vmstats[i].anon_faults;
+		stats->msg_pages_lent += vmstats[i].msg_pages_lent;
+		stats->msg_pages_mapped += vmstats[i].msg_pages_mapped;
+	}
+}
+
+struct VmKcall {
+#define VM_KCALL_OP_STATS 0
+	unsigned int op;
+	struct VmStats stats;
+	struct PgallocStats pgalloc;
+	struct PageCacheStats pagecache;
+};
+
+static int vm_kcall_handler(unsigned int arg) {
+	struct VmKcall *p = (struct VmKcall *)arg;
+	switch (p->op) {
+		case VM_KCALL_OP_STATS: {
+			// filled under locks, storing to p may fault
+			struct VmKcall s = {.op = p->op};
+			vm_get_stats(&s.stats);
+			pgalloc_get_stats(&s.pgalloc);
+			vfs_pagecache_get_stats(&s.pagecache);
+			*p = s;
+			return 0;
+		}
+	}
+	return ERROR_INVAILD;
+}
+
+void vm_init(void) {
+	kcall_set("vm", vm_kcall_handler);
+}
+
 // map physical memory to virtual memory
 static void *map_region(phyaddr_t phyaddr, size_t size) {
 	if (phyaddr < DEVSPACE) {
@@ -29,5 +29,6 @@
 #define ERROR_OUT_OF_SPACE -7
 #define ERROR_WRITE_FAIL -8
 #define ERROR_NO_PERM -9
+#define ERROR_AGAIN -10
 
 #endif
@@ -39,7 +39,7 @@ void acquiresleep(struct sleeplock *lk) {
 		sleep(lk, &lk->lk);
 	}
 	lk->locked = 1;
-	lk->pid = myproc()->pid;
+	lk->pid = myproc() ? myproc()->pid : 0; // no process during boot
 	release(&lk->lk);
 }
 
@@ -55,7 +55,7 @@ int holdingsleep(struct sleeplock *lk) {
 	int r;
 
 	acquire(&lk->lk);
-	r = lk->locked && (lk->pid == myproc()->pid);
+	r = lk->locked && (lk->pid == (myproc() ? myproc()->pid : 0));
 	release(&lk->lk);
 	return r;
 }
@@ -21,14 +21,28 @@
 #include <common/x86.h>
 #endif
 
+// Unaligned word access, x86 and the RISC-V cores we run on handle it in hardware
+typedef unsigned int __attribute__((may_alias, aligned(1))) uword_t;
+
+#define WORD_ONES 0x01010101u
+#define WORD_HIGHS 0x80808080u
+#define WORD_HAS_ZERO(x) (((x) - WORD_ONES) & ~(x) & WORD_HIGHS)
+
 void *memset(void *dst, int c, unsigned int n) {
 #ifndef __riscv
-	if ((int)dst % 4 == 0 && n % 4 == 0) {
+	char *d = dst;
+	if (n >= 16) {
+		// align the destination, then store dwords
+		unsigned int head = -(unsigned int)d & 3;
+		stosb(d, c, head);
+		d += head;
+		n -= head;
 		c &= 0xFF;
-		stosl(dst, (c << 24) | (c << 16) | (c << 8) | c, n / 4);
-	} else {
-		stosb(dst, c, n);
+		stosl(d, c * WORD_ONES, n / 4);
+		d += n & ~3;
+		n &= 3;
 	}
+	stosb(d, c, n);
 #else
 	char *p = dst;
 	while (n--) {
@@ -53,6 +67,10 @@ int memcmp(const void *v1, const void *v2, unsigned int n) {
 
 	s1 = v1;
 	s2 = v2;
+	// skip the equal words, the first difference is found byte by byte
+	while (n >= 4 && *(const uword_t *)s1 == *(const uword_t *)s2) {
+		s1 += 4, s2 += 4, n -= 4;
+	}
 	while (n-- > 0) {
 		if (*s1 != *s2) {
 			return *s1 - *s2;
@@ -78,12 +96,46 @@ int memcmp_volatile(const volatile void *v1, const volatile void *v2, unsigned i
 	return 0;
 }
 
+#ifndef __riscv
+static void copy_forward(char *d, const char *s, unsigned int n) {
+	if (n >= 16) {
+		// align the destination, then move dwords
+		unsigned int head = -(unsigned int)d & 3;
+		movsb(d, s, head);
+		d += head, s += head, n -= head;
+		movsl(d, s, n / 4);
+		d += n & ~3, s += n & ~3;
+		n &= 3;
+	}
+	movsb(d, s, n);
+}
+
+// copy from the end with the direction flag set, odd bytes first, then dwords
+static void copy_backward(char *d, const char *s, unsigned int n) {
+	char *de = d + n - 1;
+	const char *se = s + n - 1;
+	unsigned int tail = n & 3;
+	__asm__ volatile("std; rep movsb; subl $3, %%edi; subl $3, %%esi;"
+					 "movl %3, %%ecx; rep movsl; cld"
+					 : "+D"(de), "+S"(se), "+c"(tail)
+					 : "r"(n / 4)
+					 : "memory", "cc");
+}
+#endif
+
 void *memmove(void *dst, const void *src, unsigned int n) {
 	const char *s;
 	char *d;
 
 	s = src;
 	d = dst;
+#ifndef __riscv
+	if (s < d && s + n > d) {
+		copy_backward(d, s, n);
+	} else {
+		copy_forward(d, s, n);
+	}
+#else
 	if (s < d && s + n > d) {
 		s += n;
 		d += n;
@@ -95,6 +147,7 @@ void *memmove(void *dst, const void *src, unsigned int n) {
 			*d++ = *s++;
 		}
 	}
+#endif
 
 	return dst;
 }
@@ -121,6 +174,7 @@ volatile void *memmove_volatile(volatile void *dst, const volatile void *src, un
 }
 
 // memcpy exists to placate GCC.  Use memmove.
+// It stays overlap safe, memmove copies forward by words when it can.
 void *memcpy(void *dst, const void *src, unsigned int n) {
 	return memmove(dst, src, n);
 }
@@ -162,9 +216,19 @@ char *safestrcpy(char *s, const char *t, int n) {
 }
 
 int strlen(const char *s) {
-	int n;
+	const char *p = s;
 
-	for (n = 0; s[n]; n++)
-		;
-	return n;
+	// an aligned word never crosses a page, reading past the NUL is safe
+	for (; (unsigned int)p % 4; p++) {
+		if (!*p) {
+			return p - s;
+		}
+	}
+	while (!WORD_HAS_ZERO(*(const unsigned int *)p)) {
+		p += 4;
+	}
+	while (*p) {
+		p++;
+	}
+	return p - s;
 }
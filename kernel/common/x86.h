@@ -80,6 +80,14 @@ static inline void stosl(void *addr, int data, int cnt) {
 					 : "memory", "cc");
 }
 
+static inline void movsb(void *dst, const void *src, int cnt) {
+	__asm__ volatile("cld; rep movsb" : "+D"(dst), "+S"(src), "+c"(cnt) : : "memory", "cc");
+}
+
+static inline void movsl(void *dst, const void *src, int cnt) {
+	__asm__ volatile("cld; rep movsl" : "+D"(dst), "+S"(src), "+c"(cnt) : : "memory", "cc");
+}
+
 struct segdesc;
 
 static inline void lgdt(struct segdesc *p, int size) {
@@ -126,6 +134,12 @@ static inline void sti(void) {
 	__asm__ volatile("sti");
 }
 
+// Enable interrupts and halt until the next one. An interrupt
+// pending at sti is taken after hlt, so it can't be missed.
+static inline void sti_hlt(void) {
+	__asm__ volatile("sti; hlt");
+}
+
 static inline unsigned int xchg(volatile unsigned int *addr, unsigned int newval) {
 	unsigned int result;
 
@@ -144,6 +158,44 @@ static inline void lcr3(unsigned int val) {
 	__asm__ volatile("movl %0,%%cr3" : : "r"(val));
 }
 
+static inline unsigned int rcr0(void) {
+	unsigned int val;
+	__asm__ volatile("movl %%cr0,%0" : "=r"(val));
+	return val;
+}
+
+static inline void lcr0(unsigned int val) {
+	__asm__ volatile("movl %0,%%cr0" : : "r"(val));
+}
+
+static inline unsigned int rcr4(void) {
+	unsigned int val;
+	__asm__ volatile("movl %%cr4,%0" : "=r"(val));
+	return val;
+}
+
+static inline void lcr4(unsigned int val) {
+	__asm__ volatile("movl %0,%%cr4" : : "r"(val));
+}
+
+static inline void fxsave(void *addr) {
+	__asm__ volatile("fxsave (%0)" : : "r"(addr) : "memory");
+}
+
+static inline void fxrstor(const void *addr) {
+	__asm__ volatile("fxrstor (%0)" : : "r"(addr) : "memory");
+}
+
+static inline void invlpg(void *addr) {
+	__asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
 // PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trap__asm__.S, and passed to trap().
@@ -0,0 +1,146 @@
+/*
+ * Waiting for messages, input and timeouts
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/proc.h>
+#include <defs.h>
+#include <hal/hal.h>
+#include <param.h>
+#include <proc/kcall.h>
+
+// A process may wait for any of several kinds of events at once with a
+// timeout, such as the window manager waiting for a message, input or its
+// next frame. The waiter sleeps on its own message queue, which message
+// senders wake already, and input and the timer wake it there too.
+
+#define EVENT_WAITERS 8
+
+struct EventWaiter {
+	struct proc *proc; // 0 if the slot is free
+	unsigned int mask;
+	unsigned int start, timeout; // ticks
+};
+
+static struct {
+	struct spinlock lock;
+	struct EventWaiter waiter[EVENT_WAITERS];
+} event;
+
+// events of mask pending for p, p->msgqueue.lock must be held
+static unsigned int event_pending(struct proc *p, unsigned int mask) {
+	unsigned int events = hal_hid_pending() & mask;
+	if ((mask & EVENT_MESSAGE) && p->msgqueue.begin != p->msgqueue.end) {
+		events |= EVENT_MESSAGE;
+	}
+	return events;
+}
+
+// event.lock must be held
+static void event_wake(struct EventWaiter *w) {
+	acquire(&w->proc->msgqueue.lock);
+	wakeup(&w->proc->msgqueue);
+	release(&w->proc->msgqueue.lock);
+}
+
+// Sleep until one of the events in mask is pending or timeout ticks passed,
+// return the pending events, 0 on timeout
+static int event_wait(unsigned int mask, unsigned int timeout) {
+	struct proc *p = myproc();
+	struct EventWaiter *w = 0;
+	acquire(&event.lock);
+	for (int i = 0; i < EVENT_WAITERS; i++) {
+		if (!event.waiter[i].proc) {
+			w = &event.waiter[i];
+			w->proc = p;
+			w->mask = mask;
+			w->start = ticks;
+			w->timeout = timeout;
+			break;
+		}
+	}
+	release(&event.lock);
+	if (!w) {
+		return ERROR_OUT_OF_SPACE;
+	}
+
+	unsigned int events;
+	acquire(&p->msgqueue.lock);
+	while (!(events = event_pending(p, mask)) && ticks - w->start < timeout && !p->killed) {
+		sleep(&p->msgqueue, &p->msgqueue.lock);
+	}
+	release(&p->msgqueue.lock);
+
+	acquire(&event.lock);
+	w->proc = 0;
+	release(&event.lock);
+	return events;
+}
+
+// Wake the processes waiting for one of events, called by input drivers
+void event_notify(unsigned int events) {
+	acquire(&event.lock);
+	for (int i = 0; i < EVENT_WAITERS; i++) {
+		struct EventWaiter *w = &event.waiter[i];
+		if (w->proc && (w->mask & events)) {
+			event_wake(w);
+		}
+	}
+	release(&event.lock);
+}
+
+// Wake the processes whose wait timed out, called every tick
+void event_tick(void) {
+	acquire(&event.lock);
+	for (int i = 0; i < EVENT_WAITERS; i++) {
+		struct EventWaiter *w = &event.waiter[i];
+		if (w->proc && w->timeout != EVENT_WAIT_FOREVER && ticks - w->start >= w->timeout) {
+			event_wake(w);
+		}
+	}
+	release(&event.lock);
+}
+
+struct EventKcall {
+#define EVENT_KCALL_OP_WAIT 0
+	unsigned int op;
+	unsigned int mask; // EVENT_* to wait for
+	unsigned int timeout; // ticks, EVENT_WAIT_FOREVER never times out
+	unsigned int events; // pending events
+};
+
+static int event_kcall_handler(unsigned int arg) {
+	struct EventKcall *p = (struct EventKcall *)arg;
+	switch (p->op) {
+		case EVENT_KCALL_OP_WAIT: {
+			int events = event_wait(p->mask, p->timeout);
+			if (events < 0) {
+				return events;
+			}
+			p->events = events;
+			return 0;
+		}
+	}
+	return ERROR_INVAILD;
+}
+
+void event_init(void) {
+	initlock(&event.lock, "event");
+	kcall_set("event", event_kcall_handler);
+}
@@ -25,17 +25,145 @@
 extern char end[]; // first address after kernel loaded from ELF file defined by the
 				   // kernel linker script in kernel.ld
 
-struct run {
-	struct run *next;
-	unsigned int num_pages; // size in 4K pages
+// Binary buddy allocator. Every physical page has a PhysPage descriptor,
+// a free block of 2^order pages is described by the descriptor of its
+// first page and linked into free_list[order]. Freed blocks are merged
+// with their buddy as long as the buddy is also free.
+
+#define NPHYSPAGE (PHYSTOP / PGSIZE)
+
+#define PHYSPAGE_FREE (1 << 0) // page heads a free block
+
+struct PhysPage {
+	struct PhysPage *next, *prev; // free list link
+	unsigned char order; // order of the free block, valid if PHYSPAGE_FREE
+	unsigned char flags;
+	unsigned short refcount; // address spaces mapping the page, 1 after pgalloc
+};
+
+static struct PhysPage physpage[NPHYSPAGE];
+
+// Per-CPU cache of single pages, kalloc() and kfree() hit it
+// without touching kmem.lock
+#define PCP_HIGH 64 // drain to buddy when a CPU holds this many pages
+#define PCP_BATCH 16 // pages moved between buddy and cache at once
+
+struct PerCpuPages {
+	unsigned int count;
+	void *page[PCP_HIGH];
 };
 
 struct {
 	struct spinlock lock;
 	int use_lock;
-	struct run *freelist;
+	struct PhysPage *free_list[PGALLOC_MAX_ORDER];
+	unsigned int nr_free[PGALLOC_MAX_ORDER]; // free blocks of each order
+	unsigned int free_pages; // free pages in buddy, excluding per-CPU caches
+	unsigned int total_pages;
+	struct PerCpuPages pcp[NCPU];
 } kmem;
 
+static inline unsigned int page_to_pfn(struct PhysPage *page) {
+	return page - physpage;
+}
+
+static inline void *pfn_to_virt(unsigned int pfn) {
+	return P2V(pfn * PGSIZE);
+}
+
+static inline unsigned int virt_to_pfn(void *v) {
+	return V2P(v) / PGSIZE;
+}
+
+static void free_list_add(struct PhysPage *page, unsigned int order) {
+	page->flags |= PHYSPAGE_FREE;
+	page->order = order;
+	page->prev = 0;
+	page->next = kmem.free_list[order];
+	if (page->next) {
+		page->next->prev = page;
+	}
+	kmem.free_list[order] = page;
+	kmem.nr_free[order]++;
+}
+
+static void free_list_del(struct PhysPage *page) {
+	if (page->prev) {
+		page->prev->next = page->next;
+	} else {
+		kmem.free_list[page->order] = page->next;
+	}
+	if (page->next) {
+		page->next->prev = page->prev;
+	}
+	kmem.nr_free[page->order]--;
+	page->flags &= ~PHYSPAGE_FREE;
+	page->next = page->prev = 0;
+}
+
+// free a naturally aligned block of 2^order pages and merge it with its buddies
+// kmem.lock must be held
+static void buddy_free_block(unsigned int pfn, unsigned int order) {
+	kmem.free_pages += 1 << order;
+	while (order < PGALLOC_MAX_ORDER - 1) {
+		unsigned int buddy = pfn ^ (1 << order);
+		if (buddy >= NPHYSPAGE) {
+			break;
+		}
+		if (!(physpage[buddy].flags & PHYSPAGE_FREE) || physpage[buddy].order != order) {
+			break;
+		}
+		free_list_del(&physpage[buddy]);
+		pfn &= ~(1 << order);
+		order++;
+	}
+	free_list_add(&physpage[pfn], order);
+}
+
+// free an arbitrary run of pages by splitting it into aligned blocks
+// kmem.lock must be held
+static void buddy_free_range(unsigned int pfn, unsigned int num_pages) {
+	while (num_pages) {
+		unsigned int order = 0;
+		while (order < PGALLOC_MAX_ORDER - 1 && !(pfn & (1 << order)) &&
+			   (2u << order) <= num_pages) {
+			order++;
+		}
+		buddy_free_block(pfn, order);
+		pfn += 1 << order;
+		num_pages -= 1 << order;
+	}
+}
+
+// take a block of 2^order pages off the free lists, splitting larger blocks
+// kmem.lock must be held, return pfn or -1
+static int buddy_alloc_block(unsigned int order) {
+	unsigned int o = order;
+	while (o < PGALLOC_MAX_ORDER && !kmem.free_list[o]) {
+		o++;
+	}
+	if (o == PGALLOC_MAX_ORDER) {
+		return -1;
+	}
+	struct PhysPage *page = kmem.free_list[o];
+	free_list_del(page);
+	unsigned int pfn = page_to_pfn(page);
+	// give back the upper halves until the block is of the requested size
+	while (o > order) {
+		o--;
+		free_list_add(&physpage[pfn + (1 << o)], o);
+	}
+	kmem.free_pages -= 1 << order;
+	return pfn;
+}
+
+static void kmem_add_range(void *vstart, void *vend) {
+	unsigned int begin = virt_to_pfn((void *)PGROUNDUP((unsigned int)vstart));
+	unsigned int num_pages = virt_to_pfn(vend) - begin;
+	buddy_free_range(begin, num_pages);
+	kmem.total_pages += num_pages;
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -44,104 +172,176 @@ struct {
 void kinit1(void *vstart, void *vend) {
 	initlock(&kmem.lock, "kmem");
 	kmem.use_lock = 0;
-	kmem.freelist = 0;
-
-	kmem.freelist = (void *)PGROUNDUP((unsigned int)vstart);
-	kmem.freelist->next = 0;
-	kmem.freelist->num_pages = ((unsigned int)vend - PGROUNDUP((unsigned int)vstart)) / PGSIZE;
+	kmem_add_range(vstart, vend);
 }
 
 void kinit2(void *vstart, void *vend) {
-	kmem.freelist->next = (void *)PGROUNDUP((unsigned int)vstart);
-	kmem.freelist->next->next = 0;
-	kmem.freelist->next->num_pages =
-		((unsigned int)vend - PGROUNDUP((unsigned int)vstart)) / PGSIZE;
-
+	kmem_add_range(vstart, vend);
 	kmem.use_lock = 1;
 }
 
-void *pgalloc(unsigned int num_pages) {
-	if (kmem.use_lock) {
-		acquire(&kmem.lock);
+static unsigned int pgalloc_order(unsigned int num_pages) {
+	unsigned int order = 0;
+	while ((1u << order) < num_pages) {
+		order++;
 	}
+	return order;
+}
 
-	if (!kmem.freelist) {
-		panic("out of memory");
+// refill this CPU's page cache from the buddy allocator, interrupts must be off
+static void pcp_refill(struct PerCpuPages *pcp) {
+	acquire(&kmem.lock);
+	while (pcp->count < PCP_BATCH) {
+		int pfn = buddy_alloc_block(0);
+		if (pfn < 0) {
+			break;
+		}
+		pcp->page[pcp->count++] = pfn_to_virt(pfn);
 	}
+	release(&kmem.lock);
+}
+
+// return the coldest half of this CPU's page cache, interrupts must be off
+static void pcp_drain(struct PerCpuPages *pcp, unsigned int num) {
+	acquire(&kmem.lock);
+	for (unsigned int i = 0; i < num; i++) {
+		buddy_free_block(virt_to_pfn(pcp->page[i]), 0);
+	}
+	release(&kmem.lock);
+	pcp->count -= num;
+	memmove(pcp->page, pcp->page + num, pcp->count * sizeof(void *));
+}
 
-	void *p = 0;
-	if (kmem.freelist->num_pages >= num_pages) {
-		p = kmem.freelist;
-		if (kmem.freelist->num_pages > num_pages) {
-			struct run *newfl = (void *)kmem.freelist + num_pages * PGSIZE;
-			newfl->next = kmem.freelist->next;
-			newfl->num_pages = kmem.freelist->num_pages - num_pages;
-			kmem.freelist = newfl;
-		} else if (kmem.freelist->num_pages == num_pages) {
-			kmem.freelist = kmem.freelist->next;
+// Allocate num_pages contiguous pages, return 0 if memory is exhausted
+void *pgalloc_try(unsigned int num_pages) {
+	if (!num_pages) { // zero-sized message buffers still get a page
+		num_pages = 1;
+	}
+	if (num_pages == 1 && kmem.use_lock) {
+		pushcli();
+		struct PerCpuPages *pcp = &kmem.pcp[cpuid()];
+		if (!pcp->count) {
+			pcp_refill(pcp);
 		}
-	} else {
-		struct run *r = kmem.freelist;
-		while (r->next) {
-			if (r->next->num_pages >= num_pages) {
-				p = r->next;
-				if (r->next->num_pages > num_pages) {
-					struct run *newrun = (void *)r->next + num_pages * PGSIZE;
-					newrun->next = r->next->next;
-					newrun->num_pages = r->next->num_pages - num_pages;
-					r->next = newrun;
-				} else if (r->next->num_pages == num_pages) {
-					r->next = r->next->next;
-				}
-				break;
-			}
-			r = r->next;
+		void *p = pcp->count ? pcp->page[--pcp->count] : 0;
+		popcli();
+		if (p) {
+			physpage[virt_to_pfn(p)].refcount = 1;
+			return p;
 		}
 	}
 
-	if (!p) {
-		panic("out of memory");
+	unsigned int order = pgalloc_order(num_pages);
+	if (order >= PGALLOC_MAX_ORDER) {
+		panic("pgalloc too large");
 	}
 
+	if (kmem.use_lock) {
+		acquire(&kmem.lock);
+	}
+	int pfn = buddy_alloc_block(order);
+	if (pfn < 0) {
+		if (kmem.use_lock) {
+			release(&kmem.lock);
+		}
+		return 0;
+	}
+	// return the unused tail of a block rounded up to a power of two
+	if ((1u << order) > num_pages) {
+		buddy_free_range(pfn + num_pages, (1 << order) - num_pages);
+	}
 	if (kmem.use_lock) {
 		release(&kmem.lock);
 	}
+	physpage[pfn].refcount = 1;
+	return pfn_to_virt(pfn);
+}
+
+void *pgalloc(unsigned int num_pages) {
+	void *p = pgalloc_try(num_pages);
+	if (!p) {
+		panic("out of memory");
+	}
 	return p;
 }
 
 void pgfree(void *ptr, unsigned int num_pages) {
-	if (kmem.use_lock) {
-		acquire(&kmem.lock);
+	if ((unsigned int)ptr % PGSIZE || V2P(ptr) >= PHYSTOP) {
+		panic("pgfree");
+	}
+	if (!num_pages) {
+		num_pages = 1;
 	}
 
-	memset(ptr, 1, num_pages * PGSIZE);
-
-	void *orighead = kmem.freelist;
-	kmem.freelist = ptr;
-	kmem.freelist->num_pages = num_pages;
-	kmem.freelist->next = orighead;
+	if (num_pages == 1 && kmem.use_lock) {
+		pushcli();
+		struct PerCpuPages *pcp = &kmem.pcp[cpuid()];
+		if (pcp->count == PCP_HIGH) {
+			pcp_drain(pcp, PCP_HIGH / 2);
+		}
+		pcp->page[pcp->count++] = ptr;
+		popcli();
+		return;
+	}
 
+	if (kmem.use_lock) {
+		acquire(&kmem.lock);
+	}
+	buddy_free_range(virt_to_pfn(ptr), num_pages);
 	if (kmem.use_lock) {
 		release(&kmem.lock);
 	}
 }
 
-void print_memory_usage(void) {
+// Pages shared copy-on-write between address spaces are reference counted,
+// the last page_put() gives the page back
+void page_get(void *ptr) {
+	__sync_fetch_and_add(&physpage[virt_to_pfn(ptr)].refcount, 1);
+}
+
+void page_put(void *ptr) {
+	if (__sync_sub_and_fetch(&physpage[virt_to_pfn(ptr)].refcount, 1) == 0) {
+		kfree(ptr);
+	}
+}
+
+unsigned int page_refcount(void *ptr) {
+	return physpage[virt_to_pfn(ptr)].refcount;
+}
+
+void pgalloc_get_stats(struct PgallocStats *stats) {
 	if (kmem.use_lock) {
 		acquire(&kmem.lock);
 	}
-
-	unsigned int pages = 0, clusters = 0;
-	struct run *r = kmem.freelist;
-	while (r) {
-		pages += r->num_pages;
-		r = r->next;
-		clusters++;
+	stats->total_pages = kmem.total_pages;
+	stats->free_pages = kmem.free_pages;
+	stats->pcp_pages = 0;
+	for (unsigned int i = 0; i < NCPU; i++) {
+		stats->pcp_pages += kmem.pcp[i].count;
+	}
+	for (int i = 0; i < PGALLOC_MAX_ORDER; i++) {
+		stats->nr_free[i] = kmem.nr_free[i];
 	}
-
 	if (kmem.use_lock) {
 		release(&kmem.lock);
 	}
+}
 
-	cprintf("Free memory %d clusters %d pages %d MiB\n", clusters, pages, pages / 256);
+void print_memory_usage(void) {
+	struct PgallocStats stats;
+	pgalloc_get_stats(&stats);
+
+	unsigned int pages = stats.free_pages + stats.pcp_pages;
+	cprintf(
+		"Free memory %d pages %d MiB of %d MiB, %d pages in per-cpu cache\n",
+		pages,
+		pages / 256,
+		stats.total_pages / 256,
+		stats.pcp_pages
+	);
+	cprintf("Free blocks by order:");
+	for (int i = 0; i < PGALLOC_MAX_ORDER; i++) {
+		cprintf(" %d", stats.nr_free[i]);
+	}
+	cprintf("\n");
 }
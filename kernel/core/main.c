@@ -30,6 +30,7 @@
 #include <hal/hal.h>
 #include <memlayout.h>
 #include <param.h>
+#include <proc/file.h>
 #include <proc/kcall.h>
 #include <proc/pty.h>
 
@@ -149,7 +150,6 @@ void kmain(void *fdt) {
 	mpinit(); // detect other processors
 	lapicinit(); // interrupt controller
 	seginit(); // segment descriptors
-	msi_init();
 	if (boot_graphics_mode.mode == BOOT_GRAPHICS_MODE_FRAMEBUFFER) {
 		fbcon_init(boot_graphics_mode.fb_addr, boot_graphics_mode.width, boot_graphics_mode.height);
 	} else {
@@ -161,6 +161,7 @@ void kmain(void *fdt) {
 	startothers(); // start other processors
 	kinit2(P2V(4 * 1024 * 1024), P2V(PHYSTOP));
 #endif
+	slab_init(); // kernel object caches
 	// greeting
 	cprintf(" ____             _       ___  ____  \n");
 	cprintf("|  _ \\ __ _ _ __ (_) ___ / _ \\/ ___| \n");
@@ -176,7 +177,13 @@ void kmain(void *fdt) {
 	hal_hid_init();
 	hal_power_init();
 #ifndef __riscv
+	vm_init();
+	shm_init();
+	event_init();
+	sched_init();
+	msi_init(); // message signaled interrupts
 	pty_init();
+	file_init();
 #endif
 // device initialization
 #ifndef __riscv
@@ -216,6 +223,7 @@ static void mpenter(void) {
 static void mpmain(void) {
 	cprintf("[cpu] starting %d\n", cpuid());
 	idtinit(); // load idt register
+	fpu_init(); // FPU and SSE for user processes
 	xchg(&(mycpu()->started), 1); // tell startothers() we're up
 	scheduler(); // start running processes
 }
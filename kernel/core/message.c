@@ -0,0 +1,186 @@
+/*
+ * Inter-process messages
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/proc.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <param.h>
+
+// The data of a message is kept in pages. Small messages are copied into
+// a page when sent and out of it when received. Large ones avoid both
+// copies where the buffers allow: full pages at page aligned addresses of
+// the sender are lent to the message copy-on-write, and full pages are
+// mapped copy-on-write into a page aligned receive buffer. Data is only
+// copied later if one side writes it.
+//
+// A queue holds MESSAGE_MAX - 1 messages, senders wait for room or fail
+// with ERROR_AGAIN if they asked not to block.
+
+#define MESSAGE_LEND_MIN (4 * PGSIZE) // smaller messages are always copied
+
+static inline unsigned int message_npages(int size) {
+	return size ? PGROUNDUP(size) / PGSIZE : 1;
+}
+
+static inline void **message_pages(struct Message *m) {
+	return m->size > PGSIZE ? m->pages : &m->page;
+}
+
+void message_free(struct Message *m) {
+	void **pages = message_pages(m);
+	for (unsigned int i = 0; i < message_npages(m->size); i++) {
+		if (pages[i]) {
+			page_put(pages[i]);
+		}
+	}
+	if (m->size > PGSIZE) {
+		kfree((char *)m->pages);
+	}
+}
+
+// Gather a message from count buffers of the current process, checked by
+// the caller. Return the size or -1.
+int message_build(struct Message *m, const struct MessageVec *vec, int count) {
+	struct proc *p = myproc();
+	unsigned int size = 0;
+	for (int i = 0; i < count; i++) {
+		size += vec[i].size;
+	}
+	if (size > MESSAGE_SIZE_MAX) {
+		return -1;
+	}
+	m->pid = p->pid;
+	m->size = size;
+	if (size > PGSIZE) {
+		m->pages = (void **)kalloc(); // a page holds pointers to MESSAGE_SIZE_MAX bytes
+		if (!m->pages) {
+			return -1;
+		}
+	}
+	void **pages = message_pages(m);
+	memset(pages, 0, message_npages(size) * sizeof(void *));
+
+	unsigned int offset = 0;
+	for (int i = 0; i < count; i++) {
+		const char *src = vec[i].base;
+		unsigned int left = vec[i].size;
+		while (left) {
+			unsigned int index = offset / PGSIZE, in = offset % PGSIZE, n;
+			if (size >= MESSAGE_LEND_MIN && in == 0 && left >= PGSIZE &&
+				(unsigned int)src % PGSIZE == 0 &&
+				(pages[index] = vm_page_lend(p, (unsigned int)src)) != 0) {
+				n = PGSIZE;
+			} else {
+				if (!pages[index] && (pages[index] = kalloc()) == 0) {
+					message_free(m);
+					return -1;
+				}
+				n = PGSIZE - in < left ? PGSIZE - in : left;
+				memmove((char *)pages[index] + in, src, n);
+			}
+			src += n;
+			left -= n;
+			offset += n;
+		}
+	}
+	return size;
+}
+
+// Queue message m for process pid, which then owns its pages
+int message_send(int pid, struct Message *m, int flags) {
+	struct proc *dest = proc_search_pid(pid);
+	if (!dest) {
+		return ERROR_NOT_EXIST;
+	}
+	struct MessageQueue *q = &dest->msgqueue;
+	acquire(&q->lock);
+	while ((q->begin + 1) % MESSAGE_MAX == q->end && dest->pid == pid) {
+		if ((flags & MESSAGE_NONBLOCK) || myproc()->killed) {
+			release(&q->lock);
+			return ERROR_AGAIN;
+		}
+		sleep(&q->queue, &q->lock);
+	}
+	if (dest->pid != pid) { // exited while we waited
+		release(&q->lock);
+		return ERROR_NOT_EXIST;
+	}
+	q->queue[q->begin] = *m;
+	q->begin = (q->begin + 1) % MESSAGE_MAX;
+	wakeup(q);
+	release(&q->lock);
+	return 0;
+}
+
+// Take the oldest message of the current process, waiting for one if
+// block. Return 0 if there is none.
+int message_dequeue(struct Message *m, int block) {
+	struct proc *p = myproc();
+	struct MessageQueue *q = &p->msgqueue;
+	acquire(&q->lock);
+	while (q->begin == q->end) {
+		if (!block || p->killed) {
+			release(&q->lock);
+			return 0;
+		}
+		sleep(q, &q->lock);
+	}
+	if ((q->begin + 1) % MESSAGE_MAX == q->end) {
+		wakeup(&q->queue); // senders waiting for room
+	}
+	*m = q->queue[q->end];
+	q->end = (q->end + 1) % MESSAGE_MAX;
+	release(&q->lock);
+	return 1;
+}
+
+// Place the data of m at dst in the current process, which the caller
+// checked and faulted in, and free m
+void message_deliver(struct Message *m, char *dst) {
+	struct proc *p = myproc();
+	void **pages = message_pages(m);
+	for (unsigned int i = 0; i < message_npages(m->size); i++) {
+		unsigned int offset = i * PGSIZE;
+		unsigned int n = m->size - offset < PGSIZE ? m->size - offset : PGSIZE;
+		if (n == PGSIZE && m->size >= MESSAGE_LEND_MIN && (unsigned int)dst % PGSIZE == 0 &&
+			vm_page_install(p, (unsigned int)dst + offset, pages[i]) == 0) {
+			pages[i] = 0; // the mapping took the reference
+		} else {
+			memmove(dst + offset, pages[i], n);
+		}
+	}
+	message_free(m);
+}
+
+// Drop the queued messages of p, which is being freed, and fail the
+// senders waiting for room. p->pid is cleared under the queue lock so no
+// message is queued after.
+void message_queue_free(struct proc *p) {
+	struct MessageQueue *q = &p->msgqueue;
+	acquire(&q->lock);
+	while (q->end != q->begin) {
+		message_free(&q->queue[q->end]);
+		q->end = (q->end + 1) % MESSAGE_MAX;
+	}
+	p->pid = 0;
+	wakeup(&q->queue);
+	release(&q->lock);
+}
@@ -19,25 +19,142 @@
 
 #include <arch/x86/lapic.h>
 #include <arch/x86/mmu.h>
+#include <arch/x86/traps.h>
+#include <common/errorcode.h>
 #include <common/spinlock.h>
 #include <common/x86.h>
 #include <core/proc.h>
 #include <defs.h>
 #include <memlayout.h>
 #include <param.h>
+#include <proc/file.h>
+#include <proc/kcall.h>
 
 struct ProcTable ptable;
 
+// Every CPU has a FIFO run queue of RUNNABLE processes with its own lock.
+// The lock of a CPU's run queue is held across every switch between a
+// process and that CPU's scheduler, the way ptable.lock is in xv6. A process
+// going to sleep takes the run queue lock of its CPU before it releases the
+// wait queue lock, and wakeup() puts it back on the run queue of p->cpu, so
+// a process is never run elsewhere before its context is saved. A CPU with
+// an empty run queue steals from the longest one and halts if there is
+// nothing to steal.
+
+struct RunQueue {
+	struct spinlock lock;
+	struct proc *head, *tail;
+	int idle; // the CPU is halted waiting for work
+	struct SchedCpuStats stats;
+};
+
+static struct RunQueue runqueue[NCPU];
+
+// Sleeping processes are kept in wait queues hashed by channel
+#define WAITQ_HASH_SHIFT 6
+#define WAITQ_HASH (1 << WAITQ_HASH_SHIFT)
+
+static struct WaitQueue {
+	struct spinlock lock;
+	struct proc *head;
+} waitqueue[WAITQ_HASH];
+
+static inline struct WaitQueue *waitqueue_of(void *chan) {
+	return &waitqueue[((unsigned int)chan * 2654435761u) >> (32 - WAITQ_HASH_SHIFT)];
+}
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
-
 void pinit(void) {
 	initlock(&ptable.lock, "ptable");
+	for (int i = 0; i < NCPU; i++) {
+		initlock(&runqueue[i].lock, "runqueue");
+	}
+	for (int i = 0; i < WAITQ_HASH; i++) {
+		initlock(&waitqueue[i].lock, "waitqueue");
+	}
+}
+
+// lock the run queue of this CPU, the lock keeps us on it
+static struct RunQueue *runqueue_lock_this(void) {
+	pushcli();
+	struct RunQueue *rq = &runqueue[cpuid()];
+	acquire(&rq->lock);
+	popcli();
+	return rq;
+}
+
+// rq->lock must be held
+static void runqueue_push(struct RunQueue *rq, struct proc *p) {
+	p->rq_next = 0;
+	if (rq->tail) {
+		rq->tail->rq_next = p;
+	} else {
+		rq->head = p;
+	}
+	rq->tail = p;
+	rq->stats.nr_running++;
+}
+
+// rq->lock must be held
+static struct proc *runqueue_pop(struct RunQueue *rq) {
+	struct proc *p = rq->head;
+	if (p) {
+		rq->head = p->rq_next;
+		if (!rq->head) {
+			rq->tail = 0;
+		}
+		p->rq_next = 0;
+		rq->stats.nr_running--;
+	}
+	return p;
+}
+
+// Put a RUNNABLE process on the run queue of p->cpu. Halted CPUs are
+// woken up, the target one to run p or another one to steal it.
+static void runqueue_add(struct proc *p) {
+	struct RunQueue *rq = &runqueue[p->cpu];
+	acquire(&rq->lock);
+	runqueue_push(rq, p);
+	int idle = rq->idle;
+	int self = cpuid();
+	release(&rq->lock);
+
+	if (idle) {
+		if (p->cpu != self) {
+			lapic_send_ipi(cpus[p->cpu].apicid, T_IRQ0 + IRQ_RESCHED);
+		}
+		return;
+	}
+	for (int i = 0; i < (int)ncpu; i++) {
+		if (i != self && runqueue[i].idle) {
+			lapic_send_ipi(cpus[i].apicid, T_IRQ0 + IRQ_RESCHED);
+			break;
+		}
+	}
+}
+
+// Take a process from the longest run queue of the other CPUs
+static struct proc *runqueue_steal(int self) {
+	struct RunQueue *victim = 0;
+	unsigned int most = 0;
+	for (int i = 0; i < (int)ncpu; i++) {
+		if (i != self && runqueue[i].stats.nr_running > most) {
+			most = runqueue[i].stats.nr_running;
+			victim = &runqueue[i];
+		}
+	}
+	if (!victim) {
+		return 0;
+	}
+	acquire(&victim->lock);
+	struct proc *p = runqueue_pop(victim);
+	release(&victim->lock);
+	return p;
 }
 
 // Must be called with interrupts disabled
@@ -46,10 +163,13 @@ int cpuid() {
 }
 
 void proc_free(struct proc *p) {
+	message_queue_free(p);
 	kfree(p->kstack);
 	p->kstack = 0;
 	freevm(p->pgdir);
-	kfree(p->cwd.pathbuf);
+	vm_map_free(p->vmmap);
+	p->vmmap = 0;
+	vfs_path_free(p->cwd.pathbuf);
 	p->pid = 0;
 	p->parent = 0;
 	p->name[0] = 0;
@@ -138,6 +258,9 @@ found:
 
 	// empty file table
 	memset(p->files, 0, sizeof(p->files));
+	p->vmmap = 0;
+	memset(&p->stats, 0, sizeof(p->stats));
+	fpu_state_init(&p->fpu);
 	p->dyn_base = PROC_DYNAMIC_BOTTOM;
 	p->pty = 0;
 	// empty the message queue
@@ -174,25 +297,31 @@ void userinit(void) {
 	safestrcpy(p->name, "initcode", sizeof(p->name));
 
 	p->cwd.parts = 0; // root directory
-	p->cwd.pathbuf = kalloc();
+	p->cwd.pathbuf = vfs_path_alloc();
+
+	// standard input, output and error, inherited by every process
+	p->files[0] = file_alloc(FILE_CONSOLE, 1, 1);
+	p->files[1] = file_dup(p->files[0]);
+	p->files[2] = file_dup(p->files[0]);
 
 	// this assignment to p->state lets other cores
 	// run this process. the acquire forces the above
 	// writes to be visible, and the lock is also needed
 	// because the assignment might not be atomic.
-	acquire(&ptable.lock);
-
+	p->cpu = 0;
 	p->state = RUNNABLE;
-
-	release(&ptable.lock);
+	runqueue_add(p);
 }
 
-// Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Grow current process's heap by n bytes, or shrink it and free
+// its pages if n is negative. Return 0 on success, -1 on failure.
 int growproc(int n) {
 	struct proc *curproc = myproc();
 
 	if (n > 0) {
+		if (PROC_HEAP_BOTTOM + curproc->heap_size + n > PROC_DYNAMIC_BOTTOM) {
+			return -1;
+		}
 		if (allocuvm(
 				curproc->pgdir,
 				PROC_HEAP_BOTTOM + curproc->heap_size,
@@ -202,6 +331,9 @@ int growproc(int n) {
 			return -1;
 		}
 	} else if (n < 0) {
+		if ((unsigned int)-n > curproc->heap_size) {
+			return -1;
+		}
 		if (deallocuvm(
 				curproc->pgdir,
 				PROC_HEAP_BOTTOM + curproc->heap_size,
@@ -268,13 +400,41 @@ int fork(void) {
 		return -1;
 	}
 
+	// copy anonymous memory mappings
+	for (unsigned int i = 0; curproc->vmmap && i < curproc->vmmap->num; i++) {
+		struct VmArea *area = &curproc->vmmap->area[i];
+		if (area->anon && copyuvm(np->pgdir, curproc->pgdir, area->begin, area->end) == 0) {
+			freevm(np->pgdir);
+			kfree(np->kstack);
+			np->kstack = 0;
+			np->state = UNUSED;
+			return -1;
+		}
+	}
+
+	// the parent's writable pages became copy-on-write
+	switchuvm(curproc);
+
+	if ((np->vmmap = vm_map_dup(curproc->vmmap)) == 0) {
+		freevm(np->pgdir);
+		kfree(np->kstack);
+		np->kstack = 0;
+		np->state = UNUSED;
+		return -1;
+	}
 	np->sz = curproc->sz;
 	np->stack_size = curproc->stack_size;
 	np->heap_size = curproc->heap_size;
 	np->dyn_base = curproc->dyn_base;
 	np->pty = curproc->pty;
+	for (int i = 0; i < PROC_FILE_MAX; i++) {
+		if (curproc->files[i]) {
+			np->files[i] = file_dup(curproc->files[i]);
+		}
+	}
 	np->parent = curproc;
 	*np->tf = *curproc->tf;
+	fpu_save(&np->fpu); // the registers of curproc are live
 
 	// Clear %eax so that fork returns 0 in the child.
 	np->tf->eax = 0;
@@ -283,16 +443,16 @@ int fork(void) {
 
 	// copy working directory
 	np->cwd.parts = curproc->cwd.parts;
-	np->cwd.pathbuf = kalloc();
+	np->cwd.pathbuf = vfs_path_alloc();
 	memmove(np->cwd.pathbuf, curproc->cwd.pathbuf, np->cwd.parts * 128);
 
 	pid = np->pid;
 
-	acquire(&ptable.lock);
-
+	pushcli();
+	np->cpu = cpuid();
 	np->state = RUNNABLE;
-
-	release(&ptable.lock);
+	runqueue_add(np);
+	popcli();
 
 	return pid;
 }
@@ -311,32 +471,32 @@ void exit(int status) {
 	curproc->exit_status = status;
 	// Close all open files.
 	for (int i = 0; i < PROC_FILE_MAX; i++) {
-		if (curproc->files[i].used) {
-			if (curproc->files[i].dir) {
-				vfs_dir_close(&curproc->files[i]);
-			} else {
-				vfs_fd_close(&curproc->files[i]);
-			}
+		if (curproc->files[i]) {
+			file_close(curproc->files[i]);
+			curproc->files[i] = 0;
 		}
 	}
 
 	acquire(&ptable.lock);
 
 	// Parent might be sleeping in wait().
-	wakeup1(curproc->parent);
+	wakeup(curproc->parent);
 
 	// Pass abandoned children to init.
 	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
 		if (p->parent == curproc) {
 			p->parent = initproc;
 			if (p->state == ZOMBIE) {
-				wakeup1(initproc);
+				wakeup(initproc);
 			}
 		}
 	}
 
-	// Jump into the scheduler, never to return.
+	// Jump into the scheduler, never to return. ptable.lock stays
+	// held until the scheduler switched away from this process,
+	// so wait() in the parent can't free it under us.
 	curproc->state = ZOMBIE;
+	runqueue_lock_this();
 	sched();
 	panic("zombie exit");
 }
@@ -361,16 +521,6 @@ int wait(void) {
 				// Found one.
 				pid = p->pid;
 				proc_free(p);
-				// free message queue
-				acquire(&p->msgqueue.lock);
-				for (int msg = p->msgqueue.end; msg != p->msgqueue.begin; msg++) {
-					if (msg == MESSAGE_MAX) {
-						msg = 0;
-					}
-					struct Message *thismsg = &p->msgqueue.queue[msg];
-					pgfree(thismsg->addr, PGROUNDUP(thismsg->size) / 4096);
-				}
-				release(&p->msgqueue.lock);
 				release(&ptable.lock);
 				return pid;
 			}
@@ -382,7 +532,7 @@ int wait(void) {
 			return -1;
 		}
 
-		// Wait for children to exit.  (See wakeup1 call in proc_exit.)
+		// Wait for children to exit.  (See wakeup call in exit.)
 		sleep(curproc, &ptable.lock); // DOC: wait-sleep
 	}
 }
@@ -391,59 +541,84 @@ int wait(void) {
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - take a process from this CPU's run queue, or steal one
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
+// Interrupts stay off in here except while halted.
 void scheduler(void) {
 	struct proc *p;
 	struct cpu *c = mycpu();
+	int self = c - cpus;
+	struct RunQueue *rq = &runqueue[self];
 	c->proc = 0;
 
 	for (;;) {
-		// Enable interrupts on this processor.
-		sti();
-
-		// Loop over process table looking for process to run.
-		acquire(&ptable.lock);
-		for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-			if (p->state != RUNNABLE) {
+		acquire(&rq->lock);
+		rq->idle = 0;
+		p = runqueue_pop(rq);
+		if (!p) {
+			release(&rq->lock);
+			p = runqueue_steal(self);
+			acquire(&rq->lock);
+			if (p) {
+				rq->stats.steals++;
+			} else if (rq->head) {
+				// work arrived while we were looking elsewhere
+				release(&rq->lock);
+				continue;
+			} else {
+				// wait for an interrupt, runqueue_add() sends one when
+				// there is work for us
+				rq->idle = 1;
+				rq->stats.idles++;
+				release(&rq->lock);
+				sti_hlt();
+				cli();
 				continue;
 			}
+		}
 
-			// Switch to chosen process.  It is the process's job
-			// to release ptable.lock and then reacquire it
-			// before jumping back to us.
-			c->proc = p;
-			switchuvm(p);
-			p->state = RUNNING;
-
-			swtch(&(c->scheduler), p->context);
-			switchkvm();
-
-			// Process is done running for now.
-			// It should have changed its p->state before coming back.
-			c->proc = 0;
+		// Switch to chosen process.  It is the process's job
+		// to release rq->lock and then reacquire it
+		// before jumping back to us.
+		p->cpu = self;
+		c->proc = p;
+		switchuvm(p);
+		p->state = RUNNING;
+		rq->stats.switches++;
+		p->stats.switches++;
+
+		fpu_restore(&p->fpu);
+		swtch(&(c->scheduler), p->context);
+		fpu_save(&p->fpu);
+		switchkvm();
+
+		// Process is done running for now.
+		// It should have changed its p->state before coming back.
+		c->proc = 0;
+		if (p->state == ZOMBIE) {
+			release(&ptable.lock); // taken in exit()
 		}
-		release(&ptable.lock);
+		release(&rq->lock);
 	}
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
-// intena because intena is a property of this
-// kernel thread, not this CPU. It should
-// be proc->intena and proc->ncli, but that would
-// break in the few places where a lock is held but
-// there's no process.
+// Enter scheduler.  Must hold only the run queue lock
+// of this CPU, and ptable.lock if exiting, and have
+// changed proc->state. Saves and restores intena
+// because intena is a property of this kernel thread,
+// not this CPU. It should be proc->intena and
+// proc->ncli, but that would break in the few places
+// where a lock is held but there's no process.
 void sched(void) {
 	int intena;
 	struct proc *p = myproc();
 
-	if (!holding(&ptable.lock)) {
-		panic("sched ptable.lock");
+	if (!holding(&runqueue[cpuid()].lock)) {
+		panic("sched runqueue lock");
 	}
-	if (mycpu()->ncli != 1) {
+	if (mycpu()->ncli != (p->state == ZOMBIE ? 2 : 1)) {
 		panic("sched locks");
 	}
 	if (p->state == RUNNING) {
@@ -459,17 +634,19 @@ void sched(void) {
 
 // Give up the CPU for one scheduling round.
 void yield(void) {
-	acquire(&ptable.lock); // DOC: yieldlock
+	struct RunQueue *rq = runqueue_lock_this(); // DOC: yieldlock
 	myproc()->state = RUNNABLE;
+	runqueue_push(rq, myproc());
 	sched();
-	release(&ptable.lock);
+	// we may have been stolen by another CPU, release its lock
+	release(&runqueue[cpuid()].lock);
 }
 
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
 void forkret(void) {
-	// Still holding ptable.lock from scheduler.
-	release(&ptable.lock);
+	// Still holding the run queue lock from scheduler.
+	release(&runqueue[cpuid()].lock);
 	// Return to "caller", actually trapret (see allocproc).
 }
 
@@ -486,50 +663,51 @@ void sleep(void *chan, struct spinlock *lk) {
 		panic("sleep without lk");
 	}
 
-	// Must acquire ptable.lock in order to
-	// change p->state and then call sched.
-	// Once we hold ptable.lock, we can be
+	// Must acquire the wait queue lock in order to
+	// change p->state. Once we hold it, we can be
 	// guaranteed that we won't miss any wakeup
-	// (wakeup runs with ptable.lock locked),
+	// (wakeup runs with the wait queue locked),
 	// so it's okay to release lk.
-	if (lk != &ptable.lock) { // DOC: sleeplock0
-		acquire(&ptable.lock); // DOC: sleeplock1
-		release(lk);
-	}
+	struct WaitQueue *wq = waitqueue_of(chan);
+	acquire(&wq->lock);
+	release(lk);
+
 	// Go to sleep.
 	p->chan = chan;
 	p->state = SLEEPING;
+	p->wq_next = wq->head;
+	wq->head = p;
 
+	// wakeup() can't put us on a run queue before this CPU
+	// switched away, it needs the run queue lock for that
+	runqueue_lock_this();
+	release(&wq->lock);
 	sched();
-
-	// Tidy up.
-	p->chan = 0;
+	release(&runqueue[cpuid()].lock);
 
 	// Reacquire original lock.
-	if (lk != &ptable.lock) { // DOC: sleeplock2
-		release(&ptable.lock);
-		acquire(lk);
-	}
+	acquire(lk);
 }
 
 // PAGEBREAK!
 // Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-static void wakeup1(void *chan) {
-	struct proc *p;
-
-	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-		if (p->state == SLEEPING && p->chan == chan) {
+void wakeup(void *chan) {
+	struct WaitQueue *wq = waitqueue_of(chan);
+	acquire(&wq->lock);
+	struct proc **pp = &wq->head;
+	while (*pp) {
+		struct proc *p = *pp;
+		if (p->chan == chan) {
+			*pp = p->wq_next;
+			p->wq_next = 0;
+			p->chan = 0;
 			p->state = RUNNABLE;
+			runqueue_add(p);
+		} else {
+			pp = &p->wq_next;
 		}
 	}
-}
-
-// Wake up all processes sleeping on chan.
-void wakeup(void *chan) {
-	acquire(&ptable.lock);
-	wakeup1(chan);
-	release(&ptable.lock);
+	release(&wq->lock);
 }
 
 // Kill the process with the given pid.
@@ -540,9 +718,29 @@ int kill(int pid) {
 
 	acquire(&ptable.lock);
 	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-		if (p->pid == pid) {
+		if (p->state != UNUSED && p->pid == pid) {
 			p->killed = 1;
-			p->state = ZOMBIE;
+			// Wake a sleeping process so that it unwinds and
+			// releases what it holds. Sleeps that can last
+			// forever give up once killed is set, waits for a
+			// device only end with the transfer.
+			void *chan = p->chan;
+			if (p->state == SLEEPING && chan) {
+				struct WaitQueue *wq = waitqueue_of(chan);
+				acquire(&wq->lock);
+				if (p->state == SLEEPING && p->chan == chan) {
+					struct proc **pp = &wq->head;
+					while (*pp != p) {
+						pp = &(*pp)->wq_next;
+					}
+					*pp = p->wq_next;
+					p->wq_next = 0;
+					p->chan = 0;
+					p->state = RUNNABLE;
+					runqueue_add(p);
+				}
+				release(&wq->lock);
+			}
 			release(&ptable.lock);
 			return 0;
 		}
@@ -589,6 +787,48 @@ void procdump(void) {
 	}
 }
 
+void sched_get_stats(struct SchedCpuStats *stats) {
+	for (unsigned int i = 0; i < ncpu; i++) {
+		acquire(&runqueue[i].lock);
+		stats[i] = runqueue[i].stats;
+		release(&runqueue[i].lock);
+	}
+}
+
+struct SchedKcall {
+#define SCHED_KCALL_OP_STATS 0
+#define SCHED_KCALL_OP_PROC_STATS 1
+	unsigned int op;
+	unsigned int ncpu;
+	unsigned int ticks;
+	struct SchedCpuStats cpu[NCPU];
+	struct SchedProcStats proc; // of the calling process
+};
+
+static int sched_kcall_handler(unsigned int arg) {
+	struct SchedKcall *p = (struct SchedKcall *)arg;
+	switch (p->op) {
+		case SCHED_KCALL_OP_STATS: {
+			// filled under the run queue locks, storing to p may fault
+			struct SchedCpuStats cpu[NCPU];
+			sched_get_stats(cpu);
+			p->ncpu = ncpu;
+			p->ticks = ticks;
+			memmove(p->cpu, cpu, ncpu * sizeof(struct SchedCpuStats));
+			return 0;
+		}
+		case SCHED_KCALL_OP_PROC_STATS:
+			p->ticks = ticks;
+			p->proc = myproc()->stats;
+			return 0;
+	}
+	return ERROR_INVAILD;
+}
+
+void sched_init(void) {
+	kcall_set("sched", sched_kcall_handler);
+}
+
 struct proc *proc_search_pid(int pid) {
 	acquire(&ptable.lock);
 	for (int i = 0; i < NPROC; i++) {
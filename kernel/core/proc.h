@@ -25,6 +25,8 @@
 #include <filesystem/vfs/vfs.h>
 #include <param.h>
 
+struct File;
+
 // Per-CPU state
 struct cpu {
 	unsigned char apicid; // Local APIC ID
@@ -38,6 +40,13 @@ struct cpu {
 };
 
 extern struct cpu cpus[NCPU];
+
+struct SchedCpuStats {
+	unsigned int switches; // context switches to processes
+	unsigned int nr_running; // runnable processes waiting in the run queue
+	unsigned int steals; // processes taken from other CPUs
+	unsigned int idles; // times the CPU halted with nothing to run
+};
 extern unsigned int ncpu;
 
 // PAGEBREAK: 17
@@ -68,11 +77,14 @@ enum procstate {
 	ZOMBIE
 };
 
-#define MESSAGE_MAX 64
+#define MESSAGE_MAX 64 // queued messages, one slot is kept free
+#define MESSAGE_SIZE_MAX (4 * 1024 * 1024)
 
+// The data of a message is held in pages, see core/message.c
 struct Message {
 	int pid, size;
-	void *addr;
+	void *page; // the data of a message of up to a page
+	void **pages; // PGROUNDUP(size) / PGSIZE pages of a larger one
 };
 
 struct MessageQueue {
@@ -81,12 +93,39 @@ struct MessageQueue {
 	struct Message queue[MESSAGE_MAX];
 };
 
+// A range of user memory filled in from an ELF segment on first access
+struct VmArea {
+	unsigned int begin, end; // page aligned user addresses
+	unsigned int data_end; // file data ends here, the rest is zero filled
+	unsigned int offset; // file offset mapped at begin
+	unsigned int writable;
+	unsigned int anon; // demand-zero memory mapped by mem_map(), no file
+	unsigned int shm; // id of the shared memory object mapped, 0 if none
+	unsigned int fs_id, block, size; // the file, as in struct FileDesc
+};
+
+struct VmMap {
+	unsigned int num;
+	struct VmArea area[PROC_VMA_MAX];
+};
+
+// FXSAVE image of the user FPU and SSE registers
+struct FpuState {
+	unsigned char data[512];
+} __attribute__((aligned(16)));
+
+struct SchedProcStats {
+	unsigned int syscalls; // system calls made
+	unsigned int switches; // times the process was switched to
+};
+
 // Per-process state
 struct proc {
 	unsigned int sz; // size of executable image (bytes)
 	unsigned int stack_size; // size of process stack (bytes)
 	unsigned int heap_size; // size of process heap (bytes)
 	pdpte_t *pgdir; // Page table
+	struct VmMap *vmmap; // lazily loaded areas of the address space
 	char *kstack; // Bottom of kernel stack for this process
 	enum procstate state; // Process state
 	int pid; // Process ID
@@ -94,14 +133,19 @@ struct proc {
 	struct trapframe *tf; // Trap frame for current syscall
 	struct context *context; // swtch() here to run process
 	void *chan; // If non-zero, sleeping on chan
+	struct proc *wq_next; // next process sleeping in the same wait queue
+	struct proc *rq_next; // next process in the same run queue
+	int cpu; // CPU whose run queue holds the process or that ran it last
 	int killed; // If non-zero, have been killed
 	char name[16]; // Process name (debugging)
-	struct FileDesc files[PROC_FILE_MAX]; // open files
+	struct File *files[PROC_FILE_MAX]; // open files, shared after dup() and fork()
 	struct VfsPath cwd; // working directory
 	unsigned int dyn_base; // dynamic library load base
 	struct MessageQueue msgqueue; // message queue
 	int pty; // Pseudoterminal
 	int exit_status;
+	struct SchedProcStats stats;
+	struct FpuState fpu; // saved while the process is not running
 };
 
 #endif
@@ -0,0 +1,214 @@
+/*
+ * Shared memory
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/proc.h>
+#include <defs.h>
+#include <param.h>
+#include <proc/kcall.h>
+
+// A shared memory object is a set of pages that several processes map,
+// such as a window surface drawn by a client and composited by the window
+// manager. The creator names one other process allowed to map it. Mappings
+// are areas of the anonymous mapping space faulted in from the object, each
+// holds a reference and the last one gone frees the pages.
+
+#define SHM_MAX 64
+#define SHM_MAX_SIZE (16 * 1024 * 1024)
+
+struct SharedMemory {
+	unsigned int id; // 0 if the slot is free
+	unsigned int npages;
+	unsigned int refs; // mappings of the object
+	int owner, peer; // processes allowed to map it
+	void **pages;
+};
+
+static struct {
+	struct spinlock lock;
+	struct SharedMemory obj[SHM_MAX];
+	unsigned int seq;
+} shm;
+
+// shm.lock must be held
+static struct SharedMemory *shm_lookup(unsigned int id) {
+	struct SharedMemory *obj = &shm.obj[id % SHM_MAX];
+	return id && obj->id == id ? obj : 0;
+}
+
+static unsigned int shm_page_array_size(unsigned int npages) {
+	return PGROUNDUP(npages * sizeof(void *)) / PGSIZE;
+}
+
+// free the first n pages of a page array made for npages
+static void shm_free_pages(void **pages, unsigned int n, unsigned int npages) {
+	for (unsigned int i = 0; i < n; i++) {
+		kfree(pages[i]);
+	}
+	pgfree(pages, shm_page_array_size(npages));
+}
+
+// shm.lock must be held
+static void shm_destroy(struct SharedMemory *obj) {
+	for (unsigned int i = 0; i < obj->npages; i++) {
+		page_put(obj->pages[i]);
+	}
+	pgfree(obj->pages, shm_page_array_size(obj->npages));
+	obj->id = 0;
+}
+
+// Create an object of zeroed pages that the calling process and peer may
+// map, it disappears unless mapped before the next shm_put(). Return its
+// id or an error.
+static int shm_create(unsigned int size, int peer) {
+	if (size == 0 || size > SHM_MAX_SIZE) {
+		return ERROR_INVAILD;
+	}
+	unsigned int npages = PGROUNDUP(size) / PGSIZE;
+	void **pages = pgalloc_try(shm_page_array_size(npages));
+	if (!pages) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	for (unsigned int i = 0; i < npages; i++) {
+		pages[i] = kalloc_try();
+		if (!pages[i]) {
+			shm_free_pages(pages, i, npages);
+			return ERROR_OUT_OF_SPACE;
+		}
+		memset(pages[i], 0, PGSIZE);
+	}
+
+	acquire(&shm.lock);
+	for (int i = 0; i < SHM_MAX; i++) {
+		struct SharedMemory *obj = &shm.obj[i];
+		if (obj->id) {
+			continue;
+		}
+		shm.seq++;
+		obj->id = shm.seq * SHM_MAX + i;
+		obj->npages = npages;
+		obj->refs = 0;
+		obj->owner = myproc()->pid;
+		obj->peer = peer;
+		obj->pages = pages;
+		release(&shm.lock);
+		return obj->id;
+	}
+	release(&shm.lock);
+	shm_free_pages(pages, npages, npages);
+	return ERROR_OUT_OF_SPACE;
+}
+
+// Take a mapping reference, return the size of the object or 0 if it does
+// not exist or the calling process may not map it
+static unsigned int shm_get_checked(unsigned int id) {
+	unsigned int size = 0;
+	int pid = myproc()->pid;
+	acquire(&shm.lock);
+	struct SharedMemory *obj = shm_lookup(id);
+	if (obj && (obj->owner == pid || obj->peer == pid)) {
+		obj->refs++;
+		size = obj->npages * PGSIZE;
+	}
+	release(&shm.lock);
+	return size;
+}
+
+// Take another mapping reference, for a copied address space
+void shm_get(unsigned int id) {
+	acquire(&shm.lock);
+	struct SharedMemory *obj = shm_lookup(id);
+	if (obj) {
+		obj->refs++;
+	}
+	release(&shm.lock);
+}
+
+void shm_put(unsigned int id) {
+	acquire(&shm.lock);
+	struct SharedMemory *obj = shm_lookup(id);
+	if (obj && (obj->refs == 0 || --obj->refs == 0)) {
+		shm_destroy(obj);
+	}
+	release(&shm.lock);
+}
+
+// Return page index of the object with a reference taken, or 0
+void *shm_page(unsigned int id, unsigned int index) {
+	void *page = 0;
+	acquire(&shm.lock);
+	struct SharedMemory *obj = shm_lookup(id);
+	if (obj && index < obj->npages) {
+		page = obj->pages[index];
+		page_get(page);
+	}
+	release(&shm.lock);
+	return page;
+}
+
+// map the object into the calling process, return the address or 0
+static unsigned int shm_map(unsigned int id, unsigned int *size) {
+	if ((*size = shm_get_checked(id)) == 0) {
+		return 0;
+	}
+	unsigned int addr = vm_map_shm(myproc(), id, *size);
+	if (addr == 0) {
+		shm_put(id);
+	}
+	return addr;
+}
+
+struct ShmKcall {
+#define SHM_KCALL_OP_CREATE 0
+#define SHM_KCALL_OP_MAP 1
+#define SHM_KCALL_OP_UNMAP 2
+	unsigned int op;
+	unsigned int id;
+	unsigned int size;
+	int pid; // the other process allowed to map a new object
+	void *addr;
+};
+
+static int shm_kcall_handler(unsigned int arg) {
+	struct ShmKcall *p = (struct ShmKcall *)arg;
+	switch (p->op) {
+		case SHM_KCALL_OP_CREATE: {
+			int id = shm_create(p->size, p->pid);
+			if (id < 0) {
+				return id;
+			}
+			p->id = id;
+			// failing to map drops the only reference and destroys it
+			p->addr = (void *)shm_map(id, &p->size);
+			return p->addr ? 0 : ERROR_OUT_OF_SPACE;
+		}
+		case SHM_KCALL_OP_MAP:
+			p->addr = (void *)shm_map(p->id, &p->size);
+			return p->addr ? 0 : ERROR_NO_PERM;
+		case SHM_KCALL_OP_UNMAP:
+			return vm_unmap_shm(myproc(), (unsigned int)p->addr);
+	}
+	return ERROR_INVAILD;
+}
+
+void shm_init(void) {
+	initlock(&shm.lock, "shm");
+	kcall_set("shm", shm_kcall_handler);
+}
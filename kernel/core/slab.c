@@ -0,0 +1,316 @@
+/*
+ * Kernel object allocator
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/spinlock.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <param.h>
+
+// Slab allocator for small kernel objects. Every slab is a naturally aligned
+// block of SLAB_PAGES pages from the buddy allocator with a Slab header at its
+// start, so the slab of an object is found by rounding its address down.
+// Objects are carved out of physically contiguous memory and can be handed to
+// devices with V2P(). Each cache keeps a small magazine of free objects per
+// CPU, most allocations and frees never touch the cache lock.
+
+#define SLAB_PAGES 4
+#define SLAB_SIZE (SLAB_PAGES * PGSIZE)
+#define SLAB_MAGAZINE_SIZE 16 // objects held by each CPU
+#define KMEM_CACHE_MAX 32
+
+struct Slab {
+	struct Slab *next, *prev;
+	struct KmemCache *cache;
+	void *freelist; // free objects, linked through their first word
+	unsigned int inuse; // objects allocated, including those in magazines
+};
+
+struct KmemCacheCpu {
+	unsigned int count;
+	void *obj[SLAB_MAGAZINE_SIZE];
+	unsigned int alloc_count, free_count;
+};
+
+struct KmemCache {
+	char name[32];
+	unsigned int size; // object size
+	unsigned int offset; // offset of the first object in a slab
+	unsigned int objs_per_slab;
+	struct spinlock lock;
+	struct Slab *partial; // slabs with free objects
+	struct Slab *full; // slabs without free objects
+	unsigned int nr_slabs;
+	unsigned int nr_empty; // empty slabs kept on partial list, at most one
+	unsigned int nr_inuse;
+	struct KmemCacheCpu cpu[NCPU];
+};
+
+static struct {
+	struct spinlock lock;
+	unsigned int num;
+	struct KmemCache cache[KMEM_CACHE_MAX];
+} kmem_cache_table;
+
+// size classes used by kmalloc()
+#define KMALLOC_MIN_SHIFT 4 // 16 bytes
+#define KMALLOC_MAX_SHIFT 11 // 2048 bytes
+static struct KmemCache *kmalloc_cache[KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1];
+
+static void slab_list_add(struct Slab **list, struct Slab *slab) {
+	slab->prev = 0;
+	slab->next = *list;
+	if (slab->next) {
+		slab->next->prev = slab;
+	}
+	*list = slab;
+}
+
+static void slab_list_del(struct Slab **list, struct Slab *slab) {
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		*list = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->next = slab->prev = 0;
+}
+
+static inline struct Slab *obj_to_slab(void *obj) {
+	return (struct Slab *)((unsigned int)obj & ~(SLAB_SIZE - 1));
+}
+
+// cache->lock must be held, return 0 if memory is exhausted
+static struct Slab *slab_new(struct KmemCache *cache) {
+	struct Slab *slab = pgalloc_try(SLAB_PAGES);
+	if (!slab) {
+		return 0;
+	}
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->freelist = 0;
+	for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+		void **obj = (void **)((char *)slab + cache->offset + i * cache->size);
+		*obj = slab->freelist;
+		slab->freelist = obj;
+	}
+	slab_list_add(&cache->partial, slab);
+	cache->nr_slabs++;
+	cache->nr_empty++;
+	return slab;
+}
+
+// cache->lock must be held, return 0 if memory is exhausted
+static void *slab_alloc_obj(struct KmemCache *cache) {
+	struct Slab *slab = cache->partial;
+	if (!slab && !(slab = slab_new(cache))) {
+		return 0;
+	}
+	if (!slab->inuse) {
+		cache->nr_empty--;
+	}
+	void **obj = slab->freelist;
+	slab->freelist = *obj;
+	slab->inuse++;
+	cache->nr_inuse++;
+	if (slab->inuse == cache->objs_per_slab) {
+		slab_list_del(&cache->partial, slab);
+		slab_list_add(&cache->full, slab);
+	}
+	return obj;
+}
+
+// cache->lock must be held
+static void slab_free_obj(struct KmemCache *cache, void *obj) {
+	struct Slab *slab = obj_to_slab(obj);
+	if (slab->cache != cache) {
+		panic("kmem_cache_free");
+	}
+	if (slab->inuse == cache->objs_per_slab) {
+		slab_list_del(&cache->full, slab);
+		slab_list_add(&cache->partial, slab);
+	}
+	*(void **)obj = slab->freelist;
+	slab->freelist = obj;
+	slab->inuse--;
+	cache->nr_inuse--;
+	if (!slab->inuse) {
+		// keep one empty slab around, give the rest back
+		if (cache->nr_empty) {
+			slab_list_del(&cache->partial, slab);
+			pgfree(slab, SLAB_PAGES);
+			cache->nr_slabs--;
+		} else {
+			cache->nr_empty++;
+		}
+	}
+}
+
+struct KmemCache *kmem_cache_create(const char *name, unsigned int size) {
+	if (size < sizeof(void *)) {
+		size = sizeof(void *);
+	}
+	size = (size + 7) & ~7;
+	// power of two sized objects are naturally aligned and never cross a page
+	unsigned int align = (size & (size - 1)) ? 8 : size;
+	unsigned int offset = (sizeof(struct Slab) + align - 1) & ~(align - 1);
+	if (offset + size > SLAB_SIZE) {
+		panic("kmem_cache_create too large");
+	}
+
+	acquire(&kmem_cache_table.lock);
+	if (kmem_cache_table.num == KMEM_CACHE_MAX) {
+		panic("kmem_cache_create");
+	}
+	struct KmemCache *cache = &kmem_cache_table.cache[kmem_cache_table.num++];
+	release(&kmem_cache_table.lock);
+
+	memset(cache, 0, sizeof(struct KmemCache));
+	safestrcpy(cache->name, name, sizeof(cache->name));
+	cache->size = size;
+	cache->offset = offset;
+	cache->objs_per_slab = (SLAB_SIZE - offset) / size;
+	initlock(&cache->lock, cache->name);
+	return cache;
+}
+
+// Allocate an object, return 0 if memory is exhausted
+void *kmem_cache_alloc_try(struct KmemCache *cache) {
+	pushcli();
+	struct KmemCacheCpu *cc = &cache->cpu[cpuid()];
+	if (!cc->count) {
+		acquire(&cache->lock);
+		while (cc->count < SLAB_MAGAZINE_SIZE / 2) {
+			void *obj = slab_alloc_obj(cache);
+			if (!obj) {
+				break;
+			}
+			cc->obj[cc->count++] = obj;
+		}
+		release(&cache->lock);
+	}
+	if (!cc->count) {
+		popcli();
+		return 0;
+	}
+	void *obj = cc->obj[--cc->count];
+	cc->alloc_count++;
+	popcli();
+	return obj;
+}
+
+void *kmem_cache_alloc(struct KmemCache *cache) {
+	void *obj = kmem_cache_alloc_try(cache);
+	if (!obj) {
+		panic("out of memory");
+	}
+	return obj;
+}
+
+void kmem_cache_free(struct KmemCache *cache, void *obj) {
+	if (!obj) {
+		return;
+	}
+	pushcli();
+	struct KmemCacheCpu *cc = &cache->cpu[cpuid()];
+	if (cc->count == SLAB_MAGAZINE_SIZE) {
+		// return the coldest half of the magazine
+		acquire(&cache->lock);
+		for (int i = 0; i < SLAB_MAGAZINE_SIZE / 2; i++) {
+			slab_free_obj(cache, cc->obj[i]);
+		}
+		release(&cache->lock);
+		cc->count -= SLAB_MAGAZINE_SIZE / 2;
+		memmove(cc->obj, cc->obj + SLAB_MAGAZINE_SIZE / 2, cc->count * sizeof(void *));
+	}
+	cc->obj[cc->count++] = obj;
+	cc->free_count++;
+	popcli();
+}
+
+static struct KmemCache *kmalloc_cache_of(unsigned int size) {
+	int shift = KMALLOC_MIN_SHIFT;
+	while ((1u << shift) < size) {
+		shift++;
+	}
+	if (shift > KMALLOC_MAX_SHIFT) {
+		panic("kmalloc too large");
+	}
+	return kmalloc_cache[shift - KMALLOC_MIN_SHIFT];
+}
+
+void *kmalloc(unsigned int size) {
+	return kmem_cache_alloc(kmalloc_cache_of(size));
+}
+
+// Like kmalloc() but return 0 if memory is exhausted
+void *kmalloc_try(unsigned int size) {
+	return kmem_cache_alloc_try(kmalloc_cache_of(size));
+}
+
+void kmfree(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+	kmem_cache_free(obj_to_slab(ptr)->cache, ptr);
+}
+
+void slab_init(void) {
+	static const char *kmalloc_name[] = {
+		"kmalloc-16",
+		"kmalloc-32",
+		"kmalloc-64",
+		"kmalloc-128",
+		"kmalloc-256",
+		"kmalloc-512",
+		"kmalloc-1024",
+		"kmalloc-2048",
+	};
+	initlock(&kmem_cache_table.lock, "kmem_cache");
+	for (int i = KMALLOC_MIN_SHIFT; i <= KMALLOC_MAX_SHIFT; i++) {
+		kmalloc_cache[i - KMALLOC_MIN_SHIFT] =
+			kmem_cache_create(kmalloc_name[i - KMALLOC_MIN_SHIFT], 1 << i);
+	}
+}
+
+void kmem_cache_print_stats(void) {
+	cprintf("Slab caches: name size active/total objects slabs allocs frees\n");
+	for (unsigned int i = 0; i < kmem_cache_table.num; i++) {
+		struct KmemCache *cache = &kmem_cache_table.cache[i];
+		acquire(&cache->lock);
+		unsigned int cached = 0, allocs = 0, frees = 0;
+		for (int c = 0; c < NCPU; c++) {
+			cached += cache->cpu[c].count;
+			allocs += cache->cpu[c].alloc_count;
+			frees += cache->cpu[c].free_count;
+		}
+		cprintf(
+			"%s %d %d/%d %d %d %d\n",
+			cache->name,
+			cache->size,
+			cache->nr_inuse - cached,
+			cache->nr_slabs * cache->objs_per_slab,
+			cache->nr_slabs,
+			allocs,
+			frees
+		);
+		release(&cache->lock);
+	}
+}
@@ -29,13 +29,22 @@ void module_init(void);
 int module_load(const char *name);
 void module_print(void);
 
+// event.c
+#define EVENT_MESSAGE (1 << 0)
+#define EVENT_KEYBOARD (1 << 1)
+#define EVENT_MOUSE (1 << 2)
+#define EVENT_WAIT_FOREVER 0xffffffff
+void event_init(void);
+void event_notify(unsigned int events);
+void event_tick(void);
+
 // exec.c
 int exec(char *, char **);
 
 // elf.c
 int proc_elf_load(
-	pdpte_t *pgdir, unsigned int base, const char *name, unsigned int *entry, unsigned int *dynamic,
-	unsigned int *interp
+	struct VmMap *vmmap, unsigned int base, const char *name, unsigned int *entry,
+	unsigned int *dynamic, unsigned int *interp
 );
 
 // dynamic.c
@@ -43,19 +52,71 @@ int proc_load_dynamic(
 	struct proc *proc, const char *name, unsigned int *dynamic, unsigned int *entry
 );
 
+// fpu.c
+void fpu_init(void);
+void fpu_state_init(struct FpuState *fpu);
+void fpu_save(struct FpuState *fpu);
+void fpu_restore(struct FpuState *fpu);
+
 // kalloc.c
+#define PGALLOC_MAX_ORDER 13 // largest block is 2^12 pages (16 MiB)
+struct PgallocStats {
+	unsigned int total_pages; // pages managed by the allocator
+	unsigned int free_pages; // free pages in buddy free lists
+	unsigned int pcp_pages; // free pages held in per-CPU caches
+	unsigned int nr_free[PGALLOC_MAX_ORDER]; // free blocks of each order
+};
 void *pgalloc(unsigned int num_pages);
+void *pgalloc_try(unsigned int num_pages);
 void pgfree(void *ptr, unsigned int num_pages);
 static inline void *kalloc(void) {
 	return pgalloc(1);
 }
+static inline void *kalloc_try(void) {
+	return pgalloc_try(1);
+}
 static inline void kfree(void *ptr) {
 	return pgfree(ptr, 1);
 }
 void kinit1(void *, void *);
 void kinit2(void *, void *);
+void page_get(void *ptr);
+void page_put(void *ptr);
+unsigned int page_refcount(void *ptr);
+void pgalloc_get_stats(struct PgallocStats *stats);
 void print_memory_usage(void);
 
+// shm.c
+void shm_init(void);
+void shm_get(unsigned int id);
+void shm_put(unsigned int id);
+void *shm_page(unsigned int id, unsigned int index);
+
+// slab.c
+struct KmemCache;
+struct KmemCache *kmem_cache_create(const char *name, unsigned int size);
+void *kmem_cache_alloc(struct KmemCache *cache);
+void *kmem_cache_alloc_try(struct KmemCache *cache);
+void kmem_cache_free(struct KmemCache *cache, void *obj);
+void *kmalloc(unsigned int size);
+void *kmalloc_try(unsigned int size);
+void kmfree(void *ptr);
+void slab_init(void);
+void kmem_cache_print_stats(void);
+
+// message.c
+#define MESSAGE_NONBLOCK (1 << 0) // fail with ERROR_AGAIN if the queue is full
+struct MessageVec {
+	const void *base;
+	int size;
+};
+int message_build(struct Message *m, const struct MessageVec *vec, int count);
+int message_send(int pid, struct Message *m, int flags);
+int message_dequeue(struct Message *m, int block);
+void message_deliver(struct Message *m, char *dst);
+void message_free(struct Message *m);
+void message_queue_free(struct proc *p);
+
 // mp.c
 extern int ismp;
 void mpinit(void);
@@ -73,6 +134,8 @@ void pinit(void);
 void procdump(void);
 void scheduler(void) __attribute__((noreturn));
 void sched(void);
+void sched_init(void);
+void sched_get_stats(struct SchedCpuStats *stats);
 void setproc(struct proc *);
 void sleep(void *, struct spinlock *);
 void userinit(void);
@@ -124,6 +187,30 @@ void freevm(pdpte_t *);
 void inituvm(pdpte_t *, char *, unsigned int);
 int loaduvm(pdpte_t *, char *, struct FileDesc *fd, unsigned int, unsigned int);
 pdpte_t *copyuvm(pdpte_t *newpgdir, pdpte_t *oldpgdir, unsigned int begin, unsigned int end);
+struct VmMap *vm_map_alloc(void);
+struct VmMap *vm_map_dup(struct VmMap *map);
+void vm_map_free(struct VmMap *map);
+int vm_map_add(struct VmMap *map, struct VmArea *area);
+int vm_page_fault(struct proc *p, unsigned int va, unsigned int err);
+int vm_fault_in(struct proc *p, unsigned int addr, unsigned int size);
+unsigned int vm_map_anon(struct proc *p, unsigned int addr, unsigned int size);
+int vm_unmap_anon(struct proc *p, unsigned int addr, unsigned int size);
+unsigned int vm_map_shm(struct proc *p, unsigned int id, unsigned int size);
+int vm_unmap_shm(struct proc *p, unsigned int addr);
+void *vm_page_lend(struct proc *p, unsigned int va);
+int vm_page_install(struct proc *p, unsigned int va, void *page);
+struct VmStats {
+	unsigned int page_faults; // all page faults taken
+	unsigned int cow_faults; // writes to copy-on-write pages
+	unsigned int cow_copies; // copy-on-write faults that had to copy the page
+	unsigned int cow_shared; // pages shared by fork instead of copied
+	unsigned int file_faults; // pages mapped from the page cache on demand
+	unsigned int anon_faults; // private pages filled on demand
+	unsigned int msg_pages_lent; // sender pages carried by messages instead of copied
+	unsigned int msg_pages_mapped; // message pages mapped into the receiver instead of copied
+};
+void vm_get_stats(struct VmStats *stats);
+void vm_init(void);
 void switchuvm(struct proc *);
 void switchkvm(void);
 int copyout(pdpte_t *, unsigned int, void *, unsigned int);
@@ -17,6 +17,9 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <arch/x86/msi.h>
+#include <common/x86.h>
+#include <core/proc.h>
 #include <defs.h>
 #include <driver/ata/ata.h>
 #include <driver/pci/pci.h>
@@ -27,7 +30,7 @@
 #include "sata_struct.h"
 
 static struct AHCIController *ahci_controller_new(void) {
-	struct AHCIController *dev = kalloc();
+	struct AHCIController *dev = kmalloc(sizeof(struct AHCIController));
 	memset(dev, 0, sizeof(struct AHCIController));
 	return dev;
 }
@@ -41,6 +44,90 @@ ahci_write_reg32(struct AHCIController *ahci, unsigned int offset, uint32_t valu
 	ahci->abar[offset >> 2] = value;
 }
 
+static inline uint32_t ahci_port_read(struct AHCIPort *p, unsigned int reg) {
+	return ahci_read_reg32(p->ahci, AHCI_PORT_CONTROL_OFFSET(p->port) + reg);
+}
+
+static inline void ahci_port_write(struct AHCIPort *p, unsigned int reg, uint32_t value) {
+	ahci_write_reg32(p->ahci, AHCI_PORT_CONTROL_OFFSET(p->port) + reg, value);
+}
+
+static void ahci_port_start(struct AHCIPort *p) {
+	while (ahci_port_read(p, AHCI_PxCMD) & AHCI_PxCMD_CR) {}
+	while (ahci_port_read(p, AHCI_PxTFD) & (AHCI_PxTFD_STATUS_BSY | AHCI_PxTFD_STATUS_DRQ)) {}
+	ahci_port_write(p, AHCI_PxCMD, ahci_port_read(p, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+// Restart a port stopped by an error, the commands it had are dropped
+static void ahci_port_recover(struct AHCIPort *p) {
+	ahci_port_write(p, AHCI_PxCMD, ahci_port_read(p, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+	while (ahci_port_read(p, AHCI_PxCMD) & AHCI_PxCMD_CR) {}
+	ahci_port_write(p, AHCI_PxSERR, 0xffffffff);
+	ahci_port_write(p, AHCI_PxIS, 0xffffffff);
+	if ((ahci_port_read(p, AHCI_PxTFD) & (AHCI_PxTFD_STATUS_BSY | AHCI_PxTFD_STATUS_DRQ)) &&
+		(ahci_read_reg32(p->ahci, AHCI_CAP) & AHCI_CAP_SCLO)) {
+		ahci_port_write(p, AHCI_PxCMD, ahci_port_read(p, AHCI_PxCMD) | AHCI_PxCMD_CLO);
+		while (ahci_port_read(p, AHCI_PxCMD) & AHCI_PxCMD_CLO) {}
+	}
+	ahci_port_start(p);
+}
+
+// Complete the commands the device finished with, p->lock must be held
+static void ahci_port_reap(struct AHCIPort *p) {
+	uint32_t is = ahci_port_read(p, AHCI_PxIS);
+	ahci_port_write(p, AHCI_PxIS, is);
+	uint32_t pending = p->busy & ~p->done;
+	// NCQ commands are outstanding until the device clears their PxSACT bit
+	uint32_t completed =
+		pending & ~(ahci_port_read(p, AHCI_PxCI) | ahci_port_read(p, AHCI_PxSACT));
+	if (is & AHCI_PxIS_ERROR) {
+		cprintf(
+			"[ahci] Port %d error IS %x TFD %x SERR %x\n",
+			p->port,
+			is,
+			ahci_port_read(p, AHCI_PxTFD),
+			ahci_port_read(p, AHCI_PxSERR)
+		);
+		p->failed |= pending & ~completed;
+		completed = pending;
+		ahci_port_recover(p);
+	}
+	unsigned long long now = rdtsc();
+	for (unsigned int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+		if (completed & (1u << slot)) {
+			p->done |= 1u << slot;
+			p->stats.depth--;
+			p->stats.completed++;
+			if (p->failed & (1u << slot)) {
+				p->stats.errors++;
+			}
+			p->stats.latency_hist[hal_block_hist_bucket(now - p->start[slot], 10)]++;
+			wakeup(&p->command_table[slot]);
+		}
+	}
+}
+
+static void ahci_intr(struct AHCIController *ahci) {
+	uint32_t is = ahci_read_reg32(ahci, AHCI_INTRSTAT);
+	for (unsigned int port = 0; port < AHCI_MAX_PORTS; port++) {
+		if ((is & (1u << port)) && ahci->port[port]) {
+			acquire(&ahci->port[port]->lock);
+			ahci_port_reap(ahci->port[port]);
+			release(&ahci->port[port]->lock);
+		}
+	}
+	// the port interrupt status is clear, clear the controller one
+	ahci_write_reg32(ahci, AHCI_INTRSTAT, is);
+}
+
+static void ahci_msi_intr(void *private) {
+	ahci_intr(private);
+}
+
+static void ahci_pci_intr(struct PCIDevice *pci_dev) {
+	ahci_intr(pci_dev->private);
+}
+
 void ahci_init_port(struct AHCIController *ahci, unsigned int port) {
 	if (((ahci_read_reg32(ahci, AHCI_PORTIMPL) >> port) & 1) == 0) {
 		return;
@@ -72,15 +159,34 @@ void ahci_init_port(struct AHCIController *ahci, unsigned int port) {
 	} else {
 		return;
 	}
+	struct AHCIPort *p = kmalloc(sizeof(struct AHCIPort));
+	memset(p, 0, sizeof(struct AHCIPort));
+	p->ahci = ahci;
+	p->port = port;
+	initlock(&p->lock, "ahci-port");
+	p->stats.queues = 1;
+	ahci->port[port] = p;
 	// allocate command list
 	volatile struct AHCICommandList *command_list = kalloc();
-	ahci->command_list[port] = command_list;
+	p->command_list = command_list;
 	memset_volatile(command_list, 0, 4096);
 	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCLB_LOWER, V2P(command_list));
 	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCLB_UPPER, 0);
+	// allocate a command table for each slot
+	volatile void *page = 0;
+	for (unsigned int slot = 0; slot < ahci->num_slots; slot++) {
+		unsigned int index = slot % (PGSIZE / AHCI_COMMAND_TABLE_SIZE);
+		if (index == 0) {
+			page = kalloc();
+			memset_volatile(page, 0, PGSIZE);
+		}
+		p->command_table[slot] = page + index * AHCI_COMMAND_TABLE_SIZE;
+		p->command_list[slot].ctba = V2P(p->command_table[slot]);
+		p->command_list[slot].ctba_upper = 0;
+	}
 	// allocate received FIS buffer
 	volatile void *received_fis_buffer = kalloc();
-	ahci->received_fis_buffer[port] = received_fis_buffer;
+	p->received_fis_buffer = received_fis_buffer;
 	memset_volatile(received_fis_buffer, 0, 4096);
 	ahci_write_reg32(
 		ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxFB_LOWER, V2P(received_fis_buffer)
@@ -94,6 +200,14 @@ void ahci_init_port(struct AHCIController *ahci, unsigned int port) {
 	);
 	// clear error register
 	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxSERR, 0xffffffff);
+	// interrupt on completions and errors, start processing commands
+	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxIS, 0xffffffff);
+	ahci_write_reg32(
+		ahci,
+		AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxIE,
+		AHCI_PxIE_DHRE | AHCI_PxIE_PSE | AHCI_PxIE_SDBE | AHCI_PxIS_ERROR
+	);
+	ahci_port_start(p);
 	// read and print signature
 	uint32_t atasig = ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxSIG);
 	switch (atasig) {
@@ -145,6 +259,7 @@ void ahci_controller_init(struct PCIDevice *pci_dev) {
 		((ahcicap >> AHCI_CAP_NCMDS_SHIFT) & AHCI_CAP_NCMDS_MASK) + 1,
 		((ahcicap >> AHCI_CAP_NPORTS_SHIFT) & AHCI_CAP_NPORTS_MASK) + 1
 	);
+	ahci->num_slots = ((ahcicap >> AHCI_CAP_NCMDS_SHIFT) & AHCI_CAP_NCMDS_MASK) + 1;
 	// AHCI BIOS OS handoff
 	if (ahci_read_reg32(ahci, AHCI_CAP2) & AHCI_CAP2_BOH) {
 		cprintf("[ahci] Start BIOS OS handoff (not implemented)");
@@ -156,8 +271,21 @@ void ahci_controller_init(struct PCIDevice *pci_dev) {
 		 i++) {
 		ahci_init_port(ahci, i);
 	}
+	// completion interrupts, MSI if the controller has it
+	pci_register_intr_handler(pci_dev, ahci_pci_intr);
+	struct MSIMessage msi_msg;
+	if (msi_alloc_vector(&msi_msg, ahci_msi_intr, ahci)) {
+		if (pci_msi_enable(pci_addr, &msi_msg)) {
+			cprintf("[ahci] Use MSI vector %d\r\n", msi_msg.data & 0xff);
+		} else {
+			msi_free_vector(&msi_msg);
+		}
+	}
+	ahci_write_reg32(ahci, AHCI_INTRSTAT, 0xffffffff);
+	ahci_write_reg32(ahci, AHCI_GHC, ahci_read_reg32(ahci, AHCI_GHC) | AHCI_GHC_INTREN);
+	ahci->use_intr = 1;
 	// register SATA controller
-	struct SATAController *sata_controller = kalloc();
+	struct SATAController *sata_controller = kmalloc(sizeof(struct SATAController));
 	memset(sata_controller, 0, sizeof(struct SATAController));
 	sata_controller->type = SATA_CONTROLLER_TYPE_AHCI;
 	sata_controller->num_ports =
@@ -177,7 +305,7 @@ void ahci_init(void) {
 }
 
 int ahci_port_get_link_status(struct AHCIController *ahci_controller, unsigned int port) {
-	if (((ahci_read_reg32(ahci_controller, AHCI_PORTIMPL) >> port) & 1) == 0) {
+	if (!ahci_controller->port[port]) {
 		return 0;
 	}
 	return (ahci_read_reg32(ahci_controller, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxSSTS) >>
@@ -191,19 +319,65 @@ uint32_t ahci_port_get_signature(struct AHCIController *ahci_controller, unsigne
 
 void ahci_port_reset(struct AHCIController *ahci_controller, unsigned int port) {}
 
-int ahci_exec_pio_in(
-	struct AHCIController *ahci, unsigned int port, uint8_t cmd, unsigned long long lba,
-	unsigned int cont, void *buf, unsigned int blocks
+// Enable NCQ on a port with the queue depth of the device, return the
+// depth used or 0 if the controller does not support NCQ
+unsigned int
+ahci_port_enable_ncq(struct AHCIController *ahci, unsigned int port, unsigned int depth) {
+	struct AHCIPort *p = ahci->port[port];
+	if (!(ahci_read_reg32(ahci, AHCI_CAP) & AHCI_CAP_SNCQ)) {
+		return 0;
+	}
+	acquire(&p->lock);
+	p->ncq_depth = depth < ahci->num_slots ? depth : ahci->num_slots;
+	release(&p->lock);
+	return p->ncq_depth;
+}
+
+void ahci_port_get_stats(
+	struct AHCIController *ahci, unsigned int port, struct BlockQueueStats *stats
 ) {
-	// allocate command table
-	volatile struct AHCICommandTable *cmd_table = kalloc();
-	memset_volatile(cmd_table, 0, 4096);
-	// Set command list
-	ahci->command_list[port][0].ctba = V2P(cmd_table);
-	ahci->command_list[port][0].ctba_upper = 0;
-	ahci->command_list[port][0].dw0 =
-		(1 << AHCI_CMDLIST_DW0_PRDTL_SHIFT) | (5 << AHCI_CMDLIST_DW0_CFL_SHIFT);
-	ahci->command_list[port][0].prdbc = 0;
+	struct AHCIPort *p = ahci->port[port];
+	acquire(&p->lock);
+	*stats = p->stats;
+	release(&p->lock);
+}
+
+static inline int ahci_command_is_ncq(uint8_t cmd) {
+	return cmd == ATA_COMMAND_READ_FPDMA_QUEUED || cmd == ATA_COMMAND_WRITE_FPDMA_QUEUED;
+}
+
+// Return a free slot for a command or -1 if it has to wait. NCQ commands
+// run together, any other command runs alone. p->lock must be held.
+static int ahci_port_alloc_slot(struct AHCIPort *p, int ncq) {
+	if (p->busy && (!ncq || !p->queued)) {
+		return -1;
+	}
+	unsigned int slots = ncq ? p->ncq_depth : p->ahci->num_slots;
+	for (unsigned int slot = 0; slot < slots; slot++) {
+		if (!(p->busy & (1u << slot))) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// Wait for completions, sleep on chan if an interrupt will wake us up.
+// p->lock must be held.
+static void ahci_port_wait(struct AHCIPort *p, void *chan) {
+	if (p->ahci->use_intr && myproc()) {
+		sleep(chan, &p->lock);
+	} else {
+		ahci_port_reap(p);
+	}
+}
+
+// Fill the command table of slot, return the number of PRDT entries
+static int ahci_build_command(
+	struct AHCIPort *p, int slot, uint8_t cmd, unsigned long long lba, unsigned int cont,
+	const struct AHCIBuffer *buf, int nbuf
+) {
+	volatile struct AHCICommandTable *cmd_table = p->command_table[slot];
+	memset_volatile(cmd_table, 0, sizeof(struct AHCICommandTable));
 	// Set FIS
 	volatile struct SATARegisterFISHostToDevice *fis =
 		(volatile struct SATARegisterFISHostToDevice *)cmd_table;
@@ -216,77 +390,97 @@ int ahci_exec_pio_in(
 	fis->lba_31_24 = (lba >> 24) & 0xff;
 	fis->lba_39_32 = (lba >> 32) & 0xff;
 	fis->lba_47_40 = (lba >> 40) & 0xff;
-	fis->count_7_0 = cont & 0xff;
-	fis->count_15_8 = (cont >> 8) & 0xff;
+	if (ahci_command_is_ncq(cmd)) {
+		// the sector count goes in the features, the tag in the count
+		fis->features_7_0 = cont & 0xff;
+		fis->features_15_8 = (cont >> 8) & 0xff;
+		fis->count_7_0 = slot << 3;
+	} else {
+		fis->count_7_0 = cont & 0xff;
+		fis->count_15_8 = (cont >> 8) & 0xff;
+	}
 	fis->device = (1 << 6); // Bit 6 shall be set to one
-	// Set receive buffer
-	cmd_table->prdt[0].dba = V2P(buf);
-	cmd_table->prdt[0].dba_upper = 0;
-	cmd_table->prdt[0].dbc_i = AHCI_PRDT_DBC_I_I | (512 * blocks - 1);
-	// enable command list
-	ahci_write_reg32(
-		ahci,
-		AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCMD,
-		ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCMD) | AHCI_PxCMD_ST
-	);
-	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxIS, 0xffffffff);
+	// Set data buffers
+	int n = 0;
+	for (int i = 0; i < nbuf; i++) {
+		for (unsigned int off = 0; off < buf[i].len; off += AHCI_PRDT_MAX_BYTES, n++) {
+			unsigned int len = buf[i].len - off;
+			if (len > AHCI_PRDT_MAX_BYTES) {
+				len = AHCI_PRDT_MAX_BYTES;
+			}
+			if (n == AHCI_MAX_PRDT) {
+				panic("ahci prdt");
+			}
+			cmd_table->prdt[n].dba = buf[i].addr + off;
+			cmd_table->prdt[n].dba_upper = 0;
+			cmd_table->prdt[n].reserved = 0;
+			cmd_table->prdt[n].dbc_i = len - 1;
+		}
+	}
+	return n;
+}
+
+// Issue a command with the data buffers in buf and wait for it to complete.
+// Up to the NCQ depth of the port READ/WRITE FPDMA QUEUED commands are
+// outstanding at once.
+int ahci_exec(
+	struct AHCIController *ahci, unsigned int port, uint8_t cmd, unsigned long long lba,
+	unsigned int cont, const struct AHCIBuffer *buf, int nbuf, int write
+) {
+	struct AHCIPort *p = ahci->port[port];
+	int ncq = ahci_command_is_ncq(cmd);
+	acquire(&p->lock);
+	p->stats.requests++;
+	int slot;
+	while ((slot = ahci_port_alloc_slot(p, ncq)) < 0) {
+		ahci_port_wait(p, p);
+	}
+	uint32_t bit = 1u << slot;
+	int prdtl = ahci_build_command(p, slot, cmd, lba, cont, buf, nbuf);
+	p->command_list[slot].dw0 = (prdtl << AHCI_CMDLIST_DW0_PRDTL_SHIFT) |
+								(5 << AHCI_CMDLIST_DW0_CFL_SHIFT) |
+								(write ? AHCI_CMDLIST_DW0_W : 0);
+	p->command_list[slot].prdbc = 0;
+	p->busy |= bit;
+	p->queued = ncq;
+	p->start[slot] = rdtsc();
+	p->stats.depth++;
+	if (p->stats.depth > p->stats.max_depth) {
+		p->stats.max_depth = p->stats.depth;
+	}
+	p->stats.depth_hist[hal_block_hist_bucket(p->stats.depth, 0)]++;
+	for (int i = 0; i < nbuf; i++) {
+		p->stats.sectors += buf[i].len / HAL_BLOCK_SECTOR_SIZE;
+	}
 	// issue command
-	while ((ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxTFD) &
-			AHCI_PxTFD_STATUS_BSY) ||
-		   (ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxTFD) &
-			AHCI_PxTFD_STATUS_DRQ)) {}
-	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCI, 1);
-	while (ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCI) & 1) {}
-	kfree(cmd_table);
-	return 0;
+	if (ncq) {
+		ahci_port_write(p, AHCI_PxSACT, bit);
+	}
+	ahci_port_write(p, AHCI_PxCI, bit);
+	while (!(p->done & bit)) {
+		ahci_port_wait(p, &p->command_table[slot]);
+	}
+	int ret = p->failed & bit ? -1 : 0;
+	p->busy &= ~bit;
+	p->done &= ~bit;
+	p->failed &= ~bit;
+	wakeup(p); // commands waiting for a slot
+	release(&p->lock);
+	return ret;
+}
+
+int ahci_exec_pio_in(
+	struct AHCIController *ahci, unsigned int port, uint8_t cmd, unsigned long long lba,
+	unsigned int cont, void *buf, unsigned int blocks
+) {
+	struct AHCIBuffer buffer = {V2P(buf), 512 * blocks};
+	return ahci_exec(ahci, port, cmd, lba, cont, &buffer, 1, 0);
 }
 
 int ahci_exec_pio_out(
 	struct AHCIController *ahci, unsigned int port, uint8_t cmd, unsigned long long lba,
 	unsigned int cont, const void *buf, unsigned int blocks
 ) {
-	// allocate command table
-	volatile struct AHCICommandTable *cmd_table = kalloc();
-	memset_volatile(cmd_table, 0, 4096);
-	// Set command list
-	ahci->command_list[port][0].ctba = V2P(cmd_table);
-	ahci->command_list[port][0].ctba_upper = 0;
-	ahci->command_list[port][0].dw0 = (1 << AHCI_CMDLIST_DW0_PRDTL_SHIFT) |
-									  (5 << AHCI_CMDLIST_DW0_CFL_SHIFT) | AHCI_CMDLIST_DW0_W;
-	ahci->command_list[port][0].prdbc = 0;
-	// Set FIS
-	volatile struct SATARegisterFISHostToDevice *fis =
-		(volatile struct SATARegisterFISHostToDevice *)cmd_table;
-	fis->fis_type = RegisterFISHostToDevice;
-	fis->pm_c = SATA_REGISTER_FIS_H2D_PM_C_COMMAND;
-	fis->command = cmd;
-	fis->lba_7_0 = lba & 0xff;
-	fis->lba_15_8 = (lba >> 8) & 0xff;
-	fis->lba_23_16 = (lba >> 16) & 0xff;
-	fis->lba_31_24 = (lba >> 24) & 0xff;
-	fis->lba_39_32 = (lba >> 32) & 0xff;
-	fis->lba_47_40 = (lba >> 40) & 0xff;
-	fis->count_7_0 = cont & 0xff;
-	fis->count_15_8 = (cont >> 8) & 0xff;
-	fis->device = (1 << 6); // Bit 6 shall be set to one
-	// Set receive buffer
-	cmd_table->prdt[0].dba = V2P(buf);
-	cmd_table->prdt[0].dba_upper = 0;
-	cmd_table->prdt[0].dbc_i = AHCI_PRDT_DBC_I_I | (512 * blocks - 1);
-	// enable command list
-	ahci_write_reg32(
-		ahci,
-		AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCMD,
-		ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCMD) | AHCI_PxCMD_ST
-	);
-	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxIS, 0xffffffff);
-	// issue command
-	while ((ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxTFD) &
-			AHCI_PxTFD_STATUS_BSY) ||
-		   (ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxTFD) &
-			AHCI_PxTFD_STATUS_DRQ)) {}
-	ahci_write_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCI, 1);
-	while (ahci_read_reg32(ahci, AHCI_PORT_CONTROL_OFFSET(port) + AHCI_PxCI) & 1) {}
-	kfree(cmd_table);
-	return 0;
+	struct AHCIBuffer buffer = {V2P(buf), 512 * blocks};
+	return ahci_exec(ahci, port, cmd, lba, cont, &buffer, 1, 1);
 }
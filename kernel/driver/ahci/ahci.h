@@ -20,18 +20,62 @@
 #ifndef _DRIVER_AHCI_AHCI_H
 #define _DRIVER_AHCI_AHCI_H
 
+#include <common/spinlock.h>
 #include <common/types.h>
+#include <hal/hal.h>
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+#define AHCI_MAX_PRDT 32 // PRDT entries of a command table
+#define AHCI_COMMAND_TABLE_SIZE 0x280 // a table with AHCI_MAX_PRDT entries, 128 byte aligned
+
+// Each port has a command table for each command slot, allocated when the
+// port is brought up. Commands are issued in any free slot and the caller
+// sleeps until the completion interrupt. NCQ commands use the slot number
+// as their tag, up to ncq_depth of them are outstanding at once, other
+// commands run alone.
+struct AHCIPort {
+	struct AHCIController *ahci;
+	unsigned int port;
+	struct spinlock lock;
+	volatile struct AHCICommandList *command_list;
+	volatile void *received_fis_buffer;
+	volatile struct AHCICommandTable *command_table[AHCI_MAX_SLOTS];
+	unsigned int ncq_depth; // NCQ tags in use, 0 without NCQ
+	uint32_t busy; // slots issued
+	uint32_t done; // busy slots the device finished with
+	uint32_t failed; // done slots that failed
+	int queued; // busy slots hold NCQ commands
+	unsigned long long start[AHCI_MAX_SLOTS]; // TSC when issued
+	struct BlockQueueStats stats;
+};
 
 struct AHCIController {
 	volatile uint32_t *abar;
-	volatile struct AHCICommandList *command_list[32];
-	volatile void *received_fis_buffer[32];
+	unsigned int num_slots; // command slots of each port
+	int use_intr; // completions interrupt, otherwise they are polled
+	struct AHCIPort *port[AHCI_MAX_PORTS];
+};
+
+// a physically contiguous data buffer
+struct AHCIBuffer {
+	phyaddr_t addr;
+	unsigned int len;
 };
 
 void ahci_init(void);
 int ahci_port_get_link_status(struct AHCIController *ahci_controller, unsigned int port);
 uint32_t ahci_port_get_signature(struct AHCIController *ahci_controller, unsigned int port);
 void ahci_port_reset(struct AHCIController *ahci_controller, unsigned int port);
+unsigned int
+ahci_port_enable_ncq(struct AHCIController *ahci, unsigned int port, unsigned int depth);
+void ahci_port_get_stats(
+	struct AHCIController *ahci, unsigned int port, struct BlockQueueStats *stats
+);
+int ahci_exec(
+	struct AHCIController *ahci, unsigned int port, uint8_t cmd, unsigned long long lba,
+	unsigned int cont, const struct AHCIBuffer *buf, int nbuf, int write
+);
 int ahci_exec_pio_in(
 	struct AHCIController *ahci_controller, unsigned int port, uint8_t cmd, unsigned long long lba,
 	unsigned int cont, void *buf, unsigned int blocks
@@ -141,6 +141,8 @@
 #define AHCI_PxIS_DSS (1 << 2)
 #define AHCI_PxIS_PSS (1 << 1)
 #define AHCI_PxIS_DHRS (1 << 0)
+// interrupts after which the port stops processing commands
+#define AHCI_PxIS_ERROR (AHCI_PxIS_TFES | AHCI_PxIS_HBFS | AHCI_PxIS_HBDS | AHCI_PxIS_IFS)
 
 #define AHCI_PxIE 0x14
 #define AHCI_PxIE_CPDE (1 << 31)
@@ -340,6 +342,7 @@ struct AHCIPRDT {
 #define AHCI_PRDT_DBC_I_I (1 << 31)
 #define AHCI_PRDT_DBC_I_DBC_SHIFT 0
 #define AHCI_PRDT_DBC_I_DBC_MASK 0x3fffff
+#define AHCI_PRDT_MAX_BYTES (4 * 1024 * 1024)
 
 struct AHCICommandTable {
 	uint8_t cfis[0x40];
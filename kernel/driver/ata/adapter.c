@@ -29,6 +29,11 @@
 const static char *bus_master_str[] = {"Non-Bus Mastering", "Bus Mastering"};
 const static char *pci_native_str[] = {"ISA Compatibility", "PCI Native"};
 
+// the adapter in ISA compatibility mode, it interrupts on IRQ 14 and 15
+static struct PATAAdapter *pata_legacy_adapter;
+
+#define PATA_PRD_BOUNDARY 0x10000 // a PRD must not cross a 64 KiB boundary
+
 struct PATABMDMAPRD {
 	uint32_t base;
 	uint16_t size;
@@ -36,7 +41,7 @@ struct PATABMDMAPRD {
 } PACKED;
 
 static struct PATAAdapter *pata_adapter_alloc(void) {
-	struct PATAAdapter *dev = kalloc();
+	struct PATAAdapter *dev = kmalloc(sizeof(struct PATAAdapter));
 	memset(dev, 0, sizeof(struct PATAAdapter));
 	return dev;
 }
@@ -96,6 +101,8 @@ void pata_adapter_dev_init(struct PCIDevice *pcidev) {
 	// enable PCI interrupt
 	if (adapter->pci_native) {
 		pci_register_intr_handler(pcidev, pata_adapter_pci_intr);
+	} else {
+		pata_legacy_adapter = adapter;
 	}
 	release(&adapter->lock[0]);
 	pata_register_adapter(adapter);
@@ -108,13 +115,26 @@ void pata_adapter_bmdma_init(struct PATAAdapter *dev, int channel, int drive) {
 	outb(bmdma_base + 2, bmdma_status);
 }
 
+// Fill the PRD table of a channel for a physically contiguous buffer, an
+// entry for each 64 KiB region it touches
 void pata_adapter_bmdma_prepare(
 	struct PATAAdapter *dev, int channel, phyaddr_t addr, unsigned int size
 ) {
 	volatile struct PATABMDMAPRD *prd = dev->prd[channel];
-	prd[0].base = addr;
-	prd[0].size = size;
-	prd[0].eot = 0x8000;
+	int n = 0;
+	while (size) {
+		unsigned int len = PATA_PRD_BOUNDARY - addr % PATA_PRD_BOUNDARY;
+		if (len > size) {
+			len = size;
+		}
+		prd[n].base = addr;
+		prd[n].size = len; // 0 for 64 KiB
+		prd[n].eot = 0;
+		addr += len;
+		size -= len;
+		n++;
+	}
+	prd[n - 1].eot = 0x8000;
 	ioport_t bmdma_base = dev->bus_master_base + channel * 8;
 	outdw(bmdma_base + 4, V2P(prd));
 	uint8_t bmdma_status = inb(bmdma_base + 2);
@@ -142,15 +162,22 @@ int pata_adapter_bmdma_busy(struct PATAAdapter *dev, int channel) {
 	return inb(bmdma_base + 2) & 1;
 }
 
-void pata_adapter_bmdma_stop(struct PATAAdapter *dev, int channel) {
+// the drive raised its interrupt
+int pata_adapter_bmdma_interrupt(struct PATAAdapter *dev, int channel) {
+	ioport_t bmdma_base = dev->bus_master_base + channel * 8;
+	return inb(bmdma_base + 2) & 4;
+}
+
+// stop the bus master and clear its interrupt, return nonzero on error
+int pata_adapter_bmdma_stop(struct PATAAdapter *dev, int channel) {
 	ioport_t bmdma_base = dev->bus_master_base + channel * 8;
 	outb(bmdma_base + 0, 0);
 	uint8_t bmdma_status = inb(bmdma_base + 2);
 	if (bmdma_status & 2) {
 		cprintf("[ata] BMDMA error\n");
 	}
-	bmdma_status |= 6;
-	outb(bmdma_base + 2, bmdma_status);
+	outb(bmdma_base + 2, bmdma_status | 6);
+	return bmdma_status & 2;
 }
 
 struct PCIDriver pata_adapter_pci_driver = {
@@ -167,6 +194,14 @@ void pata_adapter_init(void) {
 	pci_register_driver(&pata_adapter_pci_driver);
 }
 
-void pata_adapter_legacy_intr(int irq) {}
+void pata_adapter_legacy_intr(int irq) {
+	if (pata_legacy_adapter) {
+		pata_intr(pata_legacy_adapter, irq - 14);
+	}
+}
 
-void pata_adapter_pci_intr(struct PCIDevice *dev) {}
+void pata_adapter_pci_intr(struct PCIDevice *dev) {
+	struct PATAAdapter *adapter = dev->private;
+	pata_intr(adapter, 0);
+	pata_intr(adapter, 1);
+}
@@ -27,16 +27,8 @@
 
 #include "ata.h"
 
-enum ATACommands {
-	ATA_COMMAND_READ_SECTOR = 0x20,
-	ATA_COMMAND_WRITE_SECTOR = 0x30,
-	ATA_COMMAND_READ_DMA = 0xc8,
-	ATA_COMMAND_WRITE_DMA = 0xca,
-	ATA_COMMAND_IDENTIFY = 0xec,
-};
-
 struct ATADevice *ata_device_alloc(void) {
-	struct ATADevice *dev = kalloc();
+	struct ATADevice *dev = kmalloc(sizeof(struct ATADevice));
 	memset(dev, 0, sizeof(struct ATADevice));
 	return dev;
 }
@@ -134,22 +126,38 @@ int ata_identify(struct ATADevice *dev, char *model) {
 	return 0;
 }
 
+// check buf for DMA
+static void ata_dma_check(int count, int max, const void *buf) {
+	if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
+		(phyaddr_t)buf % PGSIZE) {
+		panic("ata dma");
+	}
+	if (count <= 0 || count > max) {
+		panic("ata count");
+	}
+}
+
+// DMA command for data transfers
+static uint8_t ata_dma_command(struct ATADevice *dev, int write) {
+	if (dev->transport == ATA_TRANSPORT_SERIAL_ATA && dev->sata.use_ncq) {
+		return write ? ATA_COMMAND_WRITE_FPDMA_QUEUED : ATA_COMMAND_READ_FPDMA_QUEUED;
+	}
+	if (dev->support_lba48) {
+		return write ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_READ_DMA_EXT;
+	}
+	return write ? ATA_COMMAND_WRITE_DMA : ATA_COMMAND_READ_DMA;
+}
+
 int ata_read(void *private, unsigned int begin, int count, void *buf) {
 	struct ATADevice *dev = private;
 	if (dev->transport == ATA_TRANSPORT_PARALLEL_ATA) {
 		if (dev->pata.use_dma) {
-			if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
-				(phyaddr_t)buf % PGSIZE) {
-				panic("ata dma");
-			}
-			if (count == 0 || count > 8) {
-				panic("ata count");
-			}
+			ata_dma_check(count, ATA_DMA_MAX_SECTORS, buf);
 			if (pata_exec_dma_in(
 					dev->pata.adapter,
 					dev->pata.channel,
 					dev->pata.drive,
-					ATA_COMMAND_READ_DMA,
+					ata_dma_command(dev, 0),
 					begin,
 					count,
 					buf,
@@ -172,7 +180,8 @@ int ata_read(void *private, unsigned int begin, int count, void *buf) {
 			}
 		}
 	} else if (dev->transport == ATA_TRANSPORT_SERIAL_ATA) {
-		if (sata_exec_pio_in(&dev->sata, ATA_COMMAND_READ_SECTOR, begin, count, buf, count)) {
+		ata_dma_check(count, ATA_DMA_MAX_SECTORS, buf);
+		if (sata_exec_dma_in(&dev->sata, ata_dma_command(dev, 0), begin, count, buf, count)) {
 			return ERROR_READ_FAIL;
 		}
 	}
@@ -183,18 +192,12 @@ int ata_write(void *private, unsigned int begin, int count, const void *buf) {
 	struct ATADevice *dev = private;
 	if (dev->transport == ATA_TRANSPORT_PARALLEL_ATA) {
 		if (dev->pata.use_dma) {
-			if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
-				(phyaddr_t)buf % PGSIZE) {
-				panic("ata dma");
-			}
-			if (count == 0 || count > 8) {
-				panic("ata count");
-			}
+			ata_dma_check(count, ATA_DMA_MAX_SECTORS, buf);
 			if (pata_exec_dma_out(
 					dev->pata.adapter,
 					dev->pata.channel,
 					dev->pata.drive,
-					ATA_COMMAND_WRITE_DMA,
+					ata_dma_command(dev, 1),
 					begin,
 					count,
 					buf,
@@ -217,18 +220,38 @@ int ata_write(void *private, unsigned int begin, int count, const void *buf) {
 			}
 		}
 	} else if (dev->transport == ATA_TRANSPORT_SERIAL_ATA) {
-		if (sata_exec_pio_out(&dev->sata, ATA_COMMAND_WRITE_SECTOR, begin, count, buf, count)) {
+		ata_dma_check(count, ATA_DMA_MAX_SECTORS, buf);
+		if (sata_exec_dma_out(&dev->sata, ata_dma_command(dev, 1), begin, count, buf, count)) {
 			return ERROR_WRITE_FAIL;
 		}
 	}
 	return 0;
 }
 
+static void ata_sata_get_stats(void *private, struct BlockQueueStats *stats) {
+	struct ATADevice *dev = private;
+	sata_get_stats(&dev->sata, stats);
+}
+
 const struct BlockDeviceDriver ata_block_driver = {
 	.block_read = ata_read,
 	.block_write = ata_write,
 };
 
+const struct BlockDeviceDriver ata_dma_block_driver = {
+	.block_read = ata_read,
+	.block_write = ata_write,
+	.max_sectors = ATA_DMA_MAX_SECTORS,
+};
+
+// only SATA keeps command queue statistics
+const struct BlockDeviceDriver ata_sata_block_driver = {
+	.block_read = ata_read,
+	.block_write = ata_write,
+	.max_sectors = ATA_DMA_MAX_SECTORS,
+	.get_stats = ata_sata_get_stats,
+};
+
 void ata_register_ata_device(struct ATADevice *ata_dev) {
 	char model[50];
 	if (ata_identify(ata_dev, model) == 0) {
@@ -239,6 +262,7 @@ void ata_register_ata_device(struct ATADevice *ata_dev) {
 			ata_dev->ata_rev,
 			BOOL2SIGN(ata_dev->support_lba48)
 		);
+		const struct BlockDeviceDriver *driver = &ata_block_driver;
 
 		if (ata_dev->transport == ATA_TRANSPORT_PARALLEL_ATA) {
 			cprintf(
@@ -258,6 +282,7 @@ void ata_register_ata_device(struct ATADevice *ata_dev) {
 				pata_adapter_bmdma_init(
 					ata_dev->pata.adapter, ata_dev->pata.channel, ata_dev->pata.drive
 				);
+				driver = &ata_dma_block_driver;
 			} else {
 				ata_dev->pata.use_dma = 0;
 				cprintf(
@@ -277,12 +302,18 @@ void ata_register_ata_device(struct ATADevice *ata_dev) {
 					BOOL2SIGN(ata_dev->sata.support_receive_send_fpdma_queued),
 					ata_dev->sata.ncq_queue_depth
 				);
+				unsigned int depth = sata_enable_ncq(&ata_dev->sata, ata_dev->sata.ncq_queue_depth);
+				if (depth) {
+					ata_dev->sata.use_ncq = 1;
+					cprintf("[ata] Use NCQ with %d tags\n", depth);
+				}
 			} else {
 				cprintf("[ata] SATA NCQ not supported\n");
 			}
+			driver = &ata_sata_block_driver;
 		}
 
-		hal_block_register_device("ata", ata_dev, &ata_block_driver);
+		hal_block_register_device("ata", ata_dev, driver);
 	}
 }
 
@@ -3,6 +3,7 @@
 
 #include <common/spinlock.h>
 #include <driver/pci/pci.h>
+#include <hal/hal.h>
 
 enum ATATransport {
 	ATA_TRANSPORT_PARALLEL_ATA,
@@ -18,7 +19,11 @@ struct PATAAdapter {
 		unsigned short pci_native : 1;
 	};
 	struct PATABMDMAPRD *prd[2];
+	// for each channel, protected by its lock
 	struct spinlock lock[2];
+	int busy[2]; // a DMA command owns the channel
+	int dma_active[2]; // the DMA is in flight, cleared by the interrupt
+	int dma_error[2];
 };
 
 struct PATADevice {
@@ -31,6 +36,20 @@ struct PATADevice {
 	char dma, pio, mdma, udma;
 };
 
+enum ATACommands {
+	ATA_COMMAND_READ_SECTOR = 0x20,
+	ATA_COMMAND_READ_DMA_EXT = 0x25,
+	ATA_COMMAND_WRITE_SECTOR = 0x30,
+	ATA_COMMAND_WRITE_DMA_EXT = 0x35,
+	ATA_COMMAND_READ_FPDMA_QUEUED = 0x60,
+	ATA_COMMAND_WRITE_FPDMA_QUEUED = 0x61,
+	ATA_COMMAND_READ_DMA = 0xc8,
+	ATA_COMMAND_WRITE_DMA = 0xca,
+	ATA_COMMAND_IDENTIFY = 0xec,
+};
+
+#define ATA_DMA_MAX_SECTORS 256 // sectors of a DMA command
+
 enum SATAControllerType {
 	SATA_CONTROLLER_TYPE_AHCI
 };
@@ -52,6 +71,7 @@ struct SATADevice {
 		unsigned int support_ncq_streaming : 1;
 		unsigned int support_ncq_queue_mgmt_cmd : 1;
 		unsigned int support_receive_send_fpdma_queued : 1;
+		unsigned int use_ncq : 1; // READ/WRITE FPDMA QUEUED for data transfers
 	};
 };
 
@@ -97,6 +117,7 @@ int pata_exec_dma_out(
 	unsigned int count, const void *buf, int blocks
 );
 void pata_register_adapter(struct PATAAdapter *adapter);
+void pata_intr(struct PATAAdapter *adapter, int channel);
 
 // sata.c
 int sata_exec_pio_in(
@@ -107,6 +128,16 @@ int sata_exec_pio_out(
 	struct SATADevice *sata_dev, uint8_t cmd, unsigned long long lba, unsigned int cont,
 	const void *buf, unsigned int blocks
 );
+int sata_exec_dma_in(
+	struct SATADevice *sata_dev, uint8_t cmd, unsigned long long lba, unsigned int cont, void *buf,
+	unsigned int blocks
+);
+int sata_exec_dma_out(
+	struct SATADevice *sata_dev, uint8_t cmd, unsigned long long lba, unsigned int cont,
+	const void *buf, unsigned int blocks
+);
+unsigned int sata_enable_ncq(struct SATADevice *sata_dev, unsigned int depth);
+void sata_get_stats(struct SATADevice *sata_dev, struct BlockQueueStats *stats);
 int sata_port_get_link_status(
 	struct SATAController *sata_controller,
 	unsigned int port
@@ -127,6 +158,7 @@ void pata_adapter_bmdma_prepare(
 void pata_adapter_bmdma_start_write(struct PATAAdapter *dev, int channel);
 void pata_adapter_bmdma_start_read(struct PATAAdapter *dev, int channel);
 int pata_adapter_bmdma_busy(struct PATAAdapter *dev, int channel);
-void pata_adapter_bmdma_stop(struct PATAAdapter *dev, int channel);
+int pata_adapter_bmdma_interrupt(struct PATAAdapter *dev, int channel);
+int pata_adapter_bmdma_stop(struct PATAAdapter *dev, int channel);
 
 #endif
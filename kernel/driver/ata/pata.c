@@ -21,7 +21,9 @@
 #include <common/spinlock.h>
 #include <common/types.h>
 #include <common/x86.h>
+#include <core/proc.h>
 #include <defs.h>
+#include <memlayout.h>
 
 #include "ata.h"
 
@@ -79,22 +81,86 @@ void pata_bus_reset(const struct PATAAdapter *adapter, int channel) {
 	mdelay(2);
 }
 
-int pata_exec_pio_in(
-	struct PATAAdapter *adapter, int channel, int drive, uint8_t cmd, unsigned int lba,
-	unsigned int count, void *buf, int blocks
+static inline int pata_command_is_lba48(uint8_t cmd) {
+	return cmd == ATA_COMMAND_READ_DMA_EXT || cmd == ATA_COMMAND_WRITE_DMA_EXT;
+}
+
+// Select the drive and issue a command, 48-bit commands take the high
+// order bytes of the count and LBA first
+static void pata_issue_command(
+	ioport_t iobase, int drive, uint8_t cmd, unsigned int lba, unsigned int count
 ) {
-	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	outb(
-		iobase + PATA_IO_DRIVE,
-		PATA_DRIVE_DEFAULT | (drive << PATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf)
-	);
-	udelay(1);
-	outb(iobase + PATA_IO_COUNT, count);
+	if (pata_command_is_lba48(cmd)) {
+		outb(iobase + PATA_IO_DRIVE, PATA_DRIVE_DEFAULT | (drive << PATA_DRIVE_DRV_BIT));
+		udelay(1);
+		outb(iobase + PATA_IO_COUNT, (count >> 8) & 0xff);
+		outb(iobase + PATA_IO_LBALO, (lba >> 24) & 0xff);
+		outb(iobase + PATA_IO_LBAMID, 0);
+		outb(iobase + PATA_IO_LBAHI, 0);
+	} else {
+		outb(
+			iobase + PATA_IO_DRIVE,
+			PATA_DRIVE_DEFAULT | (drive << PATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf)
+		);
+		udelay(1);
+	}
+	outb(iobase + PATA_IO_COUNT, count & 0xff);
 	outb(iobase + PATA_IO_LBALO, lba & 0xff);
 	outb(iobase + PATA_IO_LBAMID, (lba >> 8) & 0xff);
 	outb(iobase + PATA_IO_LBAHI, (lba >> 16) & 0xff);
 	outb(iobase + PATA_IO_COMMAND, cmd);
+}
+
+// Complete the DMA command of a channel once the drive interrupted.
+// adapter->lock[channel] must be held.
+static void pata_dma_complete(struct PATAAdapter *adapter, int channel) {
+	if (!adapter->dma_active[channel] || !pata_adapter_bmdma_interrupt(adapter, channel)) {
+		return;
+	}
+	int error = pata_adapter_bmdma_stop(adapter, channel);
+	// reading the status acknowledges the drive interrupt
+	uint8_t status = inb(adapter->cmdblock_base[channel] + PATA_IO_STATUS);
+	adapter->dma_error[channel] = error || status == 0 || (status & PATA_STATUS_ERR);
+	adapter->dma_active[channel] = 0;
+	wakeup(&adapter->dma_active[channel]);
+}
+
+void pata_intr(struct PATAAdapter *adapter, int channel) {
+	acquire(&adapter->lock[channel]);
+	if (adapter->dma_active[channel]) {
+		pata_dma_complete(adapter, channel);
+	} else {
+		// acknowledge interrupts of PIO commands, they poll the status
+		inb(adapter->cmdblock_base[channel] + PATA_IO_STATUS);
+	}
+	release(&adapter->lock[channel]);
+}
+
+// Sleep on chan until the interrupt handler wakes us, or poll for the
+// interrupt when there is no process. adapter->lock[channel] must be held.
+static void pata_channel_wait(struct PATAAdapter *adapter, int channel, void *chan) {
+	if (myproc()) {
+		sleep(chan, &adapter->lock[channel]);
+	} else {
+		pata_dma_complete(adapter, channel);
+	}
+}
+
+// Acquire adapter->lock[channel] once no DMA command owns the channel
+static void pata_channel_acquire(struct PATAAdapter *adapter, int channel) {
+	acquire(&adapter->lock[channel]);
+	while (adapter->busy[channel]) {
+		pata_channel_wait(adapter, channel, &adapter->busy[channel]);
+	}
+}
+
+int pata_exec_pio_in(
+	struct PATAAdapter *adapter, int channel, int drive, uint8_t cmd, unsigned int lba,
+	unsigned int count, void *buf, int blocks
+) {
+	ioport_t iobase = adapter->cmdblock_base[channel];
+	pata_channel_acquire(adapter, channel);
+	pata_issue_command(iobase, drive, cmd, lba, count);
 	// check status
 	for (int i = 0; i < blocks; i++) {
 		while (inb(iobase + PATA_IO_STATUS) & PATA_STATUS_BSY) {}
@@ -109,35 +175,38 @@ int pata_exec_pio_in(
 	return 0;
 }
 
-int pata_exec_dma_in(
+// Run a DMA command, the channel lock is released while it is in flight so
+// the CPU runs other processes and the other channel works on its own
+static int pata_exec_dma(
 	struct PATAAdapter *adapter, int channel, int drive, uint8_t cmd, unsigned int lba,
-	unsigned int count, void *buf, int blocks
+	unsigned int count, phyaddr_t buf, int blocks, int write
 ) {
 	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	pata_adapter_bmdma_prepare(adapter, channel, V2P(buf), blocks * 512);
-	outb(
-		iobase + PATA_IO_DRIVE,
-		PATA_DRIVE_DEFAULT | (drive << PATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf)
-	);
-	udelay(1);
-	outb(iobase + PATA_IO_COUNT, count);
-	outb(iobase + PATA_IO_LBALO, lba & 0xff);
-	outb(iobase + PATA_IO_LBAMID, (lba >> 8) & 0xff);
-	outb(iobase + PATA_IO_LBAHI, (lba >> 16) & 0xff);
-	outb(iobase + PATA_IO_COMMAND, cmd);
-	pata_adapter_bmdma_start_write(adapter, channel);
-	// check status
-	while ((inb(iobase + PATA_IO_STATUS) & PATA_STATUS_BSY) ||
-		   pata_adapter_bmdma_busy(adapter, channel)) {}
-	pata_adapter_bmdma_stop(adapter, channel);
-	uint8_t status = inb(iobase + PATA_IO_STATUS);
-	if (status == 0 || status & PATA_STATUS_ERR) {
-		release(&adapter->lock[channel]);
-		return -1;
+	pata_channel_acquire(adapter, channel);
+	adapter->busy[channel] = 1;
+	pata_adapter_bmdma_prepare(adapter, channel, buf, blocks * 512);
+	pata_issue_command(iobase, drive, cmd, lba, count);
+	adapter->dma_active[channel] = 1;
+	if (write) {
+		pata_adapter_bmdma_start_read(adapter, channel);
+	} else {
+		pata_adapter_bmdma_start_write(adapter, channel);
 	}
+	while (adapter->dma_active[channel]) {
+		pata_channel_wait(adapter, channel, &adapter->dma_active[channel]);
+	}
+	int ret = adapter->dma_error[channel] ? -1 : 0;
+	adapter->busy[channel] = 0;
+	wakeup(&adapter->busy[channel]);
 	release(&adapter->lock[channel]);
-	return 0;
+	return ret;
+}
+
+int pata_exec_dma_in(
+	struct PATAAdapter *adapter, int channel, int drive, uint8_t cmd, unsigned int lba,
+	unsigned int count, void *buf, int blocks
+) {
+	return pata_exec_dma(adapter, channel, drive, cmd, lba, count, V2P(buf), blocks, 0);
 }
 
 int pata_exec_pio_out(
@@ -145,17 +214,8 @@ int pata_exec_pio_out(
 	unsigned int count, const void *buf, int blocks
 ) {
 	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	outb(
-		iobase + PATA_IO_DRIVE,
-		PATA_DRIVE_DEFAULT | (drive << PATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf)
-	);
-	udelay(1);
-	outb(iobase + PATA_IO_COUNT, count);
-	outb(iobase + PATA_IO_LBALO, lba & 0xff);
-	outb(iobase + PATA_IO_LBAMID, (lba >> 8) & 0xff);
-	outb(iobase + PATA_IO_LBAHI, (lba >> 16) & 0xff);
-	outb(iobase + PATA_IO_COMMAND, cmd);
+	pata_channel_acquire(adapter, channel);
+	pata_issue_command(iobase, drive, cmd, lba, count);
 	// check status
 	for (int i = 0; i < blocks; i++) {
 		while (inb(iobase + PATA_IO_STATUS) & PATA_STATUS_BSY) {}
@@ -175,31 +235,7 @@ int pata_exec_dma_out(
 	struct PATAAdapter *adapter, int channel, int drive, uint8_t cmd, unsigned int lba,
 	unsigned int count, const void *buf, int blocks
 ) {
-	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	pata_adapter_bmdma_prepare(adapter, channel, V2P(buf), blocks * 512);
-	outb(
-		iobase + PATA_IO_DRIVE,
-		PATA_DRIVE_DEFAULT | (drive << PATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf)
-	);
-	udelay(1);
-	outb(iobase + PATA_IO_COUNT, count);
-	outb(iobase + PATA_IO_LBALO, lba & 0xff);
-	outb(iobase + PATA_IO_LBAMID, (lba >> 8) & 0xff);
-	outb(iobase + PATA_IO_LBAHI, (lba >> 16) & 0xff);
-	outb(iobase + PATA_IO_COMMAND, cmd);
-	pata_adapter_bmdma_start_read(adapter, channel);
-	// check status
-	while ((inb(iobase + PATA_IO_STATUS) & PATA_STATUS_BSY) ||
-		   pata_adapter_bmdma_busy(adapter, channel)) {}
-	pata_adapter_bmdma_stop(adapter, channel);
-	uint8_t status = inb(iobase + PATA_IO_STATUS);
-	if (status == 0 || status & PATA_STATUS_ERR) {
-		release(&adapter->lock[channel]);
-		return -1;
-	}
-	release(&adapter->lock[channel]);
-	return 0;
+	return pata_exec_dma(adapter, channel, drive, cmd, lba, count, V2P(buf), blocks, 1);
 }
 
 void pata_register_adapter(struct PATAAdapter *adapter) {
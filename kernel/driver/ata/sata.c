@@ -21,6 +21,8 @@
 #include <defs.h>
 #include <driver/ahci/ahci.h>
 #include <driver/ahci/sata_struct.h>
+#include <hal/hal.h>
+#include <memlayout.h>
 
 #include "ata.h"
 
@@ -50,6 +52,53 @@ int sata_exec_pio_out(
 	}
 }
 
+// The AHCI command engine moves the data of PIO and DMA commands alike
+int sata_exec_dma_in(
+	struct SATADevice *sata_dev, uint8_t cmd, unsigned long long lba, unsigned int cont, void *buf,
+	unsigned int blocks
+) {
+	if (sata_dev->controller->type == SATA_CONTROLLER_TYPE_AHCI) {
+		struct AHCIBuffer buffer = {V2P(buf), blocks * HAL_BLOCK_SECTOR_SIZE};
+		return ahci_exec(
+			sata_dev->controller->private, sata_dev->port, cmd, lba, cont, &buffer, 1, 0
+		);
+	} else {
+		panic("unknown SATA controller type");
+	}
+}
+
+int sata_exec_dma_out(
+	struct SATADevice *sata_dev, uint8_t cmd, unsigned long long lba, unsigned int cont,
+	const void *buf, unsigned int blocks
+) {
+	if (sata_dev->controller->type == SATA_CONTROLLER_TYPE_AHCI) {
+		struct AHCIBuffer buffer = {V2P(buf), blocks * HAL_BLOCK_SECTOR_SIZE};
+		return ahci_exec(
+			sata_dev->controller->private, sata_dev->port, cmd, lba, cont, &buffer, 1, 1
+		);
+	} else {
+		panic("unknown SATA controller type");
+	}
+}
+
+// Use NCQ with up to depth commands outstanding, return the depth the
+// controller allows or 0 if it has no NCQ
+unsigned int sata_enable_ncq(struct SATADevice *sata_dev, unsigned int depth) {
+	if (sata_dev->controller->type == SATA_CONTROLLER_TYPE_AHCI) {
+		return ahci_port_enable_ncq(sata_dev->controller->private, sata_dev->port, depth);
+	} else {
+		panic("unknown SATA controller type");
+	}
+}
+
+void sata_get_stats(struct SATADevice *sata_dev, struct BlockQueueStats *stats) {
+	if (sata_dev->controller->type == SATA_CONTROLLER_TYPE_AHCI) {
+		ahci_port_get_stats(sata_dev->controller->private, sata_dev->port, stats);
+	} else {
+		panic("unknown SATA controller type");
+	}
+}
+
 int sata_port_get_link_status(struct SATAController *sata_controller, unsigned int port) {
 	if (sata_controller->type == SATA_CONTROLLER_TYPE_AHCI) {
 		return ahci_port_get_link_status(sata_controller->private, port);
@@ -121,7 +121,7 @@ static int bochs_display_is_qemu_stdvga(const struct PciAddress *addr) {
 static void bochs_display_dev_init(struct PCIDevice *pcidev) {
 	const struct PciAddress *addr = &pcidev->addr;
 
-	struct BochsDisplayDevice *dev = kalloc();
+	struct BochsDisplayDevice *dev = kmalloc(sizeof(struct BochsDisplayDevice));
 	memset(dev, 0, sizeof(struct BochsDisplayDevice));
 
 	phyaddr_t mmio_bar = 0;
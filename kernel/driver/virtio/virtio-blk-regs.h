@@ -24,7 +24,8 @@ struct VirtioBlockConfig {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t writeback;
-	uint8_t unused0[3];
+	uint8_t unused0;
+	uint16_t num_queues; // if VIRTIO_BLK_F_MQ
 	uint32_t max_discard_sectors;
 	uint32_t max_discard_seg;
 	uint32_t discard_sector_alignment;
@@ -44,6 +45,7 @@ enum VirtioBlockFeatureBits {
 	VIRTIO_BLK_F_FLUSH = (1 << 9),
 	VIRTIO_BLK_F_TOPOLOGY = (1 << 10),
 	VIRTIO_BLK_F_CONFIG_WCE = (1 << 11),
+	VIRTIO_BLK_F_MQ = (1 << 12),
 	VIRTIO_BLK_F_DISCARD = (1 << 13),
 	VIRTIO_BLK_F_WRITE_ZEROES = (1 << 14),
 };
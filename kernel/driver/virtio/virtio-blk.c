@@ -17,161 +17,326 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <arch/x86/msi.h>
 #include <common/errorcode.h>
+#include <core/proc.h>
 #include <defs.h>
 #include <driver/pci/pci.h>
 #include <hal/hal.h>
 #include <memlayout.h>
 
+#ifndef __riscv
+#include <common/x86.h>
+#endif
+
 #include "virtio-blk-regs.h"
 #include "virtio-blk.h"
 #include "virtio-regs.h"
 #include "virtio.h"
 
-static void virtio_blk_req(
-	struct VirtioBlockDevice *dev, int type, unsigned int sect, unsigned int count, phyaddr_t dest,
-	uint8_t *status
-) {
-	volatile struct {
-		uint32_t type;
-		uint32_t reserved;
-		uint64_t sector;
-	} __attribute__((packed)) buf0;
-
-	buf0.type = type;
-	buf0.reserved = 0;
-	buf0.sector = sect;
-
-	int desc[3];
-	if (!virtio_alloc_desc(&dev->requestq, desc, 3)) {
-		panic("virtio-blk out of desc");
+// Requests are queued on the virtqueue of the submitting CPU, as many at
+// a time as there are descriptors for. Requests that find the ring full
+// wait on a pending list sorted so that adjacent sectors follow each other,
+// and runs of them go to the device as one request with a data buffer for
+// each. Every request completes on its own, the interrupt handler calls
+// its complete function.
+
+static struct KmemCache *virtio_blk_request_cache;
+
+static inline unsigned long long virtio_blk_time(void) {
+#ifndef __riscv
+	return rdtsc();
+#else
+	return 0;
+#endif
+}
+
+struct VirtioBlockRequest *virtio_blk_alloc_request(void) {
+	struct VirtioBlockRequest *req = kmem_cache_alloc(virtio_blk_request_cache);
+	memset(req, 0, sizeof(struct VirtioBlockRequest));
+	return req;
+}
+
+void virtio_blk_free_request(struct VirtioBlockRequest *req) {
+	kmem_cache_free(virtio_blk_request_cache, req);
+}
+
+// b continues a
+static inline int virtio_blk_adjacent(struct VirtioBlockRequest *a, struct VirtioBlockRequest *b) {
+	return a->header.type == b->header.type && a->header.sector + a->count == b->header.sector;
+}
+
+// Add req to the pending list right after a request it continues or
+// before one that continues it, otherwise at the end. q->lock must be held.
+static void virtio_blk_queue_pending(struct VirtioBlockQueue *q, struct VirtioBlockRequest *req) {
+	struct VirtioBlockRequest **pp = &q->pending;
+	for (; *pp; pp = &(*pp)->next) {
+		if (virtio_blk_adjacent(*pp, req)) {
+			pp = &(*pp)->next;
+			break;
+		}
+		if (virtio_blk_adjacent(req, *pp)) {
+			break;
+		}
 	}
+	req->next = *pp;
+	*pp = req;
+	if (!req->next) {
+		q->pending_tail = req;
+	}
+}
 
-	dev->requestq.desc[desc[0]].addr = V2P(&buf0);
-	dev->requestq.desc[desc[0]].len = 16;
-	dev->requestq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->requestq.desc[desc[0]].next = desc[1];
+// Put the request of the merged requests from head to its end on the ring.
+// q->lock must be held and there must be descriptors for it.
+static void virtio_blk_send(struct VirtioBlockQueue *q, struct VirtioBlockRequest *head) {
+	struct VirtioBuffer buf[VIRTIO_BLK_MERGE_SEGMENTS + 2];
+	buf[0].addr = V2P(&head->header);
+	buf[0].len = sizeof(head->header);
+	buf[0].write = 0;
+	int i = 1;
+	for (struct VirtioBlockRequest *r = head; r; r = r->next, i++) {
+		buf[i].addr = r->buf;
+		buf[i].len = r->count * HAL_BLOCK_SECTOR_SIZE;
+		buf[i].write = head->header.type == VIRTIO_BLK_T_IN;
+	}
+	buf[i].addr = V2P(&head->status);
+	buf[i].len = 1;
+	buf[i].write = 1;
+	virtio_queue_add(&q->vq, buf, head->ndesc, head);
 
-	dev->requestq.desc[desc[1]].addr = dest;
-	dev->requestq.desc[desc[1]].len = 512 * count;
-	dev->requestq.desc[desc[1]].flags = VIRTQ_DESC_F_NEXT;
-	if (type == VIRTIO_BLK_T_IN) {
-		dev->requestq.desc[desc[1]].flags |= VIRTQ_DESC_F_WRITE;
+	q->stats.depth++;
+	if (q->stats.depth > q->stats.max_depth) {
+		q->stats.max_depth = q->stats.depth;
+	}
+	q->stats.depth_hist[hal_block_hist_bucket(q->stats.depth, 0)]++;
+}
+
+// Move pending requests to the ring while there are descriptors, merging
+// runs of adjacent ones, and kick the device once. q->lock must be held.
+static void virtio_blk_dispatch(struct VirtioBlockQueue *q) {
+	while (q->pending) {
+		struct VirtioBlockRequest *head = q->pending, *tail = head;
+		unsigned int segments = 1, count = head->count;
+		while (tail->next && segments < q->dev->seg_max &&
+			   count + tail->next->count <= VIRTIO_BLK_MERGE_SECTORS &&
+			   virtio_blk_adjacent(tail, tail->next)) {
+			tail = tail->next;
+			segments++;
+			count += tail->count;
+		}
+		if (q->vq.num_free < segments + 2) {
+			break;
+		}
+		q->pending = tail->next;
+		if (!q->pending) {
+			q->pending_tail = 0;
+		}
+		tail->next = 0;
+		head->ndesc = segments + 2;
+		q->stats.merged += segments - 1;
+		virtio_blk_send(q, head);
 	}
-	dev->requestq.desc[desc[1]].next = desc[2];
+	virtio_queue_kick(&q->vq);
+}
 
-	dev->requestq.desc[desc[2]].addr = V2P(status);
-	dev->requestq.desc[desc[2]].len = 1;
-	dev->requestq.desc[desc[2]].flags = VIRTQ_DESC_F_WRITE;
-	dev->requestq.desc[desc[2]].next = 0;
+// Complete the requests the device finished and send pending ones.
+// q->lock must be held.
+static void virtio_blk_reap(struct VirtioBlockQueue *q) {
+	unsigned long long now = virtio_blk_time();
+	struct VirtioBlockRequest *head;
+	while ((head = virtio_queue_get(&q->vq, 0)) != 0) {
+		q->stats.depth--;
+		uint8_t status = head->status;
+		for (struct VirtioBlockRequest *r = head, *next; r; r = next) {
+			next = r->next;
+			r->next = 0;
+			r->status = status;
+			r->done = 1;
+			q->stats.completed++;
+			q->stats.sectors += r->count;
+			if (status) {
+				q->stats.errors++;
+			}
+			q->stats.latency_hist[hal_block_hist_bucket(now - r->start, 10)]++;
+			r->complete(r);
+		}
+	}
+	virtio_blk_dispatch(q);
+}
 
-	virtio_queue_avail_insert(&dev->requestq, desc[0]);
+static void virtio_blk_requestq_intr(struct VirtioQueue *queue) {
+	struct VirtioBlockQueue *q = (struct VirtioBlockQueue *)queue;
+	acquire(&q->lock);
+	virtio_blk_reap(q);
+	release(&q->lock);
+}
 
-// do not sleep at boot time
+// the queue of the current CPU
+static struct VirtioBlockQueue *virtio_blk_queue(struct VirtioBlockDevice *dev) {
 #ifndef __riscv
-	if (myproc()) {
-		virtio_queue_notify(dev->virtio_dev, &dev->requestq);
-		sleep(P2V(dest), &dev->lock);
-	} else {
+	pushcli();
+	unsigned int cpu = cpuid();
+	popcli();
+	return dev->queue[cpu % dev->num_queues];
+#else
+	return dev->queue[0];
 #endif
-		virtio_queue_notify_wait(dev->virtio_dev, &dev->requestq);
+}
+
+// Queue req, which completes by calling req->complete. req->header.type,
+// req->header.sector, req->count and req->buf must be set.
+void virtio_blk_submit(struct VirtioBlockDevice *dev, struct VirtioBlockRequest *req) {
+	struct VirtioBlockQueue *q = virtio_blk_queue(dev);
+	req->done = 0;
+	req->start = virtio_blk_time();
+	req->queue = q;
+	acquire(&q->lock);
+	q->stats.requests++;
+	virtio_blk_queue_pending(q, req);
+	virtio_blk_dispatch(q);
+	release(&q->lock);
+}
+
+static void virtio_blk_wake(struct VirtioBlockRequest *req) {
 #ifndef __riscv
-	}
+	wakeup(req);
 #endif
 }
 
-int virtio_blk_read(void *private, unsigned int begin, int count, void *buf) {
-	// check buf for DMA
+// submit a request and wait for it
+static int virtio_blk_rw(
+	struct VirtioBlockDevice *dev, int type, unsigned int begin, int count, phyaddr_t buf
+) {
+	struct VirtioBlockRequest *req = virtio_blk_alloc_request();
+	req->header.type = type;
+	req->header.sector = begin;
+	req->count = count;
+	req->buf = buf;
+	req->complete = virtio_blk_wake;
+	virtio_blk_submit(dev, req);
+
+	struct VirtioBlockQueue *q = req->queue;
+	acquire(&q->lock);
+	while (!req->done) {
+// do not sleep at boot time
+#ifndef __riscv
+		if (myproc()) {
+			sleep(req, &q->lock);
+			continue;
+		}
+#endif
+		virtio_blk_reap(q);
+	}
+	release(&q->lock);
+	int status = req->status;
+	virtio_blk_free_request(req);
+	return status;
+}
+
+// check buf for DMA
+static void virtio_blk_check(unsigned int count, const void *buf) {
 	if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
 		(phyaddr_t)buf % PGSIZE) {
 		panic("virtio dma");
 	}
-	if (count == 0 || count > 8) {
+	if (count == 0 || count > VIRTIO_BLK_MAX_SECTORS) {
 		panic("virtio count");
 	}
-	phyaddr_t dest = V2P(buf);
-	struct VirtioBlockDevice *dev = private;
-	uint8_t status;
-	// start request
-	acquire(&dev->lock);
-	virtio_blk_req(dev, VIRTIO_BLK_T_IN, begin, count, dest, &status);
-	release(&dev->lock);
-	if (status) {
+}
+
+int virtio_blk_read(void *private, unsigned int begin, int count, void *buf) {
+	virtio_blk_check(count, buf);
+	if (virtio_blk_rw(private, VIRTIO_BLK_T_IN, begin, count, V2P(buf))) {
 		return ERROR_READ_FAIL;
 	}
 	return 0;
 }
 
 int virtio_blk_write(void *private, unsigned int begin, int count, const void *buf) {
-	// check buf for DMA
-	if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
-		(phyaddr_t)buf % PGSIZE) {
-		panic("virtio dma");
+	virtio_blk_check(count, buf);
+	if (virtio_blk_rw(private, VIRTIO_BLK_T_OUT, begin, count, V2P(buf))) {
+		return ERROR_WRITE_FAIL;
 	}
-	if (count == 0 || count > 8) {
-		panic("virtio count");
-	}
-	phyaddr_t dest = V2P(buf);
+	return 0;
+}
+
+static void virtio_blk_get_stats(void *private, struct BlockQueueStats *stats) {
 	struct VirtioBlockDevice *dev = private;
-	uint8_t status;
-	// start request
-	acquire(&dev->lock);
-	virtio_blk_req(dev, VIRTIO_BLK_T_OUT, begin, count, dest, &status);
-	release(&dev->lock);
-	if (status) {
-		return ERROR_READ_FAIL;
+	stats->queues = dev->num_queues;
+	for (unsigned int i = 0; i < dev->num_queues; i++) {
+		struct VirtioBlockQueue *q = dev->queue[i];
+		acquire(&q->lock);
+		stats->depth += q->stats.depth;
+		if (q->stats.max_depth > stats->max_depth) {
+			stats->max_depth = q->stats.max_depth;
+		}
+		stats->requests += q->stats.requests;
+		stats->merged += q->stats.merged;
+		stats->completed += q->stats.completed;
+		stats->errors += q->stats.errors;
+		stats->sectors += q->stats.sectors;
+		for (int j = 0; j < BLOCK_HIST_SIZE; j++) {
+			stats->depth_hist[j] += q->stats.depth_hist[j];
+			stats->latency_hist[j] += q->stats.latency_hist[j];
+		}
+		release(&q->lock);
 	}
-	return 0;
 }
 
 const struct BlockDeviceDriver virtio_blk_block_driver = {
 	.block_read = virtio_blk_read,
 	.block_write = virtio_blk_write,
+	.max_sectors = VIRTIO_BLK_MAX_SECTORS,
+	.get_stats = virtio_blk_get_stats,
 };
 
 static struct VirtioBlockDevice *virtio_blk_alloc_dev(void) {
-	struct VirtioBlockDevice *dev = kalloc();
+	struct VirtioBlockDevice *dev = kmalloc(sizeof(struct VirtioBlockDevice));
 	memset(dev, 0, sizeof(struct VirtioBlockDevice));
 	return dev;
 }
 
-static void virtio_blk_requestq_intr(struct VirtioQueue *queue) {
-	struct VirtioBlockDevice *dev = queue->virtio_dev->private;
-
-	acquire(&dev->lock);
-	static unsigned short last = 0;
-	for (; last != queue->used->idx; last++) {
-		unsigned int id = queue->used->ring[last % queue->size].id;
-		volatile struct VirtqDesc *desc = &queue->desc[id];
-		if (desc->flags & VIRTQ_DESC_F_NEXT) {
-			desc = &queue->desc[desc->next];
-#ifndef __riscv
-			wakeup(P2V((phyaddr_t)desc->addr));
-#endif
-		}
-		virtio_free_desc(queue, id);
-	}
-	release(&dev->lock);
-}
-
 static void virtio_blk_dev_init(struct VirtioDevice *virtio_dev, unsigned int features) {
 	struct VirtioBlockDevice *dev = virtio_blk_alloc_dev();
 	virtio_dev->private = dev;
 	dev->virtio_dev = virtio_dev;
 	volatile struct VirtioBlockConfig *blkcfg = dev->virtio_dev->devcfg;
-	// initialize lock
-	initlock(&dev->lock, "virtio-blk");
-	acquire(&dev->lock);
-	virtio_init_queue(dev->virtio_dev, &dev->requestq, 0, virtio_blk_requestq_intr);
+
+	// a queue for each CPU if the device has enough
+	dev->num_queues = 1;
+	if (features & VIRTIO_BLK_F_MQ) {
+		dev->num_queues = blkcfg->num_queues;
+#ifndef __riscv
+		if (dev->num_queues > ncpu) {
+			dev->num_queues = ncpu;
+		}
+#endif
+		if (dev->num_queues > VIRTIO_BLK_QUEUE_MAX) {
+			dev->num_queues = VIRTIO_BLK_QUEUE_MAX;
+		}
+	}
+	dev->seg_max = VIRTIO_BLK_MERGE_SEGMENTS;
+	if ((features & VIRTIO_BLK_F_SEG_MAX) && blkcfg->seg_max < dev->seg_max) {
+		dev->seg_max = blkcfg->seg_max ? blkcfg->seg_max : 1;
+	}
+	for (unsigned int i = 0; i < dev->num_queues; i++) {
+		struct VirtioBlockQueue *q = kmalloc(sizeof(struct VirtioBlockQueue));
+		memset(q, 0, sizeof(struct VirtioBlockQueue));
+		q->dev = dev;
+		initlock(&q->lock, "virtio-blk");
+		// completions are taken on the CPU submitting to the queue
+		int cpu = dev->num_queues > 1 ? (int)i : MSI_CPU_ANY;
+		virtio_init_queue_cpu(dev->virtio_dev, &q->vq, i, cpu, virtio_blk_requestq_intr);
+		dev->queue[i] = q;
+	}
 	// print a message
 	cprintf(
 		"[virtio-blk] Virtio Block device capacity %lld "
-		"blk_size %d\n",
-
+		"blk_size %d queues %d\n",
 		blkcfg->capacity,
-		blkcfg->blk_size
+		blkcfg->blk_size,
+		dev->num_queues
 	);
-	release(&dev->lock);
 	hal_block_register_device("virtio-blk", dev, &virtio_blk_block_driver);
 }
 
@@ -179,10 +344,12 @@ const struct VirtioDriver virtio_blk_virtio_driver = {
 	.name = "virtio-blk",
 	.legacy_device_id = 0x1001,
 	.device_id = 2,
-	.features = VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE,
+	.features = VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_MQ,
 	.init = virtio_blk_dev_init,
 };
 
 void virtio_blk_init(void) {
+	virtio_blk_request_cache =
+		kmem_cache_create("virtio-blk-request", sizeof(struct VirtioBlockRequest));
 	virtio_register_driver(&virtio_blk_virtio_driver);
 }
@@ -2,17 +2,62 @@
 #define _DRIVER_VIRTIO_BLK_H
 
 #include <common/spinlock.h>
+#include <hal/hal.h>
 
+#include "virtio-regs.h"
 #include "virtio.h"
 
+#define VIRTIO_BLK_QUEUE_MAX VIRTIO_MAX_NUM_VIRTQUEUE // one per CPU at most
+#define VIRTIO_BLK_MAX_SECTORS 256 // largest request taken from the block layer
+#define VIRTIO_BLK_MERGE_SECTORS 1024 // largest request after merging
+#define VIRTIO_BLK_MERGE_SEGMENTS 32 // data buffers of a request after merging
+
+struct VirtioBlockQueue;
+
+// A block request, allocated with virtio_blk_alloc_request(). complete is
+// called with the queue lock held once the device finished it, it must not
+// sleep. Requests for adjacent sectors that wait for room on the ring are
+// merged and sent to the device as one.
+struct VirtioBlockRequest {
+	struct {
+		uint32_t type;
+		uint32_t reserved;
+		uint64_t sector;
+	} __attribute__((packed)) header; // read by the device
+	uint8_t status; // written by the device
+	int done;
+	unsigned int count; // sectors
+	phyaddr_t buf; // physically contiguous
+	void (*complete)(struct VirtioBlockRequest *req);
+	void *private;
+	struct VirtioBlockQueue *queue; // the request was submitted to
+	struct VirtioBlockRequest *next; // pending list, then the requests merged with this one
+	unsigned int ndesc; // descriptors of the merged request
+	unsigned long long start; // TSC when submitted
+};
+
+struct VirtioBlockDevice;
+
+struct VirtioBlockQueue {
+	struct VirtioQueue vq; // first, the interrupt handler is passed a pointer to it
+	struct VirtioBlockDevice *dev;
+	struct spinlock lock;
+	struct VirtioBlockRequest *pending, *pending_tail; // waiting for descriptors
+	struct BlockQueueStats stats;
+};
+
 struct VirtioBlockDevice {
 	struct VirtioDevice *virtio_dev;
-	struct VirtioQueue requestq;
-	struct spinlock lock;
+	unsigned int num_queues;
+	unsigned int seg_max; // data buffers per request
+	struct VirtioBlockQueue *queue[VIRTIO_BLK_QUEUE_MAX];
 };
 
 // virtio-blk.c
 void virtio_blk_init(void);
+struct VirtioBlockRequest *virtio_blk_alloc_request(void);
+void virtio_blk_free_request(struct VirtioBlockRequest *req);
+void virtio_blk_submit(struct VirtioBlockDevice *dev, struct VirtioBlockRequest *req);
 int virtio_blk_read(void *private, unsigned int begin, int count, void *buf);
 int virtio_blk_write(void *private, unsigned int begin, int count, const void *buf);
 
@@ -5,6 +5,9 @@
 
 #define VIRTIO_QUEUE_SIZE_MAX 256
 
+/* Ring features of the first feature word */
+#define VIRTIO_F_EVENT_IDX (1 << 29)
+
 struct VirtqDesc {
 	/* Address (guest-physical). */
 	uint64_t addr;
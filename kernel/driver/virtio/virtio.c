@@ -28,6 +28,12 @@
 
 #define VIRTIO_PCI_USE_MSIX
 
+struct VirtioDescState {
+	void *token; // of the chain starting here
+	uint16_t ndesc; // descriptors of the chain starting here
+	uint16_t next; // free list
+};
+
 struct VirtioDevice virtio_device_table[VIRTIO_DEVICE_TABLE_SIZE];
 
 static void virtio_read_cap(const struct PciAddress *addr, struct VirtioDevice *dev) {
@@ -72,11 +78,15 @@ static void virtio_read_cap(const struct PciAddress *addr, struct VirtioDevice *
 
 static unsigned int virtio_set_feature(struct VirtioDevice *dev, unsigned int feature) {
 	dev->cmcfg->device_status |= VIRTIO_STATUS_DRIVER;
-	dev->cmcfg->driver_feature = dev->cmcfg->device_feature & feature;
+	// the device features the driver asked for and the ring features
+	dev->cmcfg->device_feature_select = 0;
+	dev->cmcfg->driver_feature_select = 0;
+	dev->cmcfg->driver_feature = dev->cmcfg->device_feature & (feature | VIRTIO_F_EVENT_IDX);
 	unsigned int ack_feature = dev->cmcfg->driver_feature;
+	dev->event_idx = (ack_feature & VIRTIO_F_EVENT_IDX) != 0;
 	dev->cmcfg->device_status |= VIRTIO_STATUS_FEATURES_OK;
 	dev->cmcfg->device_status |= VIRTIO_STATUS_DRIVER_OK;
-	return ack_feature;
+	return ack_feature & ~VIRTIO_F_EVENT_IDX;
 }
 
 /*
@@ -102,11 +112,15 @@ static void virtio_add_virtq_to_dev(struct VirtioDevice *dev, struct VirtioQueue
 	panic("virtio only support max 8 virtqueue");
 }
 
-void virtio_init_queue(
-	struct VirtioDevice *dev, struct VirtioQueue *queue, unsigned int queue_n,
+// Set up virtqueue queue_n, its interrupt is taken on cpu or on the least
+// loaded CPU if cpu is MSI_CPU_ANY
+void virtio_init_queue_cpu(
+	struct VirtioDevice *dev, struct VirtioQueue *queue, unsigned int queue_n, int cpu,
 	void (*intr_handler)(struct VirtioQueue *)
 ) {
 	queue->virtio_dev = dev;
+	queue->index = queue_n;
+	queue->event_idx = dev->event_idx;
 	virtio_add_virtq_to_dev(dev, queue);
 	// allocate queue memory
 	queue->desc = kalloc();
@@ -124,10 +138,17 @@ void virtio_init_queue(
 	queue->size = dev->cmcfg->queue_size;
 	queue->notify = dev->notify_begin + dev->cmcfg->queue_notify_off * dev->notify_off_multiplier;
 	queue->intr_handler = intr_handler;
+	// all descriptors free
+	queue->state = kmalloc(sizeof(struct VirtioDescState) * queue->size);
+	for (int i = 0; i < queue->size; i++) {
+		queue->state[i].next = i + 1;
+	}
+	queue->num_free = queue->size;
+	queue->free_head = 0;
 // config MSI-X
 #ifdef VIRTIO_PCI_USE_MSIX
 	struct MSIMessage msix_msg;
-	if (msi_alloc_vector(&msix_msg, virtio_pci_queue_msix_handler, queue) == 0) {
+	if (msi_alloc_vector_cpu(&msix_msg, cpu, virtio_pci_queue_msix_handler, queue) == 0) {
 		cprintf("[virtio] MSI-X out MSI vector\n");
 	}
 	pci_msix_set_message(dev->pcidev, queue_n, &msix_msg);
@@ -140,47 +161,122 @@ void virtio_init_queue(
 	dev->cmcfg->queue_enable = 1;
 }
 
-void virtio_queue_notify(struct VirtioDevice *dev, struct VirtioQueue *queue) {
-	*queue->notify = 0;
+void virtio_init_queue(
+	struct VirtioDevice *dev, struct VirtioQueue *queue, unsigned int queue_n,
+	void (*intr_handler)(struct VirtioQueue *)
+) {
+	virtio_init_queue_cpu(dev, queue, queue_n, MSI_CPU_ANY, intr_handler);
 }
 
-void virtio_queue_notify_wait(struct VirtioDevice *dev, struct VirtioQueue *queue) {
-	int prev = queue->used->idx;
-	*queue->notify = 0;
-	while (prev == queue->used->idx) {}
-}
+// Descriptors are allocated from a free list linked through state[].next,
+// never through the descriptors the device reads.
 
-void virtio_queue_avail_insert(struct VirtioQueue *queue, int desc) {
-	queue->avail->ring[queue->avail->idx % queue->size] = desc;
-	queue->avail->idx++;
+// need an event at index event after moving from old to new
+static inline int virtio_need_event(uint16_t event, uint16_t new, uint16_t old) {
+	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
 }
 
-int *virtio_alloc_desc(struct VirtioQueue *queue, int *desc, int num) {
+// Add a chain of num buffers to the queue, it is made available to the
+// device by the next virtio_queue_kick(). token is returned by
+// virtio_queue_get() when the device is done with it. Return -1 if there
+// are not enough free descriptors.
+int virtio_queue_add(
+	struct VirtioQueue *queue, const struct VirtioBuffer *buf, int num, void *token
+) {
+	if (num <= 0 || (unsigned int)num > queue->num_free) {
+		return -1;
+	}
+	queue->num_free -= num;
+	uint16_t head = queue->free_head, d = head;
 	for (int i = 0; i < num; i++) {
-		desc[i] = -1;
-		for (int j = 0; j < queue->size; j++) {
-			if (queue->desc[j].addr == 0) {
-				queue->desc[j].addr = 0xffffffff;
-				desc[i] = j;
-				break;
-			}
+		uint16_t cur = d;
+		d = queue->state[cur].next;
+		queue->desc[cur].addr = buf[i].addr;
+		queue->desc[cur].len = buf[i].len;
+		queue->desc[cur].flags = buf[i].write ? VIRTQ_DESC_F_WRITE : 0;
+		if (i + 1 < num) {
+			queue->desc[cur].flags |= VIRTQ_DESC_F_NEXT;
+			queue->desc[cur].next = d;
+		}
+	}
+	queue->free_head = d;
+	queue->state[head].token = token;
+	queue->state[head].ndesc = num;
+	// published by virtio_queue_kick()
+	queue->avail->ring[queue->avail_idx % queue->size] = head;
+	queue->avail_idx++;
+	queue->num_added++;
+	return 0;
+}
+
+// Publish the chains added since the last kick and notify the device
+// unless it said it does not need to be.
+void virtio_queue_kick(struct VirtioQueue *queue) {
+	if (!queue->num_added) {
+		return;
+	}
+	int notify;
+	uint16_t new = queue->avail_idx, old = new - queue->num_added;
+	// ring entries before the index, the index before the device event
+	__sync_synchronize();
+	queue->avail->idx = new;
+	__sync_synchronize();
+	if (queue->event_idx) {
+		// avail_event follows the used ring
+		uint16_t event = *(volatile uint16_t *)&queue->used->ring[queue->size];
+		notify = virtio_need_event(event, new, old);
+	} else {
+		notify = !(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	}
+	queue->num_added = 0;
+	if (notify) {
+		*queue->notify = queue->index;
+		queue->notifications++;
+	} else {
+		queue->suppressed++;
+	}
+}
+
+// Take a chain the device is done with off the queue and return its
+// token, or 0 if there is none. len is set to the bytes the device wrote.
+// Finding the queue empty asks the device to interrupt on the next chain.
+void *virtio_queue_get(struct VirtioQueue *queue, unsigned int *len) {
+	if (queue->last_used == queue->used->idx) {
+		if (!queue->event_idx) {
+			return 0;
 		}
-		if (desc[i] == -1) {
+		// interrupt when the next chain is used, then look again in case
+		// the device used one before it saw the event
+		queue->avail->ring[queue->size] = queue->last_used; // used_event
+		__sync_synchronize();
+		if (queue->last_used == queue->used->idx) {
 			return 0;
 		}
 	}
-	return desc;
+	// the ring entry after the index
+	__sync_synchronize();
+	volatile struct virtq_used_elem *elem = &queue->used->ring[queue->last_used % queue->size];
+	uint16_t head = elem->id;
+	if (len) {
+		*len = elem->len;
+	}
+	queue->last_used++;
+	// free the chain, its descriptors are still linked in the free list order
+	uint16_t tail = head;
+	for (int i = 1; i < queue->state[head].ndesc; i++) {
+		tail = queue->state[tail].next;
+	}
+	queue->state[tail].next = queue->free_head;
+	queue->free_head = head;
+	queue->num_free += queue->state[head].ndesc;
+	return queue->state[head].token;
 }
 
-void virtio_free_desc(struct VirtioQueue *queue, int desc) {
-	do {
-		queue->desc[desc].addr = 0;
-		if (queue->desc[desc].flags & VIRTQ_DESC_F_NEXT) {
-			desc = queue->desc[desc].next;
-		} else {
-			desc = -1;
-		}
-	} while (desc != -1);
+// Poll for a chain for drivers that wait for each command synchronously
+void *virtio_queue_wait(struct VirtioQueue *queue, unsigned int *len) {
+	void *token;
+	while ((token = virtio_queue_get(queue, len)) == 0) {}
+	return token;
 }
 
 #ifndef VIRTIO_PCI_USE_MSIX
@@ -330,5 +426,18 @@ void virtio_print_devices(void) {
 				);
 			}
 		}
+		for (int j = 0; j < VIRTIO_MAX_NUM_VIRTQUEUE; j++) {
+			struct VirtioQueue *queue = virtio_device_table[i].virtqueue[j];
+			if (queue) {
+				cprintf(
+					"  queue %d size %d%s notifications %d suppressed %d\n",
+					queue->index,
+					queue->size,
+					queue->event_idx ? " event-idx" : "",
+					queue->notifications,
+					queue->suppressed
+				);
+			}
+		}
 	}
 }
@@ -38,6 +38,7 @@ struct VirtioDevice {
 	struct {
 		unsigned int transport_is_pci : 1;
 		unsigned int is_legacy : 1;
+		unsigned int event_idx : 1; // VIRTIO_F_EVENT_IDX negotiated
 	};
 	struct VirtioQueue *virtqueue[VIRTIO_MAX_NUM_VIRTQUEUE];
 	// registers
@@ -56,6 +57,10 @@ struct VirtioDriver {
 	void (*uninit)(struct VirtioDevice *);
 };
 
+// A split virtqueue. Drivers add chains of buffers with virtio_queue_add(),
+// tell the device about all of them at once with virtio_queue_kick() and
+// take the chains it finished back with virtio_queue_get(). The caller
+// serializes access to a queue.
 struct VirtioQueue {
 	struct VirtioDevice *virtio_dev;
 	void (*intr_handler)(struct VirtioQueue *);
@@ -64,6 +69,23 @@ struct VirtioQueue {
 	volatile struct VirtqAvail *avail;
 	volatile struct VirtqUsed *used;
 	volatile unsigned int *notify;
+	// driver state
+	unsigned int index; // queue number
+	struct VirtioDescState *state; // by descriptor
+	unsigned int num_free; // free descriptors
+	uint16_t free_head; // first free descriptor
+	uint16_t avail_idx; // next avail ring entry
+	uint16_t num_added; // avail ring entries added since the last kick
+	uint16_t last_used; // next used ring entry
+	uint8_t event_idx;
+	unsigned int notifications, suppressed; // doorbells rung and skipped
+};
+
+// a buffer of a descriptor chain
+struct VirtioBuffer {
+	phyaddr_t addr;
+	unsigned int len;
+	int write; // written by the device
 };
 
 #define VIRTIO_DEVICE_TABLE_SIZE 16
@@ -74,11 +96,16 @@ void virtio_init_queue(
 	struct VirtioDevice *dev, struct VirtioQueue *queue, unsigned int queue_n,
 	void (*intr_handler)(struct VirtioQueue *)
 );
-void virtio_queue_notify(struct VirtioDevice *dev, struct VirtioQueue *queue);
-void virtio_queue_notify_wait(struct VirtioDevice *dev, struct VirtioQueue *queue);
-void virtio_queue_avail_insert(struct VirtioQueue *queue, int desc);
-int *virtio_alloc_desc(struct VirtioQueue *queue, int *desc, int num);
-void virtio_free_desc(struct VirtioQueue *queue, int desc);
+void virtio_init_queue_cpu(
+	struct VirtioDevice *dev, struct VirtioQueue *queue, unsigned int queue_n, int cpu,
+	void (*intr_handler)(struct VirtioQueue *)
+);
+int virtio_queue_add(
+	struct VirtioQueue *queue, const struct VirtioBuffer *buf, int num, void *token
+);
+void virtio_queue_kick(struct VirtioQueue *queue);
+void *virtio_queue_get(struct VirtioQueue *queue, unsigned int *len);
+void *virtio_queue_wait(struct VirtioQueue *queue, unsigned int *len);
 void virtio_register_driver(const struct VirtioDriver *driver);
 void virtio_init(void);
 void virtio_print_devices(void);
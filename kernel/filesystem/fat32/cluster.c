@@ -30,134 +30,186 @@ int fat32_cluster_to_sector(struct FAT32Private *priv, unsigned int cluster) {
 		   (priv->boot_sector->fat_number) * (priv->boot_sector->fat_size);
 }
 
-int fat32_read_cluster(
-	struct FAT32Private *priv, void *dest, unsigned int cluster, unsigned int begin,
+// Data is moved in runs of consecutive sectors. Partial sectors at either end
+// go through the block cache, the full sectors in between are transferred
+// with a single request, straight into the caller's buffer when it can be
+// used for DMA. Full sectors are written without reading them first.
+
+static int fat32_read_sectors(
+	struct FAT32Private *priv, void *dest, unsigned int sector, unsigned int begin,
 	unsigned int size
 ) {
-	void *sect = kalloc();
+	sector += begin / SECTORSIZE;
+	begin %= SECTORSIZE;
 	unsigned int off = 0;
-	while (off < size) {
-		int copysize;
-		if ((begin + off) / SECTORSIZE < (begin + size) / SECTORSIZE) {
-			copysize = ((begin + off) / SECTORSIZE + 1) * SECTORSIZE - (begin + off);
-		} else {
-			copysize = size - off;
+	if (begin || size < SECTORSIZE) {
+		void *sect = kmalloc(SECTORSIZE);
+		off = SECTORSIZE - begin < size ? SECTORSIZE - begin : size;
+		if (hal_partition_read(priv->partition_id, sector, 1, sect) < 0) {
+			kmfree(sect);
+			return ERROR_READ_FAIL;
+		}
+		memmove(dest, sect + begin, off);
+		kmfree(sect);
+		sector++;
+	}
+	unsigned int full = (size - off) / SECTORSIZE;
+	if (full) {
+		if (hal_partition_read(priv->partition_id, sector, full, dest + off) < 0) {
+			return ERROR_READ_FAIL;
 		}
-		unsigned int sector = fat32_cluster_to_sector(priv, cluster) + (begin + off) / SECTORSIZE;
+		off += full * SECTORSIZE;
+		sector += full;
+	}
+	if (off < size) {
+		void *sect = kmalloc(SECTORSIZE);
 		if (hal_partition_read(priv->partition_id, sector, 1, sect) < 0) {
-			kfree(sect);
+			kmfree(sect);
 			return ERROR_READ_FAIL;
 		}
-		memmove(dest + off, sect + (begin + off) % SECTORSIZE, copysize);
-		off += copysize;
+		memmove(dest + off, sect, size - off);
+		kmfree(sect);
 	}
-	kfree(sect);
 	return 0;
 }
 
-int fat32_read(
-	void *private, unsigned int cluster, void *buf, unsigned int offset, unsigned int size
+static int fat32_write_partial_sector(
+	struct FAT32Private *priv, const void *src, unsigned int sector, unsigned int begin,
+	unsigned int size
 ) {
-	struct FAT32Private *priv = private;
-	int clussize = priv->boot_sector->sector_per_cluster * SECTORSIZE;
+	void *sect = kmalloc(SECTORSIZE);
+	if (hal_partition_read(priv->partition_id, sector, 1, sect) < 0) {
+		kmfree(sect);
+		return ERROR_READ_FAIL;
+	}
+	memmove(sect + begin, src, size);
+	if (hal_partition_write(priv->partition_id, sector, 1, sect) < 0) {
+		kmfree(sect);
+		return ERROR_WRITE_FAIL;
+	}
+	kmfree(sect);
+	return 0;
+}
+
+static int fat32_write_sectors(
+	struct FAT32Private *priv, const void *src, unsigned int sector, unsigned int begin,
+	unsigned int size
+) {
+	sector += begin / SECTORSIZE;
+	begin %= SECTORSIZE;
 	unsigned int off = 0;
-	while (off < size) {
-		int copysize;
-		if ((offset + off) / clussize < (offset + size) / clussize) {
-			copysize = ((offset + off) / clussize + 1) * clussize - (offset + off);
-		} else {
-			copysize = size - off;
+	if (begin || size < SECTORSIZE) {
+		off = SECTORSIZE - begin < size ? SECTORSIZE - begin : size;
+		int ret = fat32_write_partial_sector(priv, src, sector, begin, off);
+		if (ret < 0) {
+			return ret;
 		}
-		unsigned int clus = fat32_offset_cluster(priv, cluster, offset + off);
-		if (fat32_read_cluster(priv, buf + off, clus, (offset + off) % clussize, copysize) < 0) {
-			return ERROR_READ_FAIL;
+		sector++;
+	}
+	unsigned int full = (size - off) / SECTORSIZE;
+	if (full) {
+		if (hal_partition_write(priv->partition_id, sector, full, src + off) < 0) {
+			return ERROR_WRITE_FAIL;
 		}
-		off += copysize;
+		off += full * SECTORSIZE;
+		sector += full;
 	}
-	return size;
+	if (off < size) {
+		return fat32_write_partial_sector(priv, src + off, sector, 0, size - off);
+	}
+	return 0;
 }
 
-int fat32_write_cluster(
-	struct FAT32Private *priv, const void *src, unsigned int cluster, unsigned int begin,
+int fat32_read_cluster(
+	struct FAT32Private *priv, void *dest, unsigned int cluster, unsigned int begin,
 	unsigned int size
 ) {
-	void *sect = kalloc();
+	return fat32_read_sectors(priv, dest, fat32_cluster_to_sector(priv, cluster), begin, size);
+}
+
+int fat32_read(
+	void *private, unsigned int cluster, void *buf, unsigned int offset, unsigned int size
+) {
+	struct FAT32Private *priv = private;
+	unsigned int clussize = priv->boot_sector->sector_per_cluster * SECTORSIZE;
 	unsigned int off = 0;
 	while (off < size) {
-		int copysize;
-		if ((begin + off) / SECTORSIZE < (begin + size) / SECTORSIZE) {
-			copysize = ((begin + off) / SECTORSIZE + 1) * SECTORSIZE - (begin + off);
-		} else {
+		// read up to the end of the run of contiguous clusters
+		unsigned int count;
+		unsigned int clus = fat32_offset_extent(priv, cluster, offset + off, &count);
+		if (!clus) {
+			return ERROR_READ_FAIL;
+		}
+		unsigned int begin = (offset + off) % clussize;
+		unsigned int copysize = count * clussize - begin;
+		if (copysize > size - off) {
 			copysize = size - off;
 		}
-		unsigned int sector = fat32_cluster_to_sector(priv, cluster) + (begin + off) / SECTORSIZE;
-		if (hal_partition_read(priv->partition_id, sector, 1, sect) < 0) {
-			kfree(sect);
+		if (fat32_read_sectors(
+				priv, buf + off, fat32_cluster_to_sector(priv, clus), begin, copysize
+			) < 0) {
 			return ERROR_READ_FAIL;
 		}
-		memmove(sect + (begin + off) % SECTORSIZE, src + off, copysize);
-		if (hal_partition_write(priv->partition_id, sector, 1, sect) < 0) {
-			kfree(sect);
-			return ERROR_WRITE_FAIL;
-		}
 		off += copysize;
 	}
-	kfree(sect);
-	return 0;
+	return size;
 }
 
-unsigned int fat32_allocate_cluster(struct FAT32Private *priv) {
-	unsigned int *buf = kalloc();
-	for (unsigned int fat = 0; fat < priv->boot_sector->fat_size; fat++) {
-		int sect = priv->boot_sector->reserved_sector + fat;
-		if (hal_partition_read(priv->partition_id, sect, 1, buf) < 0) {
-			return ERROR_READ_FAIL;
-		}
-		for (int i = 0; i < 128; i++) {
-			if (buf[i] == 0) {
-				buf[i] = 0x0fffffff;
-				// first FAT
-				if (hal_partition_write(priv->partition_id, sect, 1, buf) < 0) {
-					return ERROR_WRITE_FAIL;
-				}
-				// second FAT
-				if (hal_partition_write(
-						priv->partition_id, sect + priv->boot_sector->fat_size, 1, buf
-					) < 0) {
-					return ERROR_WRITE_FAIL;
-				}
-				kfree(buf);
-				return fat * 128 + i;
-			}
-		}
-	}
-	kfree(buf);
-	return 0;
+int fat32_write_cluster(
+	struct FAT32Private *priv, const void *src, unsigned int cluster, unsigned int begin,
+	unsigned int size
+) {
+	return fat32_write_sectors(priv, src, fat32_cluster_to_sector(priv, cluster), begin, size);
 }
 
 int fat32_write(
 	void *private, unsigned int cluster, const void *buf, unsigned int offset, unsigned int size
 ) {
 	struct FAT32Private *priv = private;
-	int clussize = priv->boot_sector->sector_per_cluster * SECTORSIZE;
+	unsigned int clussize = priv->boot_sector->sector_per_cluster * SECTORSIZE;
+	if (!size) {
+		return 0;
+	}
+	// grow the chain first so data goes out in runs as long as the layout allows
+	unsigned int last;
+	unsigned int len = fat32_chain_length(priv, cluster, &last);
+	unsigned int need = (offset + size - 1) / clussize + 1;
+	unsigned int old_last = last;
+	while (len < need) {
+		unsigned int count;
+		unsigned int clus = fat32_allocate_chain(priv, last, need - len, &count);
+		int ret = clus ? 0 : ERROR_OUT_OF_SPACE;
+		if (clus && fat32_append_cluster(priv, cluster, clus) < 0) {
+			if (fat32_fat_read(priv, last) != clus) {
+				fat32_free_chain(priv, clus);
+			}
+			ret = ERROR_WRITE_FAIL;
+		}
+		if (ret < 0) {
+			// give back the clusters linked by this call
+			if (old_last) {
+				fat32_truncate_chain(priv, old_last);
+			}
+			return ret;
+		}
+		len += count;
+		last = clus + count - 1;
+	}
 	unsigned int off = 0;
 	while (off < size) {
-		int copysize;
-		if ((offset + off) / clussize < (offset + size) / clussize) {
-			copysize = ((offset + off) / clussize + 1) * clussize - (offset + off);
-		} else {
-			copysize = size - off;
+		unsigned int count;
+		unsigned int clus = fat32_offset_extent(priv, cluster, offset + off, &count);
+		if (!clus) {
+			return ERROR_WRITE_FAIL;
 		}
-		unsigned int clus = fat32_offset_cluster(priv, cluster, offset + off);
-		if (clus == 0) { // end of cluster chain
-			if ((clus = fat32_allocate_cluster(priv)) < 0) {
-				return ERROR_OUT_OF_SPACE;
-			}
-			if (fat32_append_cluster(priv, cluster, clus) < 0) {
-				return ERROR_WRITE_FAIL;
-			}
+		unsigned int begin = (offset + off) % clussize;
+		unsigned int copysize = count * clussize - begin;
+		if (copysize > size - off) {
+			copysize = size - off;
 		}
-		if (fat32_write_cluster(priv, buf + off, clus, (offset + off) % clussize, copysize) < 0) {
+		if (fat32_write_sectors(
+				priv, buf + off, fat32_cluster_to_sector(priv, clus), begin, copysize
+			) < 0) {
 			return ERROR_WRITE_FAIL;
 		}
 		off += copysize;
@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+
 #include <common/errorcode.h>
 #include <defs.h>
 #include <hal/hal.h>
@@ -24,68 +25,502 @@
 #include "fat32-struct.h"
 #include "fat32.h"
 
-unsigned int fat32_fat_read(struct FAT32Private *priv, unsigned int current) {
-	uint32_t *buf = kalloc();
-	unsigned int sect = priv->boot_sector->reserved_sector + current / 128;
-	hal_partition_read(priv->partition_id, sect, 1, buf);
-	unsigned int val = buf[current % 128];
-	kfree(buf);
-	return val;
+#define FAT32_ENTRY_PER_PAGE (FAT32_FAT_CACHE_SECTORS * SECTORSIZE / 4)
+
+// The first FAT is kept in memory, loaded FAT32_FAT_CACHE_SECTORS sectors at
+// a time on first access. Updated sectors are marked dirty and written to
+// every FAT copy in batches by fat32_fat_flush(). A bitmap of free clusters
+// is built at mount time for allocation. Cluster chains are looked up
+// through extent maps, one per recently used first cluster. Static functions
+// below expect priv->fat_lock to be held.
+
+static inline int bitmap_test(const uint32_t *bitmap, unsigned int bit) {
+	return (bitmap[bit / 32] >> (bit % 32)) & 1;
 }
 
-unsigned int
-fat32_offset_cluster(struct FAT32Private *priv, unsigned int cluster, unsigned int offset) {
-	int n = offset / 512 / priv->boot_sector->sector_per_cluster;
-	while (n--) {
-		cluster = fat32_fat_read(priv, cluster);
-		if (cluster >= 0x0ffffff8) {
+static inline void bitmap_set(uint32_t *bitmap, unsigned int bit) {
+	bitmap[bit / 32] |= 1u << (bit % 32);
+}
+
+static inline void bitmap_clear(uint32_t *bitmap, unsigned int bit) {
+	bitmap[bit / 32] &= ~(1u << (bit % 32));
+}
+
+static uint32_t *fat32_bitmap_alloc(unsigned int bits) {
+	unsigned int pages = ((bits + 31) / 32 * 4 + PGSIZE - 1) / PGSIZE;
+	uint32_t *bitmap = pgalloc(pages);
+	memset(bitmap, 0, pages * PGSIZE);
+	return bitmap;
+}
+
+static uint32_t *fat32_fat_entry(struct FAT32Private *priv, unsigned int cluster) {
+	if (cluster >= priv->cluster_count) {
+		return 0;
+	}
+	unsigned int page = cluster / FAT32_ENTRY_PER_PAGE;
+	if (!priv->fat_cache[page]) {
+		uint32_t *buf = kalloc();
+		unsigned int sect = page * FAT32_FAT_CACHE_SECTORS;
+		unsigned int count = priv->boot_sector->fat_size - sect;
+		if (count > FAT32_FAT_CACHE_SECTORS) {
+			count = FAT32_FAT_CACHE_SECTORS;
+		}
+		if (hal_partition_read(
+				priv->partition_id, priv->boot_sector->reserved_sector + sect, count, buf
+			) < 0) {
+			kfree(buf);
 			return 0;
 		}
+		priv->fat_cache[page] = buf;
 	}
-	return cluster;
+	return &priv->fat_cache[page][cluster % FAT32_ENTRY_PER_PAGE];
 }
 
-int fat32_write_fat(struct FAT32Private *priv, unsigned int cluster, unsigned int data) {
-	uint32_t *buf = kalloc();
-	int sect = priv->boot_sector->reserved_sector + cluster / 128;
-	if (hal_partition_read(priv->partition_id, sect, 1, buf) < 0) {
-		kfree(buf);
+// a FAT entry that can't be read ends the chain
+static unsigned int fat32_fat_get(struct FAT32Private *priv, unsigned int cluster) {
+	uint32_t *ent = fat32_fat_entry(priv, cluster);
+	return ent ? *ent & 0x0fffffff : 0x0fffffff;
+}
+
+// write dirty FAT sectors to every FAT, consecutive ones in one request
+static int fat32_fat_flush(struct FAT32Private *priv) {
+	struct FAT32BootSector *bootsect = priv->boot_sector;
+	int ret = 0;
+	unsigned int sect = 0;
+	while (priv->fat_dirty_count && sect < bootsect->fat_size) {
+		if (!(priv->fat_dirty[sect / 32] >> (sect % 32))) {
+			sect = (sect / 32 + 1) * 32;
+			continue;
+		}
+		if (!bitmap_test(priv->fat_dirty, sect)) {
+			sect++;
+			continue;
+		}
+		// run of dirty sectors within one cache page
+		unsigned int n = 1;
+		while (sect + n < bootsect->fat_size && (sect + n) % FAT32_FAT_CACHE_SECTORS &&
+			   bitmap_test(priv->fat_dirty, sect + n)) {
+			n++;
+		}
+		void *buf = (void *)priv->fat_cache[sect / FAT32_FAT_CACHE_SECTORS] +
+					sect % FAT32_FAT_CACHE_SECTORS * SECTORSIZE;
+		for (int i = 0; i < bootsect->fat_number; i++) {
+			if (hal_partition_write(
+					priv->partition_id,
+					bootsect->reserved_sector + i * bootsect->fat_size + sect,
+					n,
+					buf
+				) < 0) {
+				ret = ERROR_WRITE_FAIL;
+			}
+		}
+		for (unsigned int i = 0; i < n; i++) {
+			bitmap_clear(priv->fat_dirty, sect + i);
+		}
+		priv->fat_dirty_count -= n;
+		sect += n;
+	}
+	return ret;
+}
+
+static int fat32_fat_set(struct FAT32Private *priv, unsigned int cluster, unsigned int data) {
+	uint32_t *ent = fat32_fat_entry(priv, cluster);
+	if (!ent) {
 		return ERROR_READ_FAIL;
 	}
-	buf[cluster % 128] = data;
-	// first fat
-	if (hal_partition_write(priv->partition_id, sect, 1, buf) < 0) {
-		kfree(buf);
-		return ERROR_WRITE_FAIL;
+	data &= 0x0fffffff;
+	// keep free cluster bitmap in sync
+	if (!(*ent & 0x0fffffff) && data) {
+		bitmap_clear(priv->free_map, cluster);
+		priv->free_count--;
+	} else if ((*ent & 0x0fffffff) && !data) {
+		bitmap_set(priv->free_map, cluster);
+		priv->free_count++;
+	}
+	*ent = (*ent & 0xf0000000) | data;
+
+	unsigned int sect = cluster / (SECTORSIZE / 4);
+	if (!bitmap_test(priv->fat_dirty, sect)) {
+		bitmap_set(priv->fat_dirty, sect);
+		priv->fat_dirty_count++;
+	}
+	if (priv->fat_dirty_count >= FAT32_FAT_FLUSH_BATCH) {
+		return fat32_fat_flush(priv);
 	}
-	// second fat
-	if (hal_partition_write(priv->partition_id, sect + priv->boot_sector->fat_size, 1, buf) < 0) {
-		kfree(buf);
-		return ERROR_WRITE_FAIL;
+	return 0;
+}
+
+void fat32_fat_cache_init(struct FAT32Private *priv) {
+	struct FAT32BootSector *bootsect = priv->boot_sector;
+	initsleeplock(&priv->fat_lock, "fat32");
+	unsigned int data_sectors = bootsect->total_sector - bootsect->reserved_sector -
+								bootsect->fat_number * bootsect->fat_size;
+	priv->cluster_count = data_sectors / bootsect->sector_per_cluster + 2;
+	if (priv->cluster_count > bootsect->fat_size * (SECTORSIZE / 4)) {
+		priv->cluster_count = bootsect->fat_size * (SECTORSIZE / 4);
+	}
+	priv->fat_cache_pages = (priv->cluster_count + FAT32_ENTRY_PER_PAGE - 1) / FAT32_ENTRY_PER_PAGE;
+	unsigned int ptr_pages = (priv->fat_cache_pages * sizeof(uint32_t *) + PGSIZE - 1) / PGSIZE;
+	priv->fat_cache = pgalloc(ptr_pages);
+	memset(priv->fat_cache, 0, ptr_pages * PGSIZE);
+	priv->fat_dirty = fat32_bitmap_alloc(bootsect->fat_size);
+	priv->fat_dirty_count = 0;
+	memset(priv->extent_map, 0, sizeof(priv->extent_map));
+	priv->extent_map_clock = 0;
+
+	// free cluster bitmap, this reads in the whole FAT
+	priv->free_map = fat32_bitmap_alloc(priv->cluster_count);
+	priv->free_count = 0;
+	for (unsigned int clus = 2; clus < priv->cluster_count; clus++) {
+		uint32_t *ent = fat32_fat_entry(priv, clus);
+		if (ent && !(*ent & 0x0fffffff)) {
+			bitmap_set(priv->free_map, clus);
+			priv->free_count++;
+		}
+	}
+	// FSInfo only gives a hint where to start looking
+	priv->next_free = 2;
+	struct FAT32FSInfo *fsinfo = kmalloc(SECTORSIZE);
+	if (bootsect->fsinfo &&
+		hal_partition_read(priv->partition_id, bootsect->fsinfo, 1, fsinfo) == 0 &&
+		fsinfo->lead_sig == 0x41615252 && fsinfo->struct_sig == 0x61417272 &&
+		fsinfo->next_free >= 2 && fsinfo->next_free < priv->cluster_count) {
+		priv->next_free = fsinfo->next_free;
+	}
+	kmfree(fsinfo);
+	cprintf("[fat32] %d of %d clusters free\n", priv->free_count, priv->cluster_count - 2);
+}
+
+static inline int fat32_chain_end(unsigned int cluster) {
+	return cluster < 2 || cluster >= 0x0ffffff8;
+}
+
+// append a cluster to the end of a map, return 0 if the map is full
+static int fat32_extent_map_add(struct FAT32ExtentMap *map, unsigned int cluster) {
+	struct FAT32Extent *last = map->num_extents ? &map->extent[map->num_extents - 1] : 0;
+	if (last && last->cluster + last->count == cluster) {
+		last->count++;
+	} else if (map->num_extents < FAT32_EXTENT_MAX) {
+		struct FAT32Extent *ext = &map->extent[map->num_extents++];
+		ext->offset = last ? last->offset + last->count : 0;
+		ext->cluster = cluster;
+		ext->count = 1;
+	} else {
+		return 0;
+	}
+	map->last_cluster = cluster;
+	return 1;
+}
+
+static void
+fat32_extent_map_build(struct FAT32Private *priv, struct FAT32ExtentMap *map, unsigned int first) {
+	map->first_cluster = first;
+	map->num_extents = 0;
+	map->complete = 0;
+	unsigned int clus = first;
+	for (unsigned int n = 0; n < priv->cluster_count; n++) {
+		if (!fat32_extent_map_add(map, clus)) {
+			return; // rest of the chain is walked on demand
+		}
+		clus = fat32_fat_get(priv, clus);
+		if (fat32_chain_end(clus)) {
+			map->complete = 1;
+			return;
+		}
+	}
+}
+
+static struct FAT32ExtentMap *fat32_extent_map_find(struct FAT32Private *priv, unsigned int first) {
+	for (int i = 0; i < FAT32_EXTENT_MAP_MAX; i++) {
+		if (priv->extent_map[i].first_cluster == first) {
+			priv->extent_map[i].last_use = ++priv->extent_map_clock;
+			return &priv->extent_map[i];
+		}
 	}
-	kfree(buf);
 	return 0;
 }
 
+static struct FAT32ExtentMap *fat32_extent_map_get(struct FAT32Private *priv, unsigned int first) {
+	struct FAT32ExtentMap *map = fat32_extent_map_find(priv, first);
+	if (map) {
+		return map;
+	}
+	// replace an unused or the least recently used map
+	map = &priv->extent_map[0];
+	for (int i = 0; i < FAT32_EXTENT_MAP_MAX; i++) {
+		if (!priv->extent_map[i].first_cluster) {
+			map = &priv->extent_map[i];
+			break;
+		}
+		if (priv->extent_map[i].last_use < map->last_use) {
+			map = &priv->extent_map[i];
+		}
+	}
+	if (!map->extent) {
+		map->extent = kmalloc(sizeof(struct FAT32Extent) * FAT32_EXTENT_MAX);
+	}
+	fat32_extent_map_build(priv, map, first);
+	map->last_use = ++priv->extent_map_clock;
+	return map;
+}
+
+static void fat32_extent_map_invalidate(struct FAT32Private *priv) {
+	for (int i = 0; i < FAT32_EXTENT_MAP_MAX; i++) {
+		priv->extent_map[i].first_cluster = 0;
+	}
+}
+
+unsigned int fat32_fat_read(struct FAT32Private *priv, unsigned int current) {
+	acquiresleep(&priv->fat_lock);
+	unsigned int val = fat32_fat_get(priv, current);
+	releasesleep(&priv->fat_lock);
+	return val;
+}
+
+unsigned int fat32_offset_extent(
+	struct FAT32Private *priv, unsigned int cluster, unsigned int offset, unsigned int *count
+) {
+	unsigned int n = offset / SECTORSIZE / priv->boot_sector->sector_per_cluster;
+	if (n == 0 && !count) {
+		return cluster;
+	}
+	if (fat32_chain_end(cluster) || cluster >= priv->cluster_count) {
+		return 0;
+	}
+
+	acquiresleep(&priv->fat_lock);
+	struct FAT32ExtentMap *map = fat32_extent_map_get(priv, cluster);
+	// last extent starting at or before n
+	unsigned int lo = 0, hi = map->num_extents;
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+		if (map->extent[mid].offset <= n) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	struct FAT32Extent *ext = &map->extent[lo];
+	unsigned int clus, run = 1;
+	if (n < ext->offset + ext->count) {
+		clus = ext->cluster + (n - ext->offset);
+		run = ext->offset + ext->count - n;
+	} else if (map->complete) {
+		clus = 0;
+	} else {
+		// beyond a full map, walk the rest of the chain
+		clus = map->last_cluster;
+		for (unsigned int i = ext->offset + ext->count - 1; i < n; i++) {
+			clus = fat32_fat_get(priv, clus);
+			if (fat32_chain_end(clus)) {
+				clus = 0;
+				break;
+			}
+		}
+	}
+	releasesleep(&priv->fat_lock);
+	if (count) {
+		*count = run;
+	}
+	return clus;
+}
+
+unsigned int
+fat32_offset_cluster(struct FAT32Private *priv, unsigned int cluster, unsigned int offset) {
+	return fat32_offset_extent(priv, cluster, offset, 0);
+}
+
+int fat32_write_fat(struct FAT32Private *priv, unsigned int cluster, unsigned int data) {
+	acquiresleep(&priv->fat_lock);
+	int ret = fat32_fat_set(priv, cluster, data);
+	fat32_extent_map_invalidate(priv);
+	if (ret == 0) {
+		ret = fat32_fat_flush(priv);
+	}
+	releasesleep(&priv->fat_lock);
+	return ret;
+}
+
 int fat32_append_cluster(
 	struct FAT32Private *priv, unsigned int begin_cluster, unsigned int end_cluster
 ) {
+	acquiresleep(&priv->fat_lock);
 	unsigned int clus = begin_cluster;
-	while (fat32_fat_read(priv, clus) < 0x0ffffff8) {
-		clus = fat32_fat_read(priv, clus);
+	struct FAT32ExtentMap *map = fat32_extent_map_find(priv, begin_cluster);
+	if (map && map->complete) {
+		clus = map->last_cluster;
+	} else {
+		for (unsigned int next; !fat32_chain_end(next = fat32_fat_get(priv, clus));) {
+			clus = next;
+		}
 	}
-	return fat32_write_fat(priv, clus, end_cluster);
+	int ret = fat32_fat_set(priv, clus, end_cluster);
+	if (ret == 0) {
+		// extend every map ending at the old end of chain
+		for (int i = 0; i < FAT32_EXTENT_MAP_MAX; i++) {
+			map = &priv->extent_map[i];
+			if (!map->first_cluster || !map->complete || map->last_cluster != clus) {
+				continue;
+			}
+			for (unsigned int c = end_cluster;; c = fat32_fat_get(priv, c)) {
+				if (fat32_chain_end(c)) {
+					break;
+				}
+				if (!fat32_extent_map_add(map, c)) {
+					map->complete = 0;
+					break;
+				}
+			}
+		}
+		ret = fat32_fat_flush(priv);
+	}
+	releasesleep(&priv->fat_lock);
+	return ret;
 }
 
 int fat32_free_chain(struct FAT32Private *priv, unsigned int cluster) {
+	if (fat32_chain_end(cluster)) {
+		return 0;
+	}
+	acquiresleep(&priv->fat_lock);
+	int ret = 0;
 	do {
 		// read it out and clear FAT entry
-		unsigned int clus = fat32_fat_read(priv, cluster);
-		if (fat32_write_fat(priv, cluster, 0) < 0) {
-			return ERROR_WRITE_FAIL;
+		unsigned int clus = fat32_fat_get(priv, cluster);
+		if (fat32_fat_set(priv, cluster, 0) < 0) {
+			ret = ERROR_WRITE_FAIL;
+			break;
 		}
 		// advance to next FAT entry
 		cluster = clus;
-	} while (cluster < 0x0ffffff8);
-	return 0;
+	} while (!fat32_chain_end(cluster));
+	// freed clusters may be part of any cached chain
+	fat32_extent_map_invalidate(priv);
+	if (fat32_fat_flush(priv) < 0) {
+		ret = ERROR_WRITE_FAIL;
+	}
+	releasesleep(&priv->fat_lock);
+	return ret;
+}
+
+// Make last the end of its chain and free the clusters that followed it
+int fat32_truncate_chain(struct FAT32Private *priv, unsigned int last) {
+	acquiresleep(&priv->fat_lock);
+	unsigned int next = fat32_fat_get(priv, last);
+	int ret = fat32_fat_set(priv, last, 0x0fffffff);
+	fat32_extent_map_invalidate(priv);
+	releasesleep(&priv->fat_lock);
+	if (ret < 0) {
+		return ret;
+	}
+	return fat32_free_chain(priv, next);
+}
+
+// length of the free run starting at a free cluster, up to max
+static unsigned int
+fat32_free_run(struct FAT32Private *priv, unsigned int cluster, unsigned int max) {
+	unsigned int len = 0;
+	while (len < max && cluster + len < priv->cluster_count &&
+		   bitmap_test(priv->free_map, cluster + len)) {
+		len++;
+	}
+	return len;
+}
+
+// Allocate up to want clusters linked as one chain and return the first one,
+// or 0 if the volume is full. The cluster after hint is taken if free so a
+// chain ending at hint keeps growing in place, otherwise a next-fit search
+// looks for a run of want free clusters and settles for the longest run seen.
+unsigned int fat32_allocate_chain(
+	struct FAT32Private *priv, unsigned int hint, unsigned int want, unsigned int *count
+) {
+	acquiresleep(&priv->fat_lock);
+	if (!priv->free_count || !want) {
+		releasesleep(&priv->fat_lock);
+		return 0;
+	}
+	unsigned int start = 0, len = 0;
+	if (hint >= 2 && hint + 1 < priv->cluster_count && bitmap_test(priv->free_map, hint + 1)) {
+		start = hint + 1;
+		len = fat32_free_run(priv, start, want);
+	} else {
+		unsigned int clus = priv->next_free;
+		unsigned int scanned = 0, total = priv->cluster_count - 2;
+		while (scanned < total && len < want) {
+			if (clus >= priv->cluster_count) {
+				clus = 2;
+			}
+			if (!priv->free_map[clus / 32]) { // no free cluster in this word
+				unsigned int skip = 32 - clus % 32;
+				clus += skip;
+				scanned += skip;
+				continue;
+			}
+			if (!bitmap_test(priv->free_map, clus)) {
+				clus++;
+				scanned++;
+				continue;
+			}
+			unsigned int run = fat32_free_run(priv, clus, want);
+			if (run > len) {
+				start = clus;
+				len = run;
+			}
+			clus += run;
+			scanned += run;
+		}
+	}
+	if (!len) {
+		releasesleep(&priv->fat_lock);
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < len; i++) {
+		unsigned int next = i + 1 < len ? start + i + 1 : 0x0fffffff;
+		if (fat32_fat_set(priv, start + i, next) < 0) {
+			// give back what was taken
+			for (unsigned int j = 0; j < i; j++) {
+				fat32_fat_set(priv, start + j, 0);
+			}
+			releasesleep(&priv->fat_lock);
+			return 0;
+		}
+	}
+	priv->next_free = start + len;
+	releasesleep(&priv->fat_lock);
+	*count = len;
+	return start;
+}
+
+unsigned int fat32_allocate_cluster(struct FAT32Private *priv) {
+	unsigned int count;
+	unsigned int clus = fat32_allocate_chain(priv, 0, 1, &count);
+	if (clus) {
+		acquiresleep(&priv->fat_lock);
+		fat32_fat_flush(priv);
+		releasesleep(&priv->fat_lock);
+	}
+	return clus;
+}
+
+unsigned int
+fat32_chain_length(struct FAT32Private *priv, unsigned int cluster, unsigned int *last) {
+	if (fat32_chain_end(cluster) || cluster >= priv->cluster_count) {
+		*last = 0;
+		return 0;
+	}
+	acquiresleep(&priv->fat_lock);
+	struct FAT32ExtentMap *map = fat32_extent_map_get(priv, cluster);
+	struct FAT32Extent *ext = &map->extent[map->num_extents - 1];
+	unsigned int len = ext->offset + ext->count;
+	unsigned int clus = map->last_cluster;
+	if (!map->complete) {
+		for (unsigned int next; !fat32_chain_end(next = fat32_fat_get(priv, clus));) {
+			clus = next;
+			len++;
+		}
+	}
+	releasesleep(&priv->fat_lock);
+	*last = clus;
+	return len;
 }
@@ -1,14 +1,49 @@
 #ifndef _FAT32_FAT32_H
 #define _FAT32_FAT32_H
 
+#include <common/sleeplock.h>
+#include <common/types.h>
 #include <filesystem/vfs/vfs.h>
 
 #define SECTORSIZE 512
 
+#define FAT32_FAT_CACHE_SECTORS 8 // FAT sectors loaded at once into a page
+#define FAT32_FAT_FLUSH_BATCH 64 // write back FAT once this many sectors are dirty
+#define FAT32_EXTENT_MAP_MAX 16 // extent maps cached per mount
+#define FAT32_EXTENT_MAX 170 // extents per map, fits in a kmalloc-2048 object
+
+// run of contiguous clusters, offset is counted in clusters from chain start
+struct FAT32Extent {
+	unsigned int offset;
+	unsigned int cluster;
+	unsigned int count;
+};
+
+// cluster chain of a file or directory as a sorted list of extents
+struct FAT32ExtentMap {
+	unsigned int first_cluster; // 0 if unused
+	unsigned int last_cluster; // last cluster mapped
+	unsigned int num_extents;
+	unsigned int complete; // whole chain is mapped, last_cluster ends it
+	unsigned int last_use;
+	struct FAT32Extent *extent;
+};
+
 struct FAT32Private {
 	unsigned int partition_id;
 	struct FAT32BootSector *boot_sector;
 	unsigned int mode, uid, gid;
+	unsigned int cluster_count; // number of FAT entries, including reserved ones
+	struct sleeplock fat_lock; // protects FAT cache and extent maps
+	uint32_t **fat_cache; // pages of the first FAT, loaded on first use
+	unsigned int fat_cache_pages;
+	uint32_t *fat_dirty; // bitmap of FAT sectors not yet written to the FATs
+	unsigned int fat_dirty_count;
+	uint32_t *free_map; // bitmap of free clusters
+	unsigned int free_count;
+	unsigned int next_free; // next-fit allocation starts here
+	struct FAT32ExtentMap extent_map[FAT32_EXTENT_MAP_MAX];
+	unsigned int extent_map_clock;
 };
 
 // cluster.c
@@ -24,7 +59,6 @@ int fat32_write_cluster(
 	struct FAT32Private *priv, const void *src, unsigned int cluster, unsigned int begin,
 	unsigned int size
 );
-unsigned int fat32_allocate_cluster(struct FAT32Private *priv);
 int fat32_write(
 	void *private, unsigned int cluster, const void *buf, unsigned int offset, unsigned int size
 );
@@ -41,7 +75,11 @@ int fat32_update_size(void *private, struct VfsPath path, unsigned int size);
 int fat32_file_create(void *private, struct VfsPath path);
 
 // fat.c
+void fat32_fat_cache_init(struct FAT32Private *priv);
 unsigned int fat32_fat_read(struct FAT32Private *priv, unsigned int current);
+unsigned int fat32_offset_extent(
+	struct FAT32Private *priv, unsigned int cluster, unsigned int offset, unsigned int *count
+);
 unsigned int
 fat32_offset_cluster(struct FAT32Private *priv, unsigned int cluster, unsigned int offset);
 int fat32_write_fat(struct FAT32Private *priv, unsigned int cluster, unsigned int data);
@@ -49,6 +87,13 @@ int fat32_append_cluster(
 	struct FAT32Private *priv, unsigned int begin_cluster, unsigned int end_cluster
 );
 int fat32_free_chain(struct FAT32Private *priv, unsigned int cluster);
+int fat32_truncate_chain(struct FAT32Private *priv, unsigned int last);
+unsigned int fat32_allocate_chain(
+	struct FAT32Private *priv, unsigned int hint, unsigned int want, unsigned int *count
+);
+unsigned int fat32_allocate_cluster(struct FAT32Private *priv);
+unsigned int
+fat32_chain_length(struct FAT32Private *priv, unsigned int cluster, unsigned int *last);
 
 // mount.c
 int fat32_mount(int partition_id, void **private);
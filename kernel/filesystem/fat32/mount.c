@@ -25,8 +25,9 @@
 #include "fat32.h"
 
 int fat32_mount(int partition_id, void **private) {
-	struct FAT32BootSector *bootsect = (void *)kalloc();
+	struct FAT32BootSector *bootsect = kmalloc(SECTORSIZE);
 	if (hal_partition_read(partition_id, 0, 1, bootsect) < 0) {
+		kmfree(bootsect);
 		return ERROR_READ_FAIL;
 	}
 	if (strncmp(bootsect->fstype, "FAT32", 5)) {
@@ -37,23 +38,27 @@ int fat32_mount(int partition_id, void **private) {
 	label[11] = '\0';
 	cprintf("[fat32] Mount %s\n", label);
 
-	struct FAT32Private *priv = kalloc();
+	struct FAT32Private *priv = kmalloc(sizeof(struct FAT32Private));
 	memset(priv, 0, sizeof(struct FAT32Private));
 	priv->partition_id = partition_id;
 	priv->boot_sector = bootsect;
 	priv->mode = 0777;
 	priv->uid = 0;
 	priv->gid = 0;
+	fat32_fat_cache_init(priv);
 	*private = priv;
 	return 0;
 }
 
 int fat32_probe(int partition_id) {
-	struct FAT32BootSector *bootsect = (void *)kalloc();
+	struct FAT32BootSector *bootsect = kmalloc(SECTORSIZE);
 	if (hal_partition_read(partition_id, 0, 1, bootsect) < 0) {
+		kmfree(bootsect);
 		return ERROR_READ_FAIL;
 	}
-	return strncmp(bootsect->fstype, "FAT32", 5);
+	int ret = strncmp(bootsect->fstype, "FAT32", 5);
+	kmfree(bootsect);
+	return ret;
 }
 
 void fat32_set_default_attr(void *private, unsigned int uid, unsigned int gid, unsigned int mode) {
@@ -1,9 +1,11 @@
 #ifndef _FILESYSTEM_H
 #define _FILESYSTEM_H
 
+#define VFS_PATH_MAX_PARTS 16 // each part is 128 bytes in pathbuf
+
 struct VfsPath {
 	int parts;
-	char *pathbuf;
+	char *pathbuf; // from vfs_path_alloc()
 };
 
 struct FilesystemDriver {
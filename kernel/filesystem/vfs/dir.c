@@ -25,17 +25,15 @@
 int vfs_dir_open(struct FileDesc *fd, const char *dirname) {
 	memset(fd, 0, sizeof(struct FileDesc));
 	struct VfsPath dirpath;
-	dirpath.pathbuf = kalloc();
-	dirpath.parts = vfs_path_split(dirname, dirpath.pathbuf);
-	if (dirname[0] != '/') {
-		vfs_get_absolute_path(&dirpath);
+	if (vfs_path_resolve(dirname, &dirpath) < 0) {
+		return ERROR_INVAILD;
 	}
 	struct VfsPath path;
 	int fs_id = vfs_path_to_fs(dirpath, &path);
 
 	int fblock = vfs_mount_table[fs_id].fs_driver->open(vfs_mount_table[fs_id].private, path);
 	if (fblock < 0) {
-		kfree(dirpath.pathbuf);
+		vfs_path_free(dirpath.pathbuf);
 		return fblock;
 	}
 	fd->block = fblock;
@@ -46,7 +44,7 @@ int vfs_dir_open(struct FileDesc *fd, const char *dirname) {
 	fd->dir = 1;
 	fd->read = 1;
 	fd->used = 1;
-	kfree(dirpath.pathbuf);
+	vfs_path_free(dirpath.pathbuf);
 	return 0;
 }
 
@@ -25,10 +25,8 @@
 int vfs_fd_open(struct FileDesc *fd, const char *filename, int mode) {
 	memset(fd, 0, sizeof(struct FileDesc));
 	struct VfsPath filepath;
-	filepath.pathbuf = kalloc();
-	filepath.parts = vfs_path_split(filename, filepath.pathbuf);
-	if (filename[0] != '/') {
-		vfs_get_absolute_path(&filepath);
+	if (vfs_path_resolve(filename, &filepath) < 0) {
+		return ERROR_INVAILD;
 	}
 	struct VfsPath path;
 	int fs_id = vfs_path_to_fs(filepath, &path);
@@ -40,7 +38,7 @@ int vfs_fd_open(struct FileDesc *fd, const char *filename, int mode) {
 			vfs_mount_table[fs_id].fs_driver->create_file(vfs_mount_table[fs_id].private, path);
 			fblock = vfs_mount_table[fs_id].fs_driver->open(vfs_mount_table[fs_id].private, path);
 		} else {
-			kfree(filepath.pathbuf);
+			vfs_path_free(filepath.pathbuf);
 			return ERROR_NOT_EXIST;
 		}
 	}
@@ -51,8 +49,13 @@ int vfs_fd_open(struct FileDesc *fd, const char *filename, int mode) {
 		fd->read = 1;
 	}
 	if (mode & O_WRITE) {
+		if (vfs_pagecache_get_write(fs_id, fblock, fd->size) < 0) {
+			// a running program is mapping it
+			vfs_path_free(filepath.pathbuf);
+			return ERROR_NO_PERM;
+		}
 		fd->path.parts = path.parts;
-		fd->path.pathbuf = kalloc();
+		fd->path.pathbuf = vfs_path_alloc();
 		memmove(fd->path.pathbuf, path.pathbuf, path.parts * 128);
 		fd->write = 1;
 		if (mode & O_APPEND) {
@@ -66,7 +69,7 @@ int vfs_fd_open(struct FileDesc *fd, const char *filename, int mode) {
 	fd->offset = 0;
 	fd->fs_id = fs_id;
 	fd->used = 1;
-	kfree(filepath.pathbuf);
+	vfs_path_free(filepath.pathbuf);
 	return 0;
 }
 
@@ -120,6 +123,7 @@ int vfs_fd_write(struct FileDesc *fd, const char *buf, unsigned int size) {
 	if (ret < 0) {
 		return ret;
 	}
+	vfs_pagecache_invalidate(fd->fs_id, fd->block);
 	fd->offset += ret;
 	if (fd->offset > fd->size) {
 		fd->size += fd->offset - fd->size;
@@ -139,7 +143,8 @@ int vfs_fd_close(struct FileDesc *fd) {
 		vfs_mount_table[fd->fs_id].fs_driver->update_size(
 			vfs_mount_table[fd->fs_id].private, fd->path, fd->size
 		);
-		kfree(fd->path.pathbuf);
+		vfs_path_free(fd->path.pathbuf);
+		vfs_pagecache_put_write(fd->fs_id, fd->block);
 	}
 
 	fd->used = 0;
@@ -0,0 +1,342 @@
+/*
+ * Virtual filesystem page cache
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <defs.h>
+
+#include "vfs.h"
+
+// Cache of file pages mapped into user space by exec and dynamic loading.
+// A file is identified by its mount table id and first cluster, a cached
+// file whose size changed is stale and dropped. The cache holds one
+// reference on each page and every mapping holds its own, so evicting a
+// page never pulls it from under a process.
+//
+// The page cache also tracks which files are mapped and which are open for
+// writing. A mapped file can't be opened for writing or removed, its
+// clusters and contents stay what the mapping expects, and its pages are
+// not evicted. A file open for writing can't be mapped.
+
+#define PAGECACHE_MAX_PAGES 2048 // 8 MiB
+#define PAGECACHE_HASH 256
+#define PAGECACHE_FILE_HASH 64
+
+struct CachedPage {
+	struct CachedPage *hash_next;
+	struct CachedPage *file_next, *file_prev; // pages of the same file
+	struct CachedPage *lru_next, *lru_prev;
+	struct CachedFile *file;
+	unsigned int index; // page index in file
+	void *page;
+};
+
+struct CachedFile {
+	struct CachedFile *hash_next;
+	struct CachedPage *pages;
+	unsigned int fs_id, block, size;
+	unsigned int nr_pages;
+	unsigned int mappings; // areas of processes mapping the file
+	unsigned int writers; // descriptors open for writing
+};
+
+static struct {
+	struct spinlock lock;
+	struct KmemCache *file_cache, *page_cache;
+	struct CachedFile *file_hash[PAGECACHE_FILE_HASH];
+	struct CachedPage *hash[PAGECACHE_HASH];
+	struct CachedPage lru; // sentinel, most recently used first
+	unsigned int nr_files, nr_pages;
+	unsigned int hits, misses, evictions;
+} pagecache;
+
+static inline unsigned int pagecache_hash(struct CachedFile *file, unsigned int index) {
+	return ((unsigned int)file / sizeof(struct CachedFile) + index) % PAGECACHE_HASH;
+}
+
+static inline unsigned int pagecache_file_hash(unsigned int fs_id, unsigned int block) {
+	return (block * 8 + fs_id) % PAGECACHE_FILE_HASH;
+}
+
+static void lru_del(struct CachedPage *cp) {
+	cp->lru_prev->lru_next = cp->lru_next;
+	cp->lru_next->lru_prev = cp->lru_prev;
+}
+
+static void lru_add_front(struct CachedPage *cp) {
+	cp->lru_next = pagecache.lru.lru_next;
+	cp->lru_prev = &pagecache.lru;
+	pagecache.lru.lru_next->lru_prev = cp;
+	pagecache.lru.lru_next = cp;
+}
+
+// pagecache.lock must be held
+static struct CachedFile *file_lookup(unsigned int fs_id, unsigned int block) {
+	struct CachedFile *file = pagecache.file_hash[pagecache_file_hash(fs_id, block)];
+	while (file && (file->fs_id != fs_id || file->block != block)) {
+		file = file->hash_next;
+	}
+	return file;
+}
+
+// pagecache.lock must be held
+static struct CachedPage *page_lookup(struct CachedFile *file, unsigned int index) {
+	struct CachedPage *cp = pagecache.hash[pagecache_hash(file, index)];
+	while (cp && (cp->file != file || cp->index != index)) {
+		cp = cp->hash_next;
+	}
+	return cp;
+}
+
+// drop a page from the cache, pagecache.lock must be held
+static void page_remove(struct CachedPage *cp) {
+	struct CachedPage **pp = &pagecache.hash[pagecache_hash(cp->file, cp->index)];
+	while (*pp != cp) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = cp->hash_next;
+	if (cp->file_prev) {
+		cp->file_prev->file_next = cp->file_next;
+	} else {
+		cp->file->pages = cp->file_next;
+	}
+	if (cp->file_next) {
+		cp->file_next->file_prev = cp->file_prev;
+	}
+	cp->file->nr_pages--;
+	lru_del(cp);
+	page_put(cp->page);
+	kmem_cache_free(pagecache.page_cache, cp);
+	pagecache.nr_pages--;
+}
+
+// drop the pages of a file, pagecache.lock must be held
+static void file_drop_pages(struct CachedFile *file) {
+	while (file->pages) {
+		page_remove(file->pages);
+	}
+}
+
+// free a file without pages that is neither mapped nor written,
+// pagecache.lock must be held
+static void file_release(struct CachedFile *file) {
+	if (file->pages || file->mappings || file->writers) {
+		return;
+	}
+	struct CachedFile **pp = &pagecache.file_hash[pagecache_file_hash(file->fs_id, file->block)];
+	while (*pp != file) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = file->hash_next;
+	kmem_cache_free(pagecache.file_cache, file);
+	pagecache.nr_files--;
+}
+
+// Find a file or add it, a file whose size changed loses its pages.
+// pagecache.lock must be held.
+static struct CachedFile *file_get(unsigned int fs_id, unsigned int block, unsigned int size) {
+	struct CachedFile *file = file_lookup(fs_id, block);
+	if (file) {
+		if (file->size != size) {
+			file_drop_pages(file);
+			file->size = size;
+		}
+		return file;
+	}
+	file = kmem_cache_alloc(pagecache.file_cache);
+	memset(file, 0, sizeof(struct CachedFile));
+	file->fs_id = fs_id;
+	file->block = block;
+	file->size = size;
+	unsigned int h = pagecache_file_hash(fs_id, block);
+	file->hash_next = pagecache.file_hash[h];
+	pagecache.file_hash[h] = file;
+	pagecache.nr_files++;
+	return file;
+}
+
+void vfs_pagecache_init(void) {
+	initlock(&pagecache.lock, "pagecache");
+	pagecache.file_cache = kmem_cache_create("pagecache-file", sizeof(struct CachedFile));
+	pagecache.page_cache = kmem_cache_create("pagecache-page", sizeof(struct CachedPage));
+	pagecache.lru.lru_next = pagecache.lru.lru_prev = &pagecache.lru;
+}
+
+// Return the cached page of fd at the page aligned offset with a reference
+// taken for the caller, or 0 if it is not cached. Never sleeps.
+void *vfs_pagecache_find(struct FileDesc *fd, unsigned int offset) {
+	void *page = 0;
+	acquire(&pagecache.lock);
+	struct CachedFile *file = file_lookup(fd->fs_id, fd->block);
+	if (file && file->size == fd->size) {
+		struct CachedPage *cp = page_lookup(file, offset / PGSIZE);
+		if (cp) {
+			lru_del(cp);
+			lru_add_front(cp);
+			page_get(cp->page);
+			page = cp->page;
+			pagecache.hits++;
+		}
+	}
+	release(&pagecache.lock);
+	return page;
+}
+
+// Like vfs_pagecache_find() but read the page in if it is not cached.
+// Return 0 on read error.
+void *vfs_pagecache_get(struct FileDesc *fd, unsigned int offset) {
+	void *page = vfs_pagecache_find(fd, offset);
+	if (page) {
+		return page;
+	}
+
+	// read without holding the lock, another process may race us
+	if ((page = kalloc()) == 0) {
+		return 0;
+	}
+	memset(page, 0, PGSIZE);
+	struct FileDesc file_fd = *fd;
+	unsigned int size = fd->size - offset < PGSIZE ? fd->size - offset : PGSIZE;
+	if (vfs_fd_seek(&file_fd, offset, SEEK_SET) < 0 ||
+		vfs_fd_read(&file_fd, page, size) != (int)size) {
+		kfree(page);
+		return 0;
+	}
+
+	acquire(&pagecache.lock);
+	pagecache.misses++;
+	if (pagecache.nr_pages >= PAGECACHE_MAX_PAGES) {
+		// pages of mapped files stay, the cache grows if there is nothing else
+		struct CachedPage *victim = pagecache.lru.lru_prev;
+		while (victim != &pagecache.lru && victim->file->mappings) {
+			victim = victim->lru_prev;
+		}
+		if (victim != &pagecache.lru) {
+			struct CachedFile *victim_file = victim->file;
+			page_remove(victim);
+			file_release(victim_file);
+			pagecache.evictions++;
+		}
+	}
+	struct CachedFile *file = file_get(fd->fs_id, fd->block, fd->size);
+	struct CachedPage *cp = page_lookup(file, offset / PGSIZE);
+	if (cp) {
+		// lost the race, use the page already cached
+		page_get(cp->page);
+		release(&pagecache.lock);
+		kfree(page);
+		return cp->page;
+	}
+	cp = kmem_cache_alloc(pagecache.page_cache);
+	cp->file = file;
+	cp->index = offset / PGSIZE;
+	cp->page = page;
+	unsigned int h = pagecache_hash(file, cp->index);
+	cp->hash_next = pagecache.hash[h];
+	pagecache.hash[h] = cp;
+	cp->file_prev = 0;
+	cp->file_next = file->pages;
+	if (file->pages) {
+		file->pages->file_prev = cp;
+	}
+	file->pages = cp;
+	file->nr_pages++;
+	lru_add_front(cp);
+	pagecache.nr_pages++;
+	page_get(page); // the caller's reference, the cache keeps the one from kalloc
+	release(&pagecache.lock);
+	return page;
+}
+
+// Drop the cached pages of a file that is written or removed, return
+// ERROR_NO_PERM and keep them if the file is mapped
+int vfs_pagecache_invalidate(unsigned int fs_id, unsigned int block) {
+	int ret = 0;
+	acquire(&pagecache.lock);
+	struct CachedFile *file = file_lookup(fs_id, block);
+	if (file && file->mappings) {
+		ret = ERROR_NO_PERM;
+	} else if (file) {
+		file_drop_pages(file);
+		file_release(file);
+	}
+	release(&pagecache.lock);
+	return ret;
+}
+
+// Pin a file for an area mapping it until vfs_pagecache_unmap(). Return
+// ERROR_NO_PERM if the file is open for writing.
+int vfs_pagecache_map(unsigned int fs_id, unsigned int block, unsigned int size) {
+	int ret = 0;
+	acquire(&pagecache.lock);
+	struct CachedFile *file = file_get(fs_id, block, size);
+	if (file->writers) {
+		file_release(file);
+		ret = ERROR_NO_PERM;
+	} else {
+		file->mappings++;
+	}
+	release(&pagecache.lock);
+	return ret;
+}
+
+void vfs_pagecache_unmap(unsigned int fs_id, unsigned int block) {
+	acquire(&pagecache.lock);
+	struct CachedFile *file = file_lookup(fs_id, block);
+	if (file && file->mappings) {
+		file->mappings--;
+		file_release(file);
+	}
+	release(&pagecache.lock);
+}
+
+// Note a descriptor opening a file for writing until
+// vfs_pagecache_put_write(). Return ERROR_NO_PERM if the file is mapped.
+int vfs_pagecache_get_write(unsigned int fs_id, unsigned int block, unsigned int size) {
+	int ret = 0;
+	acquire(&pagecache.lock);
+	struct CachedFile *file = file_get(fs_id, block, size);
+	if (file->mappings) {
+		ret = ERROR_NO_PERM;
+	} else {
+		file->writers++;
+	}
+	release(&pagecache.lock);
+	return ret;
+}
+
+void vfs_pagecache_put_write(unsigned int fs_id, unsigned int block) {
+	acquire(&pagecache.lock);
+	struct CachedFile *file = file_lookup(fs_id, block);
+	if (file && file->writers) {
+		file->writers--;
+		file_release(file);
+	}
+	release(&pagecache.lock);
+}
+
+void vfs_pagecache_get_stats(struct PageCacheStats *stats) {
+	acquire(&pagecache.lock);
+	stats->files = pagecache.nr_files;
+	stats->pages = pagecache.nr_pages;
+	stats->hits = pagecache.hits;
+	stats->misses = pagecache.misses;
+	stats->evictions = pagecache.evictions;
+	release(&pagecache.lock);
+}
@@ -17,11 +17,28 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
 #include <core/proc.h>
 #include <defs.h>
 
 #include "vfs.h"
 
+static struct KmemCache *vfs_path_cache;
+
+void vfs_path_init(void) {
+	vfs_path_cache = kmem_cache_create("vfs-path", VFS_PATH_MAX_PARTS * 128);
+}
+
+char *vfs_path_alloc(void) {
+	return kmem_cache_alloc(vfs_path_cache);
+}
+
+void vfs_path_free(char *pathbuf) {
+	kmem_cache_free(vfs_path_cache, pathbuf);
+}
+
+// Split path into its parts, return how many there are or ERROR_INVAILD if
+// the path is too deep or a part too long to fit in buf
 int vfs_path_split(const char *path, char *buf) {
 	int count = 0;
 	int x = 0, y;
@@ -35,8 +52,12 @@ int vfs_path_split(const char *path, char *buf) {
 			x = y + 1;
 			continue;
 		}
-		strncpy(buf + count * 128, path + x, y - x);
-		*(buf + count * 128 + y - x) = '\0';
+		int len = y - x;
+		if (count == VFS_PATH_MAX_PARTS || len >= 128) {
+			return ERROR_INVAILD;
+		}
+		strncpy(buf + count * 128, path + x, len);
+		*(buf + count * 128 + len) = '\0';
 		count++;
 		if (path[y] == '\0') {
 			// end of path string
@@ -71,15 +92,39 @@ void vfs_path_tostring(struct VfsPath path, char *buf) {
 	buf[next] = '\0';
 }
 
-void vfs_get_absolute_path(struct VfsPath *path) {
-	char *newpath = kalloc();
+// Prefix a relative path with the working directory, return ERROR_INVAILD
+// and leave path as it is if the result is too deep
+int vfs_get_absolute_path(struct VfsPath *path) {
+#ifndef __riscv
+	if (myproc()->cwd.parts + path->parts > VFS_PATH_MAX_PARTS) {
+		return ERROR_INVAILD;
+	}
+#endif
+	char *newpath = vfs_path_alloc();
 #ifndef __riscv
 	memmove(newpath, myproc()->cwd.pathbuf, myproc()->cwd.parts * 128);
 	memmove(newpath + myproc()->cwd.parts * 128, path->pathbuf, path->parts * 128);
 #endif
-	kfree(path->pathbuf);
+	vfs_path_free(path->pathbuf);
 	path->pathbuf = newpath;
 #ifndef __riscv
 	path->parts += myproc()->cwd.parts;
 #endif
+	return 0;
+}
+
+// Parse name, relative to the working directory unless it starts with a
+// slash, into path with a newly allocated pathbuf. Return ERROR_INVAILD
+// without allocating if it does not fit.
+int vfs_path_resolve(const char *name, struct VfsPath *path) {
+	path->pathbuf = vfs_path_alloc();
+	path->parts = vfs_path_split(name, path->pathbuf);
+	if (path->parts >= 0 && name[0] != '/' && vfs_get_absolute_path(path) < 0) {
+		path->parts = ERROR_INVAILD;
+	}
+	if (path->parts < 0) {
+		vfs_path_free(path->pathbuf);
+		return ERROR_INVAILD;
+	}
+	return 0;
 }
@@ -27,6 +27,8 @@
 struct VfsMountTableEntry vfs_mount_table[VFS_MOUNT_TABLE_MAX];
 
 void vfs_init(void) {
+	vfs_path_init();
+	vfs_pagecache_init();
 	memset(vfs_mount_table, 0, sizeof(vfs_mount_table));
 	int fs_id = 0;
 
@@ -80,62 +82,60 @@ int vfs_path_to_fs(struct VfsPath orig_path, struct VfsPath *path) {
 
 int vfs_file_get_size(const char *filename) {
 	struct VfsPath filepath;
-	filepath.pathbuf = kalloc();
-	filepath.parts = vfs_path_split(filename, filepath.pathbuf);
-	if (filename[0] != '/') {
-		vfs_get_absolute_path(&filepath);
+	if (vfs_path_resolve(filename, &filepath) < 0) {
+		return ERROR_INVAILD;
 	}
 	struct VfsPath path;
 	int fs_id = vfs_path_to_fs(filepath, &path);
 
 	int sz = vfs_mount_table[fs_id].fs_driver->get_file_size(vfs_mount_table[fs_id].private, path);
-	kfree(filepath.pathbuf);
+	vfs_path_free(filepath.pathbuf);
 	return sz;
 }
 
 int vfs_file_get_mode(const char *filename) {
 	struct VfsPath filepath;
-	filepath.pathbuf = kalloc();
-	filepath.parts = vfs_path_split(filename, filepath.pathbuf);
-	if (filename[0] != '/') {
-		vfs_get_absolute_path(&filepath);
+	if (vfs_path_resolve(filename, &filepath) < 0) {
+		return ERROR_INVAILD;
 	}
 	struct VfsPath path;
 	int fs_id = vfs_path_to_fs(filepath, &path);
 
 	int sz = vfs_mount_table[fs_id].fs_driver->get_file_mode(vfs_mount_table[fs_id].private, path);
-	kfree(filepath.pathbuf);
+	vfs_path_free(filepath.pathbuf);
 	return sz;
 }
 
 int vfs_mkdir(const char *dirname) {
 	struct VfsPath filepath;
-	filepath.pathbuf = kalloc();
-	filepath.parts = vfs_path_split(dirname, filepath.pathbuf);
-	if (dirname[0] != '/') {
-		vfs_get_absolute_path(&filepath);
+	if (vfs_path_resolve(dirname, &filepath) < 0) {
+		return ERROR_INVAILD;
 	}
 	struct VfsPath path;
 	int fs_id = vfs_path_to_fs(filepath, &path);
 
 	int ret =
 		vfs_mount_table[fs_id].fs_driver->create_directory(vfs_mount_table[fs_id].private, path);
-	kfree(filepath.pathbuf);
+	vfs_path_free(filepath.pathbuf);
 	return ret;
 }
 
 int vfs_file_remove(const char *file) {
 	struct VfsPath filepath;
-	filepath.pathbuf = kalloc();
-	filepath.parts = vfs_path_split(file, filepath.pathbuf);
-	if (file[0] != '/') {
-		vfs_get_absolute_path(&filepath);
+	if (vfs_path_resolve(file, &filepath) < 0) {
+		return ERROR_INVAILD;
 	}
 	struct VfsPath path;
 	int fs_id = vfs_path_to_fs(filepath, &path);
 
+	int block = vfs_mount_table[fs_id].fs_driver->open(vfs_mount_table[fs_id].private, path);
+	if (block >= 0 && vfs_pagecache_invalidate(fs_id, block) < 0) {
+		// a running program is mapping it
+		vfs_path_free(filepath.pathbuf);
+		return ERROR_NO_PERM;
+	}
 	int ret = vfs_mount_table[fs_id].fs_driver->remove_file(vfs_mount_table[fs_id].private, path);
 
-	kfree(filepath.pathbuf);
+	vfs_path_free(filepath.pathbuf);
 	return ret;
 }
@@ -63,10 +63,29 @@ int vfs_dir_open(struct FileDesc *fd, const char *dirname);
 int vfs_dir_read(struct FileDesc *fd, char *buffer);
 int vfs_dir_close(struct FileDesc *fd);
 
+// pagecache.c
+struct PageCacheStats {
+	unsigned int files, pages; // files and pages cached
+	unsigned int hits, misses, evictions;
+};
+void vfs_pagecache_init(void);
+void *vfs_pagecache_find(struct FileDesc *fd, unsigned int offset);
+void *vfs_pagecache_get(struct FileDesc *fd, unsigned int offset);
+int vfs_pagecache_invalidate(unsigned int fs_id, unsigned int block);
+int vfs_pagecache_map(unsigned int fs_id, unsigned int block, unsigned int size);
+void vfs_pagecache_unmap(unsigned int fs_id, unsigned int block);
+int vfs_pagecache_get_write(unsigned int fs_id, unsigned int block, unsigned int size);
+void vfs_pagecache_put_write(unsigned int fs_id, unsigned int block);
+void vfs_pagecache_get_stats(struct PageCacheStats *stats);
+
 // path.c
+void vfs_path_init(void);
+char *vfs_path_alloc(void);
+void vfs_path_free(char *pathbuf);
 int vfs_path_split(const char *path, char *buf);
 int vfs_path_compare(int lhs_parts, const char *lhs_buf, int rhs_parts, const char *rhs_buf);
 void vfs_path_tostring(struct VfsPath path, char *buf);
-void vfs_get_absolute_path(struct VfsPath *path);
+int vfs_get_absolute_path(struct VfsPath *path);
+int vfs_path_resolve(const char *name, struct VfsPath *path);
 
 #endif
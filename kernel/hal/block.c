@@ -19,6 +19,8 @@
 
 #include <common/errorcode.h>
 #include <defs.h>
+#include <memlayout.h>
+#include <proc/kcall.h>
 
 #include "hal.h"
 
@@ -57,13 +59,6 @@ static void hal_block_probe_partition(int block_id) {
 	kfree(gptsect);
 }
 
-static void hal_block_cache_init(int block_id) {
-	hal_block_map[block_id].cache = kalloc();
-	memset(hal_block_map[block_id].cache, 0, 4096);
-	hal_block_map[block_id].cache_next = 0;
-	initlock(&hal_block_map[block_id].cache_lock, "block-cache");
-}
-
 void hal_block_register_device(
 	const char *name, void *private, const struct BlockDeviceDriver *driver
 ) {
@@ -73,49 +68,358 @@ void hal_block_register_device(
 			hal_block_map[i].driver = driver;
 			hal_block_map[i].private = private;
 			hal_block_probe_partition(i);
-			hal_block_cache_init(i);
 			return;
 		}
 	}
 	panic("too many block devices");
 }
 
+// Buffer cache of single sectors keyed by (device, LBA). Buffers are found
+// through a hash table and recycled in LRU order, each buffer has a sleeplock
+// held while its data is read or modified. Writes of single sectors only mark
+// the buffer dirty, dirty buffers are written back when they are recycled or
+// by hal_block_sync().
+
+#define BLOCK_BUFFER_VALID (1 << 0) // data holds the sector
+#define BLOCK_BUFFER_DIRTY (1 << 1) // data differs from the disk
+
+struct BlockBuffer {
+	unsigned int dev, lba;
+	unsigned int refcnt; // protected by bcache.lock
+	unsigned int flags; // protected by the sleeplock
+	struct sleeplock lock;
+	struct BlockBuffer *hash_next;
+	struct BlockBuffer *lru_next, *lru_prev;
+	void *data;
+};
+
+static struct {
+	struct spinlock lock;
+	unsigned int num_buffers;
+	struct BlockBuffer *buffers;
+	struct BlockBuffer *hash[HAL_BLOCK_CACHE_HASH];
+	struct BlockBuffer lru; // lru.lru_next is the most recently used buffer
+	unsigned int hits, misses, evictions, writebacks;
+} bcache;
+
+static inline unsigned int bcache_hash(unsigned int dev, unsigned int lba) {
+	return (lba ^ (lba >> 12) ^ (dev << 8)) % HAL_BLOCK_CACHE_HASH;
+}
+
+static void bcache_hash_del(struct BlockBuffer *b) {
+	struct BlockBuffer **p = &bcache.hash[bcache_hash(b->dev, b->lba)];
+	while (*p != b) {
+		p = &(*p)->hash_next;
+	}
+	*p = b->hash_next;
+	b->hash_next = 0;
+}
+
+static void bcache_hash_add(struct BlockBuffer *b) {
+	unsigned int h = bcache_hash(b->dev, b->lba);
+	b->hash_next = bcache.hash[h];
+	bcache.hash[h] = b;
+}
+
+static void bcache_lru_del(struct BlockBuffer *b) {
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void bcache_lru_add(struct BlockBuffer *b) {
+	b->lru_next = bcache.lru.lru_next;
+	b->lru_prev = &bcache.lru;
+	bcache.lru.lru_next->lru_prev = b;
+	bcache.lru.lru_next = b;
+}
+
+static void hal_block_cache_init(unsigned int size_mb) {
+	initlock(&bcache.lock, "block-cache");
+	bcache.num_buffers = size_mb * 1024 * 1024 / HAL_BLOCK_SECTOR_SIZE;
+	unsigned int header_pages =
+		(bcache.num_buffers * sizeof(struct BlockBuffer) + PGSIZE - 1) / PGSIZE;
+	bcache.buffers = pgalloc(header_pages);
+	memset(bcache.buffers, 0, header_pages * PGSIZE);
+	bcache.lru.lru_next = bcache.lru.lru_prev = &bcache.lru;
+
+	void *page = 0;
+	for (unsigned int i = 0; i < bcache.num_buffers; i++) {
+		struct BlockBuffer *b = &bcache.buffers[i];
+		if (i % (PGSIZE / HAL_BLOCK_SECTOR_SIZE) == 0) {
+			page = kalloc();
+		}
+		b->data = page + i % (PGSIZE / HAL_BLOCK_SECTOR_SIZE) * HAL_BLOCK_SECTOR_SIZE;
+		b->dev = HAL_BLOCK_MAX; // matches no device
+		initsleeplock(&b->lock, "block-buffer");
+		bcache_lru_add(b);
+	}
+	cprintf("[hal] block cache %d MiB %d buffers\n", size_mb, bcache.num_buffers);
+}
+
+// write a dirty buffer back to the disk, buffer sleeplock must be held
+static int bcache_writeback(struct BlockBuffer *b) {
+	if (!(b->flags & BLOCK_BUFFER_DIRTY)) {
+		return 0;
+	}
+	int ret = hal_disk_write(b->dev, b->lba, 1, b->data);
+	if (ret < 0) {
+		return ret;
+	}
+	b->flags &= ~BLOCK_BUFFER_DIRTY;
+	acquire(&bcache.lock);
+	bcache.writebacks++;
+	release(&bcache.lock);
+	return 0;
+}
+
+// drop a reference, move the buffer to the head of the LRU list if touch is set
+static void bcache_put(struct BlockBuffer *b, int touch) {
+	releasesleep(&b->lock);
+	acquire(&bcache.lock);
+	b->refcnt--;
+	if (!b->refcnt && touch) {
+		bcache_lru_del(b);
+		bcache_lru_add(b);
+	}
+	release(&bcache.lock);
+}
+
+// return the locked buffer of a sector, recycle the least recently used
+// buffer if it's not cached and create is set, otherwise return 0
+static struct BlockBuffer *bcache_get(unsigned int dev, unsigned int lba, int create) {
+	struct BlockBuffer *b;
+	acquire(&bcache.lock);
+again:
+	for (b = bcache.hash[bcache_hash(dev, lba)]; b; b = b->hash_next) {
+		if (b->dev == dev && b->lba == lba) {
+			b->refcnt++;
+			bcache.hits++;
+			release(&bcache.lock);
+			acquiresleep(&b->lock);
+			return b;
+		}
+	}
+	if (!create) {
+		release(&bcache.lock);
+		return 0;
+	}
+
+	for (b = bcache.lru.lru_prev; b != &bcache.lru; b = b->lru_prev) {
+		if (b->refcnt) {
+			continue;
+		}
+		if (b->flags & BLOCK_BUFFER_DIRTY) {
+			// write back without the cache lock and look again, the sector
+			// may have been cached by someone else in the meantime
+			b->refcnt++;
+			release(&bcache.lock);
+			acquiresleep(&b->lock);
+			if (bcache_writeback(b) < 0) {
+				cprintf("[hal] block %d lba %d write back failed\n", b->dev, b->lba);
+				b->flags &= ~BLOCK_BUFFER_DIRTY;
+			}
+			releasesleep(&b->lock);
+			acquire(&bcache.lock);
+			b->refcnt--;
+			goto again;
+		}
+		if (b->flags & BLOCK_BUFFER_VALID) {
+			bcache.evictions++;
+		}
+		if (b->dev < HAL_BLOCK_MAX) {
+			bcache_hash_del(b);
+		}
+		b->dev = dev;
+		b->lba = lba;
+		b->flags = 0;
+		b->refcnt = 1;
+		bcache_hash_add(b);
+		bcache.misses++;
+		release(&bcache.lock);
+		acquiresleep(&b->lock);
+		return b;
+	}
+	panic("block cache exhausted");
+}
+
+// Lock the cached buffers of count sectors from lba in ascending order,
+// bufs[i] is the buffer of sector lba + i or 0 if it is not cached. Locking
+// in order keeps concurrent large transfers from deadlocking.
+static void bcache_lock_range(
+	unsigned int dev, unsigned int lba, int count, struct BlockBuffer **bufs
+) {
+	for (int i = 0; i < count; i++) {
+		bufs[i] = bcache_get(dev, lba + i, 0);
+	}
+}
+
+static void bcache_put_range(struct BlockBuffer **bufs, int count) {
+	for (int i = 0; i < count; i++) {
+		if (bufs[i]) {
+			bcache_put(bufs[i], 1);
+		}
+	}
+}
+
+int hal_block_sync(void) {
+	int ret = 0;
+	for (unsigned int i = 0; i < bcache.num_buffers; i++) {
+		struct BlockBuffer *b = &bcache.buffers[i];
+		acquire(&bcache.lock);
+		if (!(b->flags & BLOCK_BUFFER_DIRTY)) {
+			release(&bcache.lock);
+			continue;
+		}
+		b->refcnt++;
+		release(&bcache.lock);
+		acquiresleep(&b->lock);
+		if (bcache_writeback(b) < 0) {
+			ret = ERROR_WRITE_FAIL;
+		}
+		bcache_put(b, 0);
+	}
+	return ret;
+}
+
+void hal_block_get_cache_stats(struct BlockCacheStats *stats) {
+	acquire(&bcache.lock);
+	stats->buffers = bcache.num_buffers;
+	stats->dirty = 0;
+	for (unsigned int i = 0; i < bcache.num_buffers; i++) {
+		if (bcache.buffers[i].flags & BLOCK_BUFFER_DIRTY) {
+			stats->dirty++;
+		}
+	}
+	stats->hits = bcache.hits;
+	stats->misses = bcache.misses;
+	stats->evictions = bcache.evictions;
+	stats->writebacks = bcache.writebacks;
+	release(&bcache.lock);
+}
+
+int hal_block_get_queue_stats(int id, struct BlockQueueStats *stats) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
+	}
+	if (!hal_block_map[id].driver->get_stats) {
+		return ERROR_NOT_EXIST;
+	}
+	memset(stats, 0, sizeof(struct BlockQueueStats));
+	hal_block_map[id].driver->get_stats(hal_block_map[id].private, stats);
+	return 0;
+}
+
+struct BlockKcall {
+#define BLOCK_KCALL_OP_SYNC 0
+#define BLOCK_KCALL_OP_CACHE_STATS 1
+#define BLOCK_KCALL_OP_QUEUE_STATS 2
+	unsigned int op;
+	struct BlockCacheStats stats;
+	int id; // block device of BLOCK_KCALL_OP_QUEUE_STATS
+	struct BlockQueueStats queue;
+};
+
+static int hal_block_kcall_handler(unsigned int arg) {
+	struct BlockKcall *p = (struct BlockKcall *)arg;
+	switch (p->op) {
+		case BLOCK_KCALL_OP_SYNC:
+			return hal_block_sync();
+		case BLOCK_KCALL_OP_CACHE_STATS: {
+			// filled under locks, storing to p may fault
+			struct BlockCacheStats stats;
+			hal_block_get_cache_stats(&stats);
+			p->stats = stats;
+			return 0;
+		}
+		case BLOCK_KCALL_OP_QUEUE_STATS: {
+			struct BlockQueueStats queue;
+			int ret = hal_block_get_queue_stats(p->id, &queue);
+			if (ret == 0) {
+				p->queue = queue;
+			}
+			return ret;
+		}
+	}
+	return ERROR_INVAILD;
+}
+
 void hal_block_init(void) {
 	memset(hal_block_map, 0, sizeof(hal_block_map));
 	memset(hal_partition_map, 0, sizeof(hal_partition_map));
+	hal_block_cache_init(HAL_BLOCK_CACHE_SIZE_MB);
+	kcall_set("block", hal_block_kcall_handler);
 }
 
 int hal_block_read(int id, int begin, int count, void *buf) {
-	if (count > 1) {
-		return hal_disk_read(id, begin, count, buf);
+	if (id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
 	}
 
-	struct BlockDevice *blk = &hal_block_map[id];
-	acquire(&blk->cache_lock);
-	for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
-		if (blk->cache[i].buf && blk->cache[i].lba == begin) {
-			memmove(buf, blk->cache[i].buf, 512);
-			release(&blk->cache_lock);
-			return 0;
+	if (count == 1) {
+		struct BlockBuffer *b = bcache_get(id, begin, 1);
+		if (!(b->flags & BLOCK_BUFFER_VALID)) {
+			int ret = hal_disk_read(id, begin, 1, b->data);
+			if (ret < 0) {
+				bcache_put(b, 0);
+				return ret;
+			}
+			b->flags |= BLOCK_BUFFER_VALID;
 		}
+		memmove(buf, b->data, HAL_BLOCK_SECTOR_SIZE);
+		bcache_put(b, 1);
+		return 0;
 	}
 
-	if (!blk->cache[blk->cache_next].buf) {
-		blk->cache[blk->cache_next].buf = kalloc();
-	}
-	blk->cache[blk->cache_next].lba = begin;
-	release(&blk->cache_lock);
-	hal_disk_read(id, begin, count, blk->cache[blk->cache_next].buf);
-	acquire(&blk->cache_lock);
-	memmove(buf, blk->cache[blk->cache_next].buf, 512);
-	blk->cache_next++;
-	if (blk->cache_next >= HAL_BLOCK_CACHE_MAX) {
-		blk->cache_next = 0;
+	// large transfers are not cached, runs of uncached sectors go straight
+	// to the device and cached ones are copied since they may be dirty. The
+	// cached buffers of a chunk stay locked until it is read, so none of them
+	// changes or is written back in between.
+	struct BlockBuffer *bufs[HAL_BLOCK_UNCACHED_CHUNK];
+	for (int c = 0; c < count; c += HAL_BLOCK_UNCACHED_CHUNK) {
+		int n = count - c < HAL_BLOCK_UNCACHED_CHUNK ? count - c : HAL_BLOCK_UNCACHED_CHUNK;
+		void *chunk = buf + c * HAL_BLOCK_SECTOR_SIZE;
+		bcache_lock_range(id, begin + c, n, bufs);
+		int run = 0;
+		for (int i = 0; i <= n; i++) {
+			struct BlockBuffer *b = i < n ? bufs[i] : 0;
+			if (i < n && !(b && (b->flags & BLOCK_BUFFER_VALID))) {
+				run++;
+				continue;
+			}
+			if (run) {
+				int ret = hal_disk_read(
+					id, begin + c + i - run, run, chunk + (i - run) * HAL_BLOCK_SECTOR_SIZE
+				);
+				if (ret < 0) {
+					bcache_put_range(bufs, n);
+					return ret;
+				}
+				run = 0;
+			}
+			if (b) {
+				memmove(chunk + i * HAL_BLOCK_SECTOR_SIZE, b->data, HAL_BLOCK_SECTOR_SIZE);
+			}
+		}
+		bcache_put_range(bufs, n);
 	}
-	release(&blk->cache_lock);
 	return 0;
 }
 
+// page aligned memory in the kernel direct map, physically contiguous
+// however many pages it spans, user buffers are not
+static inline int hal_block_dma_capable(const void *buf) {
+	return (unsigned int)buf % PGSIZE == 0 && (unsigned int)buf >= KERNBASE &&
+		   (unsigned int)buf < KERNBASE + PHYSTOP;
+}
+
+// sectors per driver request, a bounce buffer holds one page
+static inline int hal_block_max_sectors(struct BlockDevice *blk, void *bounce) {
+	if (bounce || !blk->driver->max_sectors) {
+		return HAL_BLOCK_DISK_MAX_SECTORS;
+	}
+	return blk->driver->max_sectors;
+}
+
 int hal_disk_read(int id, int begin, int count, void *buf) {
 	if (id >= HAL_BLOCK_MAX) {
 		return ERROR_INVAILD;
@@ -124,7 +428,32 @@ int hal_disk_read(int id, int begin, int count, void *buf) {
 		return ERROR_INVAILD;
 	}
 
-	return hal_block_map[id].driver->block_read(hal_block_map[id].private, begin, count, buf);
+	// split transfers larger than the driver takes and bounce those the
+	// device can't reach directly
+	struct BlockDevice *blk = &hal_block_map[id];
+	void *bounce = 0;
+	if (!hal_block_dma_capable(buf) && !(bounce = kalloc_try())) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	int max = hal_block_max_sectors(blk, bounce);
+	for (int i = 0; i < count; i += max) {
+		int n = count - i < max ? count - i : max;
+		void *dest = buf + i * HAL_BLOCK_SECTOR_SIZE;
+		int ret = blk->driver->block_read(blk->private, begin + i, n, bounce ? bounce : dest);
+		if (ret < 0) {
+			if (bounce) {
+				kfree(bounce);
+			}
+			return ret;
+		}
+		if (bounce) {
+			memmove(dest, bounce, n * HAL_BLOCK_SECTOR_SIZE);
+		}
+	}
+	if (bounce) {
+		kfree(bounce);
+	}
+	return 0;
 }
 
 int hal_partition_read(int id, int begin, int count, void *buf) {
@@ -140,26 +469,46 @@ int hal_partition_read(int id, int begin, int count, void *buf) {
 }
 
 int hal_block_write(int id, int begin, int count, const void *buf) {
-	if (count > 1) {
-		for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
-			if (hal_block_map[id].cache[i].buf) {
-				kfree(hal_block_map[id].cache[i].buf);
-			}
-		}
-		hal_disk_write(id, begin, count, buf);
+	if (id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
 	}
 
-	struct BlockDevice *blk = &hal_block_map[id];
-	acquire(&blk->cache_lock);
-	for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
-		if (blk->cache[i].buf && blk->cache[i].lba == begin) {
-			memmove(blk->cache[i].buf, buf, 512);
-			release(&blk->cache_lock);
-			return hal_disk_write(id, begin, count, blk->cache[i].buf);
+	if (count == 1) {
+		struct BlockBuffer *b = bcache_get(id, begin, 1);
+		memmove(b->data, buf, HAL_BLOCK_SECTOR_SIZE);
+		b->flags |= BLOCK_BUFFER_VALID | BLOCK_BUFFER_DIRTY;
+		bcache_put(b, 1);
+		return 0;
+	}
+
+	// large transfers are written through. The cached buffers of a chunk are
+	// locked before the write and refreshed after it, a concurrent writer of
+	// a single sector waits and its update lands on top of this one.
+	struct BlockBuffer *bufs[HAL_BLOCK_UNCACHED_CHUNK];
+	for (int c = 0; c < count; c += HAL_BLOCK_UNCACHED_CHUNK) {
+		int n = count - c < HAL_BLOCK_UNCACHED_CHUNK ? count - c : HAL_BLOCK_UNCACHED_CHUNK;
+		const void *chunk = buf + c * HAL_BLOCK_SECTOR_SIZE;
+		bcache_lock_range(id, begin + c, n, bufs);
+		int ret = hal_disk_write(id, begin + c, n, chunk);
+		for (int i = 0; i < n; i++) {
+			struct BlockBuffer *b = bufs[i];
+			if (!b) {
+				continue;
+			}
+			if (ret < 0) {
+				// the disk holds old or partly written data, read it again
+				b->flags = 0;
+			} else {
+				memmove(b->data, chunk + i * HAL_BLOCK_SECTOR_SIZE, HAL_BLOCK_SECTOR_SIZE);
+				b->flags = BLOCK_BUFFER_VALID;
+			}
+		}
+		bcache_put_range(bufs, n);
+		if (ret < 0) {
+			return ret;
 		}
 	}
-	release(&blk->cache_lock);
-	return hal_disk_write(id, begin, count, buf);
+	return 0;
 }
 
 int hal_disk_write(int id, int begin, int count, const void *buf) {
@@ -170,7 +519,30 @@ int hal_disk_write(int id, int begin, int count, const void *buf) {
 		return ERROR_INVAILD;
 	}
 
-	return hal_block_map[id].driver->block_write(hal_block_map[id].private, begin, count, buf);
+	struct BlockDevice *blk = &hal_block_map[id];
+	void *bounce = 0;
+	if (!hal_block_dma_capable(buf) && !(bounce = kalloc_try())) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	int max = hal_block_max_sectors(blk, bounce);
+	for (int i = 0; i < count; i += max) {
+		int n = count - i < max ? count - i : max;
+		const void *src = buf + i * HAL_BLOCK_SECTOR_SIZE;
+		if (bounce) {
+			memmove(bounce, src, n * HAL_BLOCK_SECTOR_SIZE);
+		}
+		int ret = blk->driver->block_write(blk->private, begin + i, n, bounce ? bounce : src);
+		if (ret < 0) {
+			if (bounce) {
+				kfree(bounce);
+			}
+			return ret;
+		}
+	}
+	if (bounce) {
+		kfree(bounce);
+	}
+	return 0;
 }
 
 int hal_partition_write(int id, int begin, int count, const void *buf) {
@@ -33,6 +33,7 @@ struct FramebufferDevice {
 	void *private;
 	unsigned int preferred_xres, preferred_yres;
 	unsigned int maximum_xres, maximum_yres;
+	unsigned int xres, yres; // current mode
 } framebuffer_device[HAL_DISPLAY_MAX];
 
 struct EDIDStdTimingInformation {
@@ -52,6 +53,8 @@ struct EDIDDetailTiming {
 
 static void *hal_display_modeswitch(struct FramebufferDevice *fbdev, int xres, int yres) {
 	phyaddr_t fb = fbdev->driver->enable(fbdev->private, xres, yres);
+	fbdev->xres = xres;
+	fbdev->yres = yres;
 #ifndef __riscv
 	mappages(myproc()->pgdir, (void *)PROC_MMAP_BOTTOM, 16 * 1024 * 1024, fb, PTE_U | PTE_W);
 #endif
@@ -66,6 +69,7 @@ static int hal_display_kcall_handler(unsigned int display_struct) {
 		DISPLAY_KCALL_OP_GET_PREFERRED = 3,
 		DISPLAY_KCALL_OP_UPDATE = 4,
 		DISPLAY_KCALL_OP_GET_NAME = 5,
+		DISPLAY_KCALL_OP_UPDATE_RECT = 6,
 	};
 
 #define DISPLAY_KCALL_FLAG_NEED_UPDATE (1 << 0)
@@ -79,7 +83,9 @@ static int hal_display_kcall_handler(unsigned int display_struct) {
 		unsigned int yres;
 		unsigned int flag;
 		void *framebuffer;
+		unsigned int x, y, w, h; // rectangle to update
 	} *dc = (void *)display_struct;
+	struct FramebufferDevice *fbdev;
 
 	switch (dc->op) {
 		case DISPLAY_KCALL_OP_ENABLE:
@@ -153,20 +159,29 @@ static int hal_display_kcall_handler(unsigned int display_struct) {
 			}
 			break;
 		case DISPLAY_KCALL_OP_UPDATE:
+		case DISPLAY_KCALL_OP_UPDATE_RECT:
 			if (dc->display_id == DISPLAY_ID_BOOT_FRAMEBUFFER &&
 				boot_graphics_mode.mode == BOOT_GRAPHICS_MODE_FRAMEBUFFER) {
 				cprintf("[display] boot-framebuffer update unsupported");
 				return ERROR_INVAILD;
-			} else if (framebuffer_device[dc->display_id].driver &&
-					   framebuffer_device[dc->display_id].driver->update) {
-				framebuffer_device[dc->display_id].driver->update(
-					framebuffer_device[dc->display_id].private
-				);
+			}
+			fbdev = &framebuffer_device[dc->display_id];
+			if (dc->display_id < HAL_DISPLAY_MAX && fbdev->driver && fbdev->driver->update) {
+				if (dc->op == DISPLAY_KCALL_OP_UPDATE) {
+					fbdev->driver->update(fbdev->private, 0, 0, fbdev->xres, fbdev->yres);
+					return 0;
+				}
+				if (dc->x >= fbdev->xres || dc->y >= fbdev->yres) {
+					return ERROR_INVAILD;
+				}
+				unsigned int w = dc->w < fbdev->xres - dc->x ? dc->w : fbdev->xres - dc->x;
+				unsigned int h = dc->h < fbdev->yres - dc->y ? dc->h : fbdev->yres - dc->y;
+				if (w && h) {
+					fbdev->driver->update(fbdev->private, dc->x, dc->y, w, h);
+				}
 				return 0;
-			} else {
-				return ERROR_NOT_EXIST;
 			}
-			break;
+			return ERROR_NOT_EXIST;
 		case DISPLAY_KCALL_OP_GET_NAME:
 			if (dc->display_id == DISPLAY_ID_BOOT_FRAMEBUFFER &&
 				boot_graphics_mode.mode == BOOT_GRAPHICS_MODE_FRAMEBUFFER) {
@@ -5,24 +5,53 @@
 #include <common/types.h>
 
 // HAL Block Device
-struct BlockDeviceDriver {
-	int (*block_read)(void *private, unsigned int begin, int count, void *buf);
-	int (*block_write)(void *private, unsigned int begin, int count, const void *buf);
+#define BLOCK_HIST_SIZE 16
+
+// Request queue statistics of a driver that queues requests
+struct BlockQueueStats {
+	unsigned int queues; // hardware queues in use
+	unsigned int depth, max_depth; // requests on the device now and at most
+	unsigned int requests; // requests from the block layer
+	unsigned int merged; // requests merged into an adjacent one
+	unsigned int completed, errors;
+	unsigned long long sectors;
+	unsigned int depth_hist[BLOCK_HIST_SIZE]; // dispatches by depth, bucket i from 2^i
+	unsigned int latency_hist[BLOCK_HIST_SIZE]; // requests by TSC cycles, bucket i from 2^(i+10)
 };
 
-#define HAL_BLOCK_CACHE_MAX 512
+// bucket of value in a log2 histogram whose first bucket starts at 2^shift
+static inline unsigned int hal_block_hist_bucket(unsigned long long value, int shift) {
+	unsigned int bucket = 0;
+	value >>= shift;
+	while (value > 1 && bucket < BLOCK_HIST_SIZE - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
 
-struct BlockCache {
-	int lba;
-	void *buf;
+struct BlockDeviceDriver {
+	int (*block_read)(void *private, unsigned int begin, int count, void *buf);
+	int (*block_write)(void *private, unsigned int begin, int count, const void *buf);
+	unsigned int max_sectors; // largest request, HAL_BLOCK_DISK_MAX_SECTORS if 0
+	void (*get_stats)(void *private, struct BlockQueueStats *stats); // optional
 };
 
 struct BlockDevice {
 	const struct BlockDeviceDriver *driver;
 	void *private;
-	struct BlockCache *cache;
-	int cache_next;
-	struct spinlock cache_lock;
+};
+
+#define HAL_BLOCK_SECTOR_SIZE 512
+#define HAL_BLOCK_DISK_MAX_SECTORS 8 // one page, default driver request and bounce size
+#define HAL_BLOCK_CACHE_SIZE_MB 4 // buffer cache capacity
+#define HAL_BLOCK_CACHE_HASH 1024
+#define HAL_BLOCK_UNCACHED_CHUNK 64 // sectors of a large transfer done at once
+
+struct BlockCacheStats {
+	unsigned int buffers; // cache capacity in sectors
+	unsigned int dirty; // buffers not yet written back
+	unsigned int hits, misses, evictions, writebacks;
 };
 
 #define HAL_BLOCK_MAX 8
@@ -62,6 +91,9 @@ int hal_partition_read(int id, int begin, int count, void *buf);
 int hal_block_write(int id, int begin, int count, const void *buf);
 int hal_disk_write(int id, int begin, int count, const void *buf);
 int hal_partition_write(int id, int begin, int count, const void *buf);
+int hal_block_sync(void);
+void hal_block_get_cache_stats(struct BlockCacheStats *stats);
+int hal_block_get_queue_stats(int id, struct BlockQueueStats *stats);
 
 // mbr.c
 void mbr_probe_partition(int block_id);
@@ -73,7 +105,8 @@ void gpt_probe_partition(int block_id);
 struct FramebufferDriver {
 	phyaddr_t (*enable)(void *private, int xres, int yres);
 	void (*disable)(void *private);
-	void (*update)(void *private);
+	// copy the rectangle of the framebuffer to the screen
+	void (*update)(void *private, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
 	unsigned int (*read_edid)(void *private, void *buffer, unsigned int bytes);
 };
 
@@ -83,8 +116,28 @@ void hal_display_register_device(
 );
 
 // hid.c
+#define INPUT_KEYBOARD 0
+#define INPUT_MOUSE 1
+#define INPUT_DEVICES 2
+
+struct InputEvent {
+	unsigned int data; // keycode or mouse packet
+	unsigned int unused;
+	unsigned long long time; // TSC cycles when the driver reported it
+};
+
+struct InputDeviceStats {
+	unsigned int events; // reported by drivers
+	unsigned int coalesced; // mouse packets merged into a queued one
+	unsigned int dropped; // lost to a full queue
+	unsigned int read; // taken by readers
+	unsigned long long latency_total; // TSC cycles from report to read, summed
+	unsigned long long latency_max;
+};
+
 extern int hal_kbd_send_legacy;
 void hal_hid_init(void);
+unsigned int hal_hid_pending(void);
 void hal_mouse_update(unsigned int data);
 void hal_keyboard_update(unsigned int data);
 
@@ -17,66 +17,125 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
+#include <core/proc.h>
 #include <defs.h>
 #include <driver/pci/pci.h>
 #include <driver/usb/usb.h>
 #include <driver/virtio/virtio.h>
+#include <hal/hal.h>
 #include <proc/kcall.h>
 
-#define MOUSE_QUEUE_SIZE 16
-static unsigned int mouse_queue[MOUSE_QUEUE_SIZE];
-static int mouse_queue_begin = 0, mouse_queue_end = 0;
-static struct spinlock mouse_queue_lock;
-
-static int mouse_kcall_handler(unsigned int p) {
-	unsigned int *m = (void *)p;
-	acquire(&mouse_queue_lock);
-	if (mouse_queue_begin == mouse_queue_end) {
-		*m = 0;
-		release(&mouse_queue_lock);
+#ifndef __riscv
+#include <common/x86.h>
+#endif
+
+// Input from every keyboard and mouse driver is queued per device class
+// with the time it was reported. A reader takes the events in batches and
+// may sleep until one arrives, the event kcall lets it wait for input and
+// messages at once. Mouse motion is merged into the last queued packet
+// while the reader has not taken it, so a slow reader sees fewer, larger
+// moves instead of losing packets. Events that find the queue full are
+// dropped and counted.
+
+#define INPUT_QUEUE_SIZE 256
+#define INPUT_READ_MAX 8
+
+struct InputQueue {
+	struct spinlock lock;
+	struct InputEvent event[INPUT_QUEUE_SIZE];
+	unsigned int begin, end; // next to write and next to read
+	struct InputDeviceStats stats;
+};
+
+static struct InputQueue input_queue[INPUT_DEVICES];
+int hal_kbd_send_legacy = 1;
+
+// timestamp of input events, TSC cycles
+static inline unsigned long long input_time(void) {
+#ifndef __riscv
+	return rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// Add the motion of the mouse packet data to the packet in last if the
+// buttons did not change and neither moved the wheel or overflowed.
+// Return 0 if they cannot be merged.
+static int mouse_merge(struct InputEvent *last, unsigned int data) {
+	unsigned int prev = last->data;
+	if (((prev ^ data) >> 24 & 7) || (prev & 0xff) || (data & 0xff) ||
+		((prev | data) >> 24 & 0xc0)) {
 		return 0;
 	}
-	*m = mouse_queue[mouse_queue_end];
-	mouse_queue_end++;
-	if (mouse_queue_end == MOUSE_QUEUE_SIZE) {
-		mouse_queue_end = 0;
+	int dx = (signed char)(prev >> 16) + (signed char)(data >> 16);
+	int dy = (signed char)(prev >> 8) + (signed char)(data >> 8);
+	if (dx < -128 || dx > 127 || dy < -128 || dy > 127) {
+		return 0;
 	}
-	release(&mouse_queue_lock);
-	return 0;
+	unsigned int flags = (prev >> 24 & 0xf) | (dx < 0) << 4 | (dy < 0) << 5;
+	last->data = flags << 24 | (dx & 0xff) << 16 | (dy & 0xff) << 8;
+	return 1;
 }
 
-void hal_mouse_update(unsigned int data) {
-	acquire(&mouse_queue_lock);
-	mouse_queue[mouse_queue_begin] = data;
-	mouse_queue_begin++;
-	if (mouse_queue_begin == MOUSE_QUEUE_SIZE) {
-		mouse_queue_begin = 0;
+static void input_queue_event(int device, unsigned int data) {
+	struct InputQueue *q = &input_queue[device];
+	acquire(&q->lock);
+	q->stats.events++;
+	struct InputEvent *last = &q->event[(q->begin + INPUT_QUEUE_SIZE - 1) % INPUT_QUEUE_SIZE];
+	if (device == INPUT_MOUSE && q->begin != q->end && mouse_merge(last, data)) {
+		q->stats.coalesced++;
+	} else if ((q->begin + 1) % INPUT_QUEUE_SIZE == q->end) {
+		q->stats.dropped++;
+	} else {
+		q->event[q->begin].data = data;
+		q->event[q->begin].time = input_time();
+		q->begin = (q->begin + 1) % INPUT_QUEUE_SIZE;
 	}
-	release(&mouse_queue_lock);
+#ifndef __riscv
+	wakeup(q);
+#endif
+	release(&q->lock);
 }
 
-#define KEYBOARD_QUEUE_SIZE 16
-static unsigned int keyboard_queue[KEYBOARD_QUEUE_SIZE];
-static int keyboard_queue_begin = 0, keyboard_queue_end = 0;
-static struct spinlock keyboard_queue_lock;
-int hal_kbd_send_legacy = 1;
-
-static int keyboard_kcall_handler(unsigned int p) {
-	hal_kbd_send_legacy = 0;
-	unsigned int *m = (void *)p;
-	acquire(&keyboard_queue_lock);
-	if (keyboard_queue_begin == keyboard_queue_end) {
-		*m = 0;
-		release(&keyboard_queue_lock);
+// Take up to count events of device, sleeping until there is one if block.
+// Return the number of events taken.
+static int input_read(int device, struct InputEvent *events, int count, int block) {
+	struct InputQueue *q = &input_queue[device];
+	acquire(&q->lock);
+	while (q->begin == q->end) {
+#ifndef __riscv
+		if (block && !myproc()->killed) {
+			sleep(q, &q->lock);
+			continue;
+		}
+#endif
+		release(&q->lock);
 		return 0;
 	}
-	*m = keyboard_queue[keyboard_queue_end];
-	keyboard_queue_end++;
-	if (keyboard_queue_end == KEYBOARD_QUEUE_SIZE) {
-		keyboard_queue_end = 0;
+	unsigned long long now = input_time();
+	int n = 0;
+	while (n < count && q->end != q->begin) {
+		events[n] = q->event[q->end];
+		unsigned long long latency = now - events[n].time;
+		q->stats.latency_total += latency;
+		if (latency > q->stats.latency_max) {
+			q->stats.latency_max = latency;
+		}
+		q->end = (q->end + 1) % INPUT_QUEUE_SIZE;
+		n++;
 	}
-	release(&keyboard_queue_lock);
-	return 0;
+	q->stats.read += n;
+	release(&q->lock);
+	return n;
+}
+
+void hal_mouse_update(unsigned int data) {
+	input_queue_event(INPUT_MOUSE, data);
+#ifndef __riscv
+	event_notify(EVENT_MOUSE);
+#endif
 }
 
 void hal_keyboard_update(unsigned int data) {
@@ -85,6 +144,7 @@ void hal_keyboard_update(unsigned int data) {
 		procdump();
 #endif
 		print_memory_usage();
+		kmem_cache_print_stats();
 		pci_print_devices();
 		usb_print_devices();
 		virtio_print_devices();
@@ -93,21 +153,76 @@ void hal_keyboard_update(unsigned int data) {
 #endif
 		return;
 	}
-	acquire(&keyboard_queue_lock);
-	keyboard_queue[keyboard_queue_begin] = data;
-	keyboard_queue_begin++;
-	if (keyboard_queue_begin == KEYBOARD_QUEUE_SIZE) {
-		keyboard_queue_begin = 0;
+	input_queue_event(INPUT_KEYBOARD, data);
+#ifndef __riscv
+	event_notify(EVENT_KEYBOARD);
+#endif
+}
+
+// EVENT_KEYBOARD and EVENT_MOUSE if their queues are not empty
+unsigned int hal_hid_pending(void) {
+	static const unsigned int device_event[INPUT_DEVICES] = {
+		[INPUT_KEYBOARD] = EVENT_KEYBOARD,
+		[INPUT_MOUSE] = EVENT_MOUSE,
+	};
+	unsigned int events = 0;
+	for (int i = 0; i < INPUT_DEVICES; i++) {
+		acquire(&input_queue[i].lock);
+		if (input_queue[i].begin != input_queue[i].end) {
+			events |= device_event[i];
+		}
+		release(&input_queue[i].lock);
 	}
-	release(&keyboard_queue_lock);
+	return events;
 }
 
-void hal_hid_init(void) {
-	memset(mouse_queue, 0, sizeof(mouse_queue));
-	kcall_set("mouse", mouse_kcall_handler);
-	initlock(&mouse_queue_lock, "mouse");
+struct InputKcall {
+#define INPUT_KCALL_OP_READ 0
+#define INPUT_KCALL_OP_STATS 1
+	unsigned int op;
+	unsigned int device; // INPUT_KEYBOARD or INPUT_MOUSE
+	unsigned int flags;
+#define INPUT_READ_BLOCK (1 << 0) // sleep until there is an event
+	unsigned int count; // events to read, then events read
+	struct InputEvent events[INPUT_READ_MAX];
+	struct InputDeviceStats stats[INPUT_DEVICES];
+};
 
-	memset(keyboard_queue, 0, sizeof(keyboard_queue));
-	kcall_set("keyboard", keyboard_kcall_handler);
-	initlock(&keyboard_queue_lock, "keyboard");
+static int input_kcall_handler(unsigned int arg) {
+	struct InputKcall *p = (struct InputKcall *)arg;
+	switch (p->op) {
+		case INPUT_KCALL_OP_READ: {
+			if (p->device >= INPUT_DEVICES) {
+				return ERROR_INVAILD;
+			}
+			if (p->device == INPUT_KEYBOARD) {
+				hal_kbd_send_legacy = 0;
+			}
+			struct InputEvent events[INPUT_READ_MAX];
+			int count = p->count < INPUT_READ_MAX ? p->count : INPUT_READ_MAX;
+			int n = input_read(p->device, events, count, p->flags & INPUT_READ_BLOCK);
+			memmove(p->events, events, n * sizeof(struct InputEvent));
+			p->count = n;
+			return 0;
+		}
+		case INPUT_KCALL_OP_STATS: {
+			// copied out after the lock is dropped, storing to p may fault
+			struct InputDeviceStats stats[INPUT_DEVICES];
+			for (int i = 0; i < INPUT_DEVICES; i++) {
+				acquire(&input_queue[i].lock);
+				stats[i] = input_queue[i].stats;
+				release(&input_queue[i].lock);
+			}
+			memmove(p->stats, stats, sizeof(stats));
+			return 0;
+		}
+	}
+	return ERROR_INVAILD;
+}
+
+void hal_hid_init(void) {
+	memset(input_queue, 0, sizeof(input_queue));
+	initlock(&input_queue[INPUT_KEYBOARD].lock, "keyboard");
+	initlock(&input_queue[INPUT_MOUSE].lock, "mouse");
+	kcall_set("input", input_kcall_handler);
 }
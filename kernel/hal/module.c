@@ -153,12 +153,15 @@ static struct KernerServiceTable {
 	void (*panic)(const char *);
 	void *(*pgalloc)(unsigned int);
 	void (*pgfree)(void *, unsigned int);
+	void *(*kmalloc)(unsigned int);
+	void (*kmfree)(void *);
 	void *(*map_mmio_region)(phyaddr_t, size_t);
 	void *(*map_ram_region)(phyaddr_t, size_t);
 	void *(*map_rom_region)(phyaddr_t, size_t);
 	// arch specific
 	int (*msi_alloc_vector)(struct MSIMessage *msg, void (*handler)(void *), void *private);
 	void (*msi_free_vector)(const struct MSIMessage *msg);
+	int (*msi_alloc_vector_cpu)(struct MSIMessage *, int, void (*)(void *), void *);
 	// process control
 	void (*sleep)(void *, struct spinlock *);
 	void (*wakeup)(void *);
@@ -195,6 +198,10 @@ static struct KernerServiceTable {
 	void (*virtio_init_queue)(
 		struct VirtioDevice *, struct VirtioQueue *, unsigned int, void (*)(struct VirtioQueue *)
 	);
+	int (*virtio_queue_add)(struct VirtioQueue *, const struct VirtioBuffer *, int, void *);
+	void (*virtio_queue_kick)(struct VirtioQueue *);
+	void *(*virtio_queue_get)(struct VirtioQueue *, unsigned int *);
+	void *(*virtio_queue_wait)(struct VirtioQueue *, unsigned int *);
 	// driver/usb/usb.h
 	void (*usb_register_host_controller)(void *, const char *, unsigned int, const struct USBHostControllerDriver *);
 	void (*usb_register_driver)(const struct USBDriver *);
@@ -224,11 +231,14 @@ void module_init(void) {
 	kernsrv->panic = panic;
 	kernsrv->pgalloc = pgalloc;
 	kernsrv->pgfree = pgfree;
+	kernsrv->kmalloc = kmalloc;
+	kernsrv->kmfree = kmfree;
 	kernsrv->map_mmio_region = map_mmio_region;
 	kernsrv->map_ram_region = map_ram_region;
 	kernsrv->map_rom_region = map_rom_region;
 	kernsrv->msi_alloc_vector = msi_alloc_vector;
 	kernsrv->msi_free_vector = msi_free_vector;
+	kernsrv->msi_alloc_vector_cpu = msi_alloc_vector_cpu;
 	kernsrv->sleep = sleep;
 	kernsrv->wakeup = wakeup;
 	kernsrv->initlock = initlock;
@@ -259,6 +269,10 @@ void module_init(void) {
 	kernsrv->pci_register_driver = pci_register_driver;
 	kernsrv->virtio_register_driver = virtio_register_driver;
 	kernsrv->virtio_init_queue = virtio_init_queue;
+	kernsrv->virtio_queue_add = virtio_queue_add;
+	kernsrv->virtio_queue_kick = virtio_queue_kick;
+	kernsrv->virtio_queue_get = virtio_queue_get;
+	kernsrv->virtio_queue_wait = virtio_queue_wait;
 	kernsrv->usb_register_host_controller = usb_register_host_controller;
 	kernsrv->usb_register_driver = usb_register_driver;
 	kernsrv->usb_control_transfer_in = usb_control_transfer_in;
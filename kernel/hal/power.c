@@ -58,6 +58,7 @@ void hal_power_init(void) {
 
 void hal_shutdown(void) {
 	cprintf("[hal] shutting down\n");
+	hal_block_sync();
 #ifndef __riscv
 	outw(0x604, 0x2000); // QEMU
 	outw(0xB004, 0x2000); // Bochs
@@ -68,6 +69,7 @@ void hal_shutdown(void) {
 
 void hal_reboot(void) {
 	cprintf("[hal] reboot using port 0xcf9\n");
+	hal_block_sync();
 #ifndef __riscv
 	outb(0xcf9, 6);
 #endif
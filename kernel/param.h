@@ -16,10 +16,12 @@
 #define FSSIZE 1000 // size of file system in blocks
 #define PROC_FILE_MAX 8 // maxium number of file for a process
 #define PTY_MAX 8 // maxnum number of Pseudo Terminal
+#define PROC_VMA_MAX 48 // maximum number of lazily loaded areas of a process
 
 #define PROC_STACK_BOTTOM 0x20000000 // bottom of stack in user space
 #define PROC_HEAP_BOTTOM 0x20000000 // bottom of process heap
 #define PROC_DYNAMIC_BOTTOM 0x40000000 // bottom of dynamic library space
+#define PROC_ANON_BOTTOM 0x60000000 // bottom of anonymous memory mappings
 #define PROC_MMAP_BOTTOM 0x70000000 // bottom of process mmap
 #define PROC_MODULE_BOTTOM 0x90000000
 
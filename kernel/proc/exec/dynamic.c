@@ -27,7 +27,10 @@ int proc_load_dynamic(
 	int sz;
 	unsigned int interp;
 	unsigned int load_base = myproc()->dyn_base;
-	if ((sz = proc_elf_load(proc->pgdir, load_base, name, entry, dynamic, &interp)) < 0) {
+	if (!proc->vmmap && !(proc->vmmap = vm_map_alloc())) {
+		return 0;
+	}
+	if ((sz = proc_elf_load(proc->vmmap, load_base, name, entry, dynamic, &interp)) < 0) {
 		return 0;
 	}
 	myproc()->dyn_base += PGROUNDUP(sz);
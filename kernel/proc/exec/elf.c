@@ -23,9 +23,11 @@
 
 #include "elf.h"
 
+// Load an ELF file at base. PT_LOAD segments are not read here, they are
+// added to vmmap and faulted in page by page on first access.
 int proc_elf_load(
-	pdpte_t *pgdir, unsigned int base, const char *name, unsigned int *entry, unsigned int *dynamic,
-	unsigned int *interp
+	struct VmMap *vmmap, unsigned int base, const char *name, unsigned int *entry,
+	unsigned int *dynamic, unsigned int *interp
 ) {
 	struct FileDesc fd;
 	if (vfs_fd_open(&fd, name, O_READ) < 0) {
@@ -64,28 +66,34 @@ int proc_elf_load(
 		} else if (ph.type != ELF_PROG_LOAD) {
 			continue;
 		}
-		if (allocuvm(
-				pgdir,
-				base + ph.vaddr - ph.vaddr % PGSIZE,
-				base + ph.vaddr + ph.memsz,
-				(ph.flags & ELF_PROG_FLAG_WRITE) ? (PTE_W | PTE_U) : PTE_U
-			) == 0) {
+		if (ph.filesz > ph.memsz || ph.off + ph.filesz > fd.size ||
+			base + ph.vaddr + ph.memsz > KERNBASE) {
 			vfs_fd_close(&fd);
 			return -1;
 		}
-		if (ph.vaddr + ph.memsz > sz) {
-			sz = ph.vaddr + ph.memsz;
+		struct VmArea area = {
+			.begin = base + ph.vaddr - ph.vaddr % PGSIZE,
+			.end = PGROUNDUP(base + ph.vaddr + ph.memsz),
+			.data_end = base + ph.vaddr + ph.filesz,
+			.offset = ph.off - ph.vaddr % PGSIZE,
+			.writable = (ph.flags & ELF_PROG_FLAG_WRITE) ? 1 : 0,
+			.fs_id = fd.fs_id,
+			.block = fd.block,
+			.size = fd.size,
+		};
+		// the file can't be written or removed while it is mapped
+		if (vfs_pagecache_map(fd.fs_id, fd.block, fd.size) < 0) {
+			vfs_fd_close(&fd);
+			return -1;
 		}
-		if (loaduvm(
-				pgdir,
-				(char *)base + ph.vaddr - ph.vaddr % PGSIZE,
-				&fd,
-				ph.off - ph.vaddr % PGSIZE,
-				ph.vaddr % PGSIZE + ph.filesz
-			) < 0) {
+		if (vm_map_add(vmmap, &area) < 0) {
+			vfs_pagecache_unmap(fd.fs_id, fd.block);
 			vfs_fd_close(&fd);
 			return -1;
 		}
+		if (ph.vaddr + ph.memsz > sz) {
+			sz = ph.vaddr + ph.memsz;
+		}
 	}
 
 	vfs_fd_close(&fd);
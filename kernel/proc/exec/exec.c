@@ -27,6 +27,7 @@ int exec(char *path, char **argv) {
 	unsigned int argc, sp, ustack[3 + MAXARG + 1];
 	int sz;
 	pdpte_t *pgdir = 0, *oldpgdir;
+	struct VmMap *vmmap = 0, *oldvmmap;
 	struct proc *curproc = myproc();
 	unsigned int entry, dynamic, interp = 0;
 
@@ -36,7 +37,10 @@ int exec(char *path, char **argv) {
 	}
 
 	// Load program into memory.
-	if ((sz = proc_elf_load(pgdir, 0, path, &entry, &dynamic, &interp)) < 0) {
+	if ((vmmap = vm_map_alloc()) == 0) {
+		goto bad;
+	}
+	if ((sz = proc_elf_load(vmmap, 0, path, &entry, &dynamic, &interp)) < 0) {
 		goto bad;
 	}
 
@@ -80,20 +84,26 @@ int exec(char *path, char **argv) {
 
 	// Commit to the user image.
 	oldpgdir = curproc->pgdir;
+	oldvmmap = curproc->vmmap;
 	curproc->pgdir = pgdir;
+	curproc->vmmap = vmmap;
 	curproc->sz = sz;
 	curproc->stack_size = PGSIZE;
 	curproc->heap_size = 0;
 	curproc->dyn_base = PROC_DYNAMIC_BOTTOM;
 	curproc->tf->eip = entry; // _start
 	curproc->tf->esp = sp;
+	fpu_state_init(&curproc->fpu);
+	fpu_restore(&curproc->fpu);
 	switchuvm(curproc);
 	freevm(oldpgdir);
+	vm_map_free(oldvmmap);
 	return 0;
 
 bad:
 	if (pgdir) {
 		freevm(pgdir);
 	}
+	vm_map_free(vmmap);
 	return -1;
 }
@@ -0,0 +1,200 @@
+/*
+ * Open file objects
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/proc.h>
+#include <defs.h>
+#include <proc/pty.h>
+
+#include "file.h"
+
+// Every file descriptor of a process points to a File. dup() and fork()
+// share the File and count a reference, so the file offset is shared as
+// well and a pipe sees its end closed only when the last reference goes.
+// The sleeplock of a File keeps reads, writes and seeks through the shared
+// offset from interleaving.
+
+static struct {
+	struct spinlock lock; // protects the reference counts
+	struct KmemCache *cache;
+} ftable;
+
+void file_init(void) {
+	initlock(&ftable.lock, "ftable");
+	ftable.cache = kmem_cache_create("file", sizeof(struct File));
+	pipe_init();
+}
+
+// Return a File with one reference, 0 if memory is exhausted
+struct File *file_alloc(enum FileType type, int readable, int writable) {
+	struct File *f = kmem_cache_alloc_try(ftable.cache);
+	if (!f) {
+		return 0;
+	}
+	memset(f, 0, sizeof(struct File));
+	f->type = type;
+	f->ref = 1;
+	f->readable = readable;
+	f->writable = writable;
+	initsleeplock(&f->lock, "file");
+	return f;
+}
+
+struct File *file_dup(struct File *f) {
+	acquire(&ftable.lock);
+	if (f->ref < 1) {
+		panic("file_dup");
+	}
+	f->ref++;
+	release(&ftable.lock);
+	return f;
+}
+
+// drop a reference, return 1 if it was the last one
+static int file_put(struct File *f) {
+	acquire(&ftable.lock);
+	if (f->ref < 1) {
+		panic("file_close");
+	}
+	int last = --f->ref == 0;
+	release(&ftable.lock);
+	return last;
+}
+
+void file_close(struct File *f) {
+	if (!file_put(f)) {
+		return;
+	}
+	switch (f->type) {
+		case FILE_VFS:
+			vfs_fd_close(&f->fd);
+			break;
+		case FILE_DIR:
+			vfs_dir_close(&f->fd);
+			break;
+		case FILE_PIPE:
+			pipe_close(f->pipe, f->writable);
+			break;
+		default:
+			break;
+	}
+	kmem_cache_free(ftable.cache, f);
+}
+
+// Like file_close() but never sleeps, for a File whose open failed or
+// that was never installed. The size of a written file is not updated.
+void file_abandon(struct File *f) {
+	if (!file_put(f)) {
+		return;
+	}
+	if (f->type == FILE_VFS && f->fd.used && f->fd.write) {
+		vfs_path_free(f->fd.path.pathbuf);
+		vfs_pagecache_put_write(f->fd.fs_id, f->fd.block);
+	} else if (f->type == FILE_PIPE && f->pipe) {
+		pipe_close(f->pipe, f->writable);
+	}
+	kmem_cache_free(ftable.cache, f);
+}
+
+int file_read(struct File *f, char *buf, int n) {
+	if (!f->readable) {
+		return ERROR_INVAILD;
+	}
+	switch (f->type) {
+		case FILE_CONSOLE:
+			if (myproc()->pty == 0) {
+				return consoleread(buf, n);
+			}
+			return pty_read(myproc()->pty - 1, buf, n);
+		case FILE_VFS: {
+			acquiresleep(&f->lock);
+			int r = vfs_fd_read(&f->fd, buf, n);
+			releasesleep(&f->lock);
+			return r;
+		}
+		case FILE_PIPE:
+			return pipe_read(f->pipe, buf, n);
+		default:
+			return ERROR_INVAILD;
+	}
+}
+
+int file_write(struct File *f, const char *buf, int n) {
+	if (!f->writable) {
+		return ERROR_INVAILD;
+	}
+	switch (f->type) {
+		case FILE_CONSOLE:
+			if (myproc()->pty == 0) {
+				return consolewrite((char *)buf, n);
+			}
+			return pty_write(myproc()->pty - 1, buf, n);
+		case FILE_VFS: {
+			acquiresleep(&f->lock);
+			int r = vfs_fd_write(&f->fd, buf, n);
+			releasesleep(&f->lock);
+			return r;
+		}
+		case FILE_PIPE:
+			return pipe_write(f->pipe, buf, n);
+		default:
+			return ERROR_INVAILD;
+	}
+}
+
+int file_seek(struct File *f, unsigned int off, enum FileSeekMode mode) {
+	if (f->type != FILE_VFS) {
+		return ERROR_INVAILD;
+	}
+	acquiresleep(&f->lock);
+	int r = vfs_fd_seek(&f->fd, off, mode);
+	releasesleep(&f->lock);
+	return r;
+}
+
+int file_dir_read(struct File *f, char *buf) {
+	if (f->type != FILE_DIR) {
+		return ERROR_INVAILD;
+	}
+	acquiresleep(&f->lock);
+	int r = vfs_dir_read(&f->fd, buf);
+	releasesleep(&f->lock);
+	return r;
+}
+
+// the open file of a descriptor of the current process, 0 if none
+struct File *fd_get(int fd) {
+	if (fd < 0 || fd >= PROC_FILE_MAX) {
+		return 0;
+	}
+	return myproc()->files[fd];
+}
+
+// install f in the lowest free descriptor of the current process
+int fd_alloc(struct File *f) {
+	struct proc *p = myproc();
+	for (int i = 0; i < PROC_FILE_MAX; i++) {
+		if (!p->files[i]) {
+			p->files[i] = f;
+			return i;
+		}
+	}
+	return ERROR_OUT_OF_SPACE;
+}
@@ -0,0 +1,55 @@
+#ifndef _PROC_FILE_H
+#define _PROC_FILE_H
+
+#include <common/sleeplock.h>
+#include <common/spinlock.h>
+#include <filesystem/vfs/vfs.h>
+
+// An open file, shared by every file descriptor that refers to it after
+// dup() or fork(). The last close releases it.
+enum FileType {
+	FILE_CONSOLE, // the console, or the pseudoterminal of the process using it
+	FILE_VFS, // regular file
+	FILE_DIR, // directory
+	FILE_PIPE,
+};
+
+struct File {
+	enum FileType type;
+	int ref;
+	int readable, writable;
+	struct sleeplock lock; // serializes the users of the shared offset in fd
+	struct FileDesc fd; // FILE_VFS and FILE_DIR
+	struct Pipe *pipe; // FILE_PIPE
+};
+
+#define PIPE_SIZE 16384
+
+struct Pipe {
+	struct spinlock lock;
+	char *buffer; // ring of PIPE_SIZE bytes
+	unsigned int nread, nwrite; // bytes read and written so far
+	int readopen, writeopen; // the ends are still open
+};
+
+// file.c
+void file_init(void);
+struct File *file_alloc(enum FileType type, int readable, int writable);
+struct File *file_dup(struct File *f);
+void file_close(struct File *f);
+void file_abandon(struct File *f);
+int file_read(struct File *f, char *buf, int n);
+int file_write(struct File *f, const char *buf, int n);
+int file_seek(struct File *f, unsigned int off, enum FileSeekMode mode);
+int file_dir_read(struct File *f, char *buf);
+struct File *fd_get(int fd);
+int fd_alloc(struct File *f);
+
+// pipe.c
+void pipe_init(void);
+int pipe_alloc(struct File **rf, struct File **wf);
+void pipe_close(struct Pipe *pipe, int writable);
+int pipe_read(struct Pipe *pipe, char *buf, int n);
+int pipe_write(struct Pipe *pipe, const char *buf, int n);
+
+#endif
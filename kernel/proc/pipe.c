@@ -0,0 +1,149 @@
+/*
+ * Pipes
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/proc.h>
+#include <defs.h>
+
+#include "file.h"
+
+// A pipe is a ring buffer between a read File and a write File. Readers
+// sleep while it is empty and writers while it is full, each side wakes
+// the other after moving data. Data is copied in runs up to the end of
+// the ring rather than byte by byte.
+
+static struct KmemCache *pipe_cache;
+
+void pipe_init(void) {
+	pipe_cache = kmem_cache_create("pipe", sizeof(struct Pipe));
+}
+
+// Make a pipe and a File for each end, return -1 if memory is exhausted
+int pipe_alloc(struct File **rf, struct File **wf) {
+	struct Pipe *pipe = kmem_cache_alloc_try(pipe_cache);
+	if (!pipe) {
+		return -1;
+	}
+	pipe->buffer = pgalloc_try(PIPE_SIZE / PGSIZE);
+	if (!pipe->buffer) {
+		kmem_cache_free(pipe_cache, pipe);
+		return -1;
+	}
+	initlock(&pipe->lock, "pipe");
+	pipe->nread = pipe->nwrite = 0;
+	pipe->readopen = pipe->writeopen = 1;
+	*rf = file_alloc(FILE_PIPE, 1, 0);
+	*wf = file_alloc(FILE_PIPE, 0, 1);
+	if (!*rf || !*wf) {
+		if (*rf) {
+			file_abandon(*rf);
+		}
+		if (*wf) {
+			file_abandon(*wf);
+		}
+		pgfree(pipe->buffer, PIPE_SIZE / PGSIZE);
+		kmem_cache_free(pipe_cache, pipe);
+		return -1;
+	}
+	(*rf)->pipe = pipe;
+	(*wf)->pipe = pipe;
+	return 0;
+}
+
+// close one end, the pipe is freed with the second
+void pipe_close(struct Pipe *pipe, int writable) {
+	acquire(&pipe->lock);
+	if (writable) {
+		pipe->writeopen = 0;
+		wakeup(&pipe->nread);
+	} else {
+		pipe->readopen = 0;
+		wakeup(&pipe->nwrite);
+	}
+	if (pipe->readopen || pipe->writeopen) {
+		release(&pipe->lock);
+		return;
+	}
+	release(&pipe->lock);
+	pgfree(pipe->buffer, PIPE_SIZE / PGSIZE);
+	kmem_cache_free(pipe_cache, pipe);
+}
+
+// Write all of buf, sleeping while the pipe is full. Return the bytes
+// written, fewer if the read end was closed.
+int pipe_write(struct Pipe *pipe, const char *buf, int n) {
+	struct proc *p = myproc();
+	int written = 0;
+	acquire(&pipe->lock);
+	while (written < n) {
+		while (pipe->nwrite - pipe->nread == PIPE_SIZE && pipe->readopen && !p->killed) {
+			wakeup(&pipe->nread);
+			sleep(&pipe->nwrite, &pipe->lock);
+		}
+		if (!pipe->readopen || p->killed) {
+			break;
+		}
+		unsigned int offset = pipe->nwrite % PIPE_SIZE;
+		unsigned int len = PIPE_SIZE - (pipe->nwrite - pipe->nread);
+		if (len > PIPE_SIZE - offset) {
+			len = PIPE_SIZE - offset;
+		}
+		if (len > (unsigned int)(n - written)) {
+			len = n - written;
+		}
+		memmove(pipe->buffer + offset, buf + written, len);
+		pipe->nwrite += len;
+		written += len;
+	}
+	wakeup(&pipe->nread);
+	release(&pipe->lock);
+	return written || !n ? written : ERROR_WRITE_FAIL;
+}
+
+// Read what is in the pipe, up to n bytes, sleeping while it is empty.
+// Return 0 once it is empty and the write end was closed.
+int pipe_read(struct Pipe *pipe, char *buf, int n) {
+	struct proc *p = myproc();
+	acquire(&pipe->lock);
+	while (pipe->nread == pipe->nwrite && pipe->writeopen && !p->killed) {
+		sleep(&pipe->nread, &pipe->lock);
+	}
+	if (p->killed) {
+		release(&pipe->lock);
+		return ERROR_READ_FAIL;
+	}
+	int done = 0;
+	while (done < n && pipe->nread != pipe->nwrite) {
+		unsigned int offset = pipe->nread % PIPE_SIZE;
+		unsigned int len = pipe->nwrite - pipe->nread;
+		if (len > PIPE_SIZE - offset) {
+			len = PIPE_SIZE - offset;
+		}
+		if (len > (unsigned int)(n - done)) {
+			len = n - done;
+		}
+		memmove(buf + done, pipe->buffer + offset, len);
+		pipe->nread += len;
+		done += len;
+	}
+	wakeup(&pipe->nwrite);
+	release(&pipe->lock);
+	return done;
+}
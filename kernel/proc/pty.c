@@ -19,6 +19,7 @@
 
 #include <common/errorcode.h>
 #include <common/spinlock.h>
+#include <core/proc.h>
 #include <defs.h>
 
 #include "pty.h"
@@ -61,6 +62,10 @@ int pty_close(int ptyid) {
 int pty_read(int ptyid, char *buf, int n) {
 	acquire(&pty[ptyid].lock);
 	while (pty[ptyid].input_begin == pty[ptyid].input_end) {
+		if (myproc()->killed) {
+			release(&pty[ptyid].lock);
+			return -1;
+		}
 		sleep(&pty[ptyid].input_buffer, &pty[ptyid].lock);
 	}
 	for (int i = 0; i < n; i++) {
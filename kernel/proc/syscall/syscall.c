@@ -59,14 +59,18 @@ int argint(int n, int *ip) {
 }
 
 // Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// to a block of memory of size bytes. Lazily loaded pages of
+// the block are faulted in, so the kernel can use it while
+// holding locks.
 int argptr(int n, char **pp, int size) {
 	int i;
 
 	if (argint(n, &i) < 0) {
 		return -1;
 	}
+	if (vm_fault_in(myproc(), i, size) < 0) {
+		return -1;
+	}
 	*pp = (char *)i;
 	return 0;
 }
@@ -124,6 +128,10 @@ extern int sys_pty_close(void);
 extern int sys_pty_switch(void);
 extern int sys_proc_status(void);
 extern int sys_module_load(void);
+extern int sys_mem_map(void);
+extern int sys_mem_unmap(void);
+extern int sys_dup2(void);
+extern int sys_message_sendv(void);
 
 static int (*syscalls[])(void) = {
 	[SYS_fork] = sys_fork,
@@ -167,6 +175,10 @@ static int (*syscalls[])(void) = {
 	[SYS_pty_switch] = sys_pty_switch,
 	[SYS_proc_status] = sys_proc_status,
 	[SYS_module_load] = sys_module_load,
+	[SYS_mem_map] = sys_mem_map,
+	[SYS_mem_unmap] = sys_mem_unmap,
+	[SYS_dup2] = sys_dup2,
+	[SYS_message_sendv] = sys_message_sendv,
 };
 
 void syscall(void) {
@@ -174,6 +186,7 @@ void syscall(void) {
 	struct proc *curproc = myproc();
 
 	num = curproc->tf->eax;
+	curproc->stats.syscalls++;
 	if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
 		curproc->tf->eax = syscalls[num]();
 	} else {
@@ -62,5 +62,9 @@
 #define SYS_pty_switch 39
 #define SYS_proc_status 40
 #define SYS_module_load 41
+#define SYS_mem_map 42
+#define SYS_mem_unmap 43
+#define SYS_dup2 44
+#define SYS_message_sendv 45
 
 #endif
@@ -17,59 +17,89 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
 #include <common/x86.h>
 #include <core/proc.h>
 #include <defs.h>
 #include <filesystem/initramfs/initramfs.h>
 #include <memlayout.h>
 #include <param.h>
-#include <proc/pty.h>
+#include <proc/file.h>
+
+// Fetch the nth system call argument as a file descriptor of the current
+// process and return its open file, 0 if it is not open.
+static struct File *argfile(int n, int *pfd) {
+	int fd;
+	if (argint(n, &fd) < 0) {
+		return 0;
+	}
+	if (pfd) {
+		*pfd = fd;
+	}
+	return fd_get(fd);
+}
 
 int sys_dup(void) {
-	return 0;
+	struct File *f = argfile(0, 0);
+	if (!f) {
+		return -1;
+	}
+	int fd = fd_alloc(f);
+	if (fd >= 0) {
+		file_dup(f);
+	}
+	return fd;
+}
+
+int sys_dup2(void) {
+	int oldfd, newfd;
+	struct File *f = argfile(0, &oldfd);
+	if (!f || argint(1, &newfd) < 0 || newfd < 0 || newfd >= PROC_FILE_MAX) {
+		return -1;
+	}
+	if (newfd == oldfd) {
+		return newfd;
+	}
+	struct proc *p = myproc();
+	file_dup(f);
+	if (p->files[newfd]) {
+		file_close(p->files[newfd]);
+	}
+	p->files[newfd] = f;
+	return newfd;
 }
 
 int sys_read(void) {
-	int n, fd;
+	int n;
 	char *p;
+	struct File *f = argfile(0, 0);
 
-	if (argint(0, &fd) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0) {
+	if (!f || argint(2, &n) < 0 || argptr(1, &p, n) < 0) {
 		return -1;
 	}
-	if (fd < 3) {
-		if (myproc()->pty == 0) {
-			return consoleread(p, n);
-		} else {
-			return pty_read(myproc()->pty - 1, p, n);
-		}
-	}
-	return vfs_fd_read(&myproc()->files[fd], p, n);
+	return file_read(f, p, n);
 }
 
 int sys_write(void) {
-	int n, fd;
+	int n;
 	char *p;
+	struct File *f = argfile(0, 0);
 
-	if (argint(0, &fd) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0) {
+	if (!f || argint(2, &n) < 0 || argptr(1, &p, n) < 0) {
 		return -1;
 	}
-	if (fd < 3) {
-		if (myproc()->pty == 0) {
-			return consolewrite(p, n);
-		} else {
-			return pty_write(myproc()->pty - 1, p, n);
-		}
-	}
-
-	return vfs_fd_write(&myproc()->files[fd], p, n);
+	return file_write(f, p, n);
 }
 
 int sys_close(void) {
 	int fd;
-	if (argint(0, &fd) < 0) {
+	struct File *f = argfile(0, &fd);
+	if (!f) {
 		return -1;
 	}
-	return vfs_fd_close(&myproc()->files[fd]);
+	myproc()->files[fd] = 0;
+	file_close(f);
+	return 0;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -93,16 +123,19 @@ int sys_open(void) {
 		return -1;
 	}
 
-	for (int i = 3; i < PROC_FILE_MAX; i++) {
-		if (myproc()->files[i].used == 0) {
-			int ret;
-			if ((ret = vfs_fd_open(&myproc()->files[i], path, omode)) < 0) {
-				return ret;
-			}
-			return i;
-		}
+	struct File *f = file_alloc(FILE_VFS, omode & O_READ, omode & O_WRITE);
+	if (!f) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	int ret;
+	if ((ret = vfs_fd_open(&f->fd, path, omode)) < 0) {
+		file_abandon(f);
+		return ret;
 	}
-	return -1;
+	if ((ret = fd_alloc(f)) < 0) {
+		file_close(f);
+	}
+	return ret;
 }
 
 int sys_mkdir(void) {
@@ -145,6 +178,22 @@ int sys_exec(void) {
 }
 
 int sys_pipe(void) {
+	int *fds;
+	struct File *rf, *wf;
+	if (argptr(0, (char **)&fds, 2 * sizeof(int)) < 0 || pipe_alloc(&rf, &wf) < 0) {
+		return -1;
+	}
+	int rfd = fd_alloc(rf), wfd = rfd >= 0 ? fd_alloc(wf) : -1;
+	if (wfd < 0) {
+		if (rfd >= 0) {
+			myproc()->files[rfd] = 0;
+		}
+		file_close(rf);
+		file_close(wf);
+		return -1;
+	}
+	fds[0] = rfd;
+	fds[1] = wfd;
 	return 0;
 }
 
@@ -153,32 +202,39 @@ int sys_dir_open(void) {
 	if (argstr(0, &dirname) < 0) {
 		return -1;
 	}
-	for (int i = 3; i < PROC_FILE_MAX; i++) {
-		if (myproc()->files[i].used == 0) {
-			if (vfs_dir_open(&myproc()->files[i], dirname) < 0) {
-				return -1;
-			}
-			return i;
-		}
+	struct File *f = file_alloc(FILE_DIR, 1, 0);
+	if (!f) {
+		return -1;
 	}
-	return -1;
+	if (vfs_dir_open(&f->fd, dirname) < 0) {
+		file_abandon(f);
+		return -1;
+	}
+	int fd = fd_alloc(f);
+	if (fd < 0) {
+		file_close(f);
+	}
+	return fd;
 }
 
 int sys_dir_read(void) {
-	int handle;
 	char *buffer;
-	if ((argint(0, &handle) < 0) || (argptr(1, &buffer, 256) < 0)) {
+	struct File *f = argfile(0, 0);
+	if (!f || f->type != FILE_DIR || (argptr(1, &buffer, 256) < 0)) {
 		return -1;
 	}
-	return vfs_dir_read(&myproc()->files[handle], buffer);
+	return file_dir_read(f, buffer);
 }
 
 int sys_dir_close(void) {
 	int handle;
-	if (argint(0, &handle) < 0) {
+	struct File *f = argfile(0, &handle);
+	if (!f || f->type != FILE_DIR) {
 		return -1;
 	}
-	return vfs_dir_close(&myproc()->files[handle]);
+	myproc()->files[handle] = 0;
+	file_close(f);
+	return 0;
 }
 
 int sys_file_get_size(void) {
@@ -190,11 +246,12 @@ int sys_file_get_size(void) {
 }
 
 int sys_lseek(void) {
-	int fd, offset, whence;
-	if (argint(0, &fd) < 0 || argint(1, &offset) < 0 || argint(2, &whence) < 0) {
+	int offset, whence;
+	struct File *f = argfile(0, 0);
+	if (!f || argint(1, &offset) < 0 || argint(2, &whence) < 0) {
 		return -1;
 	}
-	return vfs_fd_seek(&myproc()->files[fd], offset, whence);
+	return file_seek(f, offset, whence);
 }
 
 int sys_file_get_mode(void) {
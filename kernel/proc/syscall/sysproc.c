@@ -69,6 +69,25 @@ int sys_sbrk(void) {
 	return addr;
 }
 
+int sys_mem_map(void) {
+	int addr, size;
+
+	if (argint(0, &addr) < 0 || argint(1, &size) < 0 || size <= 0) {
+		return -1;
+	}
+	unsigned int va = vm_map_anon(myproc(), addr, size);
+	return va ? (int)va : -1;
+}
+
+int sys_mem_unmap(void) {
+	int addr, size;
+
+	if (argint(0, &addr) < 0 || argint(1, &size) < 0 || size <= 0) {
+		return -1;
+	}
+	return vm_unmap_anon(myproc(), addr, size);
+}
+
 int sys_sleep(void) {
 	int n;
 	unsigned int ticks0;
@@ -112,6 +131,7 @@ int sys_chdir(void) {
 			return mode;
 		}
 		if (mode & 0040000) { // is a directory
+			// the path was checked by vfs_file_get_mode()
 			struct proc *p = myproc();
 			p->cwd.parts = vfs_path_split(dir, p->cwd.pathbuf);
 		} else { // not a directory
@@ -119,22 +139,24 @@ int sys_chdir(void) {
 		}
 		return 0;
 	} else { // relative path
-		struct VfsPath newpath = {.pathbuf = kalloc()};
-		newpath.parts = vfs_path_split(dir, newpath.pathbuf);
-		vfs_get_absolute_path(&newpath);
-		char fullpath[64];
+		struct VfsPath newpath;
+		if (vfs_path_resolve(dir, &newpath) < 0) {
+			return ERROR_INVAILD;
+		}
+		char *fullpath = kalloc(); // holds VFS_PATH_MAX_PARTS parts of 128 bytes
 		vfs_path_tostring(newpath, fullpath);
 		int mode = vfs_file_get_mode(fullpath);
+		kfree(fullpath);
 		if (mode < 0) {
-			kfree(newpath.pathbuf);
+			vfs_path_free(newpath.pathbuf);
 			return mode;
 		}
 		if (mode & 0040000) { // is a directory
 			struct proc *p = myproc();
-			kfree(p->cwd.pathbuf);
+			vfs_path_free(p->cwd.pathbuf);
 			p->cwd = newpath;
 		} else { // not a directory
-			kfree(newpath.pathbuf);
+			vfs_path_free(newpath.pathbuf);
 			return ERROR_NOT_DIRECTORY;
 		}
 		return 0;
@@ -161,81 +183,97 @@ int sys_dynamic_load(void) {
 	return proc_load_dynamic(myproc(), name, dynamic, entry);
 }
 
+#define KCALL_PREFAULT_SIZE 256 // start of a kcall request faulted in
+
 int sys_kcall(void) {
 	char *name;
 	unsigned int arg;
 	if (argstr(0, &name) < 0 || argint(1, (int *)&arg) < 0) {
 		return -1;
 	}
+	// arg usually points to a request structure. Handlers fill it only
+	// after dropping their locks, but a page of it that cannot be loaded
+	// fails the call here rather than faulting in the kernel.
+	if (vm_fault_in(myproc(), arg, KCALL_PREFAULT_SIZE) < 0) {
+		return ERROR_INVAILD;
+	}
 	return kcall(name, arg);
 }
 
-int sys_message_send(void) {
-	int pid, size;
-	void *data;
-	if ((argint(0, &pid) < 0) || (argint(1, &size) < 0) || (argptr(2, (char **)&data, size) < 0)) {
+#define MESSAGE_VEC_MAX 16
+
+// check a user buffer of the current process and fault it in
+static int message_buffer_check(unsigned int addr, int size) {
+	if (size < 0 || addr >= KERNBASE || (unsigned int)size > KERNBASE - addr) {
 		return -1;
 	}
-	struct proc *destproc = proc_search_pid(pid);
-	if (!destproc) {
+	return vm_fault_in(myproc(), addr, size);
+}
+
+static int message_sendv(int pid, const struct MessageVec *vec, int count, int flags) {
+	for (int i = 0; i < count; i++) {
+		if (message_buffer_check((unsigned int)vec[i].base, vec[i].size) < 0) {
+			return -1;
+		}
+	}
+	struct Message m;
+	if (message_build(&m, vec, count) < 0) {
 		return -1;
 	}
-	acquire(&destproc->msgqueue.lock);
-	struct Message *destmsg = &destproc->msgqueue.queue[destproc->msgqueue.begin];
-	destmsg->pid = myproc()->pid;
-	destmsg->size = size;
-	destmsg->addr = pgalloc(PGROUNDUP(size) / 4096);
-	memmove(destmsg->addr, data, size);
-	destproc->msgqueue.begin++;
-	if (destproc->msgqueue.begin == MESSAGE_MAX) {
-		destproc->msgqueue.begin = 0;
-	}
-	wakeup(&destproc->msgqueue);
-	release(&destproc->msgqueue.lock);
-	return 0;
+	int ret = message_send(pid, &m, flags);
+	if (ret < 0) {
+		message_free(&m);
+	}
+	return ret;
 }
 
-int sys_message_receive(void) {
-	void *data;
-	if (argptr(0, (char **)&data, 4 * 1024 * 1024) < 0) {
+int sys_message_send(void) {
+	int pid;
+	struct MessageVec vec;
+	if ((argint(0, &pid) < 0) || (argint(1, &vec.size) < 0) || (argint(2, (int *)&vec.base) < 0)) {
 		return -1;
 	}
-	acquire(&myproc()->msgqueue.lock);
-	if (myproc()->msgqueue.begin == myproc()->msgqueue.end) {
-		release(&myproc()->msgqueue.lock);
-		return 0;
-	}
-	struct Message *thismsg = &myproc()->msgqueue.queue[myproc()->msgqueue.end];
-	int ret = thismsg->pid;
-	memmove(data, thismsg->addr, thismsg->size);
-	pgfree(thismsg->addr, PGROUNDUP(thismsg->size) / 4096);
-	myproc()->msgqueue.end++;
-	if (myproc()->msgqueue.end == MESSAGE_MAX) {
-		myproc()->msgqueue.end = 0;
+	return message_sendv(pid, &vec, 1, 0);
+}
+
+int sys_message_sendv(void) {
+	int pid, count, flags;
+	struct MessageVec *uvec;
+	if (argint(0, &pid) < 0 || argint(2, &count) < 0 || argint(3, &flags) < 0 || count < 0 ||
+		count > MESSAGE_VEC_MAX ||
+		argptr(1, (char **)&uvec, count * sizeof(struct MessageVec)) < 0) {
+		return -1;
 	}
-	release(&myproc()->msgqueue.lock);
-	return ret;
+	struct MessageVec vec[MESSAGE_VEC_MAX];
+	memmove(vec, uvec, count * sizeof(struct MessageVec));
+	return message_sendv(pid, vec, count, flags);
 }
 
-int sys_message_wait(void) {
-	void *data;
-	if (argptr(0, (char **)&data, 4 * 1024 * 1024) < 0) {
+// Receive the oldest message into the user buffer at argument 0, return
+// the sender's pid or 0 if there is none and block is not set
+static int message_receive(int block) {
+	int addr;
+	struct Message m;
+	if (argint(0, &addr) < 0) {
 		return -1;
 	}
-	acquire(&myproc()->msgqueue.lock);
-	while (myproc()->msgqueue.begin == myproc()->msgqueue.end) {
-		sleep(&myproc()->msgqueue, &myproc()->msgqueue.lock);
+	if (!message_dequeue(&m, block)) {
+		return 0;
 	}
-	struct Message *thismsg = &myproc()->msgqueue.queue[myproc()->msgqueue.end];
-	int ret = thismsg->pid;
-	memmove(data, thismsg->addr, thismsg->size);
-	pgfree(thismsg->addr, PGROUNDUP(thismsg->size) / 4096);
-	myproc()->msgqueue.end++;
-	if (myproc()->msgqueue.end == MESSAGE_MAX) {
-		myproc()->msgqueue.end = 0;
+	if (message_buffer_check(addr, m.size) < 0) {
+		message_free(&m);
+		return -1;
 	}
-	release(&myproc()->msgqueue.lock);
-	return ret;
+	message_deliver(&m, (char *)addr);
+	return m.pid;
+}
+
+int sys_message_receive(void) {
+	return message_receive(0);
+}
+
+int sys_message_wait(void) {
+	return message_receive(1);
 }
 
 int sys_getppid(void) {
@@ -0,0 +1,41 @@
+/*
+ * malloc.h header
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBC_MALLOC_H
+#define _LIBC_MALLOC_H
+
+#include <stddef.h>
+
+struct MallocStats {
+	size_t heap_size; // bytes of heap obtained with sbrk()
+	size_t in_use; // heap bytes in allocated blocks, including headers
+	size_t small_cached; // heap bytes of freed small blocks kept for reuse
+	size_t free_size; // heap bytes in free blocks
+	size_t mapped_size; // bytes of large blocks in their own mappings
+	unsigned int mapped_blocks;
+	unsigned int mallocs, frees, reallocs;
+	unsigned int reallocs_in_place; // reallocs that did not move the block
+	unsigned int small_hits; // allocations served from the small bins
+	unsigned int heap_grows, heap_trims;
+};
+
+void malloc_get_stats(struct MallocStats *stats);
+void malloc_stats(void);
+
+#endif
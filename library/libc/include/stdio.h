@@ -20,16 +20,31 @@
 #ifndef _LIBC_STDIO_H
 #define _LIBC_STDIO_H
 
+#include <stdarg.h>
 #include <stddef.h>
 
-typedef struct {
+typedef struct __libc_file {
 	int fd;
+	int flags; // stream state, internal to libc
+	int mode; // _IOFBF, _IOLBF or _IONBF
+	unsigned char *buf;
+	size_t size;
+	unsigned char *rpos, *rend; // data read ahead and not consumed yet
+	unsigned char *wpos; // end of buffered data not written yet
+	struct __libc_file *next; // all open streams
+	unsigned char unbuf[9]; // buffer of unbuffered streams, room for ungetc()
 } FILE;
 
 typedef int fpos_t;
 
+#define BUFSIZ 4096
 #define EOF -1
 
+// buffering modes for setvbuf()
+#define _IOFBF 0
+#define _IOLBF 1
+#define _IONBF 2
+
 #define SEEK_CUR 0
 #define SEEK_END 1
 #define SEEK_SET 2
@@ -44,10 +59,22 @@ int remove(const char *filename);
 
 // file access functions
 int fclose(FILE *stream);
+int fflush(FILE *stream);
 FILE *fopen(const char *restrict filename, const char *restrict mode);
+void setbuf(FILE *restrict stream, char *restrict buf);
+int setvbuf(FILE *restrict stream, char *restrict buf, int mode, size_t size);
 
 // formatted input/output functions
+int dprintf(int fd, const char *restrict format, ...);
+int fprintf(FILE *restrict stream, const char *restrict format, ...);
 int printf(const char *restrict format, ...);
+int snprintf(char *restrict s, size_t n, const char *restrict format, ...);
+int sprintf(char *restrict s, const char *restrict format, ...);
+int vdprintf(int fd, const char *restrict format, va_list arg);
+int vfprintf(FILE *restrict stream, const char *restrict format, va_list arg);
+int vprintf(const char *restrict format, va_list arg);
+int vsnprintf(char *restrict s, size_t n, const char *restrict format, va_list arg);
+int vsprintf(char *restrict s, const char *restrict format, va_list arg);
 
 // character input/output functions
 int fgetc(FILE *stream);
@@ -59,6 +86,7 @@ int getchar(void);
 int putc(int c, FILE *stream);
 int putchar(int c);
 int puts(const char *s);
+int ungetc(int c, FILE *stream);
 
 // direct input/output functions
 size_t fread(void *restrict ptr, size_t size, size_t nmemb, FILE *restrict stream);
@@ -72,6 +100,9 @@ long ftell(FILE *stream);
 void rewind(FILE *stream);
 
 // error-handling functions
+void clearerr(FILE *stream);
+int feof(FILE *stream);
+int ferror(FILE *stream);
 void perror(const char *s);
 
 #endif
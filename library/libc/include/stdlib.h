@@ -31,9 +31,11 @@ long int atol(const char *nptr);
 long long int atoll(const char *nptr);
 
 // memory management functions
+void *aligned_alloc(size_t alignment, size_t size);
 void *calloc(size_t nmemb, size_t size);
 void free(void *ptr);
 void *malloc(size_t size);
+void *realloc(void *ptr, size_t size);
 
 // communication with the environment
 _Noreturn void abort(void);
@@ -21,10 +21,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "file.h"
+
 int fclose(FILE *stream) {
+	int ret = __libc_file_flush(stream);
+	for (FILE **p = &__libc_file_list; *p; p = &(*p)->next) {
+		if (*p == stream) {
+			*p = stream->next;
+			break;
+		}
+	}
 	if (close(stream->fd) < 0) {
-		return EOF;
+		ret = EOF;
+	}
+	if (stream->flags & FILE_OWNBUF) {
+		free(stream->buf);
+	}
+	if (stream->flags & FILE_ALLOC) {
+		free(stream);
 	}
-	free(stream);
-	return 0;
+	return ret;
 }
@@ -1,5 +1,5 @@
 /*
- * free function
+ * feof function
  *
  * This file is part of PanicOS.
  *
@@ -17,6 +17,10 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-void free(void *ptr) {
-	return;
+#include <stdio.h>
+
+#include "file.h"
+
+int feof(FILE *stream) {
+	return (stream->flags & FILE_EOF) != 0;
 }
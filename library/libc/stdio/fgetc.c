@@ -17,13 +17,13 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
+#include "file.h"
+
 int fgetc(FILE *stream) {
-	char c;
-	if (read(stream->fd, &c, 1) <= 0) {
+	if (stream->rpos == stream->rend && __libc_file_refill(stream) < 0) {
 		return EOF;
 	}
-	return c;
+	return *stream->rpos++;
 }
@@ -17,11 +17,10 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
 int fgetpos(FILE *restrict stream, fpos_t *restrict pos) {
-	fpos_t position = lseek(stream->fd, 0, FILE_SEEK_CUR);
+	fpos_t position = ftell(stream);
 	if (position < 0) {
 		return position;
 	}
@@ -19,21 +19,39 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "file.h"
 
 char *fgets(char *restrict s, int n, FILE *restrict stream) {
-	char *str = s;
-	while (--n) {
-		int c = fgetc(stream);
-		if (c == '\n') {
-			*s = c;
-			*(++s) = '\0';
-			return str;
-		} else if (c == EOF) {
-			*s = '\0';
-			return NULL;
+	if (n <= 0) {
+		return NULL;
+	}
+	char *p = s;
+	while (n > 1) {
+		if (stream->rpos == stream->rend && __libc_file_refill(stream) < 0) {
+			if (p == s) {
+				return NULL;
+			}
+			break;
+		}
+		// copy up to the end of line straight out of the buffer
+		size_t count = stream->rend - stream->rpos;
+		if (count > (size_t)n - 1) {
+			count = n - 1;
+		}
+		unsigned char *newline = memchr(stream->rpos, '\n', count);
+		if (newline) {
+			count = newline - stream->rpos + 1;
+		}
+		memcpy(p, stream->rpos, count);
+		stream->rpos += count;
+		p += count;
+		n -= count;
+		if (newline) {
+			break;
 		}
-		*s = c;
-		s++;
 	}
-	return str;
+	*p = '\0';
+	return s;
 }
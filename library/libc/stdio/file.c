@@ -0,0 +1,177 @@
+/*
+ * Buffered stream internals
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+
+extern FILE __libc_stdin;
+
+FILE *__libc_file_list = &__libc_stdin;
+
+// give the stream a buffer on its first use
+int __libc_file_setup(FILE *stream) {
+	if (stream->buf) {
+		return 0;
+	}
+	if (stream->mode != _IONBF) {
+		size_t size = stream->size ? stream->size : BUFSIZ;
+		if ((stream->buf = malloc(size))) {
+			stream->size = size;
+			stream->flags |= FILE_OWNBUF;
+			return 0;
+		}
+		stream->mode = _IONBF;
+	}
+	stream->buf = stream->unbuf;
+	stream->size = sizeof(stream->unbuf);
+	return 0;
+}
+
+static int write_all(FILE *stream, const unsigned char *data, size_t n) {
+	while (n) {
+		int ret = write(stream->fd, data, n > 0x40000000 ? 0x40000000 : n);
+		if (ret <= 0) {
+			stream->flags |= FILE_ERROR;
+			return EOF;
+		}
+		data += ret;
+		n -= ret;
+	}
+	return 0;
+}
+
+// Write out buffered output, or give back read ahead data by seeking the
+// file back to the position the reader is at. The stream becomes idle.
+int __libc_file_flush(FILE *stream) {
+	int ret = 0;
+	if (stream->flags & FILE_WRITING) {
+		ret = write_all(stream, stream->buf, stream->wpos - stream->buf);
+	} else if ((stream->flags & FILE_READING) && stream->rend != stream->rpos) {
+		// fails harmlessly on consoles and pipes
+		lseek(stream->fd, -(int)(stream->rend - stream->rpos), FILE_SEEK_CUR);
+	}
+	stream->flags &= ~(FILE_READING | FILE_WRITING);
+	stream->rpos = stream->rend = stream->wpos = 0;
+	return ret;
+}
+
+int __libc_file_flush_all(void) {
+	int ret = 0;
+	for (FILE *stream = __libc_file_list; stream; stream = stream->next) {
+		if ((stream->flags & FILE_WRITING) && __libc_file_flush(stream) < 0) {
+			ret = EOF;
+		}
+	}
+	return ret;
+}
+
+// Get the stream ready to read from its file. Pending output is written
+// first, and so is the output of line buffered streams, so a prompt
+// shows up before the program waits for input.
+int __libc_file_to_read(FILE *stream) {
+	if (!(stream->flags & FILE_READING)) {
+		if (__libc_file_flush(stream) < 0) {
+			return EOF;
+		}
+		__libc_file_setup(stream);
+		stream->flags |= FILE_READING;
+		stream->rpos = stream->rend = stream->buf + FILE_UNGET;
+	}
+	for (FILE *f = __libc_file_list; f; f = f->next) {
+		if (f->mode == _IOLBF && (f->flags & FILE_WRITING) && f->wpos != f->buf) {
+			__libc_file_flush(f);
+		}
+	}
+	return 0;
+}
+
+// read from the file, bypassing the buffer
+int __libc_file_read(FILE *stream, void *data, size_t n) {
+	int ret = read(stream->fd, data, n > 0x40000000 ? 0x40000000 : n);
+	if (ret <= 0) {
+		stream->flags |= ret < 0 ? FILE_ERROR : FILE_EOF;
+		return EOF;
+	}
+	return ret;
+}
+
+// fill the buffer once the read ahead data is used up
+int __libc_file_refill(FILE *stream) {
+	if (__libc_file_to_read(stream) < 0) {
+		return EOF;
+	}
+	unsigned char *begin = stream->buf + FILE_UNGET;
+	int ret = __libc_file_read(stream, begin, stream->size - FILE_UNGET);
+	if (ret < 0) {
+		return EOF;
+	}
+	stream->rpos = begin;
+	stream->rend = begin + ret;
+	return 0;
+}
+
+// Buffer output. Writes at least as large as the buffer go straight to
+// the file, a line buffered stream is flushed when it gets a newline.
+size_t __libc_file_write(FILE *stream, const void *data, size_t n) {
+	if (!(stream->flags & FILE_WRITING)) {
+		if (__libc_file_flush(stream) < 0) {
+			return 0;
+		}
+		__libc_file_setup(stream);
+		stream->flags |= FILE_WRITING;
+		stream->wpos = stream->buf;
+	}
+
+	const unsigned char *p = data;
+	size_t left = n;
+	if (stream->mode == _IONBF || n >= stream->size) {
+		if (__libc_file_flush(stream) < 0 || write_all(stream, p, n) < 0) {
+			return 0;
+		}
+		stream->flags |= FILE_WRITING;
+		stream->wpos = stream->buf;
+		return n;
+	}
+	while (left) {
+		size_t room = stream->buf + stream->size - stream->wpos;
+		if (!room) {
+			if (write_all(stream, stream->buf, stream->size) < 0) {
+				return n - left;
+			}
+			stream->wpos = stream->buf;
+			continue;
+		}
+		size_t count = left < room ? left : room;
+		memcpy(stream->wpos, p, count);
+		stream->wpos += count;
+		p += count;
+		left -= count;
+	}
+	if (stream->mode == _IOLBF && memchr(data, '\n', n)) {
+		if (write_all(stream, stream->buf, stream->wpos - stream->buf) < 0) {
+			return 0;
+		}
+		stream->wpos = stream->buf;
+	}
+	return n;
+}
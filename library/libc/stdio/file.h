@@ -0,0 +1,51 @@
+/*
+ * Buffered stream internals
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBC_STDIO_FILE_H
+#define _LIBC_STDIO_FILE_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+// A stream is reading, writing or idle. While reading, rpos to rend is
+// data read ahead from the file. While writing, buf to wpos is data not
+// written to the file yet. Read data is placed FILE_UNGET bytes into the
+// buffer so that ungetc() always has room.
+
+#define FILE_READING 1
+#define FILE_WRITING 2
+#define FILE_EOF 4
+#define FILE_ERROR 8
+#define FILE_OWNBUF 16 // buf was allocated by libc
+#define FILE_ALLOC 32 // the FILE itself was allocated by fopen()
+
+#define FILE_UNGET 8
+
+extern FILE *__libc_file_list;
+
+int __libc_file_setup(FILE *stream);
+int __libc_file_flush(FILE *stream);
+int __libc_file_flush_all(void);
+int __libc_file_to_read(FILE *stream);
+int __libc_file_refill(FILE *stream);
+int __libc_file_read(FILE *stream, void *data, size_t n);
+size_t __libc_file_write(FILE *stream, const void *data, size_t n);
+char *__libc_vformat(char *buf, size_t size, int *len, const char *format, va_list arg);
+
+#endif
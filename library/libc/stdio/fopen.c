@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "file.h"
+
 FILE *fopen(const char *restrict filename, const char *restrict mode) {
 	int omode;
 	if (mode[0] == 'w') {
@@ -83,7 +85,7 @@ FILE *fopen(const char *restrict filename, const char *restrict mode) {
 	}
 
 	FILE *file;
-	if ((file = malloc(sizeof(FILE))) == NULL) {
+	if ((file = calloc(1, sizeof(FILE))) == NULL) {
 		return NULL;
 	}
 	file->fd = open(filename, omode);
@@ -92,5 +94,9 @@ FILE *fopen(const char *restrict filename, const char *restrict mode) {
 		free(file);
 		return NULL;
 	}
+	file->mode = _IOFBF;
+	file->flags = FILE_ALLOC;
+	file->next = __libc_file_list;
+	__libc_file_list = file;
 	return file;
 }
@@ -17,12 +17,20 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
+#include "file.h"
+
 int fputc(int c, FILE *stream) {
-	if (write(stream->fd, &c, 1) < 0) {
+	unsigned char ch = c;
+	// fast path, the byte fits in the buffer and needs no flush
+	if ((stream->flags & FILE_WRITING) && stream->wpos < stream->buf + stream->size &&
+		(stream->mode == _IOFBF || (stream->mode == _IOLBF && ch != '\n'))) {
+		*stream->wpos++ = ch;
+		return ch;
+	}
+	if (__libc_file_write(stream, &ch, 1) != 1) {
 		return EOF;
 	}
-	return c;
+	return ch;
 }
@@ -17,12 +17,14 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "file.h"
+
 int fputs(const char *restrict s, FILE *restrict stream) {
-	if (write(stream->fd, s, strlen(s)) < 0) {
+	size_t len = strlen(s);
+	if (__libc_file_write(stream, s, len) != len) {
 		return EOF;
 	}
 	return 0;
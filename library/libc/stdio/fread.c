@@ -17,20 +17,38 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "file.h"
 
 size_t fread(void *restrict ptr, size_t size, size_t nmemb, FILE *restrict stream) {
-	if (!size) {
-		return 0;
-	}
-	if (!nmemb) {
+	if (!size || !nmemb || nmemb > SIZE_MAX / size) {
 		return 0;
 	}
-	for (size_t i = 0; i < nmemb; i++) {
-		if (read(stream->fd, ptr + i * size, size) <= 0) {
-			return i;
+	unsigned char *p = ptr;
+	size_t total = size * nmemb, left = total;
+	while (left) {
+		size_t count = stream->rend - stream->rpos;
+		if (count) {
+			count = count < left ? count : left;
+			memcpy(p, stream->rpos, count);
+			stream->rpos += count;
+		} else if (left >= stream->size - FILE_UNGET && stream->buf) {
+			// large reads go straight to the caller's memory
+			int ret;
+			if (__libc_file_to_read(stream) < 0 || (ret = __libc_file_read(stream, p, left)) < 0) {
+				break;
+			}
+			count = ret;
+		} else if (__libc_file_refill(stream) < 0) {
+			break;
+		} else {
+			continue;
 		}
+		p += count;
+		left -= count;
 	}
-	return nmemb;
+	return (total - left) / size;
 }
@@ -20,6 +20,8 @@
 #include <panicos.h>
 #include <stdio.h>
 
+#include "file.h"
+
 int fseek(FILE *stream, long int offset, int whence) {
 	int lsk;
 	if (whence == SEEK_CUR) {
@@ -31,8 +33,17 @@ int fseek(FILE *stream, long int offset, int whence) {
 	} else {
 		return -1;
 	}
+	// the file position is ahead of the reader by the read ahead data
+	if (whence == SEEK_CUR && (stream->flags & FILE_READING)) {
+		offset -= stream->rend - stream->rpos;
+		stream->rpos = stream->rend;
+	}
+	if (__libc_file_flush(stream) < 0) {
+		return -1;
+	}
 	if (lseek(stream->fd, offset, lsk) < 0) {
 		return -1;
 	}
+	stream->flags &= ~FILE_EOF;
 	return 0;
 }
@@ -17,13 +17,8 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
 int fsetpos(FILE *stream, const fpos_t *pos) {
-	int ret = lseek(stream->fd, *pos, FILE_SEEK_SET);
-	if (ret < 0) {
-		return ret;
-	}
-	return 0;
+	return fseek(stream, *pos, SEEK_SET);
 }
@@ -20,6 +20,17 @@
 #include <panicos.h>
 #include <stdio.h>
 
+#include "file.h"
+
 long int ftell(FILE *stream) {
-	return lseek(stream->fd, 0, FILE_SEEK_CUR);
+	long int position = lseek(stream->fd, 0, FILE_SEEK_CUR);
+	if (position < 0) {
+		return position;
+	}
+	if (stream->flags & FILE_READING) {
+		position -= stream->rend - stream->rpos;
+	} else if (stream->flags & FILE_WRITING) {
+		position += stream->wpos - stream->buf;
+	}
+	return position;
 }
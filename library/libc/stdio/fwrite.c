@@ -17,20 +17,14 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "file.h"
+
 size_t fwrite(const void *restrict ptr, size_t size, size_t nmemb, FILE *restrict stream) {
-	if (!size) {
-		return 0;
-	}
-	if (!nmemb) {
+	if (!size || !nmemb || nmemb > SIZE_MAX / size) {
 		return 0;
 	}
-	for (size_t i = 0; i < nmemb; i++) {
-		if (write(stream->fd, ptr + i * size, size) < 0) {
-			return i;
-		}
-	}
-	return nmemb;
+	return __libc_file_write(stream, ptr, size * nmemb) / size;
 }
@@ -17,13 +17,8 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
 int getc(FILE *stream) {
-	char c;
-	if (read(stream->fd, &c, 1) < 0) {
-		return EOF;
-	}
-	return c;
+	return fgetc(stream);
 }
@@ -23,6 +23,6 @@
 
 void perror(const char *s) {
 	if (errno) {
-		printf("%s: %s\n", s, strerror(errno));
+		fprintf(stderr, "%s: %s\n", s, strerror(errno));
 	}
 }
@@ -17,12 +17,8 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
 int putc(int c, FILE *stream) {
-	if (write(stream->fd, &c, 1) < 0) {
-		return EOF;
-	}
-	return c;
+	return fputc(c, stream);
 }
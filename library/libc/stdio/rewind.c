@@ -17,9 +17,9 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <panicos.h>
 #include <stdio.h>
 
 void rewind(FILE *stream) {
-	lseek(stream->fd, 0, FILE_SEEK_SET);
+	fseek(stream, 0, SEEK_SET);
+	clearerr(stream);
 }
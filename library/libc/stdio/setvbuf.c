@@ -0,0 +1,49 @@
+/*
+ * setvbuf function
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "file.h"
+
+int setvbuf(FILE *restrict stream, char *restrict buf, int mode, size_t size) {
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		return -1;
+	}
+	if (__libc_file_flush(stream) < 0) {
+		return -1;
+	}
+	if (stream->flags & FILE_OWNBUF) {
+		free(stream->buf);
+		stream->flags &= ~FILE_OWNBUF;
+	}
+	stream->mode = mode;
+	stream->buf = NULL;
+	stream->size = 0;
+	if (mode != _IONBF) {
+		// a buffer too small to keep room for ungetc() is not used
+		if (size < 2 * FILE_UNGET) {
+			size = 2 * FILE_UNGET;
+			buf = NULL;
+		}
+		stream->buf = (unsigned char *)buf;
+		stream->size = size; // allocated on first use if buf is NULL
+	}
+	return 0;
+}
@@ -19,6 +19,9 @@
 
 #include <stdio.h>
 
-FILE __libc_stderr = {.fd = 2};
+FILE __libc_stderr = {
+	.fd = 2,
+	.mode = _IONBF,
+};
 
 FILE *stderr = &__libc_stderr;
@@ -19,6 +19,12 @@
 
 #include <stdio.h>
 
-FILE __libc_stdin = {.fd = 0};
+extern FILE __libc_stdout;
+
+FILE __libc_stdin = {
+	.fd = 0,
+	.mode = _IOFBF,
+	.next = &__libc_stdout,
+};
 
 FILE *stdin = &__libc_stdin;
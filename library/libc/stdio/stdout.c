@@ -19,6 +19,12 @@
 
 #include <stdio.h>
 
-FILE __libc_stdout = {.fd = 1};
+extern FILE __libc_stderr;
+
+FILE __libc_stdout = {
+	.fd = 1,
+	.mode = _IOLBF,
+	.next = &__libc_stderr,
+};
 
 FILE *stdout = &__libc_stdout;
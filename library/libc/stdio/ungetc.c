@@ -0,0 +1,42 @@
+/*
+ * ungetc function
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "file.h"
+
+int ungetc(int c, FILE *stream) {
+	if (c == EOF) {
+		return EOF;
+	}
+	if (!(stream->flags & FILE_READING)) {
+		if (__libc_file_flush(stream) < 0) {
+			return EOF;
+		}
+		__libc_file_setup(stream);
+		stream->flags |= FILE_READING;
+		stream->rpos = stream->rend = stream->buf + stream->size;
+	}
+	if (stream->rpos == stream->buf) {
+		return EOF;
+	}
+	*--stream->rpos = c;
+	stream->flags &= ~FILE_EOF;
+	return (unsigned char)c;
+}
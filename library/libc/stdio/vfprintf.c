@@ -0,0 +1,40 @@
+/*
+ * vfprintf function
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "file.h"
+
+// Format on the stack and hand the output to the stream in one piece,
+// so an unbuffered stream still costs a single write().
+int vfprintf(FILE *restrict stream, const char *restrict format, va_list arg) {
+	char buf[256];
+	int len;
+	char *out = __libc_vformat(buf, sizeof(buf), &len, format, arg);
+	if (!out) {
+		return -1;
+	}
+	size_t written = __libc_file_write(stream, out, len);
+	if (out != buf) {
+		free(out);
+	}
+	return written == (size_t)len ? len : -1;
+}
@@ -0,0 +1,379 @@
+/*
+ * vsnprintf function
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+
+// Formatting core of the printf family. Output beyond the buffer is
+// counted but dropped, so the caller learns the full length.
+
+#define FLAG_LEFT 1 // -
+#define FLAG_PLUS 2 // +
+#define FLAG_SPACE 4 // space
+#define FLAG_ALT 8 // #
+#define FLAG_ZERO 16 // 0
+#define FLAG_POINTER 32 // %p, always prefixed with 0x
+
+enum {
+	LENGTH_NONE,
+	LENGTH_HH,
+	LENGTH_H,
+	LENGTH_L,
+	LENGTH_LL,
+	LENGTH_Z,
+	LENGTH_J,
+	LENGTH_T,
+	LENGTH_LD,
+};
+
+struct Output {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void out_str(struct Output *out, const char *s, size_t n) {
+	if (out->len + 1 < out->size) {
+		size_t room = out->size - 1 - out->len;
+		memcpy(out->buf + out->len, s, n < room ? n : room);
+	}
+	out->len += n;
+}
+
+static void out_pad(struct Output *out, char c, int n) {
+	static const char spaces[16] = "                ";
+	static const char zeros[16] = "0000000000000000";
+	while (n > 0) {
+		int count = n < 16 ? n : 16;
+		out_str(out, c == '0' ? zeros : spaces, count);
+		n -= count;
+	}
+}
+
+static void format_int(
+	struct Output *out, unsigned long long value, int negative, unsigned int base, int upper,
+	int flags, int width, int precision
+) {
+	const char *set = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char digits[24]; // 64 bits take at most 22 octal digits
+	char *end = digits + sizeof(digits), *p = end;
+
+	// most values fit in 32 bits, avoid the slow 64-bit division then
+	unsigned int low = value;
+	if (low == value) {
+		for (; low; low /= base) {
+			*--p = set[low % base];
+		}
+	} else {
+		for (; value; value /= base) {
+			*--p = set[value % base];
+		}
+	}
+	int ndigits = end - p;
+
+	if (precision < 0) {
+		precision = 1;
+	} else {
+		flags &= ~FLAG_ZERO;
+	}
+	int zeros = precision > ndigits ? precision - ndigits : 0;
+	char prefix[2];
+	int nprefix = 0;
+	if (negative) {
+		prefix[nprefix++] = '-';
+	} else if (flags & FLAG_PLUS) {
+		prefix[nprefix++] = '+';
+	} else if (flags & FLAG_SPACE) {
+		prefix[nprefix++] = ' ';
+	}
+	if (base == 16 && ((flags & FLAG_POINTER) || ((flags & FLAG_ALT) && ndigits))) {
+		prefix[nprefix++] = '0';
+		prefix[nprefix++] = upper ? 'X' : 'x';
+	} else if (base == 8 && (flags & FLAG_ALT) && !zeros) {
+		zeros = 1;
+	}
+
+	int pad = width - nprefix - zeros - ndigits;
+	if (!(flags & (FLAG_LEFT | FLAG_ZERO))) {
+		out_pad(out, ' ', pad);
+	}
+	out_str(out, prefix, nprefix);
+	if ((flags & (FLAG_LEFT | FLAG_ZERO)) == FLAG_ZERO) {
+		out_pad(out, '0', pad);
+	}
+	out_pad(out, '0', zeros);
+	out_str(out, p, ndigits);
+	if (flags & FLAG_LEFT) {
+		out_pad(out, ' ', pad);
+	}
+}
+
+static void format_str(struct Output *out, const char *s, size_t len, int flags, int width) {
+	int pad = width - (int)len;
+	if (!(flags & FLAG_LEFT)) {
+		out_pad(out, ' ', pad);
+	}
+	out_str(out, s, len);
+	if (flags & FLAG_LEFT) {
+		out_pad(out, ' ', pad);
+	}
+}
+
+static long long arg_signed(va_list *arg, int length) {
+	switch (length) {
+		case LENGTH_HH:
+			return (signed char)va_arg(*arg, int);
+		case LENGTH_H:
+			return (short)va_arg(*arg, int);
+		case LENGTH_L:
+			return va_arg(*arg, long);
+		case LENGTH_LL:
+		case LENGTH_J:
+			return va_arg(*arg, long long);
+		case LENGTH_Z:
+		case LENGTH_T:
+			return va_arg(*arg, ptrdiff_t);
+		default:
+			return va_arg(*arg, int);
+	}
+}
+
+static unsigned long long arg_unsigned(va_list *arg, int length) {
+	switch (length) {
+		case LENGTH_HH:
+			return (unsigned char)va_arg(*arg, unsigned int);
+		case LENGTH_H:
+			return (unsigned short)va_arg(*arg, unsigned int);
+		case LENGTH_L:
+			return va_arg(*arg, unsigned long);
+		case LENGTH_LL:
+		case LENGTH_J:
+			return va_arg(*arg, unsigned long long);
+		case LENGTH_Z:
+		case LENGTH_T:
+			return va_arg(*arg, size_t);
+		default:
+			return va_arg(*arg, unsigned int);
+	}
+}
+
+int vsnprintf(char *restrict s, size_t n, const char *restrict format, va_list arg) {
+	struct Output out = {
+		.buf = s,
+		.size = n,
+		.len = 0,
+	};
+	va_list ap;
+	va_copy(ap, arg);
+
+	const char *f = format;
+	while (*f) {
+		if (*f != '%') {
+			const char *percent = strchr(f, '%');
+			size_t len = percent ? (size_t)(percent - f) : strlen(f);
+			out_str(&out, f, len);
+			f += len;
+			continue;
+		}
+		const char *spec = f++;
+
+		int flags = 0;
+		for (;; f++) {
+			if (*f == '-') {
+				flags |= FLAG_LEFT;
+			} else if (*f == '+') {
+				flags |= FLAG_PLUS;
+			} else if (*f == ' ') {
+				flags |= FLAG_SPACE;
+			} else if (*f == '#') {
+				flags |= FLAG_ALT;
+			} else if (*f == '0') {
+				flags |= FLAG_ZERO;
+			} else {
+				break;
+			}
+		}
+
+		int width = 0;
+		if (*f == '*') {
+			width = va_arg(ap, int);
+			if (width < 0) {
+				flags |= FLAG_LEFT;
+				width = -width;
+			}
+			f++;
+		} else {
+			while (*f >= '0' && *f <= '9') {
+				width = width * 10 + (*f++ - '0');
+			}
+		}
+
+		int precision = -1;
+		if (*f == '.') {
+			f++;
+			precision = 0;
+			if (*f == '*') {
+				precision = va_arg(ap, int);
+				if (precision < 0) {
+					precision = -1;
+				}
+				f++;
+			} else {
+				while (*f >= '0' && *f <= '9') {
+					precision = precision * 10 + (*f++ - '0');
+				}
+			}
+		}
+
+		int length = LENGTH_NONE;
+		if (*f == 'h') {
+			length = *++f == 'h' ? (f++, LENGTH_HH) : LENGTH_H;
+		} else if (*f == 'l') {
+			length = *++f == 'l' ? (f++, LENGTH_LL) : LENGTH_L;
+		} else if (*f == 'z') {
+			length = LENGTH_Z;
+			f++;
+		} else if (*f == 'j') {
+			length = LENGTH_J;
+			f++;
+		} else if (*f == 't') {
+			length = LENGTH_T;
+			f++;
+		} else if (*f == 'L') {
+			length = LENGTH_LD;
+			f++;
+		}
+
+		char c = *f;
+		if (c) {
+			f++;
+		}
+		switch (c) {
+			case 'd':
+			case 'i': {
+				long long value = arg_signed(&ap, length);
+				unsigned long long magnitude = value;
+				if (value < 0) {
+					magnitude = -magnitude;
+				}
+				format_int(&out, magnitude, value < 0, 10, 0, flags, width, precision);
+				break;
+			}
+			case 'u':
+				format_int(&out, arg_unsigned(&ap, length), 0, 10, 0, flags, width, precision);
+				break;
+			case 'o':
+				format_int(&out, arg_unsigned(&ap, length), 0, 8, 0, flags, width, precision);
+				break;
+			case 'x':
+			case 'X':
+				format_int(
+					&out, arg_unsigned(&ap, length), 0, 16, c == 'X', flags, width, precision
+				);
+				break;
+			case 'p':
+				format_int(
+					&out,
+					(uintptr_t)va_arg(ap, void *),
+					0,
+					16,
+					0,
+					flags | FLAG_POINTER,
+					width,
+					precision
+				);
+				break;
+			case 'c': {
+				char ch = va_arg(ap, int);
+				format_str(&out, &ch, 1, flags, width);
+				break;
+			}
+			case 's': {
+				const char *str = va_arg(ap, const char *);
+				if (!str) {
+					str = "(null)";
+				}
+				size_t len;
+				if (precision >= 0) {
+					const char *nul = memchr(str, '\0', precision);
+					len = nul ? (size_t)(nul - str) : (size_t)precision;
+				} else {
+					len = strlen(str);
+				}
+				format_str(&out, str, len, flags, width);
+				break;
+			}
+			case 'n':
+				*va_arg(ap, int *) = out.len;
+				break;
+			case '%':
+				out_str(&out, "%", 1);
+				break;
+			case 'f':
+			case 'F':
+			case 'e':
+			case 'E':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				// floating point is not supported, skip the argument
+				if (length == LENGTH_LD) {
+					va_arg(ap, long double);
+				} else {
+					va_arg(ap, double);
+				}
+				out_str(&out, spec, f - spec);
+				break;
+			default:
+				// unknown conversion, print it to draw attention
+				out_str(&out, spec, f - spec);
+				break;
+		}
+	}
+	va_end(ap);
+
+	if (n) {
+		s[out.len < n ? out.len : n - 1] = '\0';
+	}
+	return out.len;
+}
+
+// Format into buf if the output fits, otherwise into memory allocated
+// with malloc(). Return the output and its length in *len, or NULL.
+char *__libc_vformat(char *buf, size_t size, int *len, const char *format, va_list arg) {
+	va_list ap;
+	va_copy(ap, arg);
+	*len = vsnprintf(buf, size, format, ap);
+	va_end(ap);
+	if ((size_t)*len < size) {
+		return buf;
+	}
+	char *out = malloc(*len + 1);
+	if (out) {
+		vsnprintf(out, *len + 1, format, arg);
+	}
+	return out;
+}
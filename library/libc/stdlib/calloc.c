@@ -17,10 +17,14 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 void *calloc(size_t nmemb, size_t size) {
+	if (size && nmemb > SIZE_MAX / size) {
+		return NULL;
+	}
 	void *ptr = malloc(nmemb * size);
 	if (!ptr) {
 		return NULL;
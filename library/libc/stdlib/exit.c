@@ -18,6 +18,7 @@
  */
 
 #include <panicos.h>
+#include <stdio.h>
 
 void (*__libc_atexit_funcs[32])(void);
 int __libc_atexit_count = -1;
@@ -41,6 +42,8 @@ _Noreturn void exit(int status) {
 	}
 	// call shared library destructors
 	_dl_fini();
+	// write out buffered output of stdio streams
+	fflush(NULL);
 	// terminate the program
 	proc_exit(status);
 }
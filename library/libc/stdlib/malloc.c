@@ -1,5 +1,5 @@
 /*
- * malloc function
+ * Memory allocator
  *
  * This file is part of PanicOS.
  *
@@ -17,9 +17,544 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <malloc.h>
 #include <panicos.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Small and medium blocks are chunks carved out of the heap grown with
+// sbrk(). Every chunk starts with a header holding its size and the size
+// of the chunk before it, so a freed chunk is merged with free neighbours
+// on both sides. Free chunks are indexed by a two-level segregated fit
+// (TLSF) table, a fitting chunk is found with two bit scans. Freed small
+// chunks are parked unmerged in per-size bins first and handed out again
+// without touching the index. The free chunk at the end of the heap is
+// the top chunk, the heap grows with it and is given back to the kernel
+// when it gets large. Large blocks get their own mapping from mem_map()
+// and are unmapped on free. The heap belongs to malloc, do not mix it
+// with sbrk().
+
+#define MALLOC_ALIGN 16
+#define PAGE_SIZE 4096
+
+#define CHUNK_HEADER 8 // prev_size and size
+#define CHUNK_MIN 16 // room for the free list links
+#define CHUNK_INUSE 1
+#define CHUNK_MAPPED 2
+#define CHUNK_FLAGS (MALLOC_ALIGN - 1)
+
+#define SMALL_MAX 256 // largest chunk parked in the small bins
+#define SMALL_BINS (SMALL_MAX / MALLOC_ALIGN)
+#define SMALL_BIN_DEPTH 32 // chunks parked per bin
+
+#define TLSF_SL_LOG2 3 // second level lists per power of two
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 4) // 4 is log2(MALLOC_ALIGN)
+#define TLSF_FL_COUNT (32 - TLSF_FL_SHIFT + 1)
+#define TLSF_SMALL (1 << TLSF_FL_SHIFT) // sizes below are mapped linearly
+
+#define HEAP_GROW_MIN (64 * 1024)
+#define HEAP_TOP_PAD (64 * 1024) // top chunk kept after a trim
+#define HEAP_TRIM_THRESHOLD (256 * 1024)
+#define MAP_THRESHOLD (128 * 1024) // chunks this large get their own mapping
+
+struct Chunk {
+	size_t prev_size; // 0 for the first chunk, offset in the mapping if mapped
+	size_t size; // including the header, low bits hold CHUNK_* flags
+	struct Chunk *next, *prev; // only valid in free chunks and small bins
+};
+
+static struct {
+	char *heap_begin, *heap_end;
+	struct Chunk *top;
+	unsigned int fl_bitmap;
+	unsigned int sl_bitmap[TLSF_FL_COUNT];
+	struct Chunk *free_list[TLSF_FL_COUNT][TLSF_SL_COUNT];
+	struct Chunk *small_bin[SMALL_BINS];
+	unsigned int small_count[SMALL_BINS];
+	struct MallocStats stats;
+} arena;
+
+static inline size_t chunk_size(struct Chunk *c) {
+	return c->size & ~CHUNK_FLAGS;
+}
+
+static inline struct Chunk *chunk_next(struct Chunk *c) {
+	return (struct Chunk *)((char *)c + chunk_size(c));
+}
+
+static inline struct Chunk *chunk_prev(struct Chunk *c) {
+	return (struct Chunk *)((char *)c - c->prev_size);
+}
+
+static inline void *chunk_to_mem(struct Chunk *c) {
+	return (char *)c + CHUNK_HEADER;
+}
+
+static inline struct Chunk *mem_to_chunk(void *ptr) {
+	return (struct Chunk *)((char *)ptr - CHUNK_HEADER);
+}
+
+static inline unsigned int fls(size_t size) {
+	return 31 - __builtin_clz(size);
+}
+
+// chunk size needed for a request, 0 if it is too large
+static size_t request_size(size_t size) {
+	if (size > SIZE_MAX / 2) {
+		return 0;
+	}
+	size = (size + CHUNK_HEADER + MALLOC_ALIGN - 1) & ~(MALLOC_ALIGN - 1);
+	return size < CHUNK_MIN ? CHUNK_MIN : size;
+}
+
+// set the size and flags of a heap chunk and tell the chunk after it
+static void chunk_set(struct Chunk *c, size_t size, size_t flags) {
+	c->size = size | flags;
+	if ((char *)c + size < arena.heap_end) {
+		chunk_next(c)->prev_size = size;
+	}
+}
+
+static void tlsf_mapping(size_t size, unsigned int *fl, unsigned int *sl) {
+	if (size < TLSF_SMALL) {
+		*fl = 0;
+		*sl = size / (TLSF_SMALL / TLSF_SL_COUNT);
+	} else {
+		unsigned int f = fls(size);
+		*sl = (size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+		*fl = f - TLSF_FL_SHIFT + 1;
+	}
+}
+
+static void tlsf_insert(struct Chunk *c) {
+	unsigned int fl, sl;
+	tlsf_mapping(chunk_size(c), &fl, &sl);
+	c->prev = 0;
+	c->next = arena.free_list[fl][sl];
+	if (c->next) {
+		c->next->prev = c;
+	}
+	arena.free_list[fl][sl] = c;
+	arena.fl_bitmap |= 1u << fl;
+	arena.sl_bitmap[fl] |= 1u << sl;
+}
+
+static void tlsf_remove(struct Chunk *c) {
+	unsigned int fl, sl;
+	tlsf_mapping(chunk_size(c), &fl, &sl);
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		arena.free_list[fl][sl] = c->next;
+		if (!c->next) {
+			arena.sl_bitmap[fl] &= ~(1u << sl);
+			if (!arena.sl_bitmap[fl]) {
+				arena.fl_bitmap &= ~(1u << fl);
+			}
+		}
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+}
+
+// find a free chunk of at least size bytes, round the size up to the
+// next list so that any chunk of the list found fits
+static struct Chunk *tlsf_find(size_t size) {
+	unsigned int fl, sl;
+	if (size >= TLSF_SMALL) {
+		size += (1u << (fls(size) - TLSF_SL_LOG2)) - 1;
+	}
+	tlsf_mapping(size, &fl, &sl);
+	if (fl >= TLSF_FL_COUNT) {
+		return 0;
+	}
+	unsigned int sl_map = arena.sl_bitmap[fl] & (~0u << sl);
+	if (!sl_map) {
+		unsigned int fl_map = arena.fl_bitmap & (~0u << (fl + 1));
+		if (!fl_map) {
+			return 0;
+		}
+		fl = __builtin_ctz(fl_map);
+		sl_map = arena.sl_bitmap[fl];
+	}
+	return arena.free_list[fl][__builtin_ctz(sl_map)];
+}
+
+// merge a chunk no longer in use with its free neighbours and file it
+static void chunk_release(struct Chunk *c) {
+	size_t size = chunk_size(c);
+	if (c->prev_size && !(chunk_prev(c)->size & CHUNK_INUSE)) {
+		c = chunk_prev(c);
+		tlsf_remove(c);
+		size += chunk_size(c);
+	}
+	struct Chunk *next = (struct Chunk *)((char *)c + size);
+	if (next == arena.top) {
+		arena.top = c;
+		chunk_set(c, size + chunk_size(next), 0);
+		return;
+	}
+	if (!(next->size & CHUNK_INUSE)) {
+		tlsf_remove(next);
+		size += chunk_size(next);
+	}
+	chunk_set(c, size, 0);
+	tlsf_insert(c);
+}
+
+// cut an in use chunk down to size and release the rest
+static void chunk_split(struct Chunk *c, size_t size) {
+	size_t total = chunk_size(c);
+	if (total - size < CHUNK_MIN) {
+		return;
+	}
+	chunk_set(c, size, c->size & CHUNK_FLAGS);
+	struct Chunk *rest = chunk_next(c);
+	chunk_set(rest, total - size, CHUNK_INUSE);
+	chunk_release(rest);
+}
+
+// move the parked small chunks back to the index so they can merge
+static void small_bins_flush(void) {
+	for (int i = 0; i < SMALL_BINS; i++) {
+		while (arena.small_bin[i]) {
+			struct Chunk *c = arena.small_bin[i];
+			arena.small_bin[i] = c->next;
+			chunk_release(c);
+		}
+		arena.small_count[i] = 0;
+	}
+	arena.stats.small_cached = 0;
+}
+
+// make the top chunk hold at least size bytes and a spare chunk
+static int heap_grow(size_t size) {
+	if (!arena.heap_begin) {
+		char *p = sbrk(0);
+		if (p == (char *)-1) {
+			return -1;
+		}
+		arena.heap_begin = arena.heap_end = p;
+	}
+	size_t have = arena.top ? chunk_size(arena.top) : 0;
+	size_t grow = size + CHUNK_MIN + CHUNK_HEADER - have;
+	if (grow < HEAP_GROW_MIN) {
+		grow = HEAP_GROW_MIN;
+	}
+	grow = (grow + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (grow > INT32_MAX) {
+		return -1;
+	}
+	char *p = sbrk(grow);
+	if (p == (char *)-1) {
+		return -1;
+	}
+	if (p != arena.heap_end) {
+		sbrk(-(int)grow);
+		return -1;
+	}
+	arena.heap_end += grow;
+	arena.stats.heap_size += grow;
+	arena.stats.heap_grows++;
+	if (!arena.top) {
+		// the heap starts page aligned, offset chunks so that blocks are aligned
+		arena.top = (struct Chunk *)(arena.heap_begin + CHUNK_HEADER);
+		arena.top->prev_size = 0;
+		chunk_set(arena.top, arena.heap_end - (char *)arena.top, 0);
+	} else {
+		chunk_set(arena.top, have + grow, 0);
+	}
+	return 0;
+}
+
+// give the memory at the end of the heap back to the kernel
+static void heap_trim(void) {
+	size_t top_size = chunk_size(arena.top);
+	if (top_size < HEAP_TRIM_THRESHOLD) {
+		return;
+	}
+	size_t release = (top_size - HEAP_TOP_PAD) & ~(PAGE_SIZE - 1);
+	if (sbrk(-(int)release) == (char *)-1) {
+		return;
+	}
+	arena.heap_end -= release;
+	chunk_set(arena.top, top_size - release, 0);
+	arena.stats.heap_size -= release;
+	arena.stats.heap_trims++;
+}
+
+static struct Chunk *top_alloc(size_t size) {
+	if ((!arena.top || chunk_size(arena.top) < size + CHUNK_MIN) && heap_grow(size) < 0) {
+		return 0;
+	}
+	struct Chunk *c = arena.top;
+	size_t rest = chunk_size(c) - size;
+	chunk_set(c, size, CHUNK_INUSE);
+	arena.top = chunk_next(c);
+	chunk_set(arena.top, rest, 0);
+	return c;
+}
+
+static struct Chunk *heap_alloc(size_t size) {
+	unsigned int bin = size / MALLOC_ALIGN - 1;
+	struct Chunk *c;
+	if (size <= SMALL_MAX && (c = arena.small_bin[bin])) {
+		arena.small_bin[bin] = c->next;
+		arena.small_count[bin]--;
+		arena.stats.small_cached -= size;
+		arena.stats.small_hits++;
+		arena.stats.in_use += size;
+		return c;
+	}
+
+	c = tlsf_find(size);
+	if (!c && arena.stats.small_cached &&
+		(!arena.top || chunk_size(arena.top) < size + CHUNK_MIN)) {
+		// merge the parked chunks before growing the heap
+		small_bins_flush();
+		c = tlsf_find(size);
+	}
+	if (c) {
+		tlsf_remove(c);
+		chunk_set(c, chunk_size(c), CHUNK_INUSE);
+		chunk_split(c, size);
+	} else if ((c = top_alloc(size)) == 0) {
+		return 0;
+	}
+	arena.stats.in_use += chunk_size(c);
+	return c;
+}
+
+static void heap_free(struct Chunk *c) {
+	size_t size = chunk_size(c);
+	arena.stats.in_use -= size;
+	if (size <= SMALL_MAX) {
+		unsigned int bin = size / MALLOC_ALIGN - 1;
+		if (arena.small_count[bin] < SMALL_BIN_DEPTH) {
+			c->next = arena.small_bin[bin];
+			arena.small_bin[bin] = c;
+			arena.small_count[bin]++;
+			arena.stats.small_cached += size;
+			return;
+		}
+	}
+	chunk_release(c);
+	size_t free_size = arena.stats.heap_size - arena.stats.in_use - arena.stats.small_cached;
+	if (arena.stats.small_cached && free_size > HEAP_TRIM_THRESHOLD &&
+		free_size > arena.stats.in_use) {
+		// mostly free, merge the parked chunks so that the heap can shrink
+		small_bins_flush();
+	}
+	heap_trim();
+}
+
+// resize a heap chunk without moving it, return 0 if it cannot be done
+static int heap_resize(struct Chunk *c, size_t size) {
+	size_t old = chunk_size(c);
+	struct Chunk *next = chunk_next(c);
+	if (size <= old) {
+		chunk_split(c, size);
+	} else if (next == arena.top) {
+		if (chunk_size(next) < size - old + CHUNK_MIN && heap_grow(size - old) < 0) {
+			return 0;
+		}
+		size_t total = old + chunk_size(arena.top);
+		chunk_set(c, size, CHUNK_INUSE);
+		arena.top = chunk_next(c);
+		chunk_set(arena.top, total - size, 0);
+	} else if (!(next->size & CHUNK_INUSE) && old + chunk_size(next) >= size) {
+		tlsf_remove(next);
+		chunk_set(c, old + chunk_size(next), CHUNK_INUSE);
+		chunk_split(c, size);
+	} else {
+		return 0;
+	}
+	arena.stats.in_use += chunk_size(c) - old;
+	return 1;
+}
+
+static struct Chunk *map_alloc(size_t size) {
+	size_t length = (size + CHUNK_HEADER + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (length > INT32_MAX) {
+		return 0;
+	}
+	char *p = mem_map(0, length);
+	if (p == (char *)-1) {
+		return 0;
+	}
+	// the chunk ends a header short of the mapping to keep its size aligned
+	struct Chunk *c = (struct Chunk *)(p + CHUNK_HEADER);
+	c->prev_size = CHUNK_HEADER;
+	c->size = (length - 2 * CHUNK_HEADER) | CHUNK_MAPPED | CHUNK_INUSE;
+	arena.stats.mapped_size += length;
+	arena.stats.mapped_blocks++;
+	return c;
+}
+
+static inline char *map_end(struct Chunk *c) {
+	return (char *)(((uintptr_t)chunk_next(c) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+static void map_free(struct Chunk *c) {
+	size_t length = map_end(c) - ((char *)c - c->prev_size);
+	mem_unmap((char *)c - c->prev_size, length);
+	arena.stats.mapped_size -= length;
+	arena.stats.mapped_blocks--;
+}
+
+// resize a mapped chunk in place by mapping or unmapping pages at its end
+static int map_resize(struct Chunk *c, size_t size) {
+	char *end = map_end(c);
+	char *new_end =
+		(char *)(((uintptr_t)c + size + CHUNK_HEADER + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+	if (new_end < end) {
+		mem_unmap(new_end, end - new_end);
+		arena.stats.mapped_size -= end - new_end;
+	} else if (new_end > end) {
+		if (new_end - end > INT32_MAX || mem_map(end, new_end - end) != end) {
+			return 0;
+		}
+		arena.stats.mapped_size += new_end - end;
+	}
+	c->size = (new_end - (char *)c - CHUNK_HEADER) | (c->size & CHUNK_FLAGS);
+	return 1;
+}
 
 void *malloc(size_t size) {
-	return sbrk(size);
+	size_t csize = request_size(size);
+	if (!csize) {
+		return NULL;
+	}
+	arena.stats.mallocs++;
+	struct Chunk *c = 0;
+	if (csize >= MAP_THRESHOLD) {
+		c = map_alloc(csize);
+	}
+	if (!c && (c = heap_alloc(csize)) == 0) {
+		return NULL;
+	}
+	return chunk_to_mem(c);
+}
+
+void free(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+	struct Chunk *c = mem_to_chunk(ptr);
+	arena.stats.frees++;
+	if (c->size & CHUNK_MAPPED) {
+		map_free(c);
+	} else {
+		heap_free(c);
+	}
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (!ptr) {
+		return malloc(size);
+	}
+	if (!size) {
+		free(ptr);
+		return NULL;
+	}
+	size_t csize = request_size(size);
+	if (!csize) {
+		return NULL;
+	}
+	struct Chunk *c = mem_to_chunk(ptr);
+	arena.stats.reallocs++;
+	if ((c->size & CHUNK_MAPPED) ? map_resize(c, csize) : heap_resize(c, csize)) {
+		arena.stats.reallocs_in_place++;
+		return ptr;
+	}
+
+	void *new = malloc(size);
+	if (!new) {
+		return NULL;
+	}
+	size_t old = chunk_size(c) - CHUNK_HEADER;
+	memcpy(new, ptr, old < size ? old : size);
+	free(ptr);
+	return new;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	if (alignment & (alignment - 1)) {
+		return NULL;
+	}
+	if (alignment <= MALLOC_ALIGN) {
+		return malloc(size);
+	}
+	size_t csize = request_size(size);
+	if (!csize || csize > SIZE_MAX / 2 - alignment) {
+		return NULL;
+	}
+	// allocate enough to leave a chunk in front of the aligned block
+	char *mem = malloc(csize + alignment + CHUNK_MIN);
+	if (!mem) {
+		return NULL;
+	}
+	struct Chunk *c = mem_to_chunk(mem);
+	char *aligned = (char *)(((uintptr_t)mem + alignment - 1) & ~(alignment - 1));
+	if (aligned != mem) {
+		size_t lead = aligned - mem;
+		if (lead < CHUNK_MIN && !(c->size & CHUNK_MAPPED)) {
+			aligned += alignment;
+			lead += alignment;
+		}
+		struct Chunk *ac = mem_to_chunk(aligned);
+		size_t total = chunk_size(c);
+		if (c->size & CHUNK_MAPPED) {
+			// the space in front stays in the mapping
+			ac->prev_size = c->prev_size + lead;
+			ac->size = (total - lead) | (c->size & CHUNK_FLAGS);
+		} else {
+			chunk_set(c, lead, CHUNK_INUSE);
+			chunk_set(ac, total - lead, CHUNK_INUSE);
+			arena.stats.in_use -= lead;
+			chunk_release(c);
+		}
+		c = ac;
+	}
+	if (!(c->size & CHUNK_MAPPED)) {
+		size_t total = chunk_size(c);
+		chunk_split(c, csize);
+		arena.stats.in_use -= total - chunk_size(c);
+	}
+	return chunk_to_mem(c);
+}
+
+void malloc_get_stats(struct MallocStats *stats) {
+	*stats = arena.stats;
+	stats->free_size = 0;
+	if (arena.heap_begin != arena.heap_end) {
+		stats->free_size = arena.stats.heap_size - CHUNK_HEADER - arena.stats.in_use -
+						   arena.stats.small_cached;
+	}
+}
+
+void malloc_stats(void) {
+	struct MallocStats stats;
+	malloc_get_stats(&stats);
+	printf(
+		"heap %u bytes: in use %u, small bins %u, free %u\n",
+		stats.heap_size,
+		stats.in_use,
+		stats.small_cached,
+		stats.free_size
+	);
+	printf("mapped %u bytes in %u blocks\n", stats.mapped_size, stats.mapped_blocks);
+	printf(
+		"malloc %u free %u realloc %u (%u in place) small bin hits %u\n",
+		stats.mallocs,
+		stats.frees,
+		stats.reallocs,
+		stats.reallocs_in_place,
+		stats.small_hits
+	);
+	printf("heap grown %u times, trimmed %u times\n", stats.heap_grows, stats.heap_trims);
 }
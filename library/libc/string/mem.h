@@ -0,0 +1,77 @@
+/*
+ * memory and string function internals
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBC_STRING_MEM_H
+#define _LIBC_STRING_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Scalar code works a word at a time, unaligned words are fine on x86.
+// Larger blocks use SSE2 when CPUID reports it, probed once at startup.
+
+typedef uint32_t __attribute__((may_alias, aligned(1))) __libc_word_t;
+
+#define WORD_ONES 0x01010101u
+#define WORD_HIGHS 0x80808080u
+#define WORD_HAS_ZERO(x) (((x) - WORD_ONES) & ~(x) & WORD_HIGHS)
+
+#define CPU_SSE2 1
+
+extern unsigned int __libc_cpu_features; // CPU_* bits
+
+#define SSE2_MIN 128 // smaller blocks don't pay for the setup
+
+static inline int __libc_use_sse2(size_t n) {
+	return n >= SSE2_MIN && (__libc_cpu_features & CPU_SSE2);
+}
+
+// align the destination, then move dwords, also right for overlapping
+// blocks with the destination below the source
+static inline void __libc_copy_forward(void *d, const void *s, size_t n) {
+	if (n >= 16) {
+		size_t head = -(uintptr_t)d & 3;
+		size_t words = (n - head) / 4;
+		n = (n - head) & 3;
+		__asm__ volatile("cld; rep movsb; movl %3, %%ecx; rep movsl"
+						 : "+D"(d), "+S"(s), "+c"(head)
+						 : "r"(words)
+						 : "memory", "cc");
+	}
+	__asm__ volatile("cld; rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory", "cc");
+}
+
+// copy from the end with the direction flag set, odd bytes first, then dwords
+static inline void __libc_copy_backward(void *d, const void *s, size_t n) {
+	char *de = (char *)d + n - 1;
+	const char *se = (const char *)s + n - 1;
+	size_t tail = n & 3;
+	__asm__ volatile("std; rep movsb; subl $3, %%edi; subl $3, %%esi;"
+					 "movl %3, %%ecx; rep movsl; cld"
+					 : "+D"(de), "+S"(se), "+c"(tail)
+					 : "r"(n / 4)
+					 : "memory", "cc");
+}
+
+void __libc_memcpy_sse2(void *restrict d, const void *restrict s, size_t n);
+void __libc_memset_sse2(void *d, int c, size_t n);
+size_t __libc_strlen_sse2(const char *s);
+void *__libc_memchr_sse2(const void *s, int c, size_t n);
+
+#endif
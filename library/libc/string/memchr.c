@@ -18,12 +18,27 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
 
 void *memchr(const void *s, int c, size_t n) {
-	const char *ss = s;
-	for (size_t i = 0; i < n; i++) {
-		if (ss[i] == c) {
-			return (void *)s + i;
+	if (__libc_use_sse2(n)) {
+		return __libc_memchr_sse2(s, c, n);
+	}
+	const unsigned char *p = s;
+	unsigned char ch = c;
+	// look for a zero byte in the word xor c
+	uint32_t pattern = ch * WORD_ONES;
+	for (; n >= 4; n -= 4, p += 4) {
+		uint32_t x = *(const __libc_word_t *)p ^ pattern;
+		if (WORD_HAS_ZERO(x)) {
+			break;
+		}
+	}
+	for (; n; n--, p++) {
+		if (*p == ch) {
+			return (void *)p;
 		}
 	}
 	return NULL;
@@ -19,16 +19,23 @@
 
 #include <stddef.h>
 
+#include "mem.h"
+
 int memcmp(const void *s1, const void *s2, size_t n) {
-	const char *p = s1;
-	const char *q = s2;
+	const unsigned char *p = s1;
+	const unsigned char *q = s2;
+	// skip the equal words, the first difference is found byte by byte
+	while (n >= 4 && *(const __libc_word_t *)p == *(const __libc_word_t *)q) {
+		p += 4;
+		q += 4;
+		n -= 4;
+	}
 	while (n--) {
-		if (*p == *q) {
-			p++;
-			q++;
-		} else {
+		if (*p != *q) {
 			return *p - *q;
 		}
+		p++;
+		q++;
 	}
 	return 0;
 }
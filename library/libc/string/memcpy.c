@@ -19,11 +19,13 @@
 
 #include <stddef.h>
 
-void *memcpy(void *restrict s1, const void *restrict s2, volatile size_t n) {
-	char *dest = s1;
-	const char *from = s2;
-	while (n--) {
-		*dest++ = *from++;
+#include "mem.h"
+
+void *memcpy(void *restrict s1, const void *restrict s2, size_t n) {
+	if (__libc_use_sse2(n)) {
+		__libc_memcpy_sse2(s1, s2, n);
+	} else {
+		__libc_copy_forward(s1, s2, n);
 	}
 	return s1;
 }
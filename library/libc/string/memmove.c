@@ -20,9 +20,18 @@
 #include <stddef.h>
 #include <string.h>
 
+#include "mem.h"
+
 void *memmove(void *s1, const void *s2, size_t n) {
-	char tmp[n];
-	memcpy(tmp, s2, n);
-	memcpy(s1, tmp, n);
+	char *d = s1;
+	const char *s = s2;
+	if (s + n <= d || d + n <= s) {
+		return memcpy(s1, s2, n);
+	}
+	if (d < s) {
+		__libc_copy_forward(d, s, n);
+	} else if (d > s) {
+		__libc_copy_backward(d, s, n);
+	}
 	return s1;
 }
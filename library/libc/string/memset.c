@@ -18,12 +18,26 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 
-void *memset(void *s, int c, volatile size_t n) {
-	char *ss = s;
-	while (n--) {
-		*ss = c;
-		ss++;
+#include "mem.h"
+
+void *memset(void *s, int c, size_t n) {
+	if (__libc_use_sse2(n)) {
+		__libc_memset_sse2(s, c, n);
+		return s;
+	}
+	void *d = s;
+	if (n >= 16) {
+		// align the destination, then store dwords
+		size_t head = -(uintptr_t)d & 3;
+		size_t words = (n - head) / 4;
+		n = (n - head) & 3;
+		__asm__ volatile("cld; rep stosb; movl %3, %%ecx; rep stosl"
+						 : "+D"(d), "+c"(head)
+						 : "a"((unsigned char)c * WORD_ONES), "r"(words)
+						 : "memory", "cc");
 	}
+	__asm__ volatile("cld; rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory", "cc");
 	return s;
 }
@@ -0,0 +1,136 @@
+/*
+ * SSE2 memory and string functions
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
+
+#define NONTEMPORAL_MIN (512 * 1024) // larger copies would only flush the cache
+
+unsigned int __libc_cpu_features;
+
+__attribute__((constructor)) static void cpu_features_init(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+		__libc_cpu_features |= CPU_SSE2;
+	}
+}
+
+// n is at least SSE2_MIN
+__attribute__((target("sse2"))) void
+__libc_memcpy_sse2(void *restrict dst, const void *restrict src, size_t n) {
+	char *d = dst;
+	const char *s = src;
+	// the first 16 bytes unaligned, then on with aligned stores
+	size_t head = -(uintptr_t)d & 15;
+	_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	d += head, s += head, n -= head;
+
+	if (n >= NONTEMPORAL_MIN) {
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i x0 = _mm_loadu_si128((const __m128i *)s);
+			__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_stream_si128((__m128i *)d, x0);
+			_mm_stream_si128((__m128i *)(d + 16), x1);
+			_mm_stream_si128((__m128i *)(d + 32), x2);
+			_mm_stream_si128((__m128i *)(d + 48), x3);
+		}
+		_mm_sfence();
+	}
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_store_si128((__m128i *)d, x0);
+		_mm_store_si128((__m128i *)(d + 16), x1);
+		_mm_store_si128((__m128i *)(d + 32), x2);
+		_mm_store_si128((__m128i *)(d + 48), x3);
+	}
+	for (; n >= 16; n -= 16, d += 16, s += 16) {
+		_mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	}
+	if (n) {
+		// the last 16 bytes unaligned, overlapping what was copied already
+		d += n - 16, s += n - 16;
+		_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	}
+}
+
+// n is at least SSE2_MIN
+__attribute__((target("sse2"))) void __libc_memset_sse2(void *dst, int c, size_t n) {
+	char *d = dst;
+	__m128i x = _mm_set1_epi8(c);
+	_mm_storeu_si128((__m128i *)d, x);
+	size_t head = -(uintptr_t)d & 15;
+	d += head, n -= head;
+	for (; n >= 64; n -= 64, d += 64) {
+		_mm_store_si128((__m128i *)d, x);
+		_mm_store_si128((__m128i *)(d + 16), x);
+		_mm_store_si128((__m128i *)(d + 32), x);
+		_mm_store_si128((__m128i *)(d + 48), x);
+	}
+	for (; n >= 16; n -= 16, d += 16) {
+		_mm_store_si128((__m128i *)d, x);
+	}
+	if (n) {
+		_mm_storeu_si128((__m128i *)(d + n - 16), x);
+	}
+}
+
+// Scans use aligned loads only. An aligned block never crosses a page, so
+// reading bytes before the start or past the end of the string is safe.
+
+__attribute__((target("sse2"))) size_t __libc_strlen_sse2(const char *s) {
+	const __m128i zero = _mm_setzero_si128();
+	const char *p = (const char *)((uintptr_t)s & ~15);
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+	mask &= ~0u << (s - p); // bytes before s
+	while (!mask) {
+		p += 16;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+	}
+	return p + __builtin_ctz(mask) - s;
+}
+
+__attribute__((target("sse2"))) void *__libc_memchr_sse2(const void *src, int c, size_t n) {
+	const char *s = src;
+	const __m128i x = _mm_set1_epi8(c);
+	const char *p = (const char *)((uintptr_t)s & ~15);
+	size_t skip = s - p;
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), x));
+	mask &= ~0u << skip;
+	n = n > SIZE_MAX - skip ? SIZE_MAX : n + skip; // bytes from p on
+	for (;;) {
+		if (mask) {
+			size_t i = __builtin_ctz(mask);
+			return i < n ? (void *)(p + i) : NULL;
+		}
+		if (n <= 16) {
+			return NULL;
+		}
+		p += 16, n -= 16;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), x));
+	}
+}
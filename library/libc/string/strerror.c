@@ -28,7 +28,8 @@ static char *error_string[] = {
 	[-ERROR_READ_FAIL] = "Disk read fail",
 	[-ERROR_OUT_OF_SPACE] = "Filesystem out of space",
 	[-ERROR_WRITE_FAIL] = "Disk write fail",
-	[-ERROR_NO_PERM] = "Permission denied"
+	[-ERROR_NO_PERM] = "Permission denied",
+	[-ERROR_AGAIN] = "Resource temporarily unavailable"
 
 };
 
@@ -18,11 +18,26 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
 
 size_t strlen(const char *s) {
-	size_t n = 0;
-	while (s[n]) {
-		n++;
+	if (__libc_cpu_features & CPU_SSE2) {
+		return __libc_strlen_sse2(s);
+	}
+	const char *p = s;
+	// an aligned word never crosses a page, reading past the NUL is safe
+	for (; (uintptr_t)p % 4; p++) {
+		if (!*p) {
+			return p - s;
+		}
+	}
+	while (!WORD_HAS_ZERO(*(const uint32_t *)p)) {
+		p += 4;
+	}
+	while (*p) {
+		p++;
 	}
-	return n;
+	return p - s;
 }
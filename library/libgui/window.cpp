@@ -30,9 +30,11 @@ GUI::Window::~Window() {
 }
 
 void GUI::Window::render() {
+	wm_begin_frame(handle);
 	for (const auto &t : control_cont) {
 		t->draw(handle);
 	}
+	wm_end_frame();
 }
 
 void GUI::Window::set_title(const char *title) {
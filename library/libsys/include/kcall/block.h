@@ -0,0 +1,83 @@
+/*
+ * Block device HAL user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_BLOCK_H
+#define _LIBSYS_KCALL_BLOCK_H
+
+#include <panicos.h>
+
+struct BlockCacheStats {
+	unsigned int buffers; // cache capacity in sectors
+	unsigned int dirty; // buffers not yet written back
+	unsigned int hits, misses, evictions, writebacks;
+};
+
+#define BLOCK_HIST_SIZE 16
+
+// Request queue statistics of a driver that queues requests
+struct BlockQueueStats {
+	unsigned int queues; // hardware queues in use
+	unsigned int depth, max_depth; // requests on the device now and at most
+	unsigned int requests; // requests from the block layer
+	unsigned int merged; // requests merged into an adjacent one
+	unsigned int completed, errors;
+	unsigned long long sectors;
+	unsigned int depth_hist[BLOCK_HIST_SIZE]; // dispatches by depth, bucket i from 2^i
+	unsigned int latency_hist[BLOCK_HIST_SIZE]; // requests by TSC cycles, bucket i from 2^(i+10)
+};
+
+struct BlockKcall {
+#define BLOCK_KCALL_OP_SYNC 0
+#define BLOCK_KCALL_OP_CACHE_STATS 1
+#define BLOCK_KCALL_OP_QUEUE_STATS 2
+	unsigned int op;
+	struct BlockCacheStats stats;
+	int id; // block device of BLOCK_KCALL_OP_QUEUE_STATS
+	struct BlockQueueStats queue;
+};
+
+static inline int block_sync(void) {
+	struct BlockKcall b = {
+		.op = BLOCK_KCALL_OP_SYNC,
+	};
+	return kcall("block", (unsigned int)&b);
+}
+
+static inline int block_cache_get_stats(struct BlockCacheStats *stats) {
+	struct BlockKcall b = {
+		.op = BLOCK_KCALL_OP_CACHE_STATS,
+	};
+	int ret = kcall("block", (unsigned int)&b);
+	*stats = b.stats;
+	return ret;
+}
+
+// Return ERROR_NOT_EXIST if block device id keeps no request queue
+// statistics, ERROR_INVAILD if there is no such device
+static inline int block_get_queue_stats(int id, struct BlockQueueStats *stats) {
+	struct BlockKcall b = {
+		.op = BLOCK_KCALL_OP_QUEUE_STATS,
+		.id = id,
+	};
+	int ret = kcall("block", (unsigned int)&b);
+	*stats = b.queue;
+	return ret;
+}
+
+#endif
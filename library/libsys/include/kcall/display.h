@@ -29,6 +29,7 @@ enum DisplayKCallOp {
 	DISPLAY_KCALL_OP_GET_PREFERRED = 3,
 	DISPLAY_KCALL_OP_UPDATE = 4,
 	DISPLAY_KCALL_OP_GET_NAME = 5,
+	DISPLAY_KCALL_OP_UPDATE_RECT = 6,
 };
 
 #define DISPLAY_KCALL_FLAG_NEED_UPDATE (1 << 0)
@@ -41,6 +42,7 @@ struct DisplayKcall {
 	unsigned int yres;
 	unsigned int flag;
 	void *framebuffer;
+	unsigned int x, y, w, h; // rectangle to update
 };
 
 static inline void *
@@ -98,6 +100,21 @@ static inline void display_update(unsigned int display_id) {
 	kcall("display", (unsigned int)&d);
 }
 
+// copy just a rectangle of the framebuffer to the screen
+static inline void display_update_rect(
+	unsigned int display_id, unsigned int x, unsigned int y, unsigned int w, unsigned int h
+) {
+	struct DisplayKcall d = {
+		.op = DISPLAY_KCALL_OP_UPDATE_RECT,
+		.display_id = display_id,
+		.x = x,
+		.y = y,
+		.w = w,
+		.h = h,
+	};
+	kcall("display", (unsigned int)&d);
+}
+
 static inline int display_get_name(unsigned int display_id, char *name) {
 	struct DisplayKcall d = {
 		.op = DISPLAY_KCALL_OP_GET_NAME,
@@ -0,0 +1,52 @@
+/*
+ * Event wait user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_EVENT_H
+#define _LIBSYS_KCALL_EVENT_H
+
+#include <panicos.h>
+
+#define EVENT_MESSAGE (1 << 0)
+#define EVENT_KEYBOARD (1 << 1)
+#define EVENT_MOUSE (1 << 2)
+#define EVENT_WAIT_FOREVER 0xffffffff
+
+struct EventKcall {
+#define EVENT_KCALL_OP_WAIT 0
+	unsigned int op;
+	unsigned int mask; // EVENT_* to wait for
+	unsigned int timeout; // ticks, EVENT_WAIT_FOREVER never times out
+	unsigned int events; // pending events
+};
+
+// Sleep until one of the events in mask is pending or timeout ticks passed.
+// Return the pending events, 0 on timeout or -1 on error.
+static inline int event_wait(unsigned int mask, unsigned int timeout) {
+	struct EventKcall e = {
+		.op = EVENT_KCALL_OP_WAIT,
+		.mask = mask,
+		.timeout = timeout,
+	};
+	if (kcall("event", (unsigned int)&e) < 0) {
+		return -1;
+	}
+	return e.events;
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Input event user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_INPUT_H
+#define _LIBSYS_KCALL_INPUT_H
+
+#include <panicos.h>
+
+#define INPUT_KEYBOARD 0
+#define INPUT_MOUSE 1
+#define INPUT_DEVICES 2
+
+#define INPUT_READ_MAX 8
+
+struct InputEvent {
+	unsigned int data; // keycode or mouse packet
+	unsigned int unused;
+	unsigned long long time; // TSC cycles when the driver reported it
+};
+
+struct InputDeviceStats {
+	unsigned int events; // reported by drivers
+	unsigned int coalesced; // mouse packets merged into a queued one
+	unsigned int dropped; // lost to a full queue
+	unsigned int read; // taken by readers
+	unsigned long long latency_total; // TSC cycles from report to read, summed
+	unsigned long long latency_max;
+};
+
+struct InputKcall {
+#define INPUT_KCALL_OP_READ 0
+#define INPUT_KCALL_OP_STATS 1
+	unsigned int op;
+	unsigned int device; // INPUT_KEYBOARD or INPUT_MOUSE
+	unsigned int flags;
+#define INPUT_READ_BLOCK (1 << 0) // sleep until there is an event
+	unsigned int count; // events to read, then events read
+	struct InputEvent events[INPUT_READ_MAX];
+	struct InputDeviceStats stats[INPUT_DEVICES];
+};
+
+// Take up to count (at most INPUT_READ_MAX) queued events of device,
+// with INPUT_READ_BLOCK wait for one. Return the number taken or -1.
+static inline int input_read(
+	unsigned int device, struct InputEvent *events, unsigned int count, unsigned int flags
+) {
+	struct InputKcall k = {
+		.op = INPUT_KCALL_OP_READ,
+		.device = device,
+		.flags = flags,
+		.count = count,
+	};
+	if (kcall("input", (unsigned int)&k) < 0) {
+		return -1;
+	}
+	for (unsigned int i = 0; i < k.count; i++) {
+		events[i] = k.events[i];
+	}
+	return k.count;
+}
+
+static inline int input_get_stats(struct InputDeviceStats stats[INPUT_DEVICES]) {
+	struct InputKcall k = {
+		.op = INPUT_KCALL_OP_STATS,
+	};
+	int ret = kcall("input", (unsigned int)&k);
+	for (int i = 0; i < INPUT_DEVICES; i++) {
+		stats[i] = k.stats[i];
+	}
+	return ret;
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Interrupt user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_IRQ_H
+#define _LIBSYS_KCALL_IRQ_H
+
+#include <panicos.h>
+
+#define IRQ_MAX_CPU 8
+
+// A message signaled interrupt vector and the interrupts it raised
+struct IrqVectorStats {
+	unsigned int vector;
+	unsigned int ncpu;
+	unsigned int cpu; // CPU the vector is delivered to
+	unsigned int count[IRQ_MAX_CPU]; // interrupts taken on each CPU
+};
+
+struct IrqKcall {
+#define IRQ_KCALL_OP_VECTOR_STATS 0
+	unsigned int op;
+	struct IrqVectorStats stats;
+};
+
+// Statistics of the first allocated vector not below vector, return
+// ERROR_NOT_EXIST if there is none
+static inline int irq_get_vector_stats(unsigned int vector, struct IrqVectorStats *stats) {
+	struct IrqKcall i = {
+		.op = IRQ_KCALL_OP_VECTOR_STATS,
+		.stats.vector = vector,
+	};
+	int ret = kcall("irq", (unsigned int)&i);
+	*stats = i.stats;
+	return ret;
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Scheduler user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_SCHED_H
+#define _LIBSYS_KCALL_SCHED_H
+
+#include <panicos.h>
+
+#define SCHED_MAX_CPU 8
+
+struct SchedCpuStats {
+	unsigned int switches; // context switches to processes
+	unsigned int nr_running; // runnable processes waiting in the run queue
+	unsigned int steals; // processes taken from other CPUs
+	unsigned int idles; // times the CPU halted with nothing to run
+};
+
+struct SchedProcStats {
+	unsigned int syscalls; // system calls made
+	unsigned int switches; // times the process was switched to
+};
+
+struct SchedStats {
+	unsigned int ncpu;
+	unsigned int ticks; // timer ticks when sampled
+	struct SchedCpuStats cpu[SCHED_MAX_CPU];
+};
+
+struct SchedKcall {
+#define SCHED_KCALL_OP_STATS 0
+#define SCHED_KCALL_OP_PROC_STATS 1
+	unsigned int op;
+	struct SchedStats stats;
+	struct SchedProcStats proc;
+};
+
+static inline int sched_get_stats(struct SchedStats *stats) {
+	struct SchedKcall s = {
+		.op = SCHED_KCALL_OP_STATS,
+	};
+	int ret = kcall("sched", (unsigned int)&s);
+	*stats = s.stats;
+	return ret;
+}
+
+// counters of the calling process
+static inline int sched_get_proc_stats(struct SchedProcStats *stats) {
+	struct SchedKcall s = {
+		.op = SCHED_KCALL_OP_PROC_STATS,
+	};
+	int ret = kcall("sched", (unsigned int)&s);
+	*stats = s.proc;
+	return ret;
+}
+
+#endif
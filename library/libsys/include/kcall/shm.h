@@ -0,0 +1,74 @@
+/*
+ * Shared memory user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_SHM_H
+#define _LIBSYS_KCALL_SHM_H
+
+#include <panicos.h>
+
+struct ShmKcall {
+#define SHM_KCALL_OP_CREATE 0
+#define SHM_KCALL_OP_MAP 1
+#define SHM_KCALL_OP_UNMAP 2
+	unsigned int op;
+	unsigned int id;
+	unsigned int size;
+	int pid; // the other process allowed to map a new object
+	void *addr;
+};
+
+// Create a shared memory object of at least size bytes, zero filled, that
+// the calling process and process pid may map, and map it. Return the
+// address and set *id, or return 0.
+static inline void *shm_create(unsigned int size, int pid, unsigned int *id) {
+	struct ShmKcall s = {
+		.op = SHM_KCALL_OP_CREATE,
+		.size = size,
+		.pid = pid,
+	};
+	if (kcall("shm", (unsigned int)&s) < 0) {
+		return 0;
+	}
+	*id = s.id;
+	return s.addr;
+}
+
+// Map the shared memory object id created for the calling process,
+// return the address and set *size, or return 0
+static inline void *shm_map(unsigned int id, unsigned int *size) {
+	struct ShmKcall s = {
+		.op = SHM_KCALL_OP_MAP,
+		.id = id,
+	};
+	if (kcall("shm", (unsigned int)&s) < 0) {
+		return 0;
+	}
+	*size = s.size;
+	return s.addr;
+}
+
+static inline int shm_unmap(void *addr) {
+	struct ShmKcall s = {
+		.op = SHM_KCALL_OP_UNMAP,
+		.addr = addr,
+	};
+	return kcall("shm", (unsigned int)&s);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Virtual memory user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_VM_H
+#define _LIBSYS_KCALL_VM_H
+
+#include <panicos.h>
+
+struct VmStats {
+	unsigned int page_faults; // all page faults taken
+	unsigned int cow_faults; // writes to copy-on-write pages
+	unsigned int cow_copies; // copy-on-write faults that had to copy the page
+	unsigned int cow_shared; // pages shared by fork instead of copied
+	unsigned int file_faults; // pages mapped from the page cache on demand
+	unsigned int anon_faults; // private pages filled on demand
+	unsigned int msg_pages_lent; // sender pages carried by messages instead of copied
+	unsigned int msg_pages_mapped; // message pages mapped into the receiver instead of copied
+};
+
+#define PGALLOC_MAX_ORDER 13
+struct PgallocStats {
+	unsigned int total_pages; // pages managed by the allocator
+	unsigned int free_pages; // free pages in buddy free lists
+	unsigned int pcp_pages; // free pages held in per-CPU caches
+	unsigned int nr_free[PGALLOC_MAX_ORDER]; // free blocks of each order
+};
+
+struct PageCacheStats {
+	unsigned int files, pages; // files and pages cached
+	unsigned int hits, misses, evictions;
+};
+
+struct VmKcall {
+#define VM_KCALL_OP_STATS 0
+	unsigned int op;
+	struct VmStats stats;
+	struct PgallocStats pgalloc;
+	struct PageCacheStats pagecache;
+};
+
+static inline int vm_get_stats(
+	struct VmStats *stats, struct PgallocStats *pgalloc, struct PageCacheStats *pagecache
+) {
+	struct VmKcall v = {
+		.op = VM_KCALL_OP_STATS,
+	};
+	int ret = kcall("vm", (unsigned int)&v);
+	*stats = v.stats;
+	*pgalloc = v.pgalloc;
+	*pagecache = v.pagecache;
+	return ret;
+}
+
+#endif
@@ -24,6 +24,18 @@
 extern "C" {
 #endif
 
+// A message is sent from the buffers of vec in order, at most 16 of them
+// and MESSAGE_SIZE_MAX bytes in total. Large messages whose buffers are
+// page aligned are sent without copying, as are those received into a
+// page aligned buffer.
+struct MessageVec {
+	const void *base;
+	int size;
+};
+
+#define MESSAGE_SIZE_MAX (4 * 1024 * 1024)
+#define MESSAGE_NONBLOCK 1 // fail with ERROR_AGAIN when the queue is full
+
 int fork(void);
 #ifdef __cplusplus
 [[noreturn]] int proc_exit(int);
@@ -45,6 +57,7 @@ int link(const char *, const char *);
 int mkdir(const char *);
 int chdir(const char *);
 int dup(int);
+int dup2(int, int);
 int getpid(void);
 char *sbrk(int);
 int sleep(int);
@@ -60,6 +73,7 @@ int kcall(const char *name, unsigned int arg);
 int message_send(int pid, int size, const void *data);
 int message_receive(void *data);
 int message_wait(void *data);
+int message_sendv(int pid, const struct MessageVec *vec, int count, int flags);
 int getppid(void);
 int proc_search(const char *name);
 int pty_create(void);
@@ -69,6 +83,8 @@ int pty_close(int pty);
 int pty_switch(int pty);
 int proc_status(int pid, int *exit_status);
 int module_load(const char *name);
+void *mem_map(void *addr, int size);
+int mem_unmap(void *addr, int size);
 
 enum OpenMode {
 	O_READ = 1,
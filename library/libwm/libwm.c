@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <kcall/shm.h>
 #include <panicos.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,7 +25,136 @@
 #include "protocol.h"
 #include "wm.h"
 
+extern unsigned char font16[256 * 16];
+
+// Pixels of a sheet shared with the window manager. Sheets get one when
+// created, drawing goes straight into it and the window manager is only
+// told the damaged rectangle. Without one drawing is sent in messages.
+struct WmSurface {
+	int handle;
+	int width, height;
+	COLOUR *pixels;
+	struct WmSurface *next;
+};
+
 static int wm_pid;
+static struct WmSurface *surface_list;
+
+// Drawing on the sheet between wm_begin_frame() and wm_end_frame() is
+// queued here and sent in one message, handle is 0 outside a frame
+static struct {
+	int handle;
+	struct MessageBatch *msg;
+} batch;
+
+static struct WmSurface *surface_find(int handle) {
+	struct WmSurface *surface = surface_list;
+	while (surface && surface->handle != handle) {
+		surface = surface->next;
+	}
+	return surface;
+}
+
+// wait for the reply of the window manager, other messages are dropped
+static void wm_wait_reply(enum WmUserMessageType msgtype, char *buf) {
+	while (!message_receive(buf) || *(int *)buf != (int)msgtype) {}
+}
+
+static int wm_wait_return_handle(void) {
+	char buf[256];
+	wm_wait_reply(WM_MESSAGE_RETURN_HANDLE, buf);
+	return ((struct MessageReturnHandle *)buf)->handle;
+}
+
+// share the pixels of a new sheet, on failure keep drawing through messages
+static void surface_attach(int handle, int width, int height) {
+	unsigned int shm_id;
+	COLOUR *pixels = shm_create(width * height * sizeof(COLOUR), wm_pid, &shm_id);
+	if (!pixels) {
+		return;
+	}
+	struct MessageAttachSurface msg = {
+		.msgtype = WM_MESSAGE_ATTACH_SURFACE,
+		.sheet_id = handle,
+		.shm_id = shm_id,
+	};
+	message_send(wm_pid, sizeof(msg), &msg);
+	if (wm_wait_return_handle() != 0) {
+		shm_unmap(pixels);
+		return;
+	}
+	struct WmSurface *surface = malloc(sizeof(struct WmSurface));
+	surface->handle = handle;
+	surface->width = width;
+	surface->height = height;
+	surface->pixels = pixels;
+	surface->next = surface_list;
+	surface_list = surface;
+}
+
+static void batch_flush(void) {
+	if (batch.msg->size) {
+		message_send(wm_pid, sizeof(struct MessageBatch) + batch.msg->size, batch.msg);
+		batch.msg->size = 0;
+	}
+}
+
+// Room for a command of size bytes in the frame of handle, sending what is
+// queued if it is full. Return NULL if no frame of handle is open.
+static struct WmCommand *batch_command(int handle, enum WmCommandType type, unsigned int size) {
+	if (!handle || batch.handle != handle) {
+		return NULL;
+	}
+	size = (size + 3) & ~3;
+	if (size > WM_BATCH_MAX) { // sent on its own after what is queued
+		batch_flush();
+		return NULL;
+	}
+	if (batch.msg->size + size > WM_BATCH_MAX) {
+		batch_flush();
+	}
+	struct WmCommand *cmd = (struct WmCommand *)(batch.msg->commands + batch.msg->size);
+	batch.msg->size += size;
+	cmd->type = type;
+	cmd->size = size;
+	return cmd;
+}
+
+static int batch_rect(
+	int handle, enum WmCommandType type, int x, int y, int width, int height, COLOUR colour
+) {
+	struct WmCommand *cmd = batch_command(handle, type, sizeof(struct WmCommand));
+	if (!cmd) {
+		return 0;
+	}
+	cmd->x = x;
+	cmd->y = y;
+	cmd->w = width;
+	cmd->h = height;
+	cmd->r = colour.r;
+	cmd->g = colour.g;
+	cmd->b = colour.b;
+	return 1;
+}
+
+// clip the rectangle to the surface, return 0 if nothing is left
+static int surface_clip(struct WmSurface *surface, int *x, int *y, int *w, int *h) {
+	if (*x < 0) {
+		*w += *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*h += *y;
+		*y = 0;
+	}
+	if (*w > surface->width - *x) {
+		*w = surface->width - *x;
+	}
+	if (*h > surface->height - *y) {
+		*h = surface->height - *y;
+	}
+	return *w > 0 && *h > 0;
+}
 
 int wm_init(void) {
 	wm_pid = proc_search("wm");
@@ -42,12 +172,23 @@ int wm_create_sheet(int x, int y, int width, int height) {
 	msg.width = width;
 	msg.height = height;
 	message_send(wm_pid, sizeof(msg), &msg);
-	struct MessageReturnHandle ret_handle;
-	while (!message_receive(&ret_handle) || ret_handle.msgtype != WM_MESSAGE_RETURN_HANDLE) {}
-	return ret_handle.handle;
+	int handle = wm_wait_return_handle();
+	surface_attach(handle, width, height);
+	return handle;
 }
 
 void wm_fill_sheet(int handle, COLOUR colour) {
+	struct WmSurface *surface = surface_find(handle);
+	if (surface) {
+		wm_buffer_fill_rect(
+			surface->pixels, surface->width, 0, 0, surface->width, surface->height, colour
+		);
+		wm_damage(handle, 0, 0, surface->width, surface->height);
+		return;
+	}
+	if (batch_rect(handle, WM_COMMAND_FILL_RECT, 0, 0, WM_COMMAND_ALL, WM_COMMAND_ALL, colour)) {
+		return;
+	}
 	struct MessageFillSheet msg;
 	msg.msgtype = WM_MESSAGE_FILL_SHEET;
 	msg.sheet_id = handle;
@@ -58,30 +199,47 @@ void wm_fill_sheet(int handle, COLOUR colour) {
 }
 
 void wm_print_text(int handle, int x, int y, COLOUR colour, const char *text) {
-	struct MessagePrintText msg;
-	msg.msgtype = WM_MESSAGE_PRINT_TEXT;
-	msg.sheet_id = handle;
-	msg.x = x;
-	msg.y = y;
-	msg.r = colour.r;
-	msg.g = colour.g;
-	msg.b = colour.b;
-	strcpy(msg.text, text);
-	message_send(wm_pid, sizeof(msg), &msg);
+	wm_print_text_n(handle, x, y, colour, text, strlen(text));
 }
 
 void wm_print_text_n(int handle, int x, int y, COLOUR colour, const char *text, int n) {
+	struct WmSurface *surface = surface_find(handle);
+	if (surface) {
+		int w = wm_buffer_print_text(
+			surface->pixels, surface->width, surface->height, x, y, colour, text, n
+		);
+		wm_damage(handle, x, y, w, 16);
+		return;
+	}
+	struct WmCommand *cmd = batch_command(handle, WM_COMMAND_TEXT, sizeof(struct WmCommand) + n);
+	if (cmd) {
+		cmd->x = x;
+		cmd->y = y;
+		cmd->w = n;
+		cmd->h = 16;
+		cmd->r = colour.r;
+		cmd->g = colour.g;
+		cmd->b = colour.b;
+		memcpy(cmd->text, text, n);
+		return;
+	}
+	// a message holds a string of up to 255 characters, longer text goes in
+	// several placed one after the other, 8 pixels per character
 	struct MessagePrintText msg;
+	int max = sizeof(msg.text) - 1;
 	msg.msgtype = WM_MESSAGE_PRINT_TEXT;
 	msg.sheet_id = handle;
-	msg.x = x;
 	msg.y = y;
 	msg.r = colour.r;
 	msg.g = colour.g;
 	msg.b = colour.b;
-	memcpy(msg.text, text, n);
-	msg.text[n] = '\0';
-	message_send(wm_pid, sizeof(msg), &msg);
+	for (int i = 0; i < n; i += max) {
+		int len = n - i < max ? n - i : max;
+		msg.x = x + i * 8;
+		memcpy(msg.text, text + i, len);
+		msg.text[len] = '\0';
+		message_send(wm_pid, sizeof(msg), &msg);
+	}
 }
 
 int wm_create_window(int width, int height) {
@@ -90,9 +248,9 @@ int wm_create_window(int width, int height) {
 	msg.width = width;
 	msg.height = height;
 	message_send(wm_pid, sizeof(msg), &msg);
-	struct MessageReturnHandle ret_handle;
-	while (!message_receive(&ret_handle) || ret_handle.msgtype != WM_MESSAGE_RETURN_HANDLE) {}
-	return ret_handle.handle;
+	int handle = wm_wait_return_handle();
+	surface_attach(handle, width, height);
+	return handle;
 }
 
 void wm_window_set_title(int handle, const char *title) {
@@ -208,13 +366,38 @@ int wm_catch_event(struct WmEvent *event) {
 }
 
 void wm_remove_sheet(int handle) {
+	if (batch.handle == handle) {
+		wm_end_frame();
+	}
 	struct MessageRemoveSheet msg;
 	msg.msgtype = WM_MESSAGE_REMOVE_SHEET;
 	msg.sheet_id = handle;
 	message_send(wm_pid, sizeof(msg), &msg);
+
+	struct WmSurface **pp = &surface_list;
+	while (*pp && (*pp)->handle != handle) {
+		pp = &(*pp)->next;
+	}
+	if (*pp) {
+		struct WmSurface *surface = *pp;
+		*pp = surface->next;
+		shm_unmap(surface->pixels);
+		free(surface);
+	}
 }
 
 void wm_fill_rect(int handle, int x, int y, int width, int height, COLOUR colour) {
+	struct WmSurface *surface = surface_find(handle);
+	if (surface) {
+		if (surface_clip(surface, &x, &y, &width, &height)) {
+			wm_buffer_fill_rect(surface->pixels, surface->width, x, y, width, height, colour);
+			wm_damage(handle, x, y, width, height);
+		}
+		return;
+	}
+	if (batch_rect(handle, WM_COMMAND_FILL_RECT, x, y, width, height, colour)) {
+		return;
+	}
 	struct MessageDrawRect msg;
 	msg.msgtype = WM_MESSAGE_DRAW_RECT;
 	msg.sheet_id = handle;
@@ -229,14 +412,140 @@ void wm_fill_rect(int handle, int x, int y, int width, int height, COLOUR colour
 }
 
 void wm_draw_buffer(int handle, int x, int y, int width, int height, COLOUR *buffer) {
-	struct MessageDrawBuffer *msg = malloc(sizeof(struct MessageDrawBuffer));
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	struct WmSurface *surface = surface_find(handle);
+	if (surface) {
+		int stride = width, src_x = x, src_y = y;
+		if (!surface_clip(surface, &x, &y, &width, &height)) {
+			return;
+		}
+		buffer += (y - src_y) * stride + x - src_x;
+		for (int i = 0; i < height; i++) {
+			memcpy(
+				surface->pixels + (y + i) * surface->width + x,
+				buffer + i * stride,
+				width * sizeof(COLOUR)
+			);
+		}
+		wm_damage(handle, x, y, width, height);
+		return;
+	}
+
+	// the pixels go in their own messages after what the frame queued, each
+	// with as many rows as fit
+	if (batch.handle == handle) {
+		batch_flush();
+	}
+	unsigned int row = width * sizeof(COLOUR);
+	unsigned int max_rows = (WM_MESSAGE_MAX - sizeof(struct MessageDrawBuffer)) / row;
+	if (max_rows == 0) {
+		return; // not even a row fits
+	}
+	unsigned int rows = (unsigned int)height < max_rows ? (unsigned int)height : max_rows;
+	struct MessageDrawBuffer *msg = malloc(sizeof(struct MessageDrawBuffer) + rows * row);
 	msg->msgtype = WM_MESSAGE_DRAW_BUFFER;
 	msg->sheet_id = handle;
 	msg->x = x;
-	msg->y = y;
 	msg->w = width;
-	msg->h = height;
-	memcpy(msg->buffer, buffer, width * height * sizeof(COLOUR));
-	message_send(wm_pid, sizeof(struct MessageDrawBuffer), msg);
+	for (unsigned int i = 0; i < (unsigned int)height; i += rows) {
+		unsigned int n = height - i < rows ? height - i : rows;
+		msg->y = y + i;
+		msg->h = n;
+		memcpy(msg->buffer, buffer + i * width, n * row);
+		message_send(wm_pid, sizeof(struct MessageDrawBuffer) + n * row, msg);
+	}
 	free(msg);
 }
+
+int wm_get_stats(struct WmStats *stats) {
+	if (!wm_pid) {
+		return 0;
+	}
+	enum WmControlMessageType msg = WM_MESSAGE_GET_STATS;
+	message_send(wm_pid, sizeof(msg), &msg);
+	char buf[256];
+	wm_wait_reply(WM_MESSAGE_STATS, buf);
+	*stats = ((struct MessageStats *)buf)->stats;
+	return 1;
+}
+
+COLOUR *wm_get_surface(int handle, int *width, int *height) {
+	struct WmSurface *surface = surface_find(handle);
+	if (!surface) {
+		return NULL;
+	}
+	*width = surface->width;
+	*height = surface->height;
+	return surface->pixels;
+}
+
+void wm_damage(int handle, int x, int y, int width, int height) {
+	COLOUR none = {0};
+	if (batch_rect(handle, WM_COMMAND_DAMAGE, x, y, width, height, none)) {
+		return;
+	}
+	struct MessageDamage msg = {
+		.msgtype = WM_MESSAGE_DAMAGE,
+		.sheet_id = handle,
+		.x = x,
+		.y = y,
+		.w = width,
+		.h = height,
+	};
+	message_send(wm_pid, sizeof(msg), &msg);
+}
+
+void wm_begin_frame(int handle) {
+	if (batch.handle) {
+		wm_end_frame();
+	}
+	if (!batch.msg) {
+		batch.msg = malloc(sizeof(struct MessageBatch) + WM_BATCH_MAX);
+		batch.msg->msgtype = WM_MESSAGE_BATCH;
+		batch.msg->size = 0;
+	}
+	batch.handle = handle;
+	batch.msg->sheet_id = handle;
+}
+
+void wm_end_frame(void) {
+	if (batch.handle) {
+		batch_flush();
+		batch.handle = 0;
+	}
+}
+
+void wm_buffer_fill_rect(
+	COLOUR *buf, int stride, int x, int y, int width, int height, COLOUR colour
+) {
+	for (int i = 0; i < height; i++) {
+		COLOUR *p = buf + (y + i) * stride + x;
+		for (int j = 0; j < width; j++) {
+			p[j] = colour;
+		}
+	}
+}
+
+int wm_buffer_print_text(
+	COLOUR *buf, int stride, int rows, int x, int y, COLOUR colour, const char *text, int n
+) {
+	if (x < 0 || y < 0 || y + 16 > rows) {
+		return 0;
+	}
+	int drawn = 0;
+	for (int i = 0; i < n && text[i] != '\0' && text[i] != '\n' && x + 8 * (i + 1) <= stride; i++) {
+		const unsigned char *glyph = font16 + (unsigned char)text[i] * 16;
+		for (int j = 0; j < 16; j++) {
+			COLOUR *p = buf + (y + j) * stride + x + i * 8;
+			for (int k = 0; k < 8; k++) {
+				if (glyph[j] & (0x80 >> k)) {
+					p[k] = colour;
+				}
+			}
+		}
+		drawn += 8;
+	}
+	return drawn;
+}
@@ -31,8 +31,14 @@ enum WmControlMessageType {
 	WM_MESSAGE_REMOVE_SHEET,
 	WM_MESSAGE_DRAW_RECT,
 	WM_MESSAGE_DRAW_BUFFER,
+	WM_MESSAGE_ATTACH_SURFACE,
+	WM_MESSAGE_DAMAGE,
+	WM_MESSAGE_GET_STATS,
+	WM_MESSAGE_BATCH,
 };
 
+#define WM_MESSAGE_MAX (4 * 1024 * 1024) // the window manager's receive buffer
+
 struct MessageCreateSheet {
 	enum WmControlMessageType msgtype;
 	int x, y, width, height;
@@ -76,7 +82,50 @@ struct MessageDrawBuffer {
 	enum WmControlMessageType msgtype;
 	int sheet_id;
 	int x, y, w, h;
-	char buffer[1000 * 1000 * 3];
+	char buffer[]; // w * h pixels
+};
+
+// Share the pixels of a sheet, or of the client area of a window, through
+// the shared memory object shm_id which the window manager maps. The sheet
+// content is copied into it, from then on the client draws there and
+// reports what it changed with WM_MESSAGE_DAMAGE. Replied with a
+// WM_MESSAGE_RETURN_HANDLE, handle is 0 on success.
+struct MessageAttachSurface {
+	enum WmControlMessageType msgtype;
+	int sheet_id;
+	unsigned int shm_id;
+};
+
+struct MessageDamage {
+	enum WmControlMessageType msgtype;
+	int sheet_id;
+	int x, y, w, h;
+};
+
+// Drawing commands on the client area of one sheet, run in order as a
+// single message. Each command starts with a struct WmCommand of size
+// bytes, rounded up to 4, and the next one follows it.
+struct MessageBatch {
+	enum WmControlMessageType msgtype;
+	int sheet_id;
+	unsigned int size; // bytes of commands
+	char commands[];
+};
+
+#define WM_BATCH_MAX 16384 // bytes of commands in a batch
+#define WM_COMMAND_ALL 0x7fffffff // w or h reaching the edge of the client area
+
+enum WmCommandType {
+	WM_COMMAND_FILL_RECT,
+	WM_COMMAND_TEXT, // w characters at x, y
+	WM_COMMAND_DAMAGE, // the client drew into its surface
+};
+
+struct WmCommand {
+	unsigned short type, size;
+	int x, y, w, h;
+	unsigned char r, g, b, unused;
+	char text[];
 };
 
 // window manager to GUI programs
@@ -86,6 +135,7 @@ enum WmUserMessageType {
 	WM_MESSAGE_KEYBOARD_EVENT,
 	WM_MESSAGE_MOUSE_BUTTON_EVENT,
 	WM_MESSAGE_WINDOW_CLOSE_EVENT,
+	WM_MESSAGE_STATS,
 };
 
 struct MessageReturnHandle {
@@ -110,4 +160,29 @@ struct MessageWindowCloseEvent {
 	int sheet_id;
 };
 
+// compositor counters, the reply to WM_MESSAGE_GET_STATS
+struct WmStats {
+	unsigned int frames; // frames composited and presented
+	unsigned int damage_rects; // damaged rectangles in the last frame
+	unsigned int copied; // bytes written to the framebuffer in the last frame
+	unsigned int presented; // bytes of the screen pushed to the display in the last frame
+	unsigned long long frame_cycles; // TSC cycles taken by the last frame
+	unsigned long long max_frame_cycles;
+	unsigned long long total_cycles;
+	unsigned long long total_copied;
+	unsigned int refresh; // frames a second at most
+	unsigned int wakeups; // times the frame loop woke up
+	unsigned int mouse_packets; // mouse input handled, coalesced into frames
+	unsigned int messages; // messages handled
+	unsigned int commands; // drawing commands handled in batches
+	unsigned int events_dropped; // input events not sent to clients with a full queue
+	unsigned long long input_latency; // TSC cycles from mouse input to the frame showing it
+	unsigned long long max_input_latency;
+};
+
+struct MessageStats {
+	enum WmUserMessageType msgtype;
+	struct WmStats stats;
+};
+
 #endif
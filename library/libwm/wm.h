@@ -50,6 +50,32 @@ void wm_remove_sheet(int handle);
 void wm_fill_rect(int handle, int x, int y, int width, int height, COLOUR colour);
 void wm_draw_buffer(int handle, int x, int y, int width, int height, COLOUR *buffer);
 
+// Drawing on handle between wm_begin_frame() and wm_end_frame() goes to
+// the window manager in a single message, which it draws as one frame.
+// Beginning a frame ends the one open on another sheet.
+void wm_begin_frame(int handle);
+void wm_end_frame(void);
+
+// Sheets share their pixels with the window manager when possible. Drawing
+// straight into the surface costs no messages, tell the window manager what
+// changed with wm_damage(). Return NULL if the sheet has no surface.
+COLOUR *wm_get_surface(int handle, int *width, int *height);
+void wm_damage(int handle, int x, int y, int width, int height);
+
+// compositor counters, struct WmStats is in libwm/protocol.h
+struct WmStats;
+int wm_get_stats(struct WmStats *stats);
+
+// Drawing into a pixel buffer of stride pixels per row, such as a surface.
+// wm_buffer_print_text() clips to the buffer of rows rows and returns the
+// width drawn.
+void wm_buffer_fill_rect(
+	COLOUR *buf, int stride, int x, int y, int width, int height, COLOUR colour
+);
+int wm_buffer_print_text(
+	COLOUR *buf, int stride, int rows, int x, int y, COLOUR colour, const char *text, int n
+);
+
 #ifdef __cplusplus
 }
 #endif
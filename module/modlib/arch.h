@@ -27,10 +27,18 @@ struct MSIMessage {
 	uint32_t data;
 };
 
+#define MSI_CPU_ANY -1 // the least loaded CPU
+
 static inline int msi_alloc_vector(struct MSIMessage *msg, void (*handler)(void *), void *private) {
 	return kernsrv->msi_alloc_vector(msg, handler, private);
 }
 
+static inline int msi_alloc_vector_cpu(
+	struct MSIMessage *msg, int cpu, void (*handler)(void *), void *private
+) {
+	return kernsrv->msi_alloc_vector_cpu(msg, cpu, handler, private);
+}
+
 static inline void msi_free_vector(const struct MSIMessage *msg) {
 	return kernsrv->msi_free_vector(msg);
 }
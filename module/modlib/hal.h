@@ -22,15 +22,20 @@
 
 #include <kernsrv.h>
 
+struct BlockQueueStats;
+
 struct BlockDeviceDriver {
 	int (*block_read)(void *private, unsigned int begin, int count, void *buf);
 	int (*block_write)(void *private, unsigned int begin, int count, const void *buf);
+	unsigned int max_sectors; // largest request, 8 if 0
+	void (*get_stats)(void *private, struct BlockQueueStats *stats); // optional
 };
 
 struct FramebufferDriver {
 	phyaddr_t (*enable)(void *private, int xres, int yres);
 	void (*disable)(void *private);
-	void (*update)(void *private);
+	// copy the rectangle of the framebuffer to the screen
+	void (*update)(void *private, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
 	unsigned int (*read_edid)(void *private, void *buffer, unsigned int bytes);
 };
 
@@ -32,6 +32,7 @@
 #define ERROR_OUT_OF_SPACE -7
 #define ERROR_WRITE_FAIL -8
 #define ERROR_NO_PERM -9
+#define ERROR_AGAIN -10
 
 // common/spinlock.h
 struct spinlock {
@@ -47,6 +48,7 @@ struct PCIDriver;
 struct VirtioDriver;
 struct VirtioDevice;
 struct VirtioQueue;
+struct VirtioBuffer;
 struct BlockDeviceDriver;
 struct FramebufferDriver;
 struct USBDevice;
@@ -61,12 +63,15 @@ const static struct KernerServiceTable {
 	void (*panic)(const char *);
 	void *(*pgalloc)(unsigned int);
 	void (*pgfree)(void *, unsigned int);
+	void *(*kmalloc)(unsigned int);
+	void (*kmfree)(void *);
 	void *(*map_mmio_region)(phyaddr_t, size_t);
 	void *(*map_ram_region)(phyaddr_t, size_t);
 	void *(*map_rom_region)(phyaddr_t, size_t);
 	// arch specific
 	int (*msi_alloc_vector)(struct MSIMessage *msg, void (*handler)(void *), void *private);
 	void (*msi_free_vector)(const struct MSIMessage *msg);
+	int (*msi_alloc_vector_cpu)(struct MSIMessage *, int, void (*)(void *), void *);
 	// process control
 	void (*sleep)(void *, struct spinlock *);
 	void (*wakeup)(void *);
@@ -103,6 +108,10 @@ const static struct KernerServiceTable {
 	void (*virtio_init_queue)(
 		struct VirtioDevice *, struct VirtioQueue *, unsigned int, void (*)(struct VirtioQueue *)
 	);
+	int (*virtio_queue_add)(struct VirtioQueue *, const struct VirtioBuffer *, int, void *);
+	void (*virtio_queue_kick)(struct VirtioQueue *);
+	void *(*virtio_queue_get)(struct VirtioQueue *, unsigned int *);
+	void *(*virtio_queue_wait)(struct VirtioQueue *, unsigned int *);
 	// driver/usb/usb.h
 	void (*usb_register_host_controller)(void *, const char *, unsigned int, const struct USBHostControllerDriver *);
 	void (*usb_register_driver)(const struct USBDriver *);
@@ -30,6 +30,15 @@ static inline void pgfree(void *ptr, unsigned int num_pages) {
 	return kernsrv->pgfree(ptr, num_pages);
 }
 
+// small physically contiguous objects, at most 2048 bytes
+static inline void *kmalloc(unsigned int size) {
+	return kernsrv->kmalloc(size);
+}
+
+static inline void kmfree(void *ptr) {
+	return kernsrv->kmfree(ptr);
+}
+
 static inline void *map_mmio_region(phyaddr_t phyaddr, size_t size) {
 	return kernsrv->map_mmio_region(phyaddr, size);
 }
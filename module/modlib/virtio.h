@@ -37,6 +37,7 @@ struct VirtioDevice {
 	struct {
 		unsigned int transport_is_pci : 1;
 		unsigned int is_legacy : 1;
+		unsigned int event_idx : 1; // VIRTIO_F_EVENT_IDX negotiated
 	};
 	struct VirtioQueue *virtqueue[VIRTIO_MAX_NUM_VIRTQUEUE];
 	// registers
@@ -104,6 +105,23 @@ struct VirtioQueue {
 	volatile struct VirtqAvail *avail;
 	volatile struct VirtqUsed *used;
 	volatile unsigned int *notify;
+	// driver state
+	unsigned int index; // queue number
+	struct VirtioDescState *state; // by descriptor
+	unsigned int num_free; // free descriptors
+	uint16_t free_head; // first free descriptor
+	uint16_t avail_idx; // next avail ring entry
+	uint16_t num_added; // avail ring entries added since the last kick
+	uint16_t last_used; // next used ring entry
+	uint8_t event_idx;
+	unsigned int notifications, suppressed; // doorbells rung and skipped
+};
+
+// a buffer of a descriptor chain
+struct VirtioBuffer {
+	phyaddr_t addr;
+	unsigned int len;
+	int write; // written by the device
 };
 
 static inline void virtio_register_driver(const struct VirtioDriver *driver) {
@@ -117,47 +135,22 @@ static inline void virtio_init_queue(
 	return kernsrv->virtio_init_queue(dev, queue, queue_n, intr_handler);
 }
 
-static inline void virtio_queue_notify(struct VirtioDevice *dev, struct VirtioQueue *queue) {
-	*queue->notify = 0;
-}
-
-static inline void virtio_queue_notify_wait(struct VirtioDevice *dev, struct VirtioQueue *queue) {
-	int prev = queue->used->idx;
-	*queue->notify = 0;
-	while (prev == queue->used->idx) {}
+static inline int virtio_queue_add(
+	struct VirtioQueue *queue, const struct VirtioBuffer *buf, int num, void *token
+) {
+	return kernsrv->virtio_queue_add(queue, buf, num, token);
 }
 
-static inline void virtio_queue_avail_insert(struct VirtioQueue *queue, int desc) {
-	queue->avail->ring[queue->avail->idx % queue->size] = desc;
-	queue->avail->idx++;
+static inline void virtio_queue_kick(struct VirtioQueue *queue) {
+	return kernsrv->virtio_queue_kick(queue);
 }
 
-static inline int *virtio_alloc_desc(struct VirtioQueue *queue, int *desc, int num) {
-	for (int i = 0; i < num; i++) {
-		desc[i] = -1;
-		for (int j = 0; j < queue->size; j++) {
-			if (queue->desc[j].addr == 0) {
-				queue->desc[j].addr = 0xffffffff;
-				desc[i] = j;
-				break;
-			}
-		}
-		if (desc[i] == -1) {
-			return 0;
-		}
-	}
-	return desc;
+static inline void *virtio_queue_get(struct VirtioQueue *queue, unsigned int *len) {
+	return kernsrv->virtio_queue_get(queue, len);
 }
 
-static inline void virtio_free_desc(struct VirtioQueue *queue, int desc) {
-	do {
-		queue->desc[desc].addr = 0;
-		if (queue->desc[desc].flags & VIRTQ_DESC_F_NEXT) {
-			desc = queue->desc[desc].next;
-		} else {
-			desc = -1;
-		}
-	} while (desc != -1);
+static inline void *virtio_queue_wait(struct VirtioQueue *queue, unsigned int *len) {
+	return kernsrv->virtio_queue_wait(queue, len);
 }
 
 #endif
@@ -24,42 +24,42 @@
 #include "virtio-gpu-regs.h"
 #include "virtio-gpu.h"
 
+// Send a command with the buffers for its response on the control queue and
+// wait for the device to answer. dev->lock must be held.
+static void virtio_gpu_command(
+	struct VirtioGPUDevice *dev, const struct VirtioBuffer *buf, int num
+) {
+	if (virtio_queue_add(&dev->controlq, buf, num, dev) < 0) {
+		panic("virtio-gpu out of desc");
+	}
+	virtio_queue_kick(&dev->controlq);
+	virtio_queue_wait(&dev->controlq, 0);
+}
+
 int virtio_gpu_get_display_info(
 	struct VirtioGPUDevice *dev, struct virtio_gpu_display_one *display_info
 ) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_ctrl_hdr *req = kalloc();
-	volatile struct virtio_gpu_resp_display_info *resp = kalloc();
+	struct virtio_gpu_ctrl_hdr *req = kmalloc(sizeof(struct virtio_gpu_ctrl_hdr));
+	volatile struct virtio_gpu_resp_display_info *resp =
+		kmalloc(sizeof(struct virtio_gpu_resp_display_info));
 
 	req->type = VIRTIO_GPU_CMD_GET_DISPLAY_INFO;
 	req->flags = 0;
 	req->fence_id = 0;
 	req->ctx_id = 0;
 
-	int desc[2];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 2)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_ctrl_hdr);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(resp);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_resp_display_info);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[1]].next = 0;
-
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_ctrl_hdr), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_resp_display_info), 1},
+	};
+	virtio_gpu_command(dev, buf, 2);
 
 	if (resp->hdr.type != VIRTIO_GPU_RESP_OK_DISPLAY_INFO) {
 		cprintf("[virtio-gpu] get display info failed with 0x%x\n", resp->hdr.type);
-		kfree(req);
-		kfree((void *)resp);
-		virtio_free_desc(&dev->controlq, desc[0]);
+		kmfree(req);
+		kmfree((void *)resp);
 		release(&dev->lock);
 		return -1;
 	}
@@ -70,9 +70,8 @@ int virtio_gpu_get_display_info(
 		sizeof(struct virtio_gpu_display_one) * VIRTIO_GPU_MAX_SCANOUTS
 	);
 
-	kfree(req);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree((void *)resp);
 	release(&dev->lock);
 	return 0;
 }
@@ -80,8 +79,8 @@ int virtio_gpu_get_display_info(
 unsigned int virtio_gpu_get_edid(struct VirtioGPUDevice *dev, unsigned int scanout, void *edid) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_get_edid *req = kalloc();
-	volatile struct virtio_gpu_resp_edid *resp = kalloc();
+	struct virtio_gpu_get_edid *req = kmalloc(sizeof(struct virtio_gpu_get_edid));
+	volatile struct virtio_gpu_resp_edid *resp = kmalloc(sizeof(struct virtio_gpu_resp_edid));
 
 	req->hdr.type = VIRTIO_GPU_CMD_GET_EDID;
 	req->hdr.flags = 0;
@@ -89,29 +88,16 @@ unsigned int virtio_gpu_get_edid(struct VirtioGPUDevice *dev, unsigned int scano
 	req->hdr.ctx_id = 0;
 	req->scanout = scanout;
 
-	int desc[2];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 2)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_get_edid);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(resp);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_resp_edid);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[1]].next = 0;
-
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_get_edid), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_resp_edid), 1},
+	};
+	virtio_gpu_command(dev, buf, 2);
 
 	if (resp->hdr.type != VIRTIO_GPU_RESP_OK_EDID) {
 		cprintf("[virtio-gpu] get edid info failed with 0x%x\n", resp->hdr.type);
-		kfree(req);
-		kfree((void *)resp);
-		virtio_free_desc(&dev->controlq, desc[0]);
+		kmfree(req);
+		kmfree((void *)resp);
 		release(&dev->lock);
 		return 0;
 	}
@@ -119,9 +105,8 @@ unsigned int virtio_gpu_get_edid(struct VirtioGPUDevice *dev, unsigned int scano
 	int sz = resp->size;
 	memcpy(edid, (void *)resp->edid, resp->size);
 
-	kfree(req);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree((void *)resp);
 	release(&dev->lock);
 	return sz;
 }
@@ -132,8 +117,9 @@ void virtio_gpu_res_create_2d(
 ) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_resource_create_2d *req = kalloc();
-	volatile struct virtio_gpu_ctrl_hdr *resp = kalloc();
+	struct virtio_gpu_resource_create_2d *req =
+		kmalloc(sizeof(struct virtio_gpu_resource_create_2d));
+	volatile struct virtio_gpu_ctrl_hdr *resp = kmalloc(sizeof(struct virtio_gpu_ctrl_hdr));
 
 	req->hdr.type = VIRTIO_GPU_CMD_RESOURCE_CREATE_2D;
 	req->hdr.flags = 0;
@@ -144,27 +130,14 @@ void virtio_gpu_res_create_2d(
 	req->width = w;
 	req->height = h;
 
-	int desc[2];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 2)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_resource_create_2d);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(resp);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_ctrl_hdr);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[1]].next = 0;
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_resource_create_2d), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_ctrl_hdr), 1},
+	};
+	virtio_gpu_command(dev, buf, 2);
 
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
-
-	kfree(req);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree((void *)resp);
 	release(&dev->lock);
 }
 
@@ -174,8 +147,8 @@ void virtio_gpu_set_scanout(
 ) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_set_scanout *req = kalloc();
-	volatile struct virtio_gpu_ctrl_hdr *resp = kalloc();
+	struct virtio_gpu_set_scanout *req = kmalloc(sizeof(struct virtio_gpu_set_scanout));
+	volatile struct virtio_gpu_ctrl_hdr *resp = kmalloc(sizeof(struct virtio_gpu_ctrl_hdr));
 
 	req->hdr.type = VIRTIO_GPU_CMD_SET_SCANOUT;
 	req->hdr.flags = 0;
@@ -188,112 +161,70 @@ void virtio_gpu_set_scanout(
 	req->scanout_id = scanout;
 	req->resource_id = resource_id;
 
-	int desc[2];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 2)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_set_scanout);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(resp);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_ctrl_hdr);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[1]].next = 0;
-
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_set_scanout), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_ctrl_hdr), 1},
+	};
+	virtio_gpu_command(dev, buf, 2);
 
-	kfree(req);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree((void *)resp);
 	release(&dev->lock);
 }
 
 void virtio_gpu_flush(
-	struct VirtioGPUDevice *dev, unsigned int resource_id, unsigned int w, unsigned int h
+	struct VirtioGPUDevice *dev, unsigned int resource_id, const struct virtio_gpu_rect *r
 ) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_resource_flush *req = kalloc();
-	volatile struct virtio_gpu_ctrl_hdr *resp = kalloc();
+	struct virtio_gpu_resource_flush *req = kmalloc(sizeof(struct virtio_gpu_resource_flush));
+	volatile struct virtio_gpu_ctrl_hdr *resp = kmalloc(sizeof(struct virtio_gpu_ctrl_hdr));
 
 	req->hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
 	req->hdr.flags = 0;
 	req->hdr.fence_id = 0;
 	req->hdr.ctx_id = 0;
-	req->r.x = 0;
-	req->r.y = 0;
-	req->r.width = w;
-	req->r.height = h;
+	req->r = *r;
 	req->resource_id = resource_id;
 
-	int desc[2];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 2)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_resource_flush);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(resp);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_ctrl_hdr);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[1]].next = 0;
-
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_resource_flush), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_ctrl_hdr), 1},
+	};
+	virtio_gpu_command(dev, buf, 2);
 
-	kfree(req);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree((void *)resp);
 	release(&dev->lock);
 }
 
+// offset is where the rectangle starts in the backing memory
 void virtio_gpu_xfer_to_host_2d(
-	struct VirtioGPUDevice *dev, unsigned int resource_id, unsigned int w, unsigned int h
+	struct VirtioGPUDevice *dev, unsigned int resource_id, const struct virtio_gpu_rect *r,
+	uint64_t offset
 ) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_transfer_to_host_2d *req = kalloc();
-	volatile struct virtio_gpu_ctrl_hdr *resp = kalloc();
+	struct virtio_gpu_transfer_to_host_2d *req =
+		kmalloc(sizeof(struct virtio_gpu_transfer_to_host_2d));
+	volatile struct virtio_gpu_ctrl_hdr *resp = kmalloc(sizeof(struct virtio_gpu_ctrl_hdr));
 
 	req->hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
 	req->hdr.flags = 0;
 	req->hdr.fence_id = 0;
 	req->hdr.ctx_id = 0;
-	req->r.x = 0;
-	req->r.y = 0;
-	req->r.width = w;
-	req->r.height = h;
-	req->offset = 0;
+	req->r = *r;
+	req->offset = offset;
 	req->resource_id = resource_id;
 
-	int desc[2];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 2)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_transfer_to_host_2d);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(resp);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_ctrl_hdr);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[1]].next = 0;
-
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_transfer_to_host_2d), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_ctrl_hdr), 1},
+	};
+	virtio_gpu_command(dev, buf, 2);
 
-	kfree(req);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree((void *)resp);
 	release(&dev->lock);
 }
 
@@ -302,9 +233,10 @@ void virtio_gpu_attach_banking(
 ) {
 	acquire(&dev->lock);
 
-	struct virtio_gpu_resource_attach_backing *req = kalloc();
-	volatile struct virtio_gpu_ctrl_hdr *resp = kalloc();
-	struct virtio_gpu_mem_entry *mement = kalloc();
+	struct virtio_gpu_resource_attach_backing *req =
+		kmalloc(sizeof(struct virtio_gpu_resource_attach_backing));
+	volatile struct virtio_gpu_ctrl_hdr *resp = kmalloc(sizeof(struct virtio_gpu_ctrl_hdr));
+	struct virtio_gpu_mem_entry *mement = kmalloc(sizeof(struct virtio_gpu_mem_entry));
 
 	req->hdr.type = VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING;
 	req->hdr.flags = 0;
@@ -316,32 +248,15 @@ void virtio_gpu_attach_banking(
 	mement->addr = fb;
 	mement->length = length;
 
-	int desc[3];
-	if (!virtio_alloc_desc(&dev->controlq, desc, 3)) {
-		panic("virtio-gpu out of desc");
-	}
-
-	dev->controlq.desc[desc[0]].addr = V2P(req);
-	dev->controlq.desc[desc[0]].len = sizeof(struct virtio_gpu_resource_attach_backing);
-	dev->controlq.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[0]].next = desc[1];
-
-	dev->controlq.desc[desc[1]].addr = V2P(mement);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_mem_entry);
-	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_NEXT;
-	dev->controlq.desc[desc[1]].next = desc[2];
-
-	dev->controlq.desc[desc[2]].addr = V2P(resp);
-	dev->controlq.desc[desc[2]].len = sizeof(struct virtio_gpu_ctrl_hdr);
-	dev->controlq.desc[desc[2]].flags = VIRTQ_DESC_F_WRITE;
-	dev->controlq.desc[desc[2]].next = 0;
-
-	virtio_queue_avail_insert(&dev->controlq, desc[0]);
-	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
+	struct VirtioBuffer buf[] = {
+		{V2P(req), sizeof(struct virtio_gpu_resource_attach_backing), 0},
+		{V2P(mement), sizeof(struct virtio_gpu_mem_entry), 0},
+		{V2P(resp), sizeof(struct virtio_gpu_ctrl_hdr), 1},
+	};
+	virtio_gpu_command(dev, buf, 3);
 
-	kfree(req);
-	kfree(mement);
-	kfree((void *)resp);
-	virtio_free_desc(&dev->controlq, desc[0]);
+	kmfree(req);
+	kmfree(mement);
+	kmfree((void *)resp);
 	release(&dev->lock);
 }
@@ -24,10 +24,14 @@
 
 #include "virtio-gpu.h"
 
-static void virtio_gpu_display_update(void *private) {
+// transfer and flush just the rectangle that changed
+static void virtio_gpu_display_update(
+	void *private, unsigned int x, unsigned int y, unsigned int w, unsigned int h
+) {
 	struct VirtioGPUDisplay *disp = private;
-	virtio_gpu_xfer_to_host_2d(disp->gpu, disp->resource_id, disp->xres, disp->yres);
-	virtio_gpu_flush(disp->gpu, disp->resource_id, disp->xres, disp->yres);
+	struct virtio_gpu_rect r = {.x = x, .y = y, .width = w, .height = h};
+	virtio_gpu_xfer_to_host_2d(disp->gpu, disp->resource_id, &r, (y * disp->xres + x) * 4);
+	virtio_gpu_flush(disp->gpu, disp->resource_id, &r);
 }
 
 static phyaddr_t virtio_gpu_display_enable(void *private, int xres, int yres) {
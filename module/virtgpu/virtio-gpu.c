@@ -33,8 +33,6 @@ static void virtio_gpu_controlq_intr(struct VirtioQueue *queue) {
 		cprintf("[virtio-gpu] event %x\n", gpucfg->events_read);
 		gpucfg->events_clear = gpucfg->events_read;
 	}
-	static unsigned short last = 0;
-	for (; last != queue->used->idx; last++) {}
 	release(&dev->lock);
 }
 
@@ -41,10 +41,11 @@ void virtio_gpu_set_scanout(
 	unsigned int h
 );
 void virtio_gpu_flush(
-	struct VirtioGPUDevice *dev, unsigned int resource_id, unsigned int w, unsigned int h
+	struct VirtioGPUDevice *dev, unsigned int resource_id, const struct virtio_gpu_rect *r
 );
 void virtio_gpu_xfer_to_host_2d(
-	struct VirtioGPUDevice *dev, unsigned int resource_id, unsigned int w, unsigned int h
+	struct VirtioGPUDevice *dev, unsigned int resource_id, const struct virtio_gpu_rect *r,
+	uint64_t offset
 );
 void virtio_gpu_attach_banking(
 	struct VirtioGPUDevice *dev, unsigned int resource_id, phyaddr_t fb, size_t length
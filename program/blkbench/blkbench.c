@@ -0,0 +1,135 @@
+/*
+ * blkbench - measure block device queueing under concurrent reads
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/block.h>
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BLOCK_DEVICE_MAX 8 // HAL_BLOCK_MAX
+#define CHUNK 65536
+
+static char buf[CHUNK];
+
+// read the whole file passes times, return the bytes read
+static int read_file(const char *name, int passes) {
+	int total = 0;
+	for (int i = 0; i < passes; i++) {
+		int fd = open(name, O_READ);
+		if (fd < 0) {
+			return -1;
+		}
+		int n;
+		while ((n = read(fd, buf, CHUNK)) > 0) {
+			total += n;
+		}
+		close(fd);
+	}
+	return total;
+}
+
+static void print_hist(
+	const char *title, const unsigned int *now, const unsigned int *prev, int shift
+) {
+	printf("  %s:", title);
+	for (int i = 0; i < BLOCK_HIST_SIZE; i++) {
+		if (now[i] != prev[i]) {
+			printf(" %u+:%u", 1u << (i + shift), now[i] - prev[i]);
+		}
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("usage: blkbench file [processes] [passes]\n");
+		return 1;
+	}
+	int procs = argc > 2 ? atoi(argv[2]) : 4;
+	int passes = argc > 3 ? atoi(argv[3]) : 4;
+	if (procs <= 0 || passes <= 0) {
+		printf("usage: blkbench file [processes] [passes]\n");
+		return 1;
+	}
+
+	struct BlockQueueStats before[BLOCK_DEVICE_MAX], after;
+	int has_stats[BLOCK_DEVICE_MAX];
+	for (int i = 0; i < BLOCK_DEVICE_MAX; i++) {
+		has_stats[i] = block_get_queue_stats(i, &before[i]) == 0;
+	}
+
+	int start = uptime();
+	for (int i = 0; i < procs; i++) {
+		int pid = fork();
+		if (pid < 0) {
+			printf("blkbench: fork failed\n");
+			return 1;
+		}
+		if (pid == 0) {
+			exit(read_file(argv[1], passes) < 0 ? 1 : 0);
+		}
+	}
+	for (int i = 0; i < procs; i++) {
+		wait();
+	}
+	int elapsed = uptime() - start;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	int size = file_get_size(argv[1]);
+	if (size < 0) {
+		printf("blkbench: cannot read %s\n", argv[1]);
+		return 1;
+	}
+	int kib = size / 1024 * passes * procs;
+	printf(
+		"%d processes read %d KiB in %d ticks, %d KiB per 100 ticks\n",
+		procs,
+		kib,
+		elapsed,
+		kib * 100 / elapsed
+	);
+	for (int i = 0; i < BLOCK_DEVICE_MAX; i++) {
+		if (!has_stats[i] || block_get_queue_stats(i, &after) < 0 ||
+			after.completed == before[i].completed) {
+			continue;
+		}
+		struct BlockQueueStats *b = &before[i];
+		unsigned int completed = after.completed - b->completed;
+		printf(
+			"block %d: %u queues, %u requests, %u merged, %u completed, %u errors\n",
+			i,
+			after.queues,
+			after.requests - b->requests,
+			after.merged - b->merged,
+			completed,
+			after.errors - b->errors
+		);
+		printf(
+			"  %u IOPS per 100 ticks, %llu KiB, max depth %u\n",
+			completed * 100 / elapsed,
+			(after.sectors - b->sectors) / 2,
+			after.max_depth
+		);
+		print_hist("depth", after.depth_hist, b->depth_hist, 0);
+		print_hist("latency cycles", after.latency_hist, b->latency_hist, 10);
+	}
+	return 0;
+}
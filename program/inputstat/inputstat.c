@@ -0,0 +1,50 @@
+/*
+ * inputstat - show input event statistics
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/input.h>
+#include <stdio.h>
+
+int main() {
+	static const char *names[INPUT_DEVICES] = {"keyboard", "mouse"};
+	struct InputDeviceStats stats[INPUT_DEVICES];
+	if (input_get_stats(stats) < 0) {
+		printf("inputstat: failed\n");
+		return 1;
+	}
+	for (int i = 0; i < INPUT_DEVICES; i++) {
+		struct InputDeviceStats *s = &stats[i];
+		printf(
+			"%s: %u events, %u coalesced, %u dropped, %u read\n",
+			names[i],
+			s->events,
+			s->coalesced,
+			s->dropped,
+			s->read
+		);
+		if (s->read) {
+			printf(
+				"%s: report to read %llu cycles average, %llu max\n",
+				names[i],
+				s->latency_total / s->read,
+				s->latency_max
+			);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * ipcbench - measure message passing latency and throughput
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errorcode.h>
+#include <kcall/vm.h>
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PGSIZE 4096
+#define SIZE_MAX_BENCH (1024 * 1024)
+#define PING_ROUNDS 10000
+#define UNALIGNED_OFFSET 64
+
+static char small[64];
+
+static int ticks_since(int start) {
+	int elapsed = uptime() - start;
+	return elapsed ? elapsed : 1;
+}
+
+static void msg_pages(unsigned int *lent, unsigned int *mapped) {
+	struct VmStats stats;
+	struct PgallocStats pgalloc;
+	struct PageCacheStats pagecache;
+	vm_get_stats(&stats, &pgalloc, &pagecache);
+	*lent = stats.msg_pages_lent;
+	*mapped = stats.msg_pages_mapped;
+}
+
+// Bounce a small message between this process and a child
+static void bench_ping(void) {
+	int pid = fork();
+	if (pid < 0) {
+		printf("ipcbench: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		int parent = getppid();
+		for (int i = 0; i < PING_ROUNDS; i++) {
+			message_wait(small);
+			message_send(parent, sizeof(small), small);
+		}
+		exit(0);
+	}
+	int start = uptime();
+	for (int i = 0; i < PING_ROUNDS; i++) {
+		message_send(pid, sizeof(small), small);
+		message_wait(small);
+	}
+	int elapsed = ticks_since(start);
+	wait();
+	printf(
+		"ping-pong %d bytes: %d round trips in %d ticks, %d us each\n",
+		(int)sizeof(small),
+		PING_ROUNDS,
+		elapsed,
+		elapsed * 10000 / PING_ROUNDS
+	);
+}
+
+// Stream total bytes from a child in size byte messages. The buffers on
+// both sides start offset bytes into page aligned mappings.
+static void bench_stream(char *send, char *receive, int size, int total, int offset) {
+	int count = total / size;
+	unsigned int lent, mapped, lent_end, mapped_end;
+	msg_pages(&lent, &mapped);
+	int start = uptime();
+	int pid = fork();
+	if (pid < 0) {
+		printf("ipcbench: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		int parent = getppid();
+		for (int i = 0; i < count; i++) {
+			message_send(parent, size, send + offset);
+		}
+		exit(0);
+	}
+	for (int i = 0; i < count; i++) {
+		message_wait(receive + offset);
+	}
+	int elapsed = ticks_since(start);
+	wait();
+	msg_pages(&lent_end, &mapped_end);
+	printf(
+		"%s %7d: %d KiB in %d ticks, %d KiB per 100 ticks, %u pages lent, %u mapped\n",
+		offset ? "unaligned" : "aligned  ",
+		size,
+		count * (size / 1024),
+		elapsed,
+		count * (size / 1024) * 100 / elapsed,
+		lent_end - lent,
+		mapped_end - mapped
+	);
+}
+
+// Fill the queue of a child that does not read it yet without blocking
+static void bench_backpressure(void) {
+	int pid = fork();
+	if (pid < 0) {
+		printf("ipcbench: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		message_wait(small); // the parent is done
+		while (message_receive(small) > 0) {
+		}
+		exit(0);
+	}
+	int queued = 0, ret;
+	struct MessageVec vec = {small, sizeof(small)};
+	while ((ret = message_sendv(pid, &vec, 1, MESSAGE_NONBLOCK)) == 0) {
+		queued++;
+	}
+	printf(
+		"queue full after %d messages, send returned %d (%s)\n", queued, ret, strerror(ret)
+	);
+	wait();
+}
+
+int main(int argc, char *argv[]) {
+	int mib = argc > 1 ? atoi(argv[1]) : 32;
+	if (mib <= 0) {
+		printf("usage: ipcbench [MiB]\n");
+		return 1;
+	}
+	char *send = mem_map(0, SIZE_MAX_BENCH + PGSIZE);
+	char *receive = mem_map(0, SIZE_MAX_BENCH + PGSIZE);
+	if (!send || !receive) {
+		printf("ipcbench: out of memory\n");
+		return 1;
+	}
+	memset(send, 0x5a, SIZE_MAX_BENCH + PGSIZE);
+
+	bench_ping();
+	for (int size = 4096; size <= SIZE_MAX_BENCH; size *= 4) {
+		bench_stream(send, receive, size, mib * 1024 * 1024, 0);
+		bench_stream(send, receive, size, mib * 1024 * 1024, UNALIGNED_OFFSET);
+	}
+	bench_backpressure();
+	return 0;
+}
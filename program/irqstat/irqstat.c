@@ -0,0 +1,43 @@
+/*
+ * irqstat program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/irq.h>
+#include <stdio.h>
+
+// print the interrupts each message signaled vector raised on every CPU,
+// then the interrupts of all vectors taken by each CPU
+int main() {
+	struct IrqVectorStats stats;
+	unsigned int total[IRQ_MAX_CPU] = {0};
+	unsigned int ncpu = 0, vector = 0;
+	while (irq_get_vector_stats(vector, &stats) == 0) {
+		ncpu = stats.ncpu < IRQ_MAX_CPU ? stats.ncpu : IRQ_MAX_CPU;
+		printf("vector %d to cpu%d:", stats.vector, stats.cpu);
+		for (unsigned int i = 0; i < ncpu; i++) {
+			printf(" %d", stats.count[i]);
+			total[i] += stats.count[i];
+		}
+		printf("\n");
+		vector = stats.vector + 1;
+	}
+	for (unsigned int i = 0; i < ncpu; i++) {
+		printf("cpu%d interrupts %d\n", i, total[i]);
+	}
+	return 0;
+}
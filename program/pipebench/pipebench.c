@@ -0,0 +1,82 @@
+/*
+ * pipebench - measure pipe throughput
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHUNK_MAX 65536
+
+static char buf[CHUNK_MAX];
+
+// Stream size bytes from a child process to this one through a pipe in
+// chunk sized reads and writes, both sides run at the same time
+static void bench_pipe(int chunk, int size) {
+	int p[2];
+	if (pipe(p) < 0) {
+		printf("pipebench: pipe failed\n");
+		exit(1);
+	}
+	int start = uptime();
+	int pid = fork();
+	if (pid < 0) {
+		printf("pipebench: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(p[0]);
+		for (int left = size; left > 0; left -= chunk) {
+			if (write(p[1], buf, left < chunk ? left : chunk) <= 0) {
+				break;
+			}
+		}
+		close(p[1]);
+		exit(0);
+	}
+	close(p[1]);
+	int total = 0, n;
+	while ((n = read(p[0], buf, chunk)) > 0) {
+		total += n;
+	}
+	close(p[0]);
+	wait();
+	int elapsed = uptime() - start;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	printf(
+		"chunk %5d: %d KiB in %d ticks, %d KiB per 100 ticks\n",
+		chunk,
+		total / 1024,
+		elapsed,
+		total / 1024 * 100 / elapsed
+	);
+}
+
+int main(int argc, char *argv[]) {
+	int mib = argc > 1 ? atoi(argv[1]) : 16;
+	if (mib <= 0) {
+		printf("usage: pipebench [MiB]\n");
+		return 1;
+	}
+	for (int chunk = 64; chunk <= CHUNK_MAX; chunk *= 4) {
+		bench_pipe(chunk, mib * 1024 * 1024);
+	}
+	return 0;
+}
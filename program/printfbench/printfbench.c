@@ -0,0 +1,105 @@
+/*
+ * printfbench - measure formatted output
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/sched.h>
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TMP_FILE "printfbench.tmp"
+
+static char buf[256];
+
+// Time formatting into memory, no system calls involved
+static void bench_snprintf(int iterations) {
+	int start = uptime();
+	unsigned int total = 0;
+	for (int i = 0; i < iterations; i++) {
+		total += snprintf(
+			buf,
+			sizeof(buf),
+			"%5d %08x %-10s %lld|%p\n",
+			i,
+			i * 2654435761u,
+			"name",
+			-1ll * i,
+			&total
+		);
+	}
+	int elapsed = uptime() - start;
+	printf("snprintf: %d calls, %d bytes in %d ticks\n", iterations, total, elapsed);
+}
+
+// Time writing lines to a file one way or another, and count the system
+// calls made on the way
+static void bench_file(const char *name, int mode, int iterations) {
+	struct SchedProcStats before, after;
+	FILE *f = 0;
+	int fd = -1;
+	if (mode < 0) {
+		fd = open(TMP_FILE, O_WRITE | O_CREATE | O_TRUNC);
+	} else {
+		f = fopen(TMP_FILE, "w");
+		if (f) {
+			setvbuf(f, 0, mode, BUFSIZ);
+		}
+	}
+	if (!f && fd < 0) {
+		printf("%s: cannot open %s\n", name, TMP_FILE);
+		return;
+	}
+
+	int start = uptime();
+	sched_get_proc_stats(&before);
+	for (int i = 0; i < iterations; i++) {
+		if (f) {
+			fprintf(f, "line %d value %x\n", i, i * 7);
+		} else {
+			dprintf(fd, "line %d value %x\n", i, i * 7);
+		}
+	}
+	if (f) {
+		fclose(f);
+	} else {
+		close(fd);
+	}
+	sched_get_proc_stats(&after);
+	int elapsed = uptime() - start;
+	printf(
+		"%s: %d lines in %d ticks, %d syscalls\n",
+		name,
+		iterations,
+		elapsed,
+		after.syscalls - before.syscalls - 1 // not the kcall reading the counters
+	);
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+	if (iterations <= 0) {
+		printf("usage: printfbench [iterations]\n");
+		return 1;
+	}
+	bench_snprintf(iterations * 10);
+	bench_file("fprintf fully buffered", _IOFBF, iterations);
+	bench_file("fprintf unbuffered", _IONBF, iterations);
+	bench_file("dprintf", -1, iterations);
+	unlink(TMP_FILE);
+	return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * schedstat program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// print per-CPU scheduler counters, with an interval in ticks also the
+// context switch rate over that interval
+int main(int argc, char *argv[]) {
+	struct SchedStats before, after;
+	if (sched_get_stats(&before) < 0) {
+		printf("schedstat: failed\n");
+		return 1;
+	}
+	int interval = argc > 1 ? atoi(argv[1]) : 0;
+	if (interval > 0) {
+		sleep(interval);
+	}
+	sched_get_stats(&after);
+
+	unsigned int elapsed = after.ticks - before.ticks;
+	for (unsigned int i = 0; i < after.ncpu && i < SCHED_MAX_CPU; i++) {
+		struct SchedCpuStats *cpu = &after.cpu[i];
+		printf(
+			"cpu%d switches %d runqueue %d steals %d idle %d",
+			i,
+			cpu->switches,
+			cpu->nr_running,
+			cpu->steals,
+			cpu->idles
+		);
+		if (elapsed) {
+			printf(
+				" switches/100 ticks %d",
+				(cpu->switches - before.cpu[i].switches) * 100 / elapsed
+			);
+		}
+		printf("\n");
+	}
+	return 0;
+}
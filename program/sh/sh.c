@@ -22,11 +22,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define O_RDONLY 0x000
-#define O_WRONLY 0x001
-#define O_RDWR 0x002
-#define O_CREATE 0x200
-
 // Parsed command representation
 #define EXEC 1
 #define REDIR 2
@@ -389,13 +384,13 @@ struct cmd *parseredirs(struct cmd *cmd, char **ps, char *es) {
 		}
 		switch (tok) {
 			case '<':
-				cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
+				cmd = redircmd(cmd, q, eq, O_READ, 0);
 				break;
 			case '>':
-				cmd = redircmd(cmd, q, eq, O_WRONLY | O_CREATE, 1);
+				cmd = redircmd(cmd, q, eq, O_WRITE | O_CREATE | O_TRUNC, 1);
 				break;
 			case '+': // >>
-				cmd = redircmd(cmd, q, eq, O_WRONLY | O_CREATE, 1);
+				cmd = redircmd(cmd, q, eq, O_WRITE | O_CREATE | O_APPEND, 1);
 				break;
 		}
 	}
@@ -0,0 +1,123 @@
+/*
+ * strbench - measure memory and string functions
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Throughput of the libc memory and string functions over a range of block
+// sizes and alignments. Every test moves the same amount of data, so the
+// ticks taken compare directly.
+
+#define MAX_SIZE (1024 * 1024)
+
+static const unsigned int sizes[] = {16, 64, 256, 4096, 65536, MAX_SIZE};
+static const unsigned int aligns[] = {0, 1, 3};
+
+static char *src, *dst;
+static volatile size_t sink; // keeps the results of scans alive
+
+static void run_memcpy(unsigned int size, unsigned int align) {
+	memcpy(dst + align, src, size);
+}
+
+static void run_memmove(unsigned int size, unsigned int align) {
+	memmove(dst + align + 8, dst + align, size); // overlapping, copied backwards
+}
+
+static void run_memset(unsigned int size, unsigned int align) {
+	memset(dst + align, size, size);
+}
+
+static void run_memcmp(unsigned int size, unsigned int align) {
+	sink += memcmp(dst + align, src + align, size);
+}
+
+static void run_strlen(unsigned int size, unsigned int align) {
+	(void)size;
+	sink += strlen(src + align);
+}
+
+static void run_memchr(unsigned int size, unsigned int align) {
+	sink += (size_t)memchr(src + align, 0, size);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(unsigned int size, unsigned int align);
+} tests[] = {
+	{"memcpy", run_memcpy},
+	{"memmove", run_memmove},
+	{"memset", run_memset},
+	{"memcmp", run_memcmp},
+	{"strlen", run_strlen},
+	{"memchr", run_memchr},
+};
+
+int main(int argc, char *argv[]) {
+	unsigned int total_mb = argc > 1 ? atoi(argv[1]) : 64;
+	if (total_mb == 0) {
+		printf("usage: strbench [MiB per test]\n");
+		return 1;
+	}
+	src = malloc(MAX_SIZE + 64);
+	dst = malloc(MAX_SIZE + 64);
+	if (!src || !dst) {
+		printf("strbench: out of memory\n");
+		return 1;
+	}
+	memset(src, 'a', MAX_SIZE + 64);
+	memset(dst, 'a', MAX_SIZE + 64);
+
+	printf("%d MiB per test, KiB per tick\n%-8s %8s", total_mb, "", "size");
+	for (unsigned int a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++) {
+		printf("  align %d", aligns[a]);
+	}
+	printf("\n");
+	for (unsigned int t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			unsigned int size = sizes[s];
+			unsigned int iterations = total_mb * 1024 / size * 1024;
+			printf("%-8s %8d", tests[t].name, size);
+			for (unsigned int a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++) {
+				unsigned int align = aligns[a];
+				// strlen stops at the NUL placed after size bytes, the other
+				// functions don't get to see it
+				memset(dst, 'a', MAX_SIZE + 64);
+				src[align + size] = '\0';
+				int start = uptime();
+				for (unsigned int i = 0; i < iterations; i++) {
+					tests[t].run(size, align);
+				}
+				int elapsed = uptime() - start;
+				src[align + size] = 'a';
+				if (elapsed > 0) {
+					printf(" %8d", total_mb * 1024 / elapsed);
+				} else {
+					printf(" %8s", ">max");
+				}
+			}
+			printf("\n");
+		}
+	}
+	free(src);
+	free(dst);
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * sync program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/block.h>
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		struct BlockCacheStats stats;
+		block_cache_get_stats(&stats);
+		printf(
+			"buffers %d dirty %d hits %d misses %d evictions %d writebacks %d\n",
+			stats.buffers,
+			stats.dirty,
+			stats.hits,
+			stats.misses,
+			stats.evictions,
+			stats.writebacks
+		);
+	}
+	if (block_sync() < 0) {
+		printf("sync: write back failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -29,10 +29,33 @@ static COLOUR term_font_colour = {255, 255, 255};
 
 int x_chars = 80, y_chars = 25;
 char *term_buffer; // terminal buffer
+char *drawn_buffer; // term_buffer as last drawn into the window surface
 int cur_x = 0, cur_y = 0; // cursor
 char inputbuf[80]; // input buffer
 int inputptr = 0;
 
+// Draw the rows that changed since the last redraw straight into the
+// window surface and report them in a single damage rectangle
+static void redraw_surface(int handle, COLOUR *surface, int width, int height) {
+	int first = y_chars, last = -1;
+	for (int i = 0; i < y_chars; i++) {
+		char *row = term_buffer + i * x_chars;
+		if (memcmp(row, drawn_buffer + i * x_chars, x_chars) == 0) {
+			continue;
+		}
+		wm_buffer_fill_rect(surface, width, 0, i * 16, x_chars * 8, 16, term_back_colour);
+		wm_buffer_print_text(surface, width, height, 0, i * 16, term_font_colour, row, x_chars);
+		memcpy(drawn_buffer + i * x_chars, row, x_chars);
+		if (first > i) {
+			first = i;
+		}
+		last = i;
+	}
+	if (last >= 0) {
+		wm_damage(handle, 0, first * 16, x_chars * 8, (last - first + 1) * 16);
+	}
+}
+
 static void print_help_message(void) {
 	fputs("Usage: termemu [program] [x_chars y_chars]\n", stderr);
 	exit(1);
@@ -60,6 +83,8 @@ int main(int argc, char *argv[]) {
 	int term_handle = wm_create_window(x_chars * 8, y_chars * 16);
 	wm_window_set_title(term_handle, "Terminal");
 	wm_fill_sheet(term_handle, term_back_colour);
+	int surface_width, surface_height;
+	COLOUR *surface = wm_get_surface(term_handle, &surface_width, &surface_height);
 	// create the Pseudoterminal
 	int pty = pty_create();
 	if (pty < 0) {
@@ -68,6 +93,8 @@ int main(int argc, char *argv[]) {
 	}
 	// allocate the terminal buffer
 	term_buffer = malloc(x_chars * y_chars);
+	drawn_buffer = malloc(x_chars * y_chars);
+	memset(drawn_buffer, '\0', x_chars * y_chars); // nothing drawn yet
 	// spawn the shell process
 	int sh_pid = fork();
 	if (sh_pid == 0) {
@@ -187,13 +214,17 @@ int main(int argc, char *argv[]) {
 
 		term_buffer[cur_y * x_chars + cur_x] = '_';
 
-		if (need_update) {
+		if (need_update && surface) {
+			redraw_surface(term_handle, surface, surface_width, surface_height);
+		} else if (need_update) {
+			wm_begin_frame(term_handle);
 			wm_fill_sheet(term_handle, term_back_colour);
 			for (int i = 0; i < y_chars; i++) {
 				wm_print_text_n(
 					term_handle, 0, i * 16, term_font_colour, term_buffer + i * x_chars, x_chars
 				);
 			}
+			wm_end_frame();
 		}
 	}
 }
@@ -0,0 +1,55 @@
+/*
+ * vmstat program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/vm.h>
+#include <stdio.h>
+
+int main() {
+	struct VmStats stats;
+	struct PgallocStats pgalloc;
+	struct PageCacheStats pagecache;
+	if (vm_get_stats(&stats, &pgalloc, &pagecache) < 0) {
+		printf("vmstat: failed\n");
+		return 1;
+	}
+	unsigned int free_pages = pgalloc.free_pages + pgalloc.pcp_pages;
+	printf("memory %d KiB free of %d KiB\n", free_pages * 4, pgalloc.total_pages * 4);
+	printf(
+		"page faults %d cow faults %d cow copies %d pages shared by fork %d\n",
+		stats.page_faults,
+		stats.cow_faults,
+		stats.cow_copies,
+		stats.cow_shared
+	);
+	printf("demand faults from page cache %d private %d\n", stats.file_faults, stats.anon_faults);
+	printf(
+		"message pages lent %d mapped into receivers %d\n",
+		stats.msg_pages_lent,
+		stats.msg_pages_mapped
+	);
+	printf(
+		"page cache %d files %d pages hits %d misses %d evictions %d\n",
+		pagecache.files,
+		pagecache.pages,
+		pagecache.hits,
+		pagecache.misses,
+		pagecache.evictions
+	);
+	return 0;
+}
@@ -17,7 +17,11 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <errorcode.h>
 #include <kcall/display.h>
+#include <kcall/event.h>
+#include <kcall/input.h>
+#include <kcall/shm.h>
 #include <libwm/protocol.h>
 #include <panicos.h>
 #include <stdint.h>
@@ -55,11 +59,16 @@ struct Window {
 	char title[64];
 };
 
+struct Rect {
+	int x0, y0, x1, y1; // [x0, x1) x [y0, y1)
+};
+
 struct Sheet {
 	int x, y, width, height;
 	int owner_pid;
 	COLOUR *buffer;
 	struct Window *window;
+	COLOUR *surface; // client pixels in shared memory, the window or sheet buffer
 	struct Sheet *next;
 };
 
@@ -72,12 +81,42 @@ COLOUR gray = {.r = 200, .g = 200, .b = 200};
 COLOUR white = {.r = 255, .g = 255, .b = 255};
 
 COLOUR *fb; // framebuffer
+COLOUR *backbuf; // frames are composited here and then presented to fb
 unsigned int xres, yres;
 int cur_x = 200, cur_y = 200;
 struct Sheet *sheet_list = NULL; // sheets linked list
 int need_update = 0; // need manual call update
 int display_id;
 
+// Screen areas that changed since the last frame. Overlapping rectangles
+// are merged, when the list is full everything becomes one rectangle.
+#define DAMAGE_MAX 32
+struct Rect damage[DAMAGE_MAX];
+int damage_num = 0;
+
+// pieces a damaged rectangle may be split in while clipping sheets above
+#define CLIP_MAX 64
+
+struct WmStats stats;
+unsigned long long input_pending; // report time of the oldest mouse input not yet on screen
+
+// Frames are presented at most refresh times a second. Time is kept in
+// timer ticks, the timer is not calibrated and assumed to tick TICK_HZ
+// times a second as it does under QEMU. Frames go out on whole ticks, so
+// the cap is really TICK_HZ / frame_ticks: 50 frames a second for the
+// default refresh of 60.
+#define TICK_HZ 100
+#define MESSAGES_PER_FRAME 64 // handled before drawing even if more are queued
+unsigned int refresh = 60;
+unsigned int frame_ticks; // ticks between frames, 1 / refresh rounded up
+unsigned int next_frame; // earliest present, in ticks
+
+static inline unsigned long long rdtsc(void) {
+	unsigned int lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long long)hi << 32) | lo;
+}
+
 static inline void fastmemcpy32(void *dest, const void *src, int cnt) {
 	uint32_t *d = dest;
 	const uint32_t *s = src;
@@ -129,6 +168,21 @@ void wm_print_string(COLOUR *buf, const char *str, int x, int y, int width, COLO
 	}
 }
 
+// Print at most n characters that fit in a buffer of height rows, return
+// the width printed
+int wm_print_string_n(
+	COLOUR *buf, const char *str, int n, int x, int y, int width, int height, COLOUR colour
+) {
+	if (x < 0 || y < 0 || y + 16 > height) {
+		return 0;
+	}
+	int i;
+	for (i = 0; i < n && str[i] != '\0' && str[i] != '\n' && x + (i + 1) * 8 <= width; i++) {
+		wm_print_char(str[i], buf, x + i * 8, y, width, colour);
+	}
+	return i * 8;
+}
+
 void wm_fill_buffer(COLOUR *buf, int x, int y, int w, int h, int width, COLOUR colour) {
 	for (int i = 0; i < h; i++) {
 		fastmemset32(buf + (y + i) * width + x, *(uint32_t *)&colour, w);
@@ -146,6 +200,221 @@ void wm_copy_buffer(
 	}
 }
 
+static inline int min(int a, int b) {
+	return a < b ? a : b;
+}
+
+static inline int max(int a, int b) {
+	return a > b ? a : b;
+}
+
+// intersection of a and b, return 0 if it is empty
+static int rect_intersect(struct Rect *r, const struct Rect *a, const struct Rect *b) {
+	r->x0 = max(a->x0, b->x0);
+	r->y0 = max(a->y0, b->y0);
+	r->x1 = min(a->x1, b->x1);
+	r->y1 = min(a->y1, b->y1);
+	return r->x0 < r->x1 && r->y0 < r->y1;
+}
+
+static struct Rect sheet_rect(struct Sheet *sht) {
+	struct Rect r = {sht->x, sht->y, sht->x + sht->width, sht->y + sht->height};
+	return r;
+}
+
+// Mark an area of the screen to be composited in the next frame
+void damage_add(int x, int y, int w, int h) {
+	struct Rect screen = {0, 0, xres, yres};
+	struct Rect r = {x, y, x + w, y + h};
+	if (!rect_intersect(&r, &r, &screen)) {
+		return;
+	}
+	// merge with every rectangle it overlaps or touches
+	for (int i = 0; i < damage_num;) {
+		struct Rect *d = &damage[i];
+		if (d->x0 > r.x1 || r.x0 > d->x1 || d->y0 > r.y1 || r.y0 > d->y1) {
+			i++;
+			continue;
+		}
+		r.x0 = min(r.x0, d->x0);
+		r.y0 = min(r.y0, d->y0);
+		r.x1 = max(r.x1, d->x1);
+		r.y1 = max(r.y1, d->y1);
+		damage[i] = damage[--damage_num];
+		i = 0;
+	}
+	if (damage_num == DAMAGE_MAX) {
+		for (int i = 0; i < damage_num; i++) {
+			r.x0 = min(r.x0, damage[i].x0);
+			r.y0 = min(r.y0, damage[i].y0);
+			r.x1 = max(r.x1, damage[i].x1);
+			r.y1 = max(r.y1, damage[i].y1);
+		}
+		damage_num = 0;
+	}
+	damage[damage_num++] = r;
+}
+
+void damage_sheet(struct Sheet *sht) {
+	damage_add(sht->x, sht->y, sht->width, sht->height);
+}
+
+// Remove cover from the n rectangles of list, return the new count or -1
+// if that takes more than CLIP_MAX rectangles
+static int clip_subtract(struct Rect *list, int n, const struct Rect *cover) {
+	for (int i = 0; i < n;) {
+		struct Rect r = list[i], parts[4];
+		int nparts = 0;
+		if (r.x0 >= cover->x1 || cover->x0 >= r.x1 || r.y0 >= cover->y1 || cover->y0 >= r.y1) {
+			i++;
+			continue;
+		}
+		// keep what is above, below, left and right of cover
+		if (r.y0 < cover->y0) {
+			parts[nparts++] = (struct Rect){r.x0, r.y0, r.x1, cover->y0};
+		}
+		if (cover->y1 < r.y1) {
+			parts[nparts++] = (struct Rect){r.x0, cover->y1, r.x1, r.y1};
+		}
+		int y0 = max(r.y0, cover->y0), y1 = min(r.y1, cover->y1);
+		if (r.x0 < cover->x0) {
+			parts[nparts++] = (struct Rect){r.x0, y0, cover->x0, y1};
+		}
+		if (cover->x1 < r.x1) {
+			parts[nparts++] = (struct Rect){cover->x1, y0, r.x1, y1};
+		}
+		if (n - 1 + nparts > CLIP_MAX) {
+			return -1;
+		}
+		list[i] = list[--n];
+		for (int j = 0; j < nparts; j++) {
+			list[n++] = parts[j];
+		}
+	}
+	return n;
+}
+
+// Parts of area not covered by above and the sheets over it, the whole area
+// if it is split too much to be worth it. Return the number of rectangles.
+static int clip_visible(struct Rect *list, const struct Rect *area, struct Sheet *above) {
+	int n = 1;
+	list[0] = *area;
+	for (struct Sheet *sht = above; sht && n > 0; sht = sht->next) {
+		struct Rect cover = sheet_rect(sht);
+		if ((n = clip_subtract(list, n, &cover)) < 0) {
+			list[0] = *area;
+			return 1;
+		}
+	}
+	return n;
+}
+
+// Redraw the damaged areas of the screen in the back buffer. Each sheet
+// only copies what no sheet above it covers, the cursor goes on top of
+// everything. Return the pixels written.
+unsigned int composite(void) {
+	struct Rect cursor = {cur_x, cur_y, cur_x + CURSOR_WIDTH, cur_y + CURSOR_HEIGHT};
+	struct Rect list[CLIP_MAX];
+	unsigned int copied = 0;
+	for (int i = 0; i < damage_num; i++) {
+		struct Rect *d = &damage[i], r;
+		// desktop background
+		int n = clip_visible(list, d, sheet_list);
+		for (int j = 0; j < n; j++) {
+			struct Rect *p = &list[j];
+			wm_fill_buffer(
+				backbuf, p->x0, p->y0, p->x1 - p->x0, p->y1 - p->y0, xres, light_blue
+			);
+			copied += (p->x1 - p->x0) * (p->y1 - p->y0);
+		}
+		for (struct Sheet *sht = sheet_list; sht; sht = sht->next) {
+			struct Rect area = sheet_rect(sht);
+			if (!rect_intersect(&r, d, &area)) {
+				continue;
+			}
+			n = clip_visible(list, &r, sht->next);
+			for (int j = 0; j < n; j++) {
+				struct Rect *p = &list[j];
+				wm_copy_buffer(
+					backbuf,
+					p->x0,
+					p->y0,
+					xres,
+					sht->buffer,
+					p->x0 - sht->x,
+					p->y0 - sht->y,
+					sht->width,
+					p->x1 - p->x0,
+					p->y1 - p->y0
+				);
+				copied += (p->x1 - p->x0) * (p->y1 - p->y0);
+			}
+		}
+		if (rect_intersect(&r, d, &cursor)) {
+			wm_fill_buffer(backbuf, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0, xres, red);
+			copied += (r.x1 - r.x0) * (r.y1 - r.y0);
+		}
+	}
+	return copied;
+}
+
+// Show the damaged areas of the back buffer, return the pixels presented
+unsigned int present(void) {
+	unsigned int presented = 0;
+	for (int i = 0; i < damage_num; i++) {
+		struct Rect *d = &damage[i];
+		int w = d->x1 - d->x0, h = d->y1 - d->y0;
+		if (backbuf != fb) {
+			wm_copy_buffer(fb, d->x0, d->y0, xres, backbuf, d->x0, d->y0, xres, w, h);
+		}
+		if (need_update) {
+			display_update_rect(display_id, d->x0, d->y0, w, h);
+		}
+		presented += w * h;
+	}
+	return presented;
+}
+
+// Ticks until the next frame may be presented
+unsigned int frame_wait_ticks(unsigned int now) {
+	return (int)(next_frame - now) > 0 ? next_frame - now : 0;
+}
+
+// Composite and present a frame if anything changed and it is time to
+void frame(void) {
+	unsigned int now = uptime();
+	if (!damage_num || frame_wait_ticks(now)) {
+		return;
+	}
+	unsigned long long start = rdtsc();
+	unsigned int copied = composite();
+	unsigned int presented = present();
+	unsigned long long cycles = rdtsc() - start;
+
+	// frames follow each other frame_ticks apart, the first after idling
+	// goes out at once
+	next_frame = now + frame_ticks;
+
+	stats.frames++;
+	stats.damage_rects = damage_num;
+	stats.copied = copied * sizeof(COLOUR);
+	stats.presented = presented * sizeof(COLOUR);
+	stats.frame_cycles = cycles;
+	if (cycles > stats.max_frame_cycles) {
+		stats.max_frame_cycles = cycles;
+	}
+	stats.total_cycles += cycles;
+	stats.total_copied += stats.copied;
+	if (input_pending) {
+		stats.input_latency = rdtsc() - input_pending;
+		if (stats.input_latency > stats.max_input_latency) {
+			stats.max_input_latency = stats.input_latency;
+		}
+		input_pending = 0;
+	}
+	damage_num = 0;
+}
+
 void wm_render_window(struct Sheet *sht, COLOUR title_colour) {
 	wm_fill_buffer(sht->buffer, 0, 0, sht->width, 32, sht->width, title_colour);
 	wm_print_string(sht->buffer, sht->window->title, 8, 8, sht->width, white);
@@ -174,6 +443,7 @@ struct Sheet *wm_create_sheet(int x, int y, int width, int height) {
 	sht->width = width;
 	sht->height = height;
 	sht->window = NULL;
+	sht->surface = NULL;
 	sht->owner_pid = 0;
 	sht->buffer = malloc(sizeof(COLOUR) * width * height);
 	// add to linked list
@@ -186,9 +456,11 @@ struct Sheet *wm_create_sheet(int x, int y, int width, int height) {
 		}
 		if (l->window) {
 			wm_render_window(l, gray);
+			damage_sheet(l);
 		}
 		l->next = sht;
 	}
+	damage_sheet(sht);
 	return sht;
 }
 
@@ -211,16 +483,63 @@ void wm_window_set_title(struct Sheet *sht, const char *title) {
 	} else {
 		wm_render_window(sht, gray);
 	}
+	damage_add(sht->x, sht->y, sht->width, 32);
 }
 
-void wm_draw_sheet(struct Sheet *sht) {
+// Draw the client pixels of sht from the shared surface and from now on,
+// return 0 on success
+int sheet_attach_surface(struct Sheet *sht, unsigned int shm_id) {
+	COLOUR **client = sht->window ? &sht->window->buffer : &sht->buffer;
+	int width = sht->window ? sht->window->width : sht->width;
+	int height = sht->window ? sht->window->height : sht->height;
+	unsigned int size;
+	COLOUR *surface = shm_map(shm_id, &size);
+	if (!surface) {
+		return -1;
+	}
+	if (sht->surface || size < width * height * sizeof(COLOUR)) {
+		shm_unmap(surface);
+		return -1;
+	}
+	fastmemcpy32(surface, *client, width * height);
+	free(*client);
+	*client = surface;
+	sht->surface = surface;
+	return 0;
+}
+
+// The client pixels changed in a rectangle, the window content is copied
+// below the title bar of the sheet
+void sheet_damage(struct Sheet *sht, int x, int y, int w, int h) {
+	int width = sht->window ? sht->window->width : sht->width;
+	int height = sht->window ? sht->window->height : sht->height;
+	struct Rect client = {0, 0, width, height}, r = {x, y, x + w, y + h};
+	if (!rect_intersect(&r, &r, &client)) {
+		return;
+	}
+	w = r.x1 - r.x0;
+	h = r.y1 - r.y0;
+	if (!sht->window) {
+		damage_add(sht->x + r.x0, sht->y + r.y0, w, h);
+		return;
+	}
 	wm_copy_buffer(
-		fb, sht->x, sht->y, xres, sht->buffer, 0, 0, sht->width, sht->width, sht->height
+		sht->buffer, r.x0, r.y0 + 32, sht->width, sht->window->buffer, r.x0, r.y0, width, w, h
 	);
+	damage_add(sht->x + r.x0, sht->y + r.y0 + 32, w, h);
+}
+
+// client pixels are freed or unmapped when shared
+void sheet_free_buffer(struct Sheet *sht, COLOUR *buffer) {
+	if (buffer == sht->surface) {
+		shm_unmap(buffer);
+	} else {
+		free(buffer);
+	}
 }
 
 void sheet_remove(struct Sheet *to_remove) {
-	free(to_remove->buffer);
+	sheet_free_buffer(to_remove, to_remove->buffer);
 	if (to_remove == sheet_list) {
 		sheet_list = sheet_list->next;
 	} else {
@@ -233,20 +552,12 @@ void sheet_remove(struct Sheet *to_remove) {
 		}
 		sht->next = sht->next->next;
 	}
-	// cover old sheet
-	wm_fill_buffer(
-		fb, to_remove->x, to_remove->y, to_remove->width, to_remove->height, xres, light_blue
-	);
+	damage_sheet(to_remove);
 	free(to_remove);
-	struct Sheet *todraw = sheet_list;
-	while (todraw) {
-		wm_draw_sheet(todraw);
-		todraw = todraw->next;
-	}
 }
 
 void window_close(struct Sheet *to_remove) {
-	free(to_remove->window->buffer);
+	sheet_free_buffer(to_remove, to_remove->window->buffer);
 	free(to_remove->window);
 	sheet_remove(to_remove);
 }
@@ -272,21 +583,26 @@ void window_move_top(struct Sheet *to_move) {
 	}
 	if (sht->window) {
 		wm_render_window(sht, gray);
+		damage_add(sht->x, sht->y, sht->width, 32);
 	}
 	sht->next = to_move;
 	wm_render_window(to_move, dark_blue);
 	to_move->next = NULL;
-	// draw buffers
-	struct Sheet *todraw = sheet_list;
-	while (todraw) {
-		wm_draw_sheet(todraw);
-		todraw = todraw->next;
-	}
+	damage_sheet(to_move);
 }
 
 struct Sheet *win_moving = NULL;
 unsigned int prev_x = 0, prev_y = 0;
 
+// Send an input event to a client without waiting, a client that does not
+// keep up loses events rather than stalling every other one
+void event_send(int pid, const void *event, int size) {
+	struct MessageVec vec = {event, size};
+	if (message_sendv(pid, &vec, 1, MESSAGE_NONBLOCK) == ERROR_AGAIN) {
+		stats.events_dropped++;
+	}
+}
+
 void window_onclick(struct Sheet *sht, unsigned int btn) {
 	if (btn & 1 && cur_y < sht->y + 32 && !win_moving) {
 		if (cur_x >= sht->x + sht->width - 28 && cur_x < sht->x + sht->width - 4 &&
@@ -296,7 +612,7 @@ void window_onclick(struct Sheet *sht, unsigned int btn) {
 				struct MessageWindowCloseEvent msg;
 				msg.msgtype = WM_MESSAGE_WINDOW_CLOSE_EVENT;
 				msg.sheet_id = (int)sht;
-				message_send(sht->owner_pid, sizeof(msg), &msg);
+				event_send(sht->owner_pid, &msg, sizeof(msg));
 			}
 		} else {
 			// start to move the window
@@ -316,16 +632,10 @@ void window_onclick(struct Sheet *sht, unsigned int btn) {
 void mouse_cursor_event(void) {
 	struct Sheet *sht = win_moving;
 	if (win_moving && cur_y < sht->y + 32) {
-		// cover old window
-		wm_fill_buffer(fb, sht->x, sht->y, sht->width, sht->height, xres, light_blue);
+		damage_sheet(sht);
 		sht->x = cur_x - prev_x;
 		sht->y = cur_y - prev_y;
-		// draw buffers
-		struct Sheet *todraw = sheet_list;
-		while (todraw) {
-			wm_draw_sheet(todraw);
-			todraw = todraw->next;
-		}
+		damage_sheet(sht);
 	}
 }
 
@@ -351,7 +661,7 @@ void mouse_button_event(unsigned char btn) {
 				msg.y = cur_y - sht->y;
 			}
 			msg.button = btn;
-			message_send(sht->owner_pid, sizeof(msg), &msg);
+			event_send(sht->owner_pid, &msg, sizeof(msg));
 
 			return;
 		}
@@ -359,6 +669,17 @@ void mouse_button_event(unsigned char btn) {
 	}
 }
 
+void cursor_move(int dx, int dy) {
+	if (!dx && !dy) {
+		return;
+	}
+	damage_add(cur_x, cur_y, CURSOR_WIDTH, CURSOR_HEIGHT);
+	cur_x += dx;
+	cur_y += dy;
+	damage_add(cur_x, cur_y, CURSOR_WIDTH, CURSOR_HEIGHT);
+	mouse_cursor_event();
+}
+
 void keyboard_event(unsigned int keycode) {
 	struct MessageKeyboardEvent event = {.msgtype = WM_MESSAGE_KEYBOARD_EVENT};
 	event.keycode = keycode & 0xff;
@@ -368,7 +689,7 @@ void keyboard_event(unsigned int keycode) {
 		event.event = 0;
 	}
 	event.sheet_id = 0;
-	message_send(getppid(), sizeof(event), &event);
+	event_send(getppid(), &event, sizeof(event));
 	struct Sheet *wnd = NULL, *sht = sheet_list;
 	while (sht) {
 		if (sht->window) {
@@ -378,11 +699,96 @@ void keyboard_event(unsigned int keycode) {
 	}
 	if (wnd) {
 		event.sheet_id = (int)wnd;
-		message_send(wnd->owner_pid, sizeof(event), &event);
+		event_send(wnd->owner_pid, &event, sizeof(event));
+	}
+}
+
+// Take all queued input. Keys are handled in order, mouse motion between
+// button changes is coalesced into a single cursor move.
+void input_events(void) {
+	struct InputEvent events[INPUT_READ_MAX];
+	int n;
+	while ((n = input_read(INPUT_KEYBOARD, events, INPUT_READ_MAX, 0)) > 0) {
+		for (int i = 0; i < n; i++) {
+			if (events[i].data != 0x100) {
+				keyboard_event(events[i].data);
+			}
+		}
+	}
+
+	static int prevbtn = 0;
+	int dx = 0, dy = 0, packets = 0;
+	while ((n = input_read(INPUT_MOUSE, events, INPUT_READ_MAX, 0)) > 0) {
+		if (!input_pending) {
+			input_pending = events[0].time;
+		}
+		for (int i = 0; i < n; i++) {
+			unsigned int m = events[i].data;
+			dx += (char)((m >> 16) & 0xff);
+			dy -= (char)((m >> 8) & 0xff);
+			int btn = (m >> 24) & 7;
+			if (prevbtn != btn) {
+				cursor_move(dx, dy);
+				dx = dy = 0;
+				mouse_button_event(btn);
+				prevbtn = btn;
+			}
+		}
+		packets += n;
+	}
+	cursor_move(dx, dy);
+	if (!damage_num) {
+		input_pending = 0; // nothing to show for it
+	}
+	stats.mouse_packets += packets;
+}
+
+// buffer the client draws in, the window content or the whole sheet
+static COLOUR *client_buffer(struct Sheet *sheet, int *width) {
+	*width = sheet->window ? sheet->window->width : sheet->width;
+	return sheet->window ? sheet->window->buffer : sheet->buffer;
+}
+
+// Run a batch of drawing commands on the client area of a sheet, drawing
+// is clipped to it
+void sheet_run_batch(struct Sheet *sheet, const char *commands, unsigned int size) {
+	int width, height = sheet->window ? sheet->window->height : sheet->height;
+	COLOUR *buffer = client_buffer(sheet, &width);
+	struct Rect client = {0, 0, width, height};
+	unsigned int offset = 0;
+	while (size - offset >= sizeof(struct WmCommand)) {
+		const struct WmCommand *cmd = (const struct WmCommand *)(commands + offset);
+		if (cmd->size < sizeof(struct WmCommand) || cmd->size > size - offset) {
+			break;
+		}
+		offset += cmd->size;
+		COLOUR colour = {.r = cmd->r, .g = cmd->g, .b = cmd->b};
+		struct Rect r = {cmd->x, cmd->y, cmd->x + cmd->w, cmd->y + cmd->h};
+		switch (cmd->type) {
+			case WM_COMMAND_FILL_RECT:
+				if (rect_intersect(&r, &r, &client)) {
+					wm_fill_buffer(buffer, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0, width, colour);
+					sheet_damage(sheet, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+				}
+				break;
+			case WM_COMMAND_TEXT: {
+				int n = min(cmd->w, cmd->size - sizeof(struct WmCommand));
+				int w = wm_print_string_n(
+					buffer, cmd->text, n, cmd->x, cmd->y, width, height, colour
+				);
+				sheet_damage(sheet, cmd->x, cmd->y, w, 16);
+				break;
+			}
+			case WM_COMMAND_DAMAGE:
+				sheet_damage(sheet, cmd->x, cmd->y, cmd->w, cmd->h);
+				break;
+		}
+		stats.commands++;
 	}
 }
 
 void message_received(int pid, void *msg) {
+	int width;
 	if (*(int *)msg == WM_MESSAGE_CREATE_SHEET) { // create_sheet
 		struct MessageCreateSheet *message = msg;
 		struct Sheet *sheet_handle =
@@ -396,47 +802,19 @@ void message_received(int pid, void *msg) {
 		struct MessageFillSheet *message = msg;
 		COLOUR colour = {.r = message->r, .g = message->g, .b = message->b};
 		struct Sheet *sheet = (struct Sheet *)message->sheet_id;
-		if (!sheet->window) {
-			wm_fill_buffer(sheet->buffer, 0, 0, sheet->width, sheet->height, sheet->width, colour);
-		} else {
-			wm_fill_buffer(
-				sheet->window->buffer,
-				0,
-				0,
-				sheet->window->width,
-				sheet->window->height,
-				sheet->window->width,
-				colour
-			);
-			if (!sheet->next) {
-				wm_render_window(sheet, dark_blue);
-			} else {
-				wm_render_window(sheet, gray);
-			}
-		}
+		COLOUR *buffer = client_buffer(sheet, &width);
+		int height = sheet->window ? sheet->window->height : sheet->height;
+		wm_fill_buffer(buffer, 0, 0, width, height, width, colour);
+		sheet_damage(sheet, 0, 0, width, height);
 	} else if (*(int *)msg == WM_MESSAGE_PRINT_TEXT) { // print_text
 		struct MessagePrintText *message = msg;
 		COLOUR colour = {.r = message->r, .g = message->g, .b = message->b};
 		struct Sheet *sheet = (struct Sheet *)message->sheet_id;
-		if (!sheet->window) {
-			wm_print_string(
-				sheet->buffer, message->text, message->x, message->y, sheet->width, colour
-			);
-		} else {
-			wm_print_string(
-				sheet->window->buffer,
-				message->text,
-				message->x,
-				message->y,
-				sheet->window->width,
-				colour
-			);
-			if (!sheet->next) {
-				wm_render_window(sheet, dark_blue);
-			} else {
-				wm_render_window(sheet, gray);
-			}
-		}
+		COLOUR *buffer = client_buffer(sheet, &width);
+		wm_print_string(buffer, message->text, message->x, message->y, width, colour);
+		char *newline = strchr(message->text, '\n');
+		int len = newline ? newline - message->text : (int)strlen(message->text);
+		sheet_damage(sheet, message->x, message->y, len * 8, 16);
 	} else if (*(int *)msg == WM_MESSAGE_CREATE_WINDOW) { // create_window
 		struct MessageCreateWindow *message = msg;
 		struct Sheet *sheet_handle = wm_create_window(message->width, message->height, 200, 200);
@@ -461,72 +839,58 @@ void message_received(int pid, void *msg) {
 		struct MessageDrawRect *message = msg;
 		struct Sheet *sheet = (struct Sheet *)message->sheet_id;
 		COLOUR colour = {.r = message->r, .g = message->g, .b = message->b};
-		if (!sheet->window) {
-			wm_fill_buffer(
-				sheet->buffer, message->x, message->y, message->w, message->h, sheet->width, colour
-			);
-		} else {
-			wm_fill_buffer(
-				sheet->window->buffer,
-				message->x,
-				message->y,
-				message->w,
-				message->h,
-				sheet->window->width,
-				colour
-			);
-			if (!sheet->next) {
-				wm_render_window(sheet, dark_blue);
-			} else {
-				wm_render_window(sheet, gray);
-			}
-		}
+		COLOUR *buffer = client_buffer(sheet, &width);
+		wm_fill_buffer(buffer, message->x, message->y, message->w, message->h, width, colour);
+		sheet_damage(sheet, message->x, message->y, message->w, message->h);
 	} else if (*(int *)msg == WM_MESSAGE_DRAW_BUFFER) {
 		struct MessageDrawBuffer *message = msg;
 		struct Sheet *sheet = (struct Sheet *)message->sheet_id;
-		if (!sheet->window) {
-			wm_copy_buffer(
-				sheet->buffer,
-				message->x,
-				message->y,
-				sheet->width,
-				(void *)message->buffer,
-				0,
-				0,
-				message->w,
-				message->w,
-				message->h
-			);
-		} else {
-			wm_copy_buffer(
-				sheet->window->buffer,
-				message->x,
-				message->y,
-				sheet->window->width,
-				(void *)message->buffer,
-				0,
-				0,
-				message->w,
-				message->w,
-				message->h
-			);
-			if (!sheet->next) {
-				wm_render_window(sheet, dark_blue);
-			} else {
-				wm_render_window(sheet, gray);
-			}
-		}
+		COLOUR *buffer = client_buffer(sheet, &width);
+		wm_copy_buffer(
+			buffer,
+			message->x,
+			message->y,
+			width,
+			(void *)message->buffer,
+			0,
+			0,
+			message->w,
+			message->w,
+			message->h
+		);
+		sheet_damage(sheet, message->x, message->y, message->w, message->h);
+	} else if (*(int *)msg == WM_MESSAGE_ATTACH_SURFACE) {
+		struct MessageAttachSurface *message = msg;
+		struct MessageReturnHandle return_handle = {
+			.msgtype = WM_MESSAGE_RETURN_HANDLE,
+			.handle = sheet_attach_surface((struct Sheet *)message->sheet_id, message->shm_id),
+		};
+		message_send(pid, sizeof(return_handle), &return_handle);
+	} else if (*(int *)msg == WM_MESSAGE_DAMAGE) {
+		struct MessageDamage *message = msg;
+		sheet_damage(
+			(struct Sheet *)message->sheet_id, message->x, message->y, message->w, message->h
+		);
+	} else if (*(int *)msg == WM_MESSAGE_BATCH) {
+		struct MessageBatch *message = msg;
+		sheet_run_batch((struct Sheet *)message->sheet_id, message->commands, message->size);
+	} else if (*(int *)msg == WM_MESSAGE_GET_STATS) {
+		struct MessageStats reply = {.msgtype = WM_MESSAGE_STATS, .stats = stats};
+		message_send(pid, sizeof(reply), &reply);
 	} else {
 		printf("Unknown message %d from pid %d\n", *(int *)msg, pid);
 	}
-	struct Sheet *todraw = sheet_list;
-	while (todraw) {
-		wm_draw_sheet(todraw);
-		todraw = todraw->next;
-	}
 }
 
 int main(int argc, char *argv[]) {
+	if (argc >= 3 && strcmp(argv[1], "-r") == 0) { // wm -r refresh ...
+		refresh = atoi(argv[2]);
+		if (refresh == 0) {
+			refresh = 60;
+		}
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc == 1) { // wm
 		display_id = display_find();
 		if (display_id < 0) {
@@ -559,6 +923,7 @@ int main(int argc, char *argv[]) {
 		fputs(" wm display_id - custom display and default resolution\n", stderr);
 		fputs(" wm xres yres - default display and custom resolution\n", stderr);
 		fputs(" wm display_id xres yres - custom display and resolution\n", stderr);
+		fputs(" wm -r refresh ... - present at most refresh frames a second\n", stderr);
 		exit(EXIT_FAILURE);
 	}
 	unsigned int flag;
@@ -575,60 +940,29 @@ int main(int argc, char *argv[]) {
 	}
 	need_update = (flag & DISPLAY_KCALL_FLAG_NEED_UPDATE) ? 1 : 0;
 
-	wm_fill_buffer(fb, 0, 0, xres, yres, xres, light_blue);
+	// virtio-gpu shows the framebuffer only when updated, it needs no back buffer
+	backbuf = need_update ? fb : malloc(xres * yres * sizeof(COLOUR));
+	frame_ticks = (TICK_HZ + refresh - 1) / refresh;
+	stats.refresh = TICK_HZ / frame_ticks;
+	damage_add(0, 0, xres, yres);
 
-	char *msg = malloc(1024 * 4096); // 4MiB byte buffer
-	// main loop
+	char *msg = malloc(WM_MESSAGE_MAX);
+	// frame loop, sleep until there is something to handle or a frame is due
 	for (;;) {
-		int pid;
-		if ((pid = message_receive(msg)) != 0) {
-			message_received(pid, msg);
-		}
-		// keyboard
-		unsigned int kbd;
-		kcall("keyboard", (unsigned int)&kbd);
-		if (kbd != 0x0 && kbd != 0x100) {
-			keyboard_event(kbd);
-		}
-		// mouse
-		int m;
-		kcall("mouse", (unsigned int)&m);
-		if (!m) {
-			// update framebuffer
-			if (need_update) {
-				display_update(display_id);
+		unsigned int timeout = damage_num ? frame_wait_ticks(uptime()) : EVENT_WAIT_FOREVER;
+		if (timeout) {
+			if (event_wait(EVENT_MESSAGE | EVENT_KEYBOARD | EVENT_MOUSE, timeout) < 0) {
+				sleep(1);
 			}
-			continue;
+			stats.wakeups++;
 		}
-		// remove old cursor
-		wm_fill_buffer(fb, cur_x, cur_y, CURSOR_WIDTH, CURSOR_HEIGHT, xres, light_blue);
-		// draw sheets
-		struct Sheet *sht = sheet_list;
-		while (sht) {
-			wm_draw_sheet(sht);
-			sht = sht->next;
-		}
-		// mouse cursor
-		char movex = (char)((m >> 16) & 0xff);
-		char movey = (char)((m >> 8) & 0xff);
-		cur_x += movex;
-		cur_y -= movey;
-		if (movex || movey) {
-			mouse_cursor_event();
-		}
-		// draw cursor
-		wm_fill_buffer(fb, cur_x, cur_y, CURSOR_WIDTH, CURSOR_HEIGHT, xres, red);
-		// mouse buttons
-		int btn = (m >> 24) & 7;
-		static int prevbtn = 0;
-		if (prevbtn != btn) {
-			mouse_button_event(btn);
-			prevbtn = btn;
-		}
-		// update framebuffer
-		if (need_update) {
-			display_update(display_id);
+		int pid;
+		for (int i = 0; i < MESSAGES_PER_FRAME && (pid = message_receive(msg)) != 0; i++) {
+			message_received(pid, msg);
+			stats.messages++;
 		}
+		input_events();
+		frame();
 	}
 
 	return 0;
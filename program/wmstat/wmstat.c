@@ -0,0 +1,80 @@
+/*
+ * wmstat program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <libwm/protocol.h>
+#include <libwm/wm.h>
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+	struct WmStats stats, prev;
+	if (!wm_init() || !wm_get_stats(&prev)) {
+		fputs("wmstat: cannot connect to window manager\n", stderr);
+		return 1;
+	}
+	// sample again after a while to see the frame rate
+	int ticks = argc > 1 ? atoi(argv[1]) : 100;
+	if (ticks <= 0) {
+		ticks = 100;
+	}
+	int start = uptime();
+	sleep(ticks);
+	int elapsed = uptime() - start;
+	wm_get_stats(&stats);
+
+	printf("frames %u, refresh cap %u per second\n", stats.frames, stats.refresh);
+	printf(
+		"in %d ticks: %u frames (%u per 100 ticks), %u wakeups, %u mouse packets\n",
+		elapsed,
+		stats.frames - prev.frames,
+		elapsed > 0 ? (stats.frames - prev.frames) * 100 / elapsed : 0,
+		stats.wakeups - prev.wakeups,
+		stats.mouse_packets - prev.mouse_packets
+	);
+	printf(
+		"in %d ticks: %u messages, %u batched drawing commands, %u events dropped\n",
+		elapsed,
+		stats.messages - prev.messages,
+		stats.commands - prev.commands,
+		stats.events_dropped - prev.events_dropped
+	);
+	if (!stats.frames) {
+		return 0;
+	}
+	printf(
+		"last frame %llu cycles, %u damaged rects, %u bytes copied, %u bytes presented\n",
+		stats.frame_cycles,
+		stats.damage_rects,
+		stats.copied,
+		stats.presented
+	);
+	printf(
+		"per frame %llu cycles average %llu max, %llu bytes copied average\n",
+		stats.total_cycles / stats.frames,
+		stats.max_frame_cycles,
+		stats.total_copied / stats.frames
+	);
+	printf(
+		"mouse to screen %llu cycles last, %llu max\n",
+		stats.input_latency,
+		stats.max_input_latency
+	);
+	return 0;
+}